@@ -0,0 +1,360 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include "bench.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+namespace bench
+{
+	histogram::histogram()
+		: m_counts((kMaxValueBits - kSubBucketBits + 2) << (kSubBucketBits - 1))
+	{
+		reset();
+	}
+
+	static int highestBit(uint64_t value)
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return (int)index;
+#else
+		return 63 - __builtin_clzll(value);
+#endif
+	}
+
+	size_t histogram::indexOf(uint64_t value)
+	{
+		const uint64_t half = 1ull << (kSubBucketBits - 1);
+		if(value < (half << 1))
+			return (size_t)value;
+
+		// The sub-bucket keeps the top kSubBucketBits bits of the value
+		int bucket = highestBit(value) - (kSubBucketBits - 1);
+		uint64_t sub = value >> bucket;
+		return (size_t)(bucket * half + sub);
+	}
+
+	uint64_t histogram::highestEquivalent(size_t index)
+	{
+		const uint64_t half = 1ull << (kSubBucketBits - 1);
+		if(index < (half << 1))
+			return index;
+
+		uint64_t bucket = index / half - 1;
+		uint64_t sub = index - bucket * half;
+		return ((sub + 1) << bucket) - 1;
+	}
+
+	void histogram::record(uint64_t value)
+	{
+		const uint64_t limit = (1ull << kMaxValueBits) - 1;
+		if(value > limit)
+			value = limit;
+
+		++m_counts[indexOf(value)];
+		++m_count;
+		m_sum += value;
+		m_min = std::min(m_min, value);
+		m_max = std::max(m_max, value);
+	}
+
+	void histogram::merge(const histogram &rhs)
+	{
+		for(size_t i = 0; i < m_counts.size(); ++i)
+			m_counts[i] += rhs.m_counts[i];
+		m_count += rhs.m_count;
+		m_sum += rhs.m_sum;
+		m_min = std::min(m_min, rhs.m_min);
+		m_max = std::max(m_max, rhs.m_max);
+	}
+
+	void histogram::reset()
+	{
+		std::fill(m_counts.begin(), m_counts.end(), 0);
+		m_count = 0;
+		m_sum = 0;
+		m_min = UINT64_MAX;
+		m_max = 0;
+	}
+
+	uint64_t histogram::percentile(double percent) const
+	{
+		if(m_count == 0)
+			return 0;
+
+		uint64_t target = (uint64_t)std::ceil(percent / 100.0 * m_count);
+		target = std::max<uint64_t>(1, std::min(target, m_count));
+
+		uint64_t seen = 0;
+		for(size_t i = 0; i < m_counts.size(); ++i)
+		{
+			seen += m_counts[i];
+			if(seen >= target)
+				return std::min(highestEquivalent(i), m_max);
+		}
+		return m_max;
+	}
+
+	static std::vector<result> g_results;
+	static bool g_quiet = false;
+
+	static void printValue(FILE *file, double value)
+	{
+		if(value == std::floor(value) && std::fabs(value) < 1e15)
+			fprintf(file, "%.0f", value);
+		else
+			fprintf(file, "%.3f", value);
+	}
+
+	static void printJsonString(FILE *file, const std::string &str)
+	{
+		fputc('"', file);
+		for(char c : str)
+		{
+			if(c == '"' || c == '\\')
+				fprintf(file, "\\%c", c);
+			else if((unsigned char)c < 0x20)
+				fprintf(file, "\\u%04x", c);
+			else
+				fputc(c, file);
+		}
+		fputc('"', file);
+	}
+
+	void set_quiet(bool quiet)
+	{
+		g_quiet = quiet;
+	}
+
+	void report(const result &res)
+	{
+		g_results.push_back(res);
+		if(g_quiet)
+			return;
+
+		printf("%-24s", res.name.c_str());
+		for(const auto &label : res.labels)
+			printf(" %s=%s", label.first.c_str(), label.second.c_str());
+		for(const auto &value : res.values)
+		{
+			printf(" %s=", value.first.c_str());
+			printValue(stdout, value.second);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	bool write_json(const std::string &path)
+	{
+		FILE *file = path == "-" ? stdout : fopen(path.c_str(), "w");
+		if(!file)
+			return false;
+
+		fprintf(file, "{\n  \"benchmarks\": [");
+		for(size_t i = 0; i < g_results.size(); ++i)
+		{
+			const result &res = g_results[i];
+			fprintf(file, "%s\n    { \"name\": ", i ? "," : "");
+			printJsonString(file, res.name);
+			for(const auto &label : res.labels)
+			{
+				fprintf(file, ", ");
+				printJsonString(file, label.first);
+				fprintf(file, ": ");
+				printJsonString(file, label.second);
+			}
+			for(const auto &value : res.values)
+			{
+				fprintf(file, ", ");
+				printJsonString(file, value.first);
+				fprintf(file, ": ");
+				printValue(file, value.second);
+			}
+			fprintf(file, " }");
+		}
+		fprintf(file, "\n  ]\n}\n");
+
+		if(file != stdout)
+			return fclose(file) == 0;
+		fflush(file);
+		return true;
+	}
+
+	void add_latency(result &res, const histogram &hist)
+	{
+		res.add("p50_us", hist.percentile(50.0) / 1000.0)
+		   .add("p99_us", hist.percentile(99.0) / 1000.0)
+		   .add("p99.9_us", hist.percentile(99.9) / 1000.0)
+		   .add("max_us", hist.max() / 1000.0)
+		   .add("mean_us", hist.mean() / 1000.0);
+	}
+
+	bool pin_thread(int cpu)
+	{
+		if(cpu < 0)
+			return true;
+
+		// Fold onto the CPUs we actually have
+		unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+		cpu %= cpus;
+#ifdef _WIN32
+		return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+	}
+
+	bool send_all(usock_handle_t hsock, const void *data, size_t len)
+	{
+		const char *p = static_cast<const char *>(data);
+		while(len > 0)
+		{
+			usock_ssize_t ret = usock_send(hsock, p, len);
+			if(ret <= 0)
+				return false;
+			p += ret;
+			len -= (size_t)ret;
+		}
+		return true;
+	}
+
+	bool recv_all(usock_handle_t hsock, void *data, size_t len)
+	{
+		char *p = static_cast<char *>(data);
+		while(len > 0)
+		{
+			usock_ssize_t ret = usock_recv(hsock, p, len);
+			if(ret <= 0)
+				return false;
+			p += ret;
+			len -= (size_t)ret;
+		}
+		return true;
+	}
+
+	bool tcp_pair(usock_port_t port, usock_flags_t flags, usock_handle_t &client, usock_handle_t &server)
+	{
+		usock_handle_t listener = nullptr;
+		client = server = nullptr;
+
+		usock_create_socket("bench listener", &listener);
+		usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, flags | USOCK_OPTIONS_REUSE_ADDRESS);
+		bool ok = usock_bind(listener, port) == USOCK_OK && usock_listen(listener, 1) == USOCK_OK;
+
+		// The connect completes out of the backlog, so no second thread is needed
+		if(ok)
+		{
+			usock_create_socket("bench client", &client);
+			usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, flags);
+			ok = usock_connect(client, "127.0.0.1", port) == USOCK_OK &&
+			     usock_accept(listener, &server) == USOCK_OK;
+		}
+
+		destroy_socket(listener);
+		if(!ok)
+		{
+			destroy_socket(client);
+			destroy_socket(server);
+			client = server = nullptr;
+		}
+		return ok;
+	}
+
+	void destroy_socket(usock_handle_t hsock)
+	{
+		if(hsock)
+		{
+			usock_close_socket(hsock);
+			usock_free_socket(hsock);
+		}
+	}
+
+	// Each block starts with its size, so frees can be counted too
+	static std::atomic<uint64_t> g_allocatedBytes(0);
+	static constexpr size_t kAllocHeader = 16;
+
+	static void *countingMalloc(size_t bytes)
+	{
+		unsigned char *block = static_cast<unsigned char *>(malloc(bytes + kAllocHeader));
+		if(!block)
+			return nullptr;
+		*reinterpret_cast<size_t *>(block) = bytes;
+		g_allocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+		return block + kAllocHeader;
+	}
+
+	static void countingFree(void *ptr)
+	{
+		if(!ptr)
+			return;
+		unsigned char *block = static_cast<unsigned char *>(ptr) - kAllocHeader;
+		g_allocatedBytes.fetch_sub(*reinterpret_cast<size_t *>(block), std::memory_order_relaxed);
+		free(block);
+	}
+
+	void install_counting_allocator()
+	{
+		usock_allocator allocator = { countingMalloc, countingFree };
+		usock_set_custom_allocator(&allocator);
+	}
+
+	uint64_t allocated_bytes()
+	{
+		return g_allocatedBytes.load(std::memory_order_relaxed);
+	}
+
+	unsigned long long raise_fd_limit(unsigned long long wanted)
+	{
+#ifdef _WIN32
+		// Winsock has no per-process descriptor limit to raise
+		return wanted;
+#else
+		struct rlimit lim;
+		if(getrlimit(RLIMIT_NOFILE, &lim) != 0)
+			return 0;
+		if(lim.rlim_cur < wanted)
+		{
+			lim.rlim_cur = lim.rlim_max == RLIM_INFINITY ? wanted : std::min<rlim_t>(wanted, lim.rlim_max);
+			setrlimit(RLIMIT_NOFILE, &lim);
+			getrlimit(RLIMIT_NOFILE, &lim);
+		}
+		return lim.rlim_cur;
+#endif
+	}
+}
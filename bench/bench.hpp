@@ -0,0 +1,163 @@
+#pragma once
+#include <usock.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench
+{
+	/*
+	* Command line options shared by every benchmark.
+	*/
+	struct options
+	{
+		std::vector<size_t> sizes;  // Message sizes to run, --size 64,1024
+		size_t iterations = 100000; // Measured round trips per size
+		size_t warmup     = 10000;  // Round trips before measuring
+		int clientCpu     = 0;      // -1 to leave the thread unpinned
+		int serverCpu     = 1;
+		usock_port_t port = 9700;   // First port used, benchmarks may use a few more
+		unsigned durationMs = 2000; // How long each throughput run lasts
+		unsigned connections = 0;   // Connections for the multi-connection runs, 0 for their default
+		unsigned batch = 32;        // Messages per usock_send_to_batch call
+		unsigned busyPollUs = 0;    // Busy-poll budget for udp-latency receives, 0 for blocking
+		std::string json;           // Write results as JSON to this file, "-" for stdout
+	};
+
+	/*
+	* Log-linear histogram in the style of HdrHistogram.
+	* Values are bucketed by power of two, and each power of two is split
+	* into linear sub-buckets, so every recorded value is kept to within
+	* 1/128 of its size with a fixed amount of memory.
+	*/
+	class histogram
+	{
+	public:
+		histogram();
+
+		void record(uint64_t value);
+		void merge(const histogram &rhs);
+		void reset();
+
+		uint64_t count() const { return m_count; }
+		uint64_t min() const { return m_count ? m_min : 0; }
+		uint64_t max() const { return m_max; }
+		double mean() const { return m_count ? (double)m_sum / m_count : 0.0; }
+
+		/*
+		* Smallest recorded value that the given percentage of values
+		* don't exceed, e.g. percentile(99.9).
+		*/
+		uint64_t percentile(double percent) const;
+
+	private:
+		static constexpr int kSubBucketBits = 8;
+		static constexpr int kMaxValueBits  = 48;
+
+		static size_t indexOf(uint64_t value);
+		static uint64_t highestEquivalent(size_t index);
+
+		std::vector<uint64_t> m_counts;
+		uint64_t m_count;
+		uint64_t m_sum;
+		uint64_t m_min;
+		uint64_t m_max;
+	};
+
+	/*
+	* One line of benchmark output: a name, and the named values measured.
+	*/
+	struct result
+	{
+		std::string name;
+		std::vector<std::pair<std::string, std::string>> labels;
+		std::vector<std::pair<std::string, double>> values;
+
+		result &label(const std::string &key, const std::string &value)
+		{
+			labels.emplace_back(key, value);
+			return *this;
+		}
+
+		result &add(const std::string &key, double value)
+		{
+			values.emplace_back(key, value);
+			return *this;
+		}
+	};
+
+	/*
+	* Print a result, and keep it for write_json.
+	*/
+	void report(const result &res);
+
+	/*
+	* Write every reported result as a JSON document:
+	* { "benchmarks": [ { "name": ..., labels..., values... }, ... ] }
+	* Returns false if the file couldn't be written.
+	*/
+	bool write_json(const std::string &path);
+
+	/*
+	* Print results as they come in. Turned off when the JSON goes to stdout.
+	*/
+	void set_quiet(bool quiet);
+
+	/*
+	* Add the common latency percentiles, in microseconds, to a result.
+	*/
+	void add_latency(result &res, const histogram &hist);
+
+	/*
+	* Pin the calling thread to a CPU. Returns false if it couldn't be
+	* pinned; the benchmark still runs, just with more noise.
+	*/
+	bool pin_thread(int cpu);
+
+	/*
+	* Send or receive exactly len bytes on a stream socket.
+	*/
+	bool send_all(usock_handle_t hsock, const void *data, size_t len);
+	bool recv_all(usock_handle_t hsock, void *data, size_t len);
+
+	/*
+	* Open a connected pair of loopback TCP sockets on the given port.
+	* The listener is only kept until the connection is accepted.
+	*/
+	bool tcp_pair(usock_port_t port, usock_flags_t flags, usock_handle_t &client, usock_handle_t &server);
+
+	/*
+	* Close and free a socket handle.
+	*/
+	void destroy_socket(usock_handle_t hsock);
+
+	/*
+	* Route usock's allocations through a counting allocator.
+	* Must be called before usock_initialize().
+	*/
+	void install_counting_allocator();
+
+	/*
+	* Bytes currently allocated by usock, if the counting allocator is installed.
+	*/
+	uint64_t allocated_bytes();
+
+	/*
+	* Raise the open descriptor limit towards wanted, as far as the hard
+	* limit allows. Returns the limit now in effect.
+	*/
+	unsigned long long raise_fd_limit(unsigned long long wanted);
+
+	// Benchmarks
+	int tcp_latency(const options &opts);
+	int udp_latency(const options &opts);
+	int tcp_connect(const options &opts);
+	int local_latency(const options &opts);
+	int tcp_stream(const options &opts);
+	int tcp_rate(const options &opts);
+	int udp_rate(const options &opts);
+	int tcp_multi(const options &opts);
+	int c10k(const options &opts);
+}
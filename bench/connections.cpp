@@ -0,0 +1,261 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include "bench.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+/*
+* Many idle loopback connections with a trickle of traffic.
+* Sockets are only created from the main thread, a backlog sized batch
+* at a time: connect the batch, then accept it. A poller thread then
+* watches every server side socket while the main thread sends
+* timestamps to random connections, to measure how long a wake-up takes.
+*/
+
+namespace bench
+{
+	static constexpr unsigned kDefaultConnections = 10000;
+	static constexpr unsigned kBatch = 512;
+	static constexpr unsigned kMessagesPerSecond = 2000;
+
+	struct tcpMemory
+	{
+		long long rssKb = 0;
+		long long tcpPages = 0;
+	};
+
+	// Kernel side memory, where the platform lets us see it
+	static tcpMemory readMemory()
+	{
+		tcpMemory mem;
+#ifdef __linux__
+		char line[256];
+		FILE *file = fopen("/proc/self/status", "r");
+		if(file)
+		{
+			while(fgets(line, sizeof(line), file))
+			{
+				if(strncmp(line, "VmRSS:", 6) == 0)
+					mem.rssKb = atoll(line + 6);
+			}
+			fclose(file);
+		}
+
+		file = fopen("/proc/net/sockstat", "r");
+		if(file)
+		{
+			while(fgets(line, sizeof(line), file))
+			{
+				const char *p = strncmp(line, "TCP:", 4) == 0 ? strstr(line, " mem ") : nullptr;
+				if(p)
+					mem.tcpPages = atoll(p + 5);
+			}
+			fclose(file);
+		}
+#endif
+		return mem;
+	}
+
+	int c10k(const options &opts)
+	{
+		unsigned count = opts.connections ? opts.connections : kDefaultConnections;
+
+		// Two descriptors per connection, plus some slack for everything else
+		unsigned long long limit = raise_fd_limit(2ull * count + 64);
+		if(limit < 2ull * count + 64)
+		{
+			count = limit > 64 ? (unsigned)((limit - 64) / 2) : 0;
+			printf("c10k: descriptor limit is %llu, running %u connections\n", limit, count);
+		}
+		if(count == 0)
+			return 1;
+
+		usock_handle_t listener = nullptr;
+		usock_create_socket("bench listener", &listener);
+		usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS | USOCK_OPTIONS_NO_DELAY);
+		if(usock_bind(listener, opts.port) != USOCK_OK || usock_listen(listener, kBatch) != USOCK_OK)
+		{
+			printf("c10k: failed to listen on port %hu\n", opts.port);
+			destroy_socket(listener);
+			return 1;
+		}
+
+		const uint64_t heapBefore = allocated_bytes();
+		const tcpMemory memBefore = readMemory();
+
+		std::vector<usock_handle_t> clients, servers;
+		clients.reserve(count);
+		servers.reserve(count);
+
+		// Connect and accept in batches, timing each side on its own
+		histogram connectHist;
+		usock_size_t connectNs = 0, acceptNs = 0;
+		usock_size_t firstKNs = 0, lastKNs = 0;
+		bool ok = true;
+		while(ok && clients.size() < count)
+		{
+			unsigned batch = std::min<unsigned>(kBatch, count - (unsigned)clients.size());
+
+			usock_size_t start = usock_get_time_ns();
+			for(unsigned i = 0; i < batch; ++i)
+			{
+				usock_size_t t0 = usock_get_time_ns();
+				usock_handle_t hsock = nullptr;
+				usock_create_socket("bench client", &hsock);
+				usock_configure(hsock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_NO_DELAY);
+				if(usock_connect(hsock, "127.0.0.1", opts.port) != USOCK_OK)
+				{
+					destroy_socket(hsock);
+					ok = false;
+					batch = i;
+					break;
+				}
+				clients.push_back(hsock);
+
+				usock_size_t t1 = usock_get_time_ns();
+				connectHist.record(t1 - t0);
+				if(clients.size() <= 1000)
+					firstKNs += t1 - t0;
+				if(clients.size() > count - std::min(count, 1000u))
+					lastKNs += t1 - t0;
+			}
+			usock_size_t mid = usock_get_time_ns();
+
+			for(unsigned i = 0; i < batch; ++i)
+			{
+				usock_handle_t hsock = nullptr;
+				if(usock_accept(listener, &hsock) != USOCK_OK)
+				{
+					ok = false;
+					break;
+				}
+				servers.push_back(hsock);
+			}
+			usock_size_t end = usock_get_time_ns();
+
+			connectNs += mid - start;
+			acceptNs += end - mid;
+		}
+		destroy_socket(listener);
+
+		const uint64_t heapAfter = allocated_bytes();
+		const tcpMemory memAfter = readMemory();
+		const size_t established = servers.size();
+		if(!ok)
+			printf("c10k: stopped after %zu connections (error %d)\n", established, usock_get_last_error());
+
+		// Every server socket is watched by a single poller thread
+		std::atomic<bool> stop(false);
+		histogram wakeHist;
+		std::thread poller([&]()
+		{
+			pin_thread(opts.serverCpu);
+
+			std::vector<usock_pollfd_t> fds(established);
+			for(size_t i = 0; i < established; ++i)
+			{
+				fds[i].hsock = servers[i];
+				fds[i].events = USOCK_POLL_IN;
+				fds[i].revents = 0;
+			}
+
+			while(!stop.load(std::memory_order_acquire))
+			{
+				usock_ssize_t ready = usock_poll(fds.data(), fds.size(), 50);
+				usock_size_t now = usock_get_time_ns();
+				for(size_t i = 0; ready > 0 && i < fds.size(); ++i)
+				{
+					if(!fds[i].revents)
+						continue;
+					--ready;
+
+					usock_size_t stamp;
+					if(recv_all(fds[i].hsock, &stamp, sizeof(stamp)))
+						wakeHist.record(now - stamp);
+					else
+						fds[i].hsock = nullptr;
+				}
+			}
+		});
+
+		pin_thread(opts.clientCpu);
+
+		// Send timestamps to random connections at a steady rate
+		uint64_t rng = 0x9E3779B97F4A7C15ull;
+		const usock_size_t interval = 1000000000ull / kMessagesPerSecond;
+		const usock_size_t begin = usock_get_time_ns();
+		const usock_size_t deadline = begin + (usock_size_t)opts.durationMs * 1000000;
+		uint64_t sent = 0;
+		for(usock_size_t next = begin; established > 0 && next < deadline; next += interval)
+		{
+			while(usock_get_time_ns() < next)
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			usock_size_t stamp = usock_get_time_ns();
+			if(send_all(clients[rng % established], &stamp, sizeof(stamp)))
+				++sent;
+		}
+
+		// Give the last wake-ups a moment before stopping the poller
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		stop.store(true, std::memory_order_release);
+		poller.join();
+
+		usock_size_t closeStart = usock_get_time_ns();
+		for(size_t i = 0; i < clients.size(); ++i)
+			destroy_socket(clients[i]);
+		for(size_t i = 0; i < servers.size(); ++i)
+			destroy_socket(servers[i]);
+		usock_size_t closeNs = usock_get_time_ns() - closeStart;
+
+		const double sockets = 2.0 * (established ? established : 1);
+		const unsigned edge = (unsigned)std::min<size_t>(established, 1000);
+		result res;
+		res.name = "c10k";
+		res.add("connections", (double)established)
+		   .add("connect_per_s", clients.size() / (connectNs / 1e9))
+		   .add("accept_per_s", established / (acceptNs / 1e9))
+		   .add("close_per_s", sockets / (closeNs / 1e9))
+		   .add("connect_first_1k_us", edge ? firstKNs / 1000.0 / edge : 0.0)
+		   .add("connect_last_1k_us", edge ? lastKNs / 1000.0 / edge : 0.0)
+		   .add("connect_p99_us", connectHist.percentile(99.0) / 1000.0)
+		   .add("heap_bytes_per_socket", (heapAfter - heapBefore) / sockets)
+		   .add("rss_bytes_per_connection", (memAfter.rssKb - memBefore.rssKb) * 1024.0 / (sockets / 2))
+		   .add("kernel_tcp_bytes_per_connection", (memAfter.tcpPages - memBefore.tcpPages) * 4096.0 / (sockets / 2))
+		   .add("messages", (double)sent)
+		   .add("wakeups", (double)wakeHist.count());
+		res.add("wake_p50_us", wakeHist.percentile(50.0) / 1000.0)
+		   .add("wake_p99_us", wakeHist.percentile(99.0) / 1000.0)
+		   .add("wake_p99.9_us", wakeHist.percentile(99.9) / 1000.0)
+		   .add("wake_max_us", wakeHist.max() / 1000.0);
+		report(res);
+
+		return ok ? 0 : 1;
+	}
+}
@@ -0,0 +1,431 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include "bench.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+* Ping-pong latency over loopback.
+* The client sends a message, the server echoes it back, and the client
+* times the round trip. Client and server run on their own pinned threads.
+* tcp-connect does the same over a fresh connection every time, timing
+* the handshake along with the first exchange. local-latency compares a
+* Unix domain stream with the shared memory transport, and with the
+* in-process memory transport as the floor without a kernel.
+*/
+
+namespace bench
+{
+	// Largest payload that fits in a single UDP datagram
+	static constexpr size_t kMaxDatagram = 65507;
+
+	// Every connection leaves a port in TIME_WAIT, so keep the count modest
+	static constexpr size_t kMaxConnects = 2000;
+
+	static void waitFor(const std::atomic<int> &flag)
+	{
+		while(flag.load(std::memory_order_acquire) == 0)
+			std::this_thread::yield();
+	}
+
+	static bool tcpLatency(const options &opts, size_t size, usock_port_t port)
+	{
+		usock_handle_t hsock, server;
+		if(!tcp_pair(port, USOCK_OPTIONS_NO_DELAY, hsock, server))
+		{
+			printf("tcp-latency: failed to connect on port %hu\n", port);
+			return false;
+		}
+
+		std::thread echo([&]()
+		{
+			pin_thread(opts.serverCpu);
+			std::vector<char> buffer(size);
+			while(recv_all(server, buffer.data(), size) && send_all(server, buffer.data(), size))
+			{
+			}
+		});
+
+		pin_thread(opts.clientCpu);
+
+		std::vector<char> message(size, 'x');
+		histogram hist;
+		bool ok = true;
+		for(size_t i = 0; ok && i < opts.warmup + opts.iterations; ++i)
+		{
+			usock_size_t start = usock_get_time_ns();
+			ok = send_all(hsock, message.data(), size) && recv_all(hsock, message.data(), size);
+			usock_size_t end = usock_get_time_ns();
+			if(i >= opts.warmup)
+				hist.record(end - start);
+		}
+
+		// Closing our end stops the echo thread
+		usock_close_socket(hsock);
+		echo.join();
+		usock_free_socket(hsock);
+		destroy_socket(server);
+
+		if(!ok)
+		{
+			printf("tcp-latency: connection failed at size %zu\n", size);
+			return false;
+		}
+
+		result res;
+		res.name = "tcp-latency";
+		res.add("size", (double)size).add("iterations", (double)hist.count());
+		add_latency(res, hist);
+		report(res);
+		return true;
+	}
+
+	static bool udpLatency(const options &opts, size_t size, usock_port_t port)
+	{
+		std::atomic<int> ready(0);
+		bool serverOk = true;
+
+		std::thread server([&]()
+		{
+			pin_thread(opts.serverCpu);
+
+			usock_handle_t hsock = nullptr;
+			usock_create_socket("bench server", &hsock);
+			usock_configure(hsock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_REUSE_ADDRESS);
+			if(usock_bind(hsock, port) != USOCK_OK)
+			{
+				serverOk = false;
+				ready.store(-1, std::memory_order_release);
+				usock_free_socket(hsock);
+				return;
+			}
+			if(opts.busyPollUs)
+				usock_set_busy_poll(hsock, opts.busyPollUs);
+			ready.store(1, std::memory_order_release);
+
+			// An empty datagram ends the run
+			std::vector<char> buffer(kMaxDatagram);
+			for(;;)
+			{
+				usock_handle_t client = nullptr;
+				usock_ssize_t n = usock_recv_from(hsock, buffer.data(), buffer.size(), 0, &client);
+				if(n > 0)
+					usock_send_to(hsock, buffer.data(), (usock_size_t)n, 0, client);
+				if(client)
+					usock_free_socket(client);
+				if(n <= 0)
+					break;
+			}
+			usock_close_socket(hsock);
+			usock_free_socket(hsock);
+		});
+
+		waitFor(ready);
+		if(!serverOk)
+		{
+			server.join();
+			printf("udp-latency: failed to bind port %hu\n", port);
+			return false;
+		}
+
+		pin_thread(opts.clientCpu);
+
+		usock_handle_t hsock = nullptr;
+		usock_create_socket("bench client", &hsock);
+		usock_configure(hsock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+		bool ok = usock_connect(hsock, "127.0.0.1", port) == USOCK_OK;
+		if(ok && opts.busyPollUs)
+			usock_set_busy_poll(hsock, opts.busyPollUs);
+
+		std::vector<char> message(size, 'x');
+		histogram hist;
+		for(size_t i = 0; ok && i < opts.warmup + opts.iterations; ++i)
+		{
+			usock_size_t start = usock_get_time_ns();
+			ok = usock_send(hsock, message.data(), size) == (usock_ssize_t)size &&
+			     usock_recv(hsock, message.data(), size) == (usock_ssize_t)size;
+			usock_size_t end = usock_get_time_ns();
+			if(i >= opts.warmup)
+				hist.record(end - start);
+		}
+
+		// Client side only, the server's counters go with its thread
+		usock_busy_poll_stats_t poll = {};
+		usock_get_busy_poll_stats(hsock, &poll);
+
+		// Wait for the server before freeing, it creates nodes in usock_recv_from
+		usock_send(hsock, message.data(), 0);
+		server.join();
+		destroy_socket(hsock);
+
+		if(!ok)
+		{
+			printf("udp-latency: round trip failed at size %zu\n", size);
+			return false;
+		}
+
+		result res;
+		res.name = "udp-latency";
+		res.add("size", (double)size).add("iterations", (double)hist.count());
+		if(opts.busyPollUs)
+		{
+			usock_size_t polls = poll.hits + poll.fallbacks;
+			res.add("busy_poll_us", (double)opts.busyPollUs)
+			   .add("busy_poll_hit_rate", polls ? (double)poll.hits / (double)polls : 0.0);
+		}
+		add_latency(res, hist);
+		report(res);
+		return true;
+	}
+
+	static bool tcpConnect(const options &opts, size_t size, usock_port_t port, bool fastOpen)
+	{
+		const char *name = fastOpen ? "tcp-connect-fastopen" : "tcp-connect";
+		const usock_flags_t flags = USOCK_OPTIONS_NO_DELAY | (fastOpen ? USOCK_OPTIONS_FAST_OPEN : 0);
+		const size_t warmup = std::min(opts.warmup, kMaxConnects / 10);
+		const size_t iterations = std::min(opts.iterations, kMaxConnects);
+
+		usock_handle_t listener = nullptr;
+		usock_create_socket("bench listener", &listener);
+		usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, flags | USOCK_OPTIONS_REUSE_ADDRESS);
+		if(usock_bind(listener, port) != USOCK_OK || usock_listen(listener, 128) != USOCK_OK)
+		{
+			printf("%s: failed to listen on port %hu\n", name, port);
+			destroy_socket(listener);
+			return false;
+		}
+
+		// Answer each connection's first message, then hang up
+		std::thread server([&]()
+		{
+			pin_thread(opts.serverCpu);
+			std::vector<char> buffer(size);
+			for(size_t i = 0; i < warmup + iterations; ++i)
+			{
+				usock_handle_t hsock = nullptr;
+				if(usock_accept(listener, &hsock) != USOCK_OK)
+					break;
+				if(recv_all(hsock, buffer.data(), size))
+					send_all(hsock, buffer.data(), size);
+				destroy_socket(hsock);
+			}
+		});
+
+		pin_thread(opts.clientCpu);
+
+		std::vector<char> message(size, 'x');
+		histogram hist;
+		bool ok = true;
+		for(size_t i = 0; ok && i < warmup + iterations; ++i)
+		{
+			usock_handle_t hsock = nullptr;
+			usock_create_socket("bench client", &hsock);
+			usock_configure(hsock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, flags);
+
+			usock_size_t start = usock_get_time_ns();
+			usock_size_t sent = 0;
+			if(fastOpen)
+				ok = usock_connect_send(hsock, "127.0.0.1", port, message.data(), size, &sent) == USOCK_OK &&
+				     (sent == size || send_all(hsock, message.data() + sent, size - sent));
+			else
+				ok = usock_connect(hsock, "127.0.0.1", port) == USOCK_OK &&
+				     send_all(hsock, message.data(), size);
+			ok = ok && recv_all(hsock, message.data(), size);
+			usock_size_t end = usock_get_time_ns();
+			if(i >= warmup)
+				hist.record(end - start);
+
+			destroy_socket(hsock);
+		}
+
+		// A failed client leaves the server waiting in accept
+		if(!ok)
+			usock_close_socket(listener);
+		server.join();
+		destroy_socket(listener);
+
+		if(!ok)
+		{
+			printf("%s: connection failed at size %zu (error %d)\n", name, size, usock_get_last_error());
+			return false;
+		}
+
+		result res;
+		res.name = name;
+		res.add("size", (double)size).add("connections", (double)hist.count());
+		add_latency(res, hist);
+		report(res);
+		return true;
+	}
+
+	// The shared memory handshake needs the accept running alongside the connect
+	static bool localPair(usock_domain_t domain, usock_socket_type_t type, const std::string &name, usock_port_t port, usock_handle_t &client, usock_handle_t &server)
+	{
+		usock_handle_t listener = nullptr;
+		client = server = nullptr;
+
+		usock_create_socket("bench listener", &listener);
+		usock_configure(listener, domain, type, USOCK_OPTIONS_DEFAULT);
+		if(usock_bind_address(listener, name.c_str(), port) != USOCK_OK || usock_listen(listener, 1) != USOCK_OK)
+		{
+			destroy_socket(listener);
+			return false;
+		}
+
+		bool accepted = false;
+		std::thread acceptor([&]()
+		{
+			accepted = usock_accept(listener, &server) == USOCK_OK;
+		});
+
+		usock_create_socket("bench client", &client);
+		usock_configure(client, domain, type, USOCK_OPTIONS_DEFAULT);
+		bool ok = usock_connect(client, name.c_str(), port) == USOCK_OK;
+		acceptor.join();
+		destroy_socket(listener);
+
+		if(!ok || !accepted)
+		{
+			destroy_socket(client);
+			destroy_socket(server);
+			client = server = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	static bool localLatency(const options &opts, size_t size, usock_domain_t domain, usock_socket_type_t type)
+	{
+		const char *name = domain == USOCK_DOMAIN_MEMORY ? "memory-latency" :
+		                   type == USOCK_SOCKTYPE_SHARED_MEMORY ? "shm-latency" : "unix-latency";
+		usock_handle_t hsock, server;
+		// Abstract names, so nothing is left behind in the filesystem; only memory sockets use the port
+		if(!localPair(domain, type, "@usock-bench-" + std::to_string(opts.port), opts.port, hsock, server))
+		{
+			printf("%s: failed to connect\n", name);
+			return false;
+		}
+
+		std::thread echo([&]()
+		{
+			pin_thread(opts.serverCpu);
+			std::vector<char> buffer(size);
+			while(recv_all(server, buffer.data(), size) && send_all(server, buffer.data(), size))
+			{
+			}
+		});
+
+		pin_thread(opts.clientCpu);
+
+		std::vector<char> message(size, 'x');
+		histogram hist;
+		bool ok = true;
+		for(size_t i = 0; ok && i < opts.warmup + opts.iterations; ++i)
+		{
+			usock_size_t start = usock_get_time_ns();
+			ok = send_all(hsock, message.data(), size) && recv_all(hsock, message.data(), size);
+			usock_size_t end = usock_get_time_ns();
+			if(i >= opts.warmup)
+				hist.record(end - start);
+		}
+
+		usock_close_socket(hsock);
+		echo.join();
+		usock_free_socket(hsock);
+		destroy_socket(server);
+
+		if(!ok)
+		{
+			printf("%s: round trip failed at size %zu\n", name, size);
+			return false;
+		}
+
+		result res;
+		res.name = name;
+		res.add("size", (double)size).add("iterations", (double)hist.count());
+		add_latency(res, hist);
+		report(res);
+		return true;
+	}
+
+	int tcp_latency(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 16, 64, 1024, 16384 } : opts.sizes;
+		int fail = 0;
+		for(size_t i = 0; i < sizes.size(); ++i)
+			fail |= !tcpLatency(opts, sizes[i], (usock_port_t)(opts.port + i));
+		return fail;
+	}
+
+	int tcp_connect(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 64, 1024 } : opts.sizes;
+		int fail = 0;
+		for(size_t i = 0; i < sizes.size(); ++i)
+		{
+			fail |= !tcpConnect(opts, sizes[i], (usock_port_t)(opts.port + 2 * i), false);
+			fail |= !tcpConnect(opts, sizes[i], (usock_port_t)(opts.port + 2 * i + 1), true);
+		}
+		return fail;
+	}
+
+	int local_latency(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 16, 64, 1024, 16384 } : opts.sizes;
+		int fail = 0;
+		for(size_t size : sizes)
+		{
+			if(size == 0 || size > USOCK_SHM_MAX_MESSAGE_SIZE)
+			{
+				printf("local-latency: size %zu doesn't fit a ring\n", size);
+				fail = 1;
+				continue;
+			}
+			fail |= !localLatency(opts, size, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_RELIABLE);
+			fail |= !localLatency(opts, size, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_SHARED_MEMORY);
+			fail |= !localLatency(opts, size, USOCK_DOMAIN_MEMORY, USOCK_SOCKTYPE_RELIABLE);
+		}
+		return fail;
+	}
+
+	int udp_latency(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 16, 64, 1024, 16384 } : opts.sizes;
+		int fail = 0;
+		for(size_t i = 0; i < sizes.size(); ++i)
+		{
+			if(sizes[i] == 0 || sizes[i] > kMaxDatagram)
+			{
+				printf("udp-latency: size %zu doesn't fit a datagram\n", sizes[i]);
+				fail = 1;
+				continue;
+			}
+			fail |= !udpLatency(opts, sizes[i], (usock_port_t)(opts.port + i));
+		}
+		return fail;
+	}
+}
@@ -0,0 +1,304 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include "bench.hpp"
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+* Throughput over loopback.
+* A sender thread pushes data for a fixed duration while a receiver
+* thread counts what arrives; rates are taken at the receiver.
+*/
+
+namespace bench
+{
+	static constexpr size_t kRecvBufferSize = 256 * 1024;
+	static constexpr unsigned kDefaultConnections = 8;
+
+	static double seconds(usock_size_t startNs, usock_size_t endNs)
+	{
+		return endNs > startNs ? (endNs - startNs) / 1e9 : 1e-9;
+	}
+
+	struct streamResult
+	{
+		uint64_t bytes = 0;
+		usock_size_t startNs = 0;
+		usock_size_t endNs = 0;
+	};
+
+	// Write chunks of size bytes until the duration is up, then close
+	static void streamSender(const options &opts, usock_handle_t hsock, size_t size)
+	{
+		pin_thread(opts.clientCpu);
+
+		std::vector<char> chunk(size, 'x');
+		const usock_size_t deadline = usock_get_time_ns() + (usock_size_t)opts.durationMs * 1000000;
+		for(unsigned i = 0; ; ++i)
+		{
+			if((i & 15) == 0 && usock_get_time_ns() >= deadline)
+				break;
+			if(!send_all(hsock, chunk.data(), size))
+				break;
+		}
+		usock_close_socket(hsock);
+	}
+
+	// Read until the sender closes, timing from the first byte to the last
+	static void streamReceiver(const options &opts, usock_handle_t hsock, streamResult &res)
+	{
+		pin_thread(opts.serverCpu);
+
+		std::vector<char> buffer(kRecvBufferSize);
+		for(;;)
+		{
+			usock_ssize_t n = usock_recv(hsock, buffer.data(), buffer.size());
+			if(n <= 0)
+				break;
+			if(res.bytes == 0)
+				res.startNs = usock_get_time_ns();
+			res.bytes += (uint64_t)n;
+			res.endNs = usock_get_time_ns();
+		}
+	}
+
+	static bool tcpStream(const options &opts, const char *name, size_t size, usock_port_t port)
+	{
+		usock_handle_t client, server;
+		if(!tcp_pair(port, USOCK_OPTIONS_NO_DELAY, client, server))
+		{
+			printf("%s: failed to connect on port %hu\n", name, port);
+			return false;
+		}
+
+		streamResult recvd;
+		std::thread receiver(streamReceiver, std::cref(opts), server, std::ref(recvd));
+		streamSender(opts, client, size);
+		receiver.join();
+
+		usock_free_socket(client);
+		destroy_socket(server);
+
+		double secs = seconds(recvd.startNs, recvd.endNs);
+		result res;
+		res.name = name;
+		res.label("api", "usock_send")
+		   .add("size", (double)size)
+		   .add("bytes", (double)recvd.bytes)
+		   .add("seconds", secs)
+		   .add("mb_per_s", recvd.bytes / secs / 1e6)
+		   .add("msgs_per_s", recvd.bytes / (double)size / secs);
+		report(res);
+		return recvd.bytes > 0;
+	}
+
+	static bool udpRate(const options &opts, unsigned batch, size_t size, usock_port_t port)
+	{
+		usock_handle_t receiver = nullptr, sender = nullptr;
+		usock_create_socket("bench receiver", &receiver);
+		usock_configure(receiver, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_REUSE_ADDRESS);
+		if(usock_bind(receiver, port) != USOCK_OK)
+		{
+			printf("udp-rate: failed to bind port %hu\n", port);
+			destroy_socket(receiver);
+			return false;
+		}
+		usock_set_nonblocking(receiver, 1);
+
+		usock_create_socket("bench sender", &sender);
+		usock_configure(sender, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+		usock_connect(sender, "127.0.0.1", port);
+
+		// The receiver polls so it can stop once the sender is done;
+		// datagrams that don't fit the socket buffer are simply lost
+		std::atomic<bool> done(false);
+		uint64_t received = 0;
+		std::thread recvThread([&]()
+		{
+			pin_thread(opts.serverCpu);
+			std::vector<char> buffer(size);
+			for(;;)
+			{
+				usock_ssize_t n = usock_recv(receiver, buffer.data(), buffer.size());
+				if(n >= 0)
+					++received;
+				else if(done.load(std::memory_order_acquire))
+					break;
+				else
+					std::this_thread::yield();
+			}
+		});
+
+		pin_thread(opts.clientCpu);
+
+		std::vector<char> payload(size, 'x');
+		std::vector<usock_msg_t> msgs(batch);
+		for(auto &msg : msgs)
+		{
+			msg.pBuffer = payload.data();
+			msg.len     = size;
+			msg.hdest   = nullptr; // Connected socket
+		}
+
+		uint64_t sent = 0;
+		const usock_size_t start = usock_get_time_ns();
+		const usock_size_t deadline = start + (usock_size_t)opts.durationMs * 1000000;
+		usock_size_t end = start;
+		while(end < deadline)
+		{
+			for(unsigned i = 0; i < 16; ++i)
+			{
+				usock_ssize_t n = batch > 1
+					? usock_send_to_batch(sender, msgs.data(), batch, 0)
+					: usock_send(sender, payload.data(), size);
+				if(n > 0)
+					sent += batch > 1 ? (uint64_t)n : 1;
+			}
+			end = usock_get_time_ns();
+		}
+
+		// Let the receiver drain what's already queued
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		done.store(true, std::memory_order_release);
+		recvThread.join();
+
+		destroy_socket(sender);
+		destroy_socket(receiver);
+
+		double secs = seconds(start, end);
+		result res;
+		res.name = "udp-rate";
+		res.label("api", batch > 1 ? "usock_send_to_batch" : "usock_send")
+		   .add("size", (double)size)
+		   .add("batch", (double)batch)
+		   .add("sent_pps", sent / secs)
+		   .add("recv_pps", received / secs)
+		   .add("recv_mb_per_s", received * (double)size / secs / 1e6)
+		   .add("loss_pct", sent ? 100.0 * (sent - std::min(sent, received)) / sent : 0.0);
+		report(res);
+		return received > 0;
+	}
+
+	static bool tcpMulti(const options &opts, size_t size, usock_port_t port)
+	{
+		const unsigned count = opts.connections ? opts.connections : kDefaultConnections;
+		std::vector<usock_handle_t> clients(count), servers(count);
+
+		for(unsigned i = 0; i < count; ++i)
+		{
+			if(!tcp_pair((usock_port_t)(port + i), USOCK_OPTIONS_NO_DELAY, clients[i], servers[i]))
+			{
+				printf("tcp-multi: failed to connect on port %hu\n", (usock_port_t)(port + i));
+				for(unsigned j = 0; j < i; ++j)
+				{
+					destroy_socket(clients[j]);
+					destroy_socket(servers[j]);
+				}
+				return false;
+			}
+		}
+
+		// One sender and one receiver thread per connection; each thread
+		// pins itself with the shared client/server CPU settings
+		std::vector<streamResult> recvd(count);
+		std::vector<std::thread> threads;
+		for(unsigned i = 0; i < count; ++i)
+		{
+			threads.emplace_back(streamReceiver, std::cref(opts), servers[i], std::ref(recvd[i]));
+			threads.emplace_back(streamSender, std::cref(opts), clients[i], size);
+		}
+		for(auto &t : threads)
+			t.join();
+
+		uint64_t bytes = 0;
+		usock_size_t start = ~0ull, end = 0;
+		for(unsigned i = 0; i < count; ++i)
+		{
+			bytes += recvd[i].bytes;
+			if(recvd[i].bytes)
+			{
+				start = std::min(start, recvd[i].startNs);
+				end = std::max(end, recvd[i].endNs);
+			}
+			usock_free_socket(clients[i]);
+			destroy_socket(servers[i]);
+		}
+
+		double secs = seconds(start, end);
+		result res;
+		res.name = "tcp-multi";
+		res.label("api", "usock_send")
+		   .add("size", (double)size)
+		   .add("connections", (double)count)
+		   .add("bytes", (double)bytes)
+		   .add("seconds", secs)
+		   .add("mb_per_s", bytes / secs / 1e6);
+		report(res);
+		return bytes > 0;
+	}
+
+	int tcp_stream(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 1024, 4096, 16384, 65536, 262144 } : opts.sizes;
+		int fail = 0;
+		for(size_t i = 0; i < sizes.size(); ++i)
+			fail |= !tcpStream(opts, "tcp-stream", sizes[i], (usock_port_t)(opts.port + i));
+		return fail;
+	}
+
+	int tcp_rate(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 16, 64, 256 } : opts.sizes;
+		int fail = 0;
+		for(size_t i = 0; i < sizes.size(); ++i)
+			fail |= !tcpStream(opts, "tcp-rate", sizes[i], (usock_port_t)(opts.port + i));
+		return fail;
+	}
+
+	int udp_rate(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 64, 512, 1400 } : opts.sizes;
+		int fail = 0;
+		usock_port_t port = opts.port;
+		for(size_t size : sizes)
+		{
+			// Once with plain sends, once batched, to compare the two paths
+			fail |= !udpRate(opts, 1, size, port++);
+			if(opts.batch > 1)
+				fail |= !udpRate(opts, opts.batch, size, port++);
+		}
+		return fail;
+	}
+
+	int tcp_multi(const options &opts)
+	{
+		const std::vector<size_t> sizes = opts.sizes.empty() ? std::vector<size_t>{ 65536 } : opts.sizes;
+		int fail = 0;
+		for(size_t i = 0; i < sizes.size(); ++i)
+			fail |= !tcpMulti(opts, sizes[i], (usock_port_t)(opts.port + i * (opts.connections ? opts.connections : kDefaultConnections)));
+		return fail;
+	}
+}
@@ -0,0 +1,178 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include "bench.hpp"
+#include <usock.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+struct Bench
+{
+	int (*run)(const bench::options &opts);
+	const char *description;
+};
+
+static void PrintUsage(const std::map<std::string, Bench> &benches);
+static bool ParseOptions(int argc, const char *argv[], bench::options &opts);
+
+int main(int argc, const char *argv[])
+{
+	//Benchmarks in the order "all" runs them
+	static const std::map<std::string, Bench> benches = {
+		{ "tcp-latency", { bench::tcp_latency, "TCP ping-pong round trip latency over loopback." } },
+		{ "udp-latency", { bench::udp_latency, "UDP ping-pong round trip latency over loopback." } },
+		{ "tcp-connect", { bench::tcp_connect, "Time to first response on fresh TCP connections, with and without fast open." } },
+		{ "local-latency", { bench::local_latency, "Ping-pong round trip latency over a Unix domain stream, shared memory and the memory transport." } },
+		{ "tcp-stream",  { bench::tcp_stream,  "Bulk TCP streaming throughput with varying write sizes." } },
+		{ "tcp-rate",    { bench::tcp_rate,    "Small message TCP rate, one usock_send per message." } },
+		{ "udp-rate",    { bench::udp_rate,    "UDP packet rate on one sending core, plain and batched sends." } },
+		{ "tcp-multi",   { bench::tcp_multi,   "Aggregate TCP throughput over several connections." } },
+		{ "c10k",        { bench::c10k,        "Tens of thousands of mostly idle TCP connections." } },
+	};
+
+	if(argc <= 1 || strcmp(argv[1], "help") == 0)
+	{
+		PrintUsage(benches);
+		return 0;
+	}
+
+	bench::options opts;
+	if(!ParseOptions(argc, argv, opts))
+	{
+		PrintUsage(benches);
+		return 2;
+	}
+
+	bench::install_counting_allocator();
+	usock::instance usockInst;
+	bench::set_quiet(opts.json == "-");
+
+	int fail = 0;
+	if(strcmp(argv[1], "all") == 0)
+	{
+		for(const auto &b : benches)
+		{
+			fail |= b.second.run(opts);
+			opts.port = (usock_port_t)(opts.port + 64);
+		}
+	}
+	else
+	{
+		const auto b = benches.find(argv[1]);
+		if(b == benches.end())
+		{
+			printf("Invalid benchmark name: %s\n", argv[1]);
+			PrintUsage(benches);
+			return 2;
+		}
+		fail = b->second.run(opts);
+	}
+
+	if(!opts.json.empty() && !bench::write_json(opts.json))
+	{
+		printf("Failed to write %s\n", opts.json.c_str());
+		fail = 1;
+	}
+	return fail;
+}
+
+static void PrintUsage(const std::map<std::string, Bench> &benches)
+{
+	printf("Usage: usock-bench name [options]\n");
+	printf("%-20s | Description\n", "Name");
+	printf("%.20s-------------------------\n", "------------------------------------------------------");
+	printf("%-20s | Display this help text\n", "help");
+	printf("%-20s | Run all benchmarks.\n", "all");
+	for(const auto &b : benches)
+	{
+		printf("%-20s | %s\n", b.first.c_str(), b.second.description);
+	}
+	printf("\n");
+	printf("Options:\n");
+	printf("  --size N[,N...]     Message sizes in bytes.\n");
+	printf("  --iterations N      Measured iterations per size.\n");
+	printf("  --warmup N          Iterations run before measuring.\n");
+	printf("  --client-cpu N      CPU to pin the client thread to, -1 for none.\n");
+	printf("  --server-cpu N      CPU to pin the server thread to, -1 for none.\n");
+	printf("  --port N            First loopback port to use.\n");
+	printf("  --duration-ms N     Length of each throughput run.\n");
+	printf("  --connections N     Connections for tcp-multi and c10k.\n");
+	printf("  --batch N           Messages per batched send in udp-rate, 1 to skip.\n");
+	printf("  --busy-poll-us N    Spin budget for udp-latency receives, 0 to block.\n");
+	printf("  --json PATH         Also write the results as JSON, - for stdout only.\n");
+}
+
+static bool ParseOptions(int argc, const char *argv[], bench::options &opts)
+{
+	for(int i = 2; i < argc; ++i)
+	{
+		if(i + 1 >= argc)
+		{
+			printf("Missing value for %s\n", argv[i]);
+			return false;
+		}
+
+		const char *key = argv[i];
+		const char *value = argv[++i];
+		if(strcmp(key, "--size") == 0)
+		{
+			opts.sizes.clear();
+			for(const char *p = value; *p; )
+			{
+				char *end;
+				opts.sizes.push_back(strtoull(p, &end, 10));
+				p = *end == ',' ? end + 1 : end;
+				if(*end && *end != ',')
+					return false;
+			}
+		}
+		else if(strcmp(key, "--iterations") == 0)
+			opts.iterations = strtoull(value, nullptr, 10);
+		else if(strcmp(key, "--warmup") == 0)
+			opts.warmup = strtoull(value, nullptr, 10);
+		else if(strcmp(key, "--client-cpu") == 0)
+			opts.clientCpu = atoi(value);
+		else if(strcmp(key, "--server-cpu") == 0)
+			opts.serverCpu = atoi(value);
+		else if(strcmp(key, "--port") == 0)
+			opts.port = (usock_port_t)atoi(value);
+		else if(strcmp(key, "--duration-ms") == 0)
+			opts.durationMs = (unsigned)strtoul(value, nullptr, 10);
+		else if(strcmp(key, "--connections") == 0)
+			opts.connections = (unsigned)strtoul(value, nullptr, 10);
+		else if(strcmp(key, "--batch") == 0)
+			opts.batch = (unsigned)strtoul(value, nullptr, 10);
+		else if(strcmp(key, "--busy-poll-us") == 0)
+			opts.busyPollUs = (unsigned)strtoul(value, nullptr, 10);
+		else if(strcmp(key, "--json") == 0)
+			opts.json = value;
+		else
+		{
+			printf("Unknown option %s\n", key);
+			return false;
+		}
+	}
+	return true;
+}
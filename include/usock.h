@@ -60,37 +60,91 @@ typedef enum
 	USOCK_ERROR_INVALID_ARG,
 	USOCK_ERROR_PROTOCOL_NOT_SUPPORTED,
 	USOCK_ERROR_INTERNAL, //Use usock_get_last_error() to get internal error code
+	USOCK_ERROR_CONNECTION_CLOSED,
+	USOCK_ERROR_BUFFER_TOO_SMALL,
+	USOCK_ERROR_CHECKSUM_MISMATCH,
+	USOCK_ERROR_LIMIT_REACHED,
+	USOCK_ERROR_TIMEOUT,
 } usock_err_t;
 
 /*
 * The communication domain to use.
+* Local - Unix domain sockets, for peers on the same host. They skip the
+*         IP stack altogether. Addresses are filesystem paths, or names in
+*         the abstract namespace when they start with '@'. Ports are
+*         ignored. Reliable sockets are streams and fast sockets are
+*         datagrams. Linux only.
+* Memory - Sockets that never leave the process, for benchmarking and
+*         testing code above the network without the kernel in the way.
+*         Addresses are any name plus a port. Reliable sockets keep each
+*         send as a message in order; fast sockets are datagrams that can
+*         be lost. Latency, jitter, loss and bandwidth can be simulated
+*         (see usock_memory_set_conditions). usock_poll, the vectored
+*         calls and deadline I/O don't apply to them.
 */
 typedef enum
 {
 	USOCK_DOMAIN_UNSPECIFIED = 0,
 	USOCK_DOMAIN_IPV4,
 	USOCK_DOMAIN_IPV6,
+	USOCK_DOMAIN_LOCAL,
+	USOCK_DOMAIN_MEMORY,
 } usock_domain_t;
 
 /*
 * The socket type to use.
 * Fast     - UDP connection, fast but unreliable.
 * Reliable - TCP connection, more overhead than UDP but also more reliable.
+* Reliable datagram - Message oriented, reliable transport over UDP, with
+*            selective acks and independent channels (see usock_rudp_send).
+*            Each socket talks to a single peer: the client connects, and
+*            the bound server adopts the sender of the first datagram.
+* Shared memory - Messages between processes on the same host, copied
+*            through a pair of rings in shared memory. Connections are set
+*            up like USOCK_DOMAIN_LOCAL streams (always local, whatever the
+*            domain), after which usock_send and usock_recv make no system
+*            calls unless the other side is asleep. Each send is delivered
+*            as one message; a receive returns at most one, and a short
+*            buffer leaves the rest for the next call. Sends larger than
+*            USOCK_SHM_MAX_MESSAGE_SIZE are cut short, like on a stream.
+*            One thread may send while another receives. Ring data doesn't
+*            wake usock_poll. Linux only.
 */
 typedef enum
 {
 	USOCK_SOCKTYPE_FAST = 0,
 	USOCK_SOCKTYPE_RELIABLE,
+	USOCK_SOCKTYPE_RELIABLE_DATAGRAM,
+	USOCK_SOCKTYPE_SHARED_MEMORY,
 } usock_socket_type_t;
 
+/*
+* Ring size, per direction, of shared memory sockets, and the largest
+* message that fits in one.
+*/
+#define USOCK_SHM_RING_SIZE         (1 << 20)
+#define USOCK_SHM_MAX_MESSAGE_SIZE  (USOCK_SHM_RING_SIZE - 8)
+
 /*
 * Optional bit flags for configuring the socket.
+* No delay - Disable Nagle's algorithm on TCP sockets, so small writes
+*            go out immediately. Accepted sockets inherit it.
+* Stats    - Keep traffic counters for the socket (see usock_get_stats).
+*            Accepted sockets inherit it.
+* Fast open - TCP Fast Open. A listener accepts data in the SYN of clients
+*            that hold a cookie from an earlier connection, and a client's
+*            usock_connect returns at once so the first usock_send goes
+*            out with the SYN. Linux also needs the net.ipv4.tcp_fastopen
+*            sysctl to allow it; without it the handshake is a normal one.
 */
 typedef enum
 {
 	USOCK_OPTIONS_DEFAULT       = 0x0,
 	USOCK_OPTIONS_REUSE_ADDRESS = 0x1,
 	USOCK_OPTIONS_REUSE_PORT    = 0x2,
+	USOCK_OPTIONS_NO_DELAY      = 0x4,
+	USOCK_OPTIONS_STATS         = 0x8,
+	USOCK_OPTIONS_FAST_OPEN     = 0x10,
 } usock_options_t;
 
 /*
@@ -191,6 +245,24 @@ USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_create_socket_ex(
 	void             **ppOutUserData
 );
 
+/*
+* Number of registry shards, and so the most threads that can each have
+* a shard of their own.
+*/
+#define USOCK_REGISTRY_SHARDS 64
+
+/*
+* Pick the registry shard this thread's sockets and allocations are
+* counted in. Each shard has its own lock, and threads are spread over
+* them round robin by default; a thread-per-core program gives every
+* core its own shard so creating and freeing sockets never contends.
+* \param shard - Any number, taken modulo USOCK_REGISTRY_SHARDS, so
+*                threads past that many share shards, and locks.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_set_thread_shard(
+	unsigned           shard
+);
+
 /*
 * Configure the connection protocol.
 * \param hsock - The socket handle (returned by usock_create_socket).
@@ -215,6 +287,23 @@ USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_bind(
 	usock_port_t        port
 );
 
+/*
+* Bind the server socket to a single local address, e.g. "127.0.0.1"
+* to only accept connections from the same machine.
+* Local sockets are bound to a path this way. With
+* USOCK_OPTIONS_REUSE_ADDRESS a stale socket file left at the path is
+* removed first.
+* \param hsock      - The socket handle (returned by usock_create_socket).
+* \param ip_address - The local address, or NULL for any address.
+* \param port       - The port number to bind the socket to.
+* \return           - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_bind_address(
+	usock_handle_t      hsock,
+	const char         *ip_address,
+	usock_port_t        port
+);
+
 /*
 * Listen for incoming connections.
 * \param hsock - The socket handle (returned by usock_create_socket).
@@ -241,6 +330,7 @@ USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_accept(
 
 /*
 * Connect to a server at the specified address and port.
+* Local sockets take the server's path as the address.
 * \param hsock - The socket handle (returned by usock_create_socket).
 * \param ip_address - The ip address to connect to.
 * \param port - The port to connect to.
@@ -252,6 +342,62 @@ USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_connect(
 	usock_port_t        port
 );
 
+/*
+* Connect to a server and send the first message in one call.
+* TCP sockets send the message with the SYN (TCP Fast Open) when the
+* server has handed out a cookie before, saving the handshake round trip
+* before the request. Otherwise, and for other socket types, this is a
+* usock_connect followed by a usock_send.
+* \param hsock - The socket handle (returned by usock_create_socket).
+* \param ip_address - The ip address to connect to.
+* \param port - The port to connect to.
+* \param pBuffer - The message to send.
+* \param len - Length of the message in bytes.
+* \param pOutSent - Returns the number of bytes sent. May be NULL.
+* \return - Error code, USOCK_ERROR_INTERNAL if the connect or the send failed.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_connect_send(
+	usock_handle_t      hsock,
+	const char         *ip_address,
+	usock_port_t        port,
+	const void         *pBuffer,
+	usock_size_t        len,
+	usock_size_t       *pOutSent
+);
+
+/*
+* One connection of a usock_connect_batch call.
+* hsock      - A configured socket that isn't connected yet.
+* ip_address - The ip address to connect to.
+* port       - The port to connect to.
+* timeoutMs  - How long this connection may take, or -1 for no limit.
+* result     - Filled in with USOCK_OK, USOCK_ERROR_TIMEOUT, or the error
+*              that stopped the connect.
+*/
+typedef struct
+{
+	usock_handle_t hsock;
+	const char    *ip_address;
+	usock_port_t   port;
+	int            timeoutMs;
+	usock_err_t    result;
+} usock_connect_request_t;
+
+/*
+* Connect many sockets at once. Every connect is started without
+* blocking, and a single poll waits for all of them, so the whole batch
+* takes about as long as the slowest connection rather than the sum.
+* Sockets that connect are left in blocking mode, as usock_connect
+* leaves them. Sockets that fail or time out are closed.
+* \param pRequests - The connections to make, results are filled in.
+* \param count     - The number of entries in pRequests.
+* \return          - The number of sockets connected.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_connect_batch(
+	usock_connect_request_t *pRequests,
+	usock_size_t             count
+);
+
 /*
 * Read incoming data from the connected socket. This is a blocking call.
 * \param hsock - The socket handle (returned by usock_create_socket).
@@ -278,6 +424,47 @@ USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_send(
 	usock_size_t        buflen
 );
 
+/*
+* usock_recv that gives up at a deadline. Returns as soon as any data is
+* read, like usock_recv; a deadline already passed still takes what's
+* waiting. Not supported on reliable datagram sockets.
+* \param hsock         - The socket handle (returned by usock_create_socket).
+* \param pOutBuffer    - A buffer into which the incoming data will be put.
+* \param buflen        - The size of the provided buffer.
+* \param deadlineNs    - When to give up, see usock_get_time_ns().
+* \param pOutReceived  - Returns the number of bytes read, 0 once the peer
+*                        closes a stream. May be NULL.
+* \return              - Error code, USOCK_ERROR_TIMEOUT if nothing arrived.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_recv_deadline(
+	usock_handle_t      hsock,
+	void               *pOutBuffer,
+	usock_size_t        buflen,
+	usock_size_t        deadlineNs,
+	usock_size_t       *pOutReceived
+);
+
+/*
+* usock_send that gives up at a deadline. Keeps writing until the whole
+* buffer is sent or the deadline passes. Not supported on reliable
+* datagram sockets.
+* \param hsock      - The socket handle (returned by usock_create_socket).
+* \param pBuffer    - The buffer containing the data to be sent.
+* \param buflen     - The number bytes to be sent.
+* \param deadlineNs - When to give up, see usock_get_time_ns().
+* \param pOutSent   - Returns the number of bytes sent, which on a timeout
+*                     may be part of the buffer. May be NULL.
+* \return           - Error code, USOCK_ERROR_TIMEOUT if the buffer couldn't
+*                     all be sent in time.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_send_deadline(
+	usock_handle_t      hsock,
+	const void         *pBuffer,
+	usock_size_t        buflen,
+	usock_size_t        deadlineNs,
+	usock_size_t       *pOutSent
+);
+
 /*
 * Receive a message.
 * \param hsock          - The socket handle (returned by usock_create_socket)
@@ -313,6 +500,237 @@ USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_send_to(
 	usock_handle_t     hdest
 );
 
+/*
+* A single message for the batched send functions.
+* pBuffer - The buffer containing the message to be sent.
+* len     - The size of the message buffer.
+* hdest   - Handle to the intended recipient of this message
+*           (returned by usock_recv_from), or NULL for connected sockets.
+*/
+typedef struct
+{
+	const void        *pBuffer;
+	usock_size_t       len;
+	usock_handle_t     hdest;
+} usock_msg_t;
+
+/*
+* Send a batch of messages. On Linux the whole batch is handed to the
+* kernel with a single sendmmsg() call; other platforms fall back to
+* one sendto() per message.
+* \param hsock - The socket handle (returned by usock_create_socket).
+* \param pMsgs - The messages to be sent.
+* \param count - The number of messages in pMsgs.
+* \param flags - Options to configure the behavior of this function.
+* \return      - Number of messages sent, or -1 if none could be sent.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_send_to_batch(
+	usock_handle_t     hsock,
+	const usock_msg_t *pMsgs,
+	usock_size_t       count,
+	usock_flags_t      flags
+);
+
+/*
+* Cap the rate at which the kernel transmits data on this socket
+* (SO_MAX_PACING_RATE). This only spaces out packets when the fq qdisc
+* is installed on the outgoing interface, or for TCP sockets.
+* The socket must already be bound or connected.
+* \param hsock          - The socket handle (returned by usock_create_socket).
+* \param bytesPerSecond - The maximum rate, or 0 to remove the cap.
+* \return               - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_set_max_pacing_rate(
+	usock_handle_t     hsock,
+	usock_size_t       bytesPerSecond
+);
+
+/*
+* Read a monotonic clock.
+* \return - The current time in nanoseconds, from an arbitrary epoch.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_get_time_ns();
+
+/*
+* A single buffer for the gathered send functions.
+*/
+typedef struct
+{
+	const void        *pBuffer;
+	usock_size_t       len;
+} usock_iovec_t;
+
+/*
+* Send several buffers on the connected socket with a single call,
+* as if they had been concatenated (writev/WSASend).
+* On reliable datagram sockets they go out as one message on channel 0,
+* which must fit in USOCK_RUDP_MAX_MESSAGE_SIZE.
+* \param hsock - The socket handle (returned by usock_create_socket).
+* \param pIov  - The buffers to be sent, in order.
+* \param count - The number of buffers in pIov.
+* \return      - Number of bytes sent, or -1 on error.
+*                This can be less than the total on non-blocking sockets.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_sendv(
+	usock_handle_t       hsock,
+	const usock_iovec_t *pIov,
+	usock_size_t         count
+);
+
+/*
+* Receive into several buffers with a single call (readv/WSARecv),
+* filling each buffer in turn. The buffers are written to, despite
+* usock_iovec_t pointing to const data.
+* On reliable datagram sockets this takes one message, and drops any of
+* it that doesn't fit the buffers.
+* \param hsock - The socket handle (returned by usock_create_socket).
+* \param pIov  - The buffers to receive into, in order.
+* \param count - The number of buffers in pIov.
+* \return      - Number of bytes received, or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_recvv(
+	usock_handle_t       hsock,
+	const usock_iovec_t *pIov,
+	usock_size_t         count
+);
+
+/*
+* Get the socket type the socket was configured with.
+* \param hsock    - The socket handle (returned by usock_create_socket).
+* \param pOutType - The returned socket type.
+* \return         - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_get_socket_type(
+	usock_handle_t       hsock,
+	usock_socket_type_t *pOutType
+);
+
+/*
+* Switch the socket between blocking and non-blocking mode.
+* In non-blocking mode, calls that would block fail instead;
+* use usock_would_block() to tell these apart from real errors.
+* The socket must already be bound, connected or accepted.
+* \param hsock  - The socket handle (returned by usock_create_socket).
+* \param enable - Non-zero for non-blocking mode.
+* \return       - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_set_nonblocking(
+	usock_handle_t     hsock,
+	int                enable
+);
+
+/*
+* Get the platform error code of the last failed call on this thread
+* (errno, or WSAGetLastError() on Windows).
+*/
+USOCK_INTERFACE int USOCK_CONVENTION usock_get_last_error();
+
+/*
+* Check whether the last failed call on this thread only failed because
+* a non-blocking socket wasn't ready.
+* \return - Non-zero if the call should be retried later.
+*/
+USOCK_INTERFACE int USOCK_CONVENTION usock_would_block();
+
+/*
+* Readiness events for usock_poll.
+* In      - Data can be read, or a connection can be accepted.
+* Out     - Data can be written without blocking.
+* Error   - The socket has a pending error (only reported in revents).
+* Hang up - The peer closed the connection (only reported in revents).
+*/
+typedef enum
+{
+	USOCK_POLL_IN     = 0x1,
+	USOCK_POLL_OUT    = 0x2,
+	USOCK_POLL_ERROR  = 0x4,
+	USOCK_POLL_HANGUP = 0x8,
+} usock_poll_events_t;
+
+/*
+* A socket to wait on with usock_poll.
+* hsock   - The socket handle. NULL entries are skipped.
+* events  - The events to wait for (see usock_poll_events_t).
+* revents - The events that happened, filled in by usock_poll.
+*/
+typedef struct
+{
+	usock_handle_t hsock;
+	unsigned short events;
+	unsigned short revents;
+} usock_pollfd_t;
+
+/*
+* Wait until at least one of the sockets is ready.
+* Readiness of reliable datagram sockets only says a datagram arrived,
+* which may not hold a complete message.
+* \param pFds      - The sockets and the events to wait for.
+* \param count     - The number of entries in pFds.
+* \param timeoutMs - How long to wait, 0 to return straight away,
+*                    or -1 to wait until something is ready.
+* \return          - Number of sockets with events, 0 on timeout,
+*                    or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_poll(
+	usock_pollfd_t    *pFds,
+	usock_size_t       count,
+	int                timeoutMs
+);
+
+/*
+* Traffic counters of a socket configured with USOCK_OPTIONS_STATS.
+* Calls count usock calls, so a batch is one send call but several
+* messages. Calls that fail only because a non-blocking socket wasn't
+* ready count as would-block rather than errors. A short write is a
+* send that took fewer bytes (or batch messages) than it was given.
+* Messages received count calls that returned data.
+*/
+typedef struct
+{
+	usock_size_t bytesSent;
+	usock_size_t bytesReceived;
+	usock_size_t messagesSent;
+	usock_size_t messagesReceived;
+	usock_size_t sendCalls;
+	usock_size_t recvCalls;
+	usock_size_t sendWouldBlock;
+	usock_size_t recvWouldBlock;
+	usock_size_t sendErrors;
+	usock_size_t recvErrors;
+	usock_size_t shortWrites;
+} usock_stats_t;
+
+/*
+* Read the counters of a socket. Each counter is read atomically, but
+* the snapshot as a whole isn't, so counters may be a few calls apart.
+* \param hsock    - The socket handle (returned by usock_create_socket).
+* \param pOutStats - The returned counters.
+* \return         - Error code (see usock_err_t for more info).
+*                   USOCK_ERROR_NOT_INITIALIZED if the socket doesn't
+*                   keep counters.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_get_stats(
+	usock_handle_t     hsock,
+	usock_stats_t     *pOutStats
+);
+
+/*
+* Set the counters of a socket back to zero.
+* \param hsock - The socket handle (returned by usock_create_socket).
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_reset_stats(
+	usock_handle_t     hsock
+);
+
+/*
+* Sum the counters of every socket, including sockets that have
+* already been freed.
+* \param pOutStats - The returned counters.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_get_aggregate_stats(
+	usock_stats_t     *pOutStats
+);
+
 /*
 * Close the socket connection.
 * \param hsock - The socket handle (returned by usock_create_socket).
@@ -329,7 +747,840 @@ USOCK_INTERFACE void USOCK_CONVENTION usock_free_socket(
 	usock_handle_t     hsock
 );
 
-/* TODO: Add debug callbacks */
+/*
+* Join a multicast group, so that datagrams sent to it are received on
+* this socket. Bind the socket to the group's port first.
+* Works for both IPv4 and IPv6 groups, depending on the socket's domain.
+* \param hsock      - The socket handle (returned by usock_create_socket).
+* \param group      - The multicast group address, e.g. "239.1.2.3" or "ff15::1".
+* \param iface_name - The interface to join on (e.g. "eth0"),
+*                     or NULL to let the kernel pick one.
+* \return           - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_join_multicast_group(
+	usock_handle_t     hsock,
+	const char        *group,
+	const char        *iface_name
+);
+
+/*
+* Leave a multicast group joined with usock_join_multicast_group.
+* \return - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_leave_multicast_group(
+	usock_handle_t     hsock,
+	const char        *group,
+	const char        *iface_name
+);
+
+/*
+* Join a multicast group, only accepting datagrams from a single source
+* (source-specific multicast). Call it once per source.
+* \param hsock      - The socket handle (returned by usock_create_socket).
+* \param group      - The multicast group address.
+* \param source     - The address of the sender to accept.
+* \param iface_name - The interface to join on, or NULL for the default.
+* \return           - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_join_source_multicast_group(
+	usock_handle_t     hsock,
+	const char        *group,
+	const char        *source,
+	const char        *iface_name
+);
+
+/*
+* Stop accepting datagrams from a source joined with
+* usock_join_source_multicast_group.
+* \return - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_leave_source_multicast_group(
+	usock_handle_t     hsock,
+	const char        *group,
+	const char        *source,
+	const char        *iface_name
+);
+
+/*
+* Set how many hops outgoing multicast datagrams may travel.
+* The default of 1 keeps them on the local network.
+* \param hsock - The socket handle (returned by usock_create_socket).
+* \param ttl   - Time to live (IPv4) or hop limit (IPv6), 0 to 255.
+* \return      - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_set_multicast_ttl(
+	usock_handle_t     hsock,
+	int                ttl
+);
+
+/*
+* Choose whether outgoing multicast datagrams are looped back to
+* receivers on the same host. This is enabled by default.
+* \param hsock  - The socket handle (returned by usock_create_socket).
+* \param enable - Non-zero to loop datagrams back.
+* \return       - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_set_multicast_loop(
+	usock_handle_t     hsock,
+	int                enable
+);
+
+/*
+* Choose the interface outgoing multicast datagrams are sent on.
+* \param hsock      - The socket handle (returned by usock_create_socket).
+* \param iface_name - The interface name, or NULL for the default.
+* \return           - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_set_multicast_interface(
+	usock_handle_t     hsock,
+	const char        *iface_name
+);
+
+/*
+* Limits of the reliable datagram socket type.
+* Messages are never fragmented, so each one must fit in a single packet.
+*/
+#define USOCK_RUDP_MAX_MESSAGE_SIZE 1400
+#define USOCK_RUDP_MAX_CHANNELS     16
+
+/*
+* Optional bit flags for usock_rudp_send.
+* Unordered - Deliver the message as soon as it arrives, instead of
+*             waiting for earlier messages on the same channel.
+*/
+typedef enum
+{
+	USOCK_RUDP_DEFAULT   = 0x0,
+	USOCK_RUDP_UNORDERED = 0x1,
+} usock_rudp_flags_t;
+
+/*
+* Statistics of a reliable datagram socket.
+*/
+typedef struct
+{
+	usock_size_t messagesSent;
+	usock_size_t messagesReceived;
+	usock_size_t packetsSent;
+	usock_size_t retransmits;
+	usock_size_t fastRetransmits;
+	usock_size_t timeouts;
+	usock_size_t duplicates;
+	usock_size_t srttUs;
+	usock_size_t rtoUs;
+	usock_size_t cwnd;
+} usock_rudp_stats_t;
+
+/*
+* Send a message on a reliable datagram socket.
+* Ordering is only enforced within a channel, so a lost message on one
+* channel never holds up delivery on another. usock_send() and
+* usock_send_to() send on channel 0.
+* This blocks while the congestion window is full.
+* Once the peer stops acking, through 8 retransmission timeouts in a row,
+* the socket fails and this and every later call return -1 with ETIMEDOUT.
+* \param hsock   - The socket handle (returned by usock_create_socket).
+* \param channel - The channel, below USOCK_RUDP_MAX_CHANNELS.
+* \param pBuffer - The message to be sent.
+* \param len     - The size of the message, at most USOCK_RUDP_MAX_MESSAGE_SIZE.
+* \param flags   - Options to configure the message (see usock_rudp_flags_t).
+* \return        - Number of bytes sent, or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_rudp_send(
+	usock_handle_t     hsock,
+	unsigned           channel,
+	const void        *pBuffer,
+	usock_size_t       len,
+	usock_flags_t      flags
+);
+
+/*
+* Receive the next message from any channel of a reliable datagram socket.
+* This is a blocking call. Messages that don't fit the buffer are truncated.
+* It fails with ETIMEDOUT like usock_rudp_send once the peer stops acking;
+* with nothing unacknowledged it waits for the peer like a UDP receive.
+* \param hsock       - The socket handle (returned by usock_create_socket).
+* \param pBuffer     - The buffer to capture the incoming message in.
+* \param len         - The size of the buffer.
+* \param pOutChannel - Optional, the channel the message arrived on.
+* \return            - Number of bytes received, or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_rudp_recv(
+	usock_handle_t     hsock,
+	void              *pBuffer,
+	usock_size_t       len,
+	unsigned          *pOutChannel
+);
+
+/*
+* Process incoming packets, acks and retransmissions.
+* Sending and receiving already do this; call it when the socket would
+* otherwise sit idle with unacknowledged messages.
+* \param hsock     - The socket handle (returned by usock_create_socket).
+* \param timeoutMs - How long to wait for incoming packets.
+* \return          - Number of messages ready to be received, or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_rudp_service(
+	usock_handle_t     hsock,
+	int                timeoutMs
+);
+
+/*
+* Drop a fraction of the outgoing packets, to simulate a lossy link.
+* \param hsock    - The socket handle (returned by usock_create_socket).
+* \param lossRate - Fraction of packets to drop, between 0 and 1.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_rudp_set_loss(
+	usock_handle_t     hsock,
+	double             lossRate
+);
+
+/*
+* Get the statistics of a reliable datagram socket.
+* \param hsock    - The socket handle (returned by usock_create_socket).
+* \param pOutStats - The returned statistics.
+* \return         - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_rudp_get_stats(
+	usock_handle_t      hsock,
+	usock_rudp_stats_t *pOutStats
+);
+
+/*
+* Busy-poll receive counters.
+* spins     - Non-blocking receive attempts made while spinning.
+* hits      - Receives that got data while spinning.
+* fallbacks - Receives that used up the budget and fell back to waiting.
+* spinNs    - Time spent spinning, hits and fallbacks alike.
+*/
+typedef struct
+{
+	usock_size_t spins;
+	usock_size_t hits;
+	usock_size_t fallbacks;
+	usock_size_t spinNs;
+} usock_busy_poll_stats_t;
+
+/*
+* Spin on receives before blocking, trading CPU time for the wakeup
+* latency of a blocking call. usock_recv and usock_recv_from retry a
+* non-blocking receive for up to budgetUs, and only then wait as usual.
+* The kernel is also asked to busy poll the device queue (SO_BUSY_POLL,
+* SO_PREFER_BUSY_POLL) where it allows it; raising SO_BUSY_POLL above
+* net.core.busy_read needs CAP_NET_ADMIN, and it's skipped without it.
+* Linux only. Not available on reliable datagram sockets.
+* \param hsock    - The socket handle (returned by usock_create_socket).
+* \param budgetUs - How long to spin per receive, 0 to turn spinning off.
+* \return         - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_set_busy_poll(
+	usock_handle_t     hsock,
+	unsigned           budgetUs
+);
+
+/*
+* Get the busy-poll counters of a socket.
+* \param hsock     - The socket handle (returned by usock_create_socket).
+* \param pOutStats - The returned counters.
+* \return          - Error code, USOCK_ERROR_NOT_INITIALIZED if busy
+*                    polling was never turned on.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_get_busy_poll_stats(
+	usock_handle_t           hsock,
+	usock_busy_poll_stats_t *pOutStats
+);
+
+/*
+* TCP connection state, as reported by the kernel.
+* Fields that the platform doesn't report are 0.
+* rttUs        - Smoothed round trip time.
+* rttVarUs     - Round trip time variance.
+* minRttUs     - Lowest round trip time seen.
+* mss          - Sender maximum segment size, in bytes.
+* cwnd         - Congestion window, in segments.
+* ssthresh     - Slow start threshold, in segments.
+* unacked      - Segments sent and not yet acknowledged.
+* lost         - Segments currently considered lost.
+* totalRetrans - Segments retransmitted over the connection.
+* bytesSent    - Bytes sent, including retransmissions.
+* bytesAcked   - Bytes acknowledged by the peer.
+* bytesRetrans - Bytes retransmitted.
+* deliveryRate - Most recent delivery rate, in bytes per second.
+*/
+typedef struct
+{
+	unsigned int rttUs;
+	unsigned int rttVarUs;
+	unsigned int minRttUs;
+	unsigned int mss;
+	unsigned int cwnd;
+	unsigned int ssthresh;
+	unsigned int unacked;
+	unsigned int lost;
+	usock_size_t totalRetrans;
+	usock_size_t bytesSent;
+	usock_size_t bytesAcked;
+	usock_size_t bytesRetrans;
+	usock_size_t deliveryRate;
+} usock_tcp_info_t;
+
+/*
+* Get the TCP state of a connected USOCK_SOCKTYPE_RELIABLE socket.
+* \param hsock   - The socket handle (returned by usock_create_socket).
+* \param pOutInfo - The returned state.
+* \return        - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_get_tcp_info(
+	usock_handle_t     hsock,
+	usock_tcp_info_t  *pOutInfo
+);
+
+typedef struct
+{
+	usock_handle_t   hsock;
+	usock_tcp_info_t info;
+} usock_tcp_sample_t;
+
+/*
+* Receives TCP samples in batches. The handles only identify the
+* sockets: a socket may have been freed by the time it's called.
+*/
+typedef void (*usock_tcp_sample_callback_t)(const usock_tcp_sample_t *pSamples, usock_size_t count, void *pUserData);
+
+/*
+* Sample every connected USOCK_SOCKTYPE_RELIABLE socket once, on the
+* calling thread. Each batch is queried with its part of the registry
+* locked, which holds up closing and freeing those sockets for as long,
+* but the callback runs unlocked. Sockets created or freed during the walk
+* may be missed.
+* \param callback  - Called with each batch of samples.
+* \param pUserData - Passed to the callback as is.
+* \return          - The number of sockets sampled.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_sample_tcp_info(
+	usock_tcp_sample_callback_t callback,
+	void                       *pUserData
+);
+
+/*
+* Run usock_sample_tcp_info on a background thread every intervalMs.
+* Only one sampler runs at a time.
+* \return - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_tcp_sampler_start(
+	unsigned                    intervalMs,
+	usock_tcp_sample_callback_t callback,
+	void                       *pUserData
+);
+
+/*
+* Stop the background sampler, waiting for a pass in progress.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_tcp_sampler_stop();
+
+/*
+* Pass an open socket to another process over a connected local socket
+* (SCM_RIGHTS), e.g. to hand an accepted connection to a worker without
+* it having to accept it again. The receiver gets its own descriptor of
+* the same connection; the sender's handle stays open until it's closed.
+* A message of at least one byte goes along with the socket.
+* \param hsock     - A connected USOCK_DOMAIN_LOCAL socket.
+* \param hsockSend - The socket to pass.
+* \param pBuffer   - The message sent with it.
+* \param len       - Length of the message, at least 1.
+* \return          - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_send_socket(
+	usock_handle_t  hsock,
+	usock_handle_t  hsockSend,
+	const void     *pBuffer,
+	usock_size_t    len
+);
+
+/*
+* Receive a message, and the socket passed with it if there is one.
+* The new handle is configured like the passed socket, and has to be
+* freed like any other.
+* \param hsock        - A connected USOCK_DOMAIN_LOCAL socket.
+* \param pOutSock     - Returns the passed socket, or NULL if the message
+*                       didn't carry one.
+* \param pOutBuffer   - A buffer into which the message will be put.
+* \param buflen       - The size of the provided buffer.
+* \param pOutReceived - Returns the number of bytes read. May be NULL.
+* \return             - Error code, USOCK_ERROR_CONNECTION_CLOSED if the
+*                       peer closed the connection.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_recv_socket(
+	usock_handle_t  hsock,
+	usock_handle_t *pOutSock,
+	void           *pOutBuffer,
+	usock_size_t    buflen,
+	usock_size_t   *pOutReceived
+);
+
+/*
+* Network conditions simulated by USOCK_DOMAIN_MEMORY sockets.
+* Every message is held back by latencyNs plus a uniform random share of
+* jitterNs, and by the time the link takes to carry it at bytesPerSecond.
+* Reliable sockets keep their messages in order and never lose them;
+* lossRate only drops datagrams. The random numbers come from a stream
+* per socket, seeded from seed and the order sockets were configured in,
+* so a test that sets things up the same way loses the same messages.
+*/
+typedef struct
+{
+	usock_size_t latencyNs;
+	usock_size_t jitterNs;
+	double       lossRate;       /* 0 to 1 */
+	usock_size_t bytesPerSecond; /* 0 for no limit */
+	usock_size_t seed;
+} usock_memory_conditions_t;
+
+/*
+* Set the conditions for memory sockets configured from now on, and
+* restart the numbering behind their random streams.
+* \param pConditions - The conditions, or NULL for a perfect link.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_memory_set_conditions(
+	const usock_memory_conditions_t *pConditions
+);
+
+/*
+* Change the conditions of the messages one memory socket sends.
+* \param hsock       - A socket configured with USOCK_DOMAIN_MEMORY.
+* \param pConditions - The conditions, or NULL for a perfect link.
+* \return            - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_memory_set_socket_conditions(
+	usock_handle_t                   hsock,
+	const usock_memory_conditions_t *pConditions
+);
+
+/*
+* Name resolution.
+* Hostnames are resolved on a worker thread and cached, so a lookup never
+* blocks the caller, and concurrent lookups of the same name share one
+* query. getaddrinfo doesn't report the record TTLs, so cached answers
+* live for a fixed time, set when the resolver is started. Numeric
+* addresses skip the resolver altogether.
+*/
+
+/* Longest address string, IPv6 included, with its terminator */
+#define USOCK_ADDRESS_STRLEN         46
+/* Addresses kept per name */
+#define USOCK_RESOLVE_MAX_ADDRESSES  4
+
+/*
+* Receives the addresses of a name, in the order getaddrinfo returned
+* them. They're only valid during the call.
+*/
+typedef void (*usock_resolve_callback_t)(void *pUserData, usock_err_t result, const char *const *ppAddresses, usock_size_t count);
+
+/*
+* Start the resolver thread.
+* \param ttlMs         - How long an answer is cached.
+* \param negativeTtlMs - How long a failed lookup is cached.
+* \return              - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_resolver_start(
+	unsigned ttlMs,
+	unsigned negativeTtlMs
+);
+
+/*
+* Stop the resolver thread, waiting for a lookup in progress, and drop
+* the cache. Callers still waiting get USOCK_ERROR_NOT_INITIALIZED.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_resolver_stop();
+
+/*
+* Look up a hostname without blocking.
+* A cached answer or a numeric address is passed to the callback before
+* this returns; otherwise it's called from the resolver thread.
+* \param hostname  - The name to look up.
+* \param domain    - The address family wanted, or unspecified for both.
+* \param callback  - Receives the result.
+* \param pUserData - Passed to the callback as is.
+* \return          - Error code, USOCK_ERROR_NOT_INITIALIZED if the
+*                    resolver isn't running.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_resolve_async(
+	const char              *hostname,
+	usock_domain_t           domain,
+	usock_resolve_callback_t callback,
+	void                    *pUserData
+);
+
+/*
+* Look up a hostname through the resolver, waiting for the answer.
+* \param hostname    - The name to look up.
+* \param domain      - The address family wanted, or unspecified for both.
+* \param pOutAddress - Returns the first address.
+* \param len         - Size of pOutAddress, USOCK_ADDRESS_STRLEN is enough.
+* \return            - Error code, USOCK_ERROR_INTERNAL if the name
+*                      didn't resolve.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_resolve(
+	const char     *hostname,
+	usock_domain_t  domain,
+	char           *pOutAddress,
+	usock_size_t    len
+);
+
+/*
+* Connect to a server by name. The name is resolved through the
+* resolver's cache for the socket's domain, and each address is tried in
+* turn until one connects. Local and memory sockets connect to the
+* name directly.
+* \param hsock    - The socket handle (returned by usock_create_socket).
+* \param hostname - The name, or numeric address, to connect to.
+* \param port     - The port to connect to.
+* \return         - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_connect_host(
+	usock_handle_t  hsock,
+	const char     *hostname,
+	usock_port_t    port
+);
+
+/*
+* Kernel timestamping.
+* The kernel can stamp datagrams as they arrive and as they leave, in
+* software and, with a NIC that supports it, in hardware. Comparing the
+* stamps with the time of the usock calls separates the time spent in
+* the network stack and queues from the time spent in the application.
+* Stamps are CLOCK_REALTIME nanoseconds, as taken by the kernel.
+* Hardware stamps also need the interface to be configured for them
+* (e.g. with hwstamp_ctl); without it only software stamps are reported.
+* Linux only.
+*/
+
+typedef enum
+{
+	USOCK_TIMESTAMP_RX_SOFTWARE = 0x1,
+	USOCK_TIMESTAMP_TX_SOFTWARE = 0x2,
+	USOCK_TIMESTAMP_RX_HARDWARE = 0x4,
+	USOCK_TIMESTAMP_TX_HARDWARE = 0x8,
+} usock_timestamp_flags_t;
+
+/*
+* Arrival stamps of a received datagram, 0 where there is none.
+*/
+typedef struct
+{
+	usock_size_t softwareNs;
+	usock_size_t hardwareNs;
+} usock_rx_timestamp_t;
+
+/*
+* The point a transmit stamp was taken at.
+*/
+typedef enum
+{
+	USOCK_TX_STAMP_SENT = 0,  /* Handed to the driver, or on the wire for hardware stamps */
+	USOCK_TX_STAMP_SCHED,     /* Entered the packet scheduler */
+	USOCK_TX_STAMP_ACKED,     /* Acknowledged by the peer, stream sockets only */
+} usock_tx_stamp_type_t;
+
+/*
+* A transmit stamp read from the error queue.
+* id          - The send it belongs to: the datagram count since
+*               timestamping was enabled, or for stream sockets the
+*               offset of the last byte of the send.
+* timestampNs - When the stamp was taken.
+* sendNs      - When the matching usock send call started, 0 if it's
+*               no longer known.
+* type        - See usock_tx_stamp_type_t.
+* hardware    - 1 for a hardware stamp.
+*/
+typedef struct
+{
+	usock_size_t id;
+	usock_size_t timestampNs;
+	usock_size_t sendNs;
+	unsigned int type;
+	unsigned int hardware;
+} usock_tx_timestamp_t;
+
+/*
+* Turn kernel timestamping on or off. Call it once the socket exists,
+* after usock_bind or usock_connect. Not available on reliable datagram
+* sockets, whose sends don't map to single packets.
+* Stamps also feed the USOCK_LATENCY_TX_STACK, USOCK_LATENCY_TX_QUEUE
+* and USOCK_LATENCY_RX_QUEUE histograms, without sampling.
+* \param hsock - The socket handle (returned by usock_create_socket).
+* \param flags - Any of usock_timestamp_flags_t, or 0 to turn it off.
+* \return      - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_enable_timestamping(
+	usock_handle_t     hsock,
+	unsigned           flags
+);
+
+/*
+* Same as usock_recv_from, also returning the arrival stamps.
+* \param pOutTs - The returned stamps, zeroed when there are none.
+* \return       - Number of bytes received, or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_recv_from_ts(
+	usock_handle_t        hsock,
+	void                 *pBuffer,
+	usock_size_t          len,
+	usock_flags_t         flags,
+	usock_handle_t       *pOutClientInfo,
+	usock_rx_timestamp_t *pOutTs
+);
+
+/*
+* Read transmit stamps from the socket's error queue. Never blocks;
+* usock_poll reports USOCK_POLL_ERROR while stamps are waiting.
+* \param hsock - The socket handle (returned by usock_create_socket).
+* \param pOut  - The returned stamps.
+* \param count - The number of entries in pOut.
+* \return      - Number of stamps read, or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_read_tx_timestamps(
+	usock_handle_t        hsock,
+	usock_tx_timestamp_t *pOut,
+	usock_size_t          count
+);
+
+/*
+* Event tracing.
+* While tracing is on, every socket call is recorded into a lock-free
+* ring buffer owned by the calling thread, and a background thread
+* drains the rings to a callback or a file. While it's off, each call
+* only pays for a single flag test.
+* Events are dropped, and counted, when a thread records faster than
+* the rings are drained.
+*/
+
+/*
+* Traced events.
+*/
+typedef enum
+{
+	USOCK_TRACE_CREATE = 0,
+	USOCK_TRACE_BIND,
+	USOCK_TRACE_LISTEN,
+	USOCK_TRACE_ACCEPT,
+	USOCK_TRACE_CONNECT,
+	USOCK_TRACE_SEND,
+	USOCK_TRACE_RECV,
+	USOCK_TRACE_SEND_TO,
+	USOCK_TRACE_RECV_FROM,
+	USOCK_TRACE_SEND_BATCH,
+	USOCK_TRACE_SENDV,
+	USOCK_TRACE_RECVV,
+	USOCK_TRACE_CLOSE,
+	USOCK_TRACE_FREE,
+} usock_trace_event_t;
+
+/*
+* A single traced call.
+* timestampNs - When the call started (see usock_get_time_ns).
+* hsock       - The socket the call was made on.
+* result      - What the call returned: a byte or message count for
+*               transfers, a usock_err_t for the others.
+* durationNs  - How long the call took, saturated at about 4 seconds.
+* event       - The call (see usock_trace_event_t).
+* thread      - Small id of the calling thread, unique while tracing.
+*/
+typedef struct
+{
+	usock_size_t   timestampNs;
+	usock_handle_t hsock;
+	usock_ssize_t  result;
+	unsigned int   durationNs;
+	unsigned short event;
+	unsigned short thread;
+} usock_trace_record_t;
+
+/*
+* Receives drained trace records, on the tracing thread.
+*/
+typedef void (*usock_trace_callback_t)(const usock_trace_record_t *pRecords, usock_size_t count, void *pUserData);
+
+/*
+* Start tracing to a callback.
+* \param callback  - Called with batches of records.
+* \param pUserData - Passed to the callback as is.
+* \return          - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_trace_start(
+	usock_trace_callback_t callback,
+	void                  *pUserData
+);
+
+/*
+* Start tracing to a binary file.
+* The file starts with the 8 byte magic "USOCKTR1" and the 4 byte
+* little endian size of a record, followed by the raw records.
+* \param path - The file to write. It's truncated if it exists.
+* \return     - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_trace_start_file(
+	const char        *path
+);
+
+/*
+* Stop tracing. Records already taken are drained before this returns.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_trace_stop();
+
+/*
+* Number of records dropped because a ring was full, since the library
+* was initialized.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_trace_get_dropped();
+
+/*
+* Latency sampling.
+* One in every N calls to usock_send, usock_recv, usock_accept and
+* usock_connect is timed with the CPU timestamp counter where there is
+* one, and recorded into a log-linear histogram per operation.
+* Sampling is off by default.
+*/
+
+/*
+* Sampled operations.
+*/
+typedef enum
+{
+	USOCK_LATENCY_SEND = 0,
+	USOCK_LATENCY_RECV,
+	USOCK_LATENCY_ACCEPT,
+	USOCK_LATENCY_CONNECT,
+	/* From kernel timestamping (see usock_enable_timestamping) */
+	USOCK_LATENCY_TX_STACK,  /* Send call to the packet scheduler */
+	USOCK_LATENCY_TX_QUEUE,  /* Packet scheduler to the driver or wire */
+	USOCK_LATENCY_RX_QUEUE,  /* Arrival to the receive call returning */
+	USOCK_LATENCY_OP_COUNT,
+} usock_latency_op_t;
+
+/*
+* Histogram buckets. Values below 16ns get a bucket each; above that,
+* every power of two is split into 16 buckets, so a bucket is never
+* wider than 1/16th of its lower bound. The last bucket also holds
+* everything above its range (about 18 minutes).
+*/
+#define USOCK_LATENCY_BUCKET_COUNT 592
+
+/*
+* A snapshot of the samples of one operation.
+* count   - Number of samples.
+* sumNs   - Sum of the samples, for the mean.
+* minNs   - The shortest sample, 0 without samples.
+* maxNs   - The longest sample.
+* buckets - Samples per bucket (see usock_latency_bucket_bound).
+*/
+typedef struct
+{
+	usock_size_t count;
+	usock_size_t sumNs;
+	usock_size_t minNs;
+	usock_size_t maxNs;
+	usock_size_t buckets[USOCK_LATENCY_BUCKET_COUNT];
+} usock_latency_histogram_t;
+
+/*
+* Set how often calls are sampled. This can be changed at any time.
+* \param oneIn - Sample one call in this many, per thread. 0 turns sampling off.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_latency_set_sample_rate(
+	unsigned           oneIn
+);
+
+/*
+* \return - The current sample rate, 0 if sampling is off.
+*/
+USOCK_INTERFACE unsigned USOCK_CONVENTION usock_latency_get_sample_rate();
+
+/*
+* Copy the histogram of an operation.
+* Samples taken while copying may or may not be included.
+* \param op   - The operation (see usock_latency_op_t).
+* \param pOut - The returned histogram.
+* \return     - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_latency_get_histogram(
+	usock_latency_op_t         op,
+	usock_latency_histogram_t *pOut
+);
+
+/*
+* Clear the histograms of all operations.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_latency_reset();
+
+/*
+* \param bucket - A bucket index, below USOCK_LATENCY_BUCKET_COUNT.
+* \return       - The smallest latency in nanoseconds that falls in the bucket.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_latency_bucket_bound(
+	unsigned           bucket
+);
+
+/*
+* Estimate a percentile from a histogram.
+* \param pHist      - The histogram (returned by usock_latency_get_histogram).
+* \param percentile - Between 0 and 100.
+* \return           - The upper bound of the bucket holding the percentile, in nanoseconds.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_latency_percentile(
+	const usock_latency_histogram_t *pHist,
+	double                           percentile
+);
+
+/*
+* Metrics export.
+* Renders the library's state in the Prometheus text format: live
+* sockets, bytes held by the allocator, the counters of every socket
+* configured with USOCK_OPTIONS_STATS, totals including freed sockets,
+* and the sampled latency histograms.
+* The exporter runs on its own thread, either serving the metrics over
+* HTTP on a loopback port or rewriting a file at a fixed interval.
+* Only one exporter runs at a time.
+*/
+
+/*
+* Render the current metrics.
+* \param pBuffer - The buffer to render into. Can be NULL if len is 0.
+* \param len     - The size of the buffer.
+* \return        - The length of the full text, excluding the terminator.
+*                  It was truncated if this is not below len.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_metrics_format(
+	char              *pBuffer,
+	usock_size_t       len
+);
+
+/*
+* Serve the metrics over HTTP on 127.0.0.1, for any request path.
+* \param port - The port to listen on.
+* \return     - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_metrics_serve(
+	usock_port_t       port
+);
+
+/*
+* Write the metrics to a file every intervalMs milliseconds.
+* Each snapshot replaces the file as a whole, so readers never see a
+* partial one.
+* \param path       - The file to write.
+* \param intervalMs - Time between snapshots.
+* \return           - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_metrics_write_file(
+	const char        *path,
+	unsigned           intervalMs
+);
+
+/*
+* Stop the exporter. A file exporter writes a last snapshot first.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_metrics_stop();
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,176 @@
+#pragma once
+#include <usock.h>
+#include <usock_types.hpp>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace usock
+{
+	/*
+	* An immutable, reference counted message payload.
+	* The data is stored once, in the same allocation as the counter,
+	* and shared by every subscriber queue it's put on.
+	*/
+	class payload
+	{
+	public:
+		/*
+		* Reference to a payload. Copying only bumps the reference count.
+		*/
+		class ref
+		{
+		public:
+			ref() : m_ptr(nullptr) {}
+			ref(const ref &rhs) : m_ptr(rhs.m_ptr) { acquire(); }
+			ref(ref &&rref) : m_ptr(rref.m_ptr) { rref.m_ptr = nullptr; }
+			~ref() { reset(); }
+
+			ref &operator=(const ref &rhs)
+			{
+				ref tmp(rhs);
+				std::swap(m_ptr, tmp.m_ptr);
+				return *this;
+			}
+			ref &operator=(ref &&rref)
+			{
+				std::swap(m_ptr, rref.m_ptr);
+				return *this;
+			}
+
+			const payload *operator->() const { return m_ptr; }
+			const payload &operator*() const { return *m_ptr; }
+			explicit operator bool() const { return m_ptr != nullptr; }
+
+			void reset();
+
+		private:
+			friend class payload;
+			explicit ref(payload *ptr) : m_ptr(ptr) {}
+			void acquire() { if(m_ptr) m_ptr->m_refCount.fetch_add(1, std::memory_order_relaxed); }
+
+			payload *m_ptr;
+		};
+
+		/*
+		* Allocate a payload and copy the data into it.
+		*/
+		static ref create(const void *data, size_t size);
+
+		const void *data() const { return m_data; }
+		size_t size() const { return m_size; }
+
+		int64_t use_count() const { return m_refCount.load(std::memory_order_relaxed); }
+
+	private:
+		payload(size_t size) : m_refCount(1), m_size(size) {}
+
+		std::atomic<int64_t> m_refCount;
+		size_t m_size;
+		unsigned char m_data[1];
+	};
+
+	/*
+	* Topic based fan-out of messages to many TCP connections.
+	* A published message is stored once, queued by reference on every
+	* subscribed connection, and written with gathered writes, so several
+	* queued messages go out in a single call.
+	* Subscriber sockets are switched to non-blocking mode, so a slow
+	* subscriber never holds up the others. A subscriber whose queue
+	* grows past the limits is evicted.
+	* The fan-out doesn't own the sockets. All members are thread safe.
+	*/
+	class fanout
+	{
+	public:
+		struct limits
+		{
+			// Evict a subscriber once this much data is waiting for it.
+			size_t maxQueuedBytes    = 4 * 1024 * 1024;
+			size_t maxQueuedMessages = 4096;
+		};
+
+		// Called, without the fan-out locked, when a subscriber is evicted
+		// or its connection fails. By default the socket is closed.
+		using evict_callback = std::function<void(handle_t)>;
+
+		fanout();
+		explicit fanout(const limits &lim);
+		~fanout();
+
+		fanout(const fanout &) = delete;
+		void operator=(const fanout &) = delete;
+
+		void set_evict_callback(evict_callback callback);
+
+		/*
+		* Subscribe a connected socket to a topic.
+		* The same socket can be subscribed to any number of topics,
+		* and shares a single queue between them.
+		*/
+		err_t subscribe(const std::string &topic, handle_t hsock);
+
+		/*
+		* Unsubscribe a socket from one topic, or from all of them.
+		* Messages that are already queued will still be sent by flush().
+		*/
+		void unsubscribe(const std::string &topic, handle_t hsock);
+		void remove(handle_t hsock);
+
+		/*
+		* Queue a message for every subscriber of the topic, and write as
+		* much as possible right away.
+		* \return - The number of subscribers the message was queued for.
+		*/
+		size_t publish(const std::string &topic, const void *data, size_t size);
+		size_t publish(const std::string &topic, const payload::ref &msg);
+
+		/*
+		* Retry pending writes for all subscribers, e.g. when their sockets
+		* become writable again.
+		* \return - The number of bytes still queued.
+		*/
+		size_t flush();
+
+		size_t subscriber_count(const std::string &topic) const;
+
+	private:
+		struct entry
+		{
+			payload::ref msg;
+			size_t offset;
+		};
+
+		struct subscriber
+		{
+			handle_t hsock;
+			std::deque<entry> queue;
+			size_t queuedBytes = 0;
+			size_t topicCount = 0;
+			bool evicted = false;
+		};
+
+		using subscriber_list = std::vector<subscriber *>;
+
+		// These must be called with m_mutex held.
+		bool write_queued(subscriber &sub);
+		void evict(subscriber &sub, std::vector<handle_t> &evicted);
+		void drop_subscriber(subscriber &sub);
+		void free_retired();
+		void run_evict_callbacks(const std::vector<handle_t> &evicted);
+
+		limits m_limits;
+		evict_callback m_onEvict;
+		mutable std::mutex m_mutex;
+		std::unordered_map<std::string, subscriber_list> m_topics;
+		std::unordered_map<handle_t, subscriber *> m_subscribers;
+		// Dropped subscribers, freed once no copied list can refer to them.
+		std::vector<subscriber *> m_retired;
+	};
+}
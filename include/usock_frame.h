@@ -0,0 +1,113 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+#ifndef USOCK_FRAME_H
+#define USOCK_FRAME_H
+
+#include <usock.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+* Every frame starts with an 8 byte header:
+* a 32 bit big endian payload length, whose top bit is set when the frame
+* carries a checksum, followed by the 32 bit big endian CRC32C of the
+* payload (0 if there's no checksum).
+*/
+#define USOCK_FRAME_HEADER_SIZE 8
+#define USOCK_FRAME_MAX_SIZE    0x7FFFFFFFULL
+
+/*
+* Optional bit flags for usock_send_frame.
+* CRC32C - Add a CRC32C checksum of the payload to the frame.
+*/
+typedef enum
+{
+	USOCK_FRAME_DEFAULT = 0x0,
+	USOCK_FRAME_CRC32C  = 0x1,
+} usock_frame_flags_t;
+
+/*
+* Compute or continue a CRC32C (Castagnoli) checksum.
+* Uses the SSE4.2 crc32 instruction when the CPU has it, and a
+* slicing-by-8 table otherwise; the choice is made once at runtime.
+* \param crc  - 0 to start a new checksum, or the result of a previous
+*               call to continue it.
+* \param data - The data to checksum.
+* \param len  - The number of bytes.
+* \return     - The checksum.
+*/
+USOCK_INTERFACE unsigned USOCK_CONVENTION usock_crc32c(
+	unsigned           crc,
+	const void        *data,
+	usock_size_t       len
+);
+
+/*
+* Name of the CRC32C implementation picked for this CPU,
+* e.g. "sse4.2" or "software".
+*/
+USOCK_INTERFACE const char * USOCK_CONVENTION usock_crc32c_implementation();
+
+/*
+* Send a frame. On stream sockets short writes are retried until the
+* whole frame is sent; on datagram sockets the frame is a single datagram.
+* \param hsock   - The socket handle (returned by usock_create_socket).
+* \param pBuffer - The payload.
+* \param len     - The size of the payload.
+* \param flags   - Options to configure the frame (see usock_frame_flags_t).
+* \return        - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_send_frame(
+	usock_handle_t     hsock,
+	const void        *pBuffer,
+	usock_size_t       len,
+	usock_flags_t      flags
+);
+
+/*
+* Receive a frame. If it carries a checksum, it's verified as the payload
+* comes in, so the data is only walked once.
+* A frame that doesn't fit the buffer is discarded, keeping the stream in
+* sync, and USOCK_ERROR_BUFFER_TOO_SMALL is returned.
+* \param hsock   - The socket handle (returned by usock_create_socket).
+* \param pBuffer - The buffer to receive the payload in.
+* \param buflen  - The size of the buffer.
+* \param pOutLen - The returned payload size.
+* \return        - Error code (see usock_err_t for more info).
+*                  USOCK_ERROR_CHECKSUM_MISMATCH means the payload was
+*                  received but is corrupt.
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_recv_frame(
+	usock_handle_t     hsock,
+	void              *pBuffer,
+	usock_size_t       buflen,
+	usock_size_t      *pOutLen
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USOCK_FRAME_H */
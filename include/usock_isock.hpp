@@ -52,6 +52,41 @@ namespace usock
 			handle_t hdest
 		);
 
+		// Multicast (see usock_join_multicast_group and friends)
+		err_t join_multicast_group(
+			const char *group,
+			const char *iface_name = nullptr
+		);
+
+		err_t leave_multicast_group(
+			const char *group,
+			const char *iface_name = nullptr
+		);
+
+		err_t join_source_multicast_group(
+			const char *group,
+			const char *source,
+			const char *iface_name = nullptr
+		);
+
+		err_t leave_source_multicast_group(
+			const char *group,
+			const char *source,
+			const char *iface_name = nullptr
+		);
+
+		err_t set_multicast_ttl(
+			int ttl
+		);
+
+		err_t set_multicast_loop(
+			bool enable
+		);
+
+		err_t set_multicast_interface(
+			const char *iface_name
+		);
+
 	protected:
 		handle_t m_handle;
 	};
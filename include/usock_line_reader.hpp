@@ -0,0 +1,94 @@
+#pragma once
+#include <usock.h>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace usock
+{
+	/*
+	* Find the first occurrence of a byte in [begin, end).
+	* Uses AVX2 or SSE2 when the CPU has them, picked once at runtime.
+	* Returns end if the byte isn't there.
+	*/
+	const char *find_byte(const char *begin, const char *end, char c);
+
+	/*
+	* Name of the find_byte implementation picked for this CPU,
+	* e.g. "avx2", "sse2" or "scalar".
+	*/
+	const char *find_byte_implementation();
+
+	/*
+	* Splits the data received on a stream socket into delimited lines.
+	* Lines are returned as views into the receive buffer, so nothing is
+	* copied; a view is only valid until the next call to next().
+	* A line that spans several reads is carried over, and the bytes already
+	* searched aren't searched again when more data arrives.
+	*/
+	class line_reader
+	{
+	public:
+		enum status_t
+		{
+			STATUS_OK = 0,
+			STATUS_WOULD_BLOCK,  // Non-blocking socket has no more data yet
+			STATUS_CLOSED,       // Peer closed the connection
+			STATUS_LINE_TOO_LONG,// No delimiter within max_line_length bytes
+			STATUS_ERROR,        // usock_recv failed, see usock_get_last_error()
+		};
+
+		/*
+		* \param hsock          - A connected stream socket.
+		* \param delimiter      - Byte sequence that ends a line. Not included
+		*                         in the returned lines.
+		* \param maxLineLength  - Longest line accepted, delimiter included.
+		* \param readSize       - Minimum free space asked of each usock_recv.
+		*/
+		line_reader(
+			usock_handle_t hsock,
+			std::string delimiter = "\r\n",
+			size_t maxLineLength = 64 * 1024,
+			size_t readSize = 16 * 1024);
+
+		line_reader(const line_reader &) = delete;
+		line_reader &operator=(const line_reader &) = delete;
+
+		/*
+		* Get the next line, receiving more data if needed.
+		* Returns false when no line is available; status() tells why.
+		* When the peer closes the connection, any trailing bytes without a
+		* delimiter are returned as a last line first.
+		*/
+		bool next(std::string_view &line);
+
+		status_t status() const { return m_status; }
+
+		/*
+		* Bytes received but not yet returned as part of a line.
+		* Useful to switch to a binary body after reading headers.
+		*/
+		std::string_view pending() const;
+
+		/*
+		* Drop n bytes of pending data, e.g. after reading them through pending().
+		*/
+		void consume(size_t n);
+
+	private:
+		bool findLine(std::string_view &line);
+		bool fill();
+
+		usock_handle_t m_socket;
+		std::string m_delimiter;
+		size_t m_maxLineLength;
+		size_t m_readSize;
+
+		std::vector<char> m_buffer;
+		size_t m_begin;    // Start of the current line
+		size_t m_scanned;  // Everything before this has been searched
+		size_t m_end;      // End of the received data
+		status_t m_status;
+	};
+}
@@ -0,0 +1,125 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+#ifndef USOCK_PACER_H
+#define USOCK_PACER_H
+
+#include <usock.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+* Optional bit flags for configuring the pacer.
+* Kernel - Let the kernel space out the packets using SO_MAX_PACING_RATE
+*          (requires the fq qdisc). The pacer then only splits the sends
+*          into bursts, and falls back to user space pacing if the socket
+*          option can't be set.
+*/
+typedef enum
+{
+	USOCK_PACER_DEFAULT = 0x0,
+	USOCK_PACER_KERNEL  = 0x1,
+} usock_pacer_flags_t;
+
+/*
+* A token bucket used to pace datagram sends.
+* Use one pacer per socket to limit the total send rate, or one pacer
+* per destination to limit the rate towards each receiver.
+* The pacer is not thread safe.
+*/
+typedef struct
+{
+	double         rate;          /* Refill rate in bytes per nanosecond */
+	double         tokens;        /* Bytes that may be sent right now */
+	double         burst;         /* Maximum number of tokens */
+	usock_size_t   lastRefill;    /* Time of the last refill, see usock_get_time_ns() */
+	usock_size_t   bytesPerSecond;
+	usock_flags_t  flags;
+	usock_handle_t kernelSock;    /* Socket the kernel pacing rate was set on */
+} usock_pacer_t;
+
+/*
+* Initialize a pacer.
+* \param pPacer         - The pacer to initialize.
+* \param bytesPerSecond - The sustained send rate.
+* \param burstBytes     - The bucket size, i.e. the largest burst that can be
+*                         sent back to back. Must be at least as big as the
+*                         largest message that will be sent.
+* \param flags          - Options to configure the pacer (see usock_pacer_flags_t).
+* \return               - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_pacer_init(
+	usock_pacer_t     *pPacer,
+	usock_size_t       bytesPerSecond,
+	usock_size_t       burstBytes,
+	usock_flags_t      flags
+);
+
+/*
+* Send a batch of messages at the pacer's rate.
+* The messages are split into bursts that fit in the bucket, and each burst
+* is handed to the kernel with a single usock_send_to_batch() call. The
+* call sleeps between bursts until enough tokens are available.
+* \param pPacer - The pacer (initialized with usock_pacer_init).
+* \param hsock  - The socket handle (returned by usock_create_socket).
+* \param pMsgs  - The messages to be sent.
+* \param count  - The number of messages in pMsgs.
+* \param flags  - Options passed on to usock_send_to_batch().
+* \return       - Number of messages sent, or -1 if none could be sent.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_pacer_send_to(
+	usock_pacer_t     *pPacer,
+	usock_handle_t     hsock,
+	const usock_msg_t *pMsgs,
+	usock_size_t       count,
+	usock_flags_t      flags
+);
+
+/*
+* Send as many messages as the bucket currently allows, without sleeping.
+* Useful for event loops that can't afford to block.
+* \return - Number of messages sent (possibly 0), or -1 on error.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_pacer_try_send_to(
+	usock_pacer_t     *pPacer,
+	usock_handle_t     hsock,
+	const usock_msg_t *pMsgs,
+	usock_size_t       count,
+	usock_flags_t      flags
+);
+
+/*
+* Time until the next message of the given size may be sent.
+* \return - The delay in nanoseconds, 0 if it can be sent right away.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_pacer_delay_ns(
+	usock_pacer_t     *pPacer,
+	usock_size_t       bytes
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USOCK_PACER_H */
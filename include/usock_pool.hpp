@@ -0,0 +1,151 @@
+#pragma once
+#include <usock.h>
+#include <usock_types.hpp>
+#include <usock_isock.hpp>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace usock
+{
+	/*
+	* A pool of outbound TCP connections, keyed by address and port.
+	* Connections are handed out as leases, which go back to the pool when
+	* they're destroyed, so the next request to the same host skips the
+	* socket setup, the handshake and slow start.
+	* Returning a lease never takes a lock: it's pushed onto a lock-free
+	* stack, which acquire() collects under the host's lock. Idle connections
+	* are reused most recently used first, so the rest age out and get
+	* closed, and each is checked for a peer hangup before it's handed out.
+	* All members are thread safe. Leases must be returned or released
+	* before the pool is destroyed.
+	*/
+	class pool
+	{
+		struct host;
+		struct connection;
+
+	public:
+		struct options
+		{
+			// Connections to a host, leased and idle, before acquire() fails.
+			size_t maxPerHost = 16;
+			// Idle connections older than this are closed instead of reused.
+			usock_size_t maxIdleMs = 30000;
+			domain_t domain = USOCK_DOMAIN_IPV4;
+			flags_t flags = USOCK_OPTIONS_NO_DELAY;
+		};
+
+		struct stats
+		{
+			usock_size_t reused;    // Leases served by an idle connection
+			usock_size_t connected; // New connections opened
+			usock_size_t expired;   // Idle connections closed for age
+			usock_size_t broken;    // Connections closed as unusable
+		};
+
+		/*
+		* A connected socket on loan from the pool.
+		* Move only, like unique_sock. The connection goes back to the pool
+		* when the lease is destroyed or reset, unless it was marked broken,
+		* in which case it's closed.
+		*/
+		class lease : public isock
+		{
+		public:
+			lease() : m_conn(nullptr), m_broken(false) { m_handle = nullptr; }
+			lease(lease &&rref) : lease() { swap(rref); }
+			~lease() { reset(); }
+
+			lease &operator=(lease &&rref)
+			{
+				lease tmp(std::move(rref));
+				swap(tmp);
+				return *this;
+			}
+
+			lease(const lease &) = delete;
+			void operator=(const lease &) = delete;
+
+			handle_t get() const { return m_handle; }
+			explicit operator bool() const { return m_handle != nullptr; }
+
+			/*
+			* Close the connection instead of reusing it, e.g. after an I/O
+			* error or a response that wasn't read to the end.
+			*/
+			void mark_broken() { m_broken = true; }
+
+			/*
+			* Take the socket out of the pool. The caller owns the handle,
+			* and it no longer counts against the host's limit.
+			*/
+			handle_t release();
+
+			// Give the connection back now
+			void reset();
+
+			void swap(lease &rhs)
+			{
+				std::swap(m_handle, rhs.m_handle);
+				std::swap(m_conn, rhs.m_conn);
+				std::swap(m_broken, rhs.m_broken);
+			}
+
+		private:
+			friend class pool;
+			explicit lease(connection *conn);
+
+			connection *m_conn;
+			bool m_broken;
+		};
+
+		pool();
+		explicit pool(const options &opts);
+		~pool();
+
+		pool(const pool &) = delete;
+		void operator=(const pool &) = delete;
+
+		/*
+		* Lease a connection to the host, reusing an idle one if there is
+		* one, or connecting otherwise.
+		* \param pErr - Returns USOCK_ERROR_LIMIT_REACHED when the host already
+		*               has maxPerHost connections, or the connect error.
+		* \return     - The lease, empty on failure.
+		*/
+		lease acquire(const char *ip_address, port_t port, err_t *pErr = nullptr);
+
+		/*
+		* Close idle connections older than maxIdleMs, on every host.
+		* acquire() only ages out the host it's asked for, so call this
+		* periodically to let go of hosts that have gone quiet.
+		* \return - The number of connections closed.
+		*/
+		size_t evict_idle();
+
+		// Connections to a host, leased and idle
+		size_t open_count(const char *ip_address, port_t port);
+
+		stats get_stats() const;
+
+	private:
+		host *find_host(const char *ip_address, port_t port);
+		void collect_returned(host &h);
+		connection *take_idle(host &h, usock_size_t now);
+		bool is_healthy(connection *conn) const;
+		void close(connection *conn);
+
+		options m_opts;
+		mutable std::mutex m_hostsLock;
+		std::unordered_map<std::string, std::unique_ptr<host>> m_hosts;
+
+		std::atomic<usock_size_t> m_reused;
+		std::atomic<usock_size_t> m_connected;
+		std::atomic<usock_size_t> m_expired;
+		std::atomic<usock_size_t> m_broken;
+	};
+}
@@ -0,0 +1,273 @@
+#pragma once
+#include <usock.h>
+#include <usock_timer.h>
+#include <usock_types.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace usock
+{
+	/*
+	* Bounded lock-free queue from one producer thread to one consumer thread.
+	* Each side owns an index on a cache line of its own and keeps a copy of
+	* the other side's, so it only reads the shared one when its copy says the
+	* queue is full, or empty.
+	*/
+	template <typename T>
+	class spsc_queue
+	{
+	public:
+		// Capacity is rounded up to a power of two
+		explicit spsc_queue(size_t capacity) :
+			m_mask(roundUp(capacity) - 1), m_slots(new T[m_mask + 1]),
+			m_head(0), m_cachedTail(0), m_tail(0), m_cachedHead(0)
+		{
+		}
+
+		spsc_queue(const spsc_queue &) = delete;
+		void operator=(const spsc_queue &) = delete;
+
+		// Producer only; false when the queue is full
+		bool push(const T &value)
+		{
+			const size_t tail = m_tail.load(std::memory_order_relaxed);
+			if(tail - m_cachedHead > m_mask)
+			{
+				m_cachedHead = m_head.load(std::memory_order_acquire);
+				if(tail - m_cachedHead > m_mask)
+					return false;
+			}
+			m_slots[tail & m_mask] = value;
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer only; false when the queue is empty
+		bool pop(T &out)
+		{
+			const size_t head = m_head.load(std::memory_order_relaxed);
+			if(head == m_cachedTail)
+			{
+				m_cachedTail = m_tail.load(std::memory_order_acquire);
+				if(head == m_cachedTail)
+					return false;
+			}
+			out = m_slots[head & m_mask];
+			m_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Either side, though it may be stale by the time it returns
+		bool empty() const
+		{
+			return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+		}
+
+		size_t capacity() const { return m_mask + 1; }
+
+	private:
+		static size_t roundUp(size_t n)
+		{
+			size_t p = 2;
+			while(p < n)
+				p <<= 1;
+			return p;
+		}
+
+		const size_t m_mask;
+		std::unique_ptr<T[]> m_slots;
+
+		// Consumer side
+		alignas(64) std::atomic<size_t> m_head;
+		size_t m_cachedTail;
+
+		// Producer side
+		alignas(64) std::atomic<size_t> m_tail;
+		size_t m_cachedHead;
+	};
+
+	/*
+	* Thread-per-core runtime.
+	* Every core runs a reactor thread pinned to its CPU, which owns its
+	* sockets, registry shard, buffer cache and timer wheel, and nothing in
+	* it is shared or locked. Each core listens on the same port with
+	* SO_REUSEPORT, so the kernel spreads new connections over the cores,
+	* and a connection stays with the core that accepted it unless it's
+	* handed over. Cores only talk through messages, over one lock-free
+	* SPSC queue per pair of cores; a core asleep in usock_poll is woken
+	* through a local datagram socket, and only when it's actually asleep.
+	* Linux only, as it relies on SO_REUSEPORT and abstract local sockets.
+	*/
+	class runtime
+	{
+	public:
+		class core;
+
+		struct options
+		{
+			// Reactor threads, 0 for one per CPU. At most
+			// USOCK_REGISTRY_SHARDS, so that no two cores share a shard.
+			unsigned cores = 0;
+			// Pin core i to CPU firstCpu + i.
+			bool pin = true;
+			unsigned firstCpu = 0;
+			// Where every core listens; port 0 for no listener.
+			domain_t domain = USOCK_DOMAIN_IPV4;
+			std::string address;
+			port_t port = 0;
+			int backlog = 128;
+			flags_t flags = USOCK_OPTIONS_NO_DELAY;
+			// Messages in flight from one core to another before post() fails.
+			size_t channelCapacity = 1024;
+			// Resolution of each core's timer wheel.
+			unsigned tickMs = 1;
+			// Size of the blocks from core::alloc_buffer, and how many each core keeps.
+			size_t bufferSize = 16384;
+			size_t cachedBuffers = 256;
+		};
+
+		/*
+		* A message from one core to another.
+		* If hsock is set the socket moves along with it: the sending core
+		* stops watching it and the receiving core watches it before
+		* onMessage sees the message.
+		*/
+		struct message
+		{
+			unsigned from = 0; // Filled in by post()
+			unsigned kind = 0;
+			void *data = nullptr;
+			usock_size_t value = 0;
+			handle_t hsock = nullptr;
+		};
+
+		/*
+		* The application, called on the core's own thread. Any of them may
+		* be left empty, but onReadable is needed once sockets are watched.
+		*/
+		struct handlers
+		{
+			// Once on every core, before its loop starts.
+			std::function<void(core &)> onStart;
+			// A connection the core accepted. It's non-blocking and watched for reads.
+			std::function<void(core &, handle_t)> onConnection;
+			// A watched socket is readable, or hung up.
+			std::function<void(core &, handle_t)> onReadable;
+			// A message from another core.
+			std::function<void(core &, const message &)> onMessage;
+			// Once on every core after its loop ends, before its sockets are closed.
+			std::function<void(core &)> onStop;
+		};
+
+		class core
+		{
+		public:
+			~core();
+
+			unsigned index() const { return m_index; }
+			runtime &owner() { return *m_owner; }
+
+			// Arm timers here; they fire on this core's thread
+			usock_timer_wheel_t *wheel() { return &m_wheel; }
+
+			// Report reads on a socket to onReadable, or stop
+			void watch(handle_t hsock);
+			void unwatch(handle_t hsock);
+			// Unwatch, close and free a socket
+			void close(handle_t hsock);
+
+			/*
+			* Send a message to a core, this one included. Only from this
+			* core's thread, as each channel has a single producer.
+			* \return - false if the channel is full; the message, and any
+			*           socket in it, stays with this core.
+			*/
+			bool post(unsigned to, const message &msg);
+
+			/*
+			* Buffers of options::bufferSize from this core's cache, so the
+			* hot path doesn't go to the shared heap. A buffer may travel in
+			* a message and be freed by the core that receives it.
+			*/
+			void *alloc_buffer();
+			void free_buffer(void *buffer);
+
+		private:
+			friend class runtime;
+			core(runtime &owner, unsigned index);
+
+			err_t setup();
+			void run();
+			void teardown();
+			void ring();
+			void drain_channels();
+			bool pending() const;
+			void accept_all();
+
+			runtime *m_owner;
+			unsigned m_index;
+			usock_timer_wheel_t m_wheel;
+			handle_t m_listener;
+			handle_t m_doorbell;
+			// Connected to m_doorbell; other cores send on it to wake this one
+			handle_t m_ringer;
+			std::vector<usock_pollfd_t> m_fds;
+			std::unordered_map<handle_t, size_t> m_watched;
+			std::vector<void *> m_buffers;
+			// Indexed by the sending core
+			std::vector<std::unique_ptr<spsc_queue<message>>> m_inbox;
+			// Set while the loop may block in usock_poll
+			alignas(64) std::atomic<bool> m_sleeping;
+		};
+
+		runtime(const options &opts, const handlers &h);
+		~runtime();
+
+		runtime(const runtime &) = delete;
+		void operator=(const runtime &) = delete;
+
+		/*
+		* Start a reactor on every core and wait until each has its sockets
+		* set up.
+		* \return - The first error a core ran into, in which case none run.
+		*/
+		err_t start();
+
+		// Ask every core to stop; safe from any thread, a core's included.
+		void stop();
+
+		/*
+		* Wait for the cores to stop. Each closes the sockets it still
+		* watches on its way out, and sockets in undelivered messages are
+		* closed here. Not from a core.
+		*/
+		void join();
+
+		unsigned core_count() const { return (unsigned)m_cores.size(); }
+		core &get_core(unsigned index) { return *m_cores[index]; }
+		const options &get_options() const { return m_opts; }
+
+	private:
+		void core_main(core &c);
+
+		options m_opts;
+		handlers m_handlers;
+		std::vector<std::unique_ptr<core>> m_cores;
+		std::vector<std::thread> m_threads;
+		std::atomic<bool> m_stopping;
+
+		// Start up handshake
+		std::mutex m_startLock;
+		std::condition_variable m_started;
+		unsigned m_ready;
+		err_t m_startErr;
+	};
+}
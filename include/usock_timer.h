@@ -0,0 +1,165 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+#ifndef USOCK_TIMER_H
+#define USOCK_TIMER_H
+
+#include <usock.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+* Hashed hierarchical timer wheel.
+* Four levels of 256 slots, each level 256 times coarser than the one
+* below, cover 2^32 ticks. Timers are linked into the slot of their
+* expiry, so arming and cancelling are O(1) whatever the number of
+* pending timers. A timer moves down a level each time the wheel below
+* it turns over, so it's touched at most once per level before it fires.
+* Timers live in the caller's memory, typically next to the connection
+* they guard, and the wheel never allocates.
+* A wheel is not thread safe; give each event loop thread its own.
+*/
+
+#define USOCK_TIMER_LEVELS 4
+#define USOCK_TIMER_SLOTS  256
+
+/* Slot of a timer that isn't armed */
+#define USOCK_TIMER_IDLE   0xFFFFFFFFu
+
+struct usock_timer;
+
+/*
+* Called when a timer fires. The timer is no longer armed, so it may be
+* armed again, or freed, from the callback.
+*/
+typedef void (*usock_timer_callback_t)(struct usock_timer *pTimer, void *pUserData);
+
+typedef struct usock_timer_link
+{
+	struct usock_timer_link *next, *prev;
+} usock_timer_link_t;
+
+typedef struct usock_timer
+{
+	usock_timer_link_t     link;
+	usock_size_t           expires;   /* Tick it fires on */
+	unsigned               slot;      /* Level * USOCK_TIMER_SLOTS + index, or USOCK_TIMER_IDLE */
+	usock_timer_callback_t callback;
+	void                  *pUserData;
+} usock_timer_t;
+
+typedef struct
+{
+	usock_size_t       tickNs;
+	usock_size_t       startNs;   /* Time of tick 0, see usock_get_time_ns() */
+	usock_size_t       current;   /* Last tick processed */
+	usock_size_t       count;     /* Timers armed */
+	usock_size_t       occupied[USOCK_TIMER_LEVELS][USOCK_TIMER_SLOTS / 64];
+	usock_timer_link_t slots[USOCK_TIMER_LEVELS][USOCK_TIMER_SLOTS];
+} usock_timer_wheel_t;
+
+/*
+* Initialize a wheel. Timers fire at most one tick late, so the tick is
+* the timer resolution.
+* \param pWheel - The wheel to initialize.
+* \param tickMs - Length of a tick in milliseconds.
+* \return       - Error code (see usock_err_t for more info)
+*/
+USOCK_INTERFACE usock_err_t USOCK_CONVENTION usock_timer_wheel_init(
+	usock_timer_wheel_t *pWheel,
+	unsigned             tickMs
+);
+
+/*
+* Initialize a timer, before it's armed the first time.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_timer_init(
+	usock_timer_t         *pTimer,
+	usock_timer_callback_t callback,
+	void                  *pUserData
+);
+
+/*
+* Arm a timer to fire delayMs from now. An armed timer is moved, so this
+* also pushes back an idle timeout on every bit of activity.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_timer_arm(
+	usock_timer_wheel_t *pWheel,
+	usock_timer_t       *pTimer,
+	usock_size_t         delayMs
+);
+
+/*
+* Disarm a timer. Does nothing if it isn't armed.
+*/
+USOCK_INTERFACE void USOCK_CONVENTION usock_timer_cancel(
+	usock_timer_wheel_t *pWheel,
+	usock_timer_t       *pTimer
+);
+
+/*
+* \return - Non-zero if the timer is armed.
+*/
+USOCK_INTERFACE int USOCK_CONVENTION usock_timer_armed(
+	const usock_timer_t *pTimer
+);
+
+/*
+* Fire every timer that's due at nowNs, in expiry order by tick.
+* \return - The number of timers fired.
+*/
+USOCK_INTERFACE usock_size_t USOCK_CONVENTION usock_timer_wheel_advance(
+	usock_timer_wheel_t *pWheel,
+	usock_size_t         nowNs
+);
+
+/*
+* How long an event loop can sleep before the wheel needs advancing.
+* Timers above the lowest level only report the next time the level below
+* turns over, so this may be shorter than the wait for the next timer.
+* \return - Milliseconds, rounded up, or -1 if no timer is armed.
+*/
+USOCK_INTERFACE int USOCK_CONVENTION usock_timer_wheel_timeout_ms(
+	const usock_timer_wheel_t *pWheel,
+	usock_size_t               nowNs
+);
+
+/*
+* One turn of an event loop: usock_poll for at most maxTimeoutMs, or until
+* the next timer is due, then fire the due timers.
+* \param maxTimeoutMs - Longest wait, or -1 to only wait on the timers.
+* \return             - usock_poll's result.
+*/
+USOCK_INTERFACE usock_ssize_t USOCK_CONVENTION usock_timer_wheel_poll(
+	usock_timer_wheel_t *pWheel,
+	usock_pollfd_t      *pFds,
+	usock_size_t         count,
+	int                  maxTimeoutMs
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USOCK_TIMER_H */
@@ -20,34 +20,97 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 *****************************************************************************/
 
+#ifdef __linux__
+/* Needed for sendmmsg() */
+#define _GNU_SOURCE
+#endif
+
 #include <usock.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include "usock_internal.h"
 
 /***************************************/
 /*            COMMON CODE              */
 /***************************************/
-#define MAX_SOCKET_NAME_LEN 32
-
-typedef struct SockInfoNode
-{
-	char name[MAX_SOCKET_NAME_LEN];
-	struct SockInfoNode *prev, *next;
-	size_t blockSize;
-} SockInfoNode;
 
 /***************************************/
 /*          Socket node list           */
-struct SockInfoNode *g_head  = NULL;
-struct SockInfoNode *g_tail  = NULL;
-/* TODO: Add mutex */
+
+/* Each shard is guarded by its registryLock() */
+RegistryShard g_shards[REGISTRY_SHARDS];
+
+/* 1 + the shard of this thread, 0 until it needs one */
+static THREAD_LOCAL unsigned t_shard = 0;
+static usock_size_t g_nextShard = 0;
+
+unsigned threadShard()
+{
+	if(!t_shard)
+		t_shard = 1 + (unsigned)(STAT_ADD(g_nextShard, 1) % REGISTRY_SHARDS);
+	return t_shard - 1;
+}
+
+void usock_set_thread_shard(unsigned shard)
+{
+	t_shard = 1 + shard % REGISTRY_SHARDS;
+}
+
+usock_size_t registryLiveSockets()
+{
+	usock_size_t total = 0;
+	unsigned i;
+	for(i = 0; i < REGISTRY_SHARDS; ++i)
+		total += STAT_LOAD(g_shards[i].liveSockets);
+	return total;
+}
+
+usock_size_t registryAllocatedBytes()
+{
+	usock_size_t total = 0;
+	unsigned i;
+	for(i = 0; i < REGISTRY_SHARDS; ++i)
+		total += STAT_LOAD(g_shards[i].allocatedBytes);
+	return total;
+}
 
 /***************************************/
 /*        Allocator functions          */
 usock_palloc_t g_palloc      = NULL;
 usock_pfree_t  g_pfree       = NULL;
 
+/* The allocator g_palloc and g_pfree forward to, after counting */
+static usock_palloc_t g_userAlloc = NULL;
+static usock_pfree_t  g_userFree  = NULL;
+
+/* Room for the size in front of every block, keeping the alignment of malloc */
+#define ALLOC_HEADER_SIZE 16
+
+static void *countingAlloc(size_t size)
+{
+	unsigned char *block = (unsigned char *)g_userAlloc(size + ALLOC_HEADER_SIZE);
+	if(!block)
+		return NULL;
+
+	*(size_t *)block = size;
+	STAT_ADD(g_shards[threadShard()].allocatedBytes, size);
+	return block + ALLOC_HEADER_SIZE;
+}
+
+static void countingFree(void *ptr)
+{
+	unsigned char *block;
+
+	if(!ptr)
+		return;
+
+	/* Freed from another thread's shard maybe, the sum still comes out right */
+	block = (unsigned char *)ptr - ALLOC_HEADER_SIZE;
+	STAT_ADD(g_shards[threadShard()].allocatedBytes, -(usock_size_t)*(size_t *)block);
+	g_userFree(block);
+}
+
 /***************************************/
 /* Check if the library is initialized */
 int            g_initialized = 0;
@@ -57,66 +120,125 @@ usock_err_t usock_set_custom_allocator(const usock_allocator *allocator)
 	if(g_initialized)
 		return USOCK_ERROR_ALREADY_INITIALIZED;
 
-	g_palloc = allocator->pMalloc;
-	g_pfree  = allocator->pFree;
+	g_userAlloc = allocator->pMalloc;
+	g_userFree  = allocator->pFree;
 	return USOCK_OK;
 }
 
 usock_err_t initCommon()
 {
-	if(!g_palloc)
+	if(!g_userAlloc)
 	{
-		g_palloc = malloc;
-		g_pfree  = free;
+		g_userAlloc = malloc;
+		g_userFree  = free;
 	}
+	g_palloc = countingAlloc;
+	g_pfree  = countingFree;
 	g_initialized = 1;
 	return USOCK_OK;
 }
 
-void initSockInfo(struct SockInfoNode *node, size_t bytes, const char *name)
+static int registryReserve(RegistryShard *shard)
+{
+	struct SockInfoNode **grown;
+	usock_size_t capacity;
+
+	if(shard->count < shard->capacity)
+		return 1;
+
+	capacity = shard->capacity ? shard->capacity * 2 : 64;
+	grown = (struct SockInfoNode **)g_palloc(sizeof(struct SockInfoNode *) * capacity);
+	if(!grown)
+		return 0;
+
+	if(shard->nodes)
+	{
+		memcpy(grown, shard->nodes, sizeof(struct SockInfoNode *) * shard->count);
+		g_pfree(shard->nodes);
+	}
+	shard->nodes = grown;
+	shard->capacity = capacity;
+	return 1;
+}
+
+usock_err_t initSockInfo(struct SockInfoNode *node, size_t bytes, const char *name)
 {
+	RegistryShard *shard;
+
 	memset(node, 0, bytes);
 	node->blockSize = bytes;
+	node->transport = &g_kernelTransport;
 #ifdef _WIN32
 	strncpy_s(node->name, MAX_SOCKET_NAME_LEN, name, MAX_SOCKET_NAME_LEN);
 #else
 	strncpy(node->name, name, MAX_SOCKET_NAME_LEN);
 #endif
 
-	if(!g_tail)
+	node->shard = threadShard();
+	shard = &g_shards[node->shard];
+
+	registryLock(node->shard);
+	if(!registryReserve(shard))
+	{
+		registryUnlock(node->shard);
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	}
+	node->registryIndex = shard->count;
+	shard->nodes[shard->count++] = node;
+
+	if(!shard->tail)
 	{
-		g_head = g_tail = node;
+		shard->head = shard->tail = node;
 	}
 	else
 	{
-		g_tail->next = node;
-		node->prev = g_tail;
-		g_tail = node;
+		shard->tail->next = node;
+		node->prev = shard->tail;
+		shard->tail = node;
 	}
+	registryUnlock(node->shard);
+	STAT_ADD(shard->liveSockets, 1);
+	return USOCK_OK;
+}
+
+static usock_size_t iovecBytes(const usock_iovec_t *pIov, usock_size_t count)
+{
+	usock_size_t i, bytes = 0;
+	for(i = 0; i < count; ++i)
+		bytes += pIov[i].len;
+	return bytes;
 }
 
 void freeNodeList()
 {
-	struct SockInfoNode *si = g_head;
+	struct SockInfoNode *si;
 	struct SockInfoNode *next;
+	unsigned i;
 
 	/* Free all allocated socket nodes */
-	while(si)
+	for(i = 0; i < REGISTRY_SHARDS; ++i)
 	{
-		next = si->next;
-		usock_close_socket(si);
-		usock_free_socket(si);
-		si = next;
+		si = g_shards[i].head;
+		while(si)
+		{
+			next = si->next;
+			usock_close_socket(si);
+			usock_free_socket(si);
+			si = next;
+		}
+
+		g_pfree(g_shards[i].nodes);
+		g_shards[i].nodes = NULL;
+		g_shards[i].capacity = 0;
 	}
 }
 
-#define GET_SOCK_INFO_FROM_HANDLE(SOCKINFO_T, HSOCK) (SOCKINFO_T*)(((unsigned char*)HSOCK) + sizeof(SockInfoNode))
-
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <WinSock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 
 #pragma comment (lib, "Ws2_32.lib")
 
@@ -129,6 +251,23 @@ typedef struct SockInfo
 
 const size_t kSockNodeSize = sizeof(SockInfoNode) + sizeof(SockInfo);
 
+/* A lock per shard, a cache line each; all zeroes is SRWLOCK_INIT */
+static struct
+{
+	SRWLOCK lock;
+	unsigned char pad[64 - sizeof(SRWLOCK)];
+} g_registryLocks[REGISTRY_SHARDS];
+
+void registryLock(unsigned shard)
+{
+	AcquireSRWLockExclusive(&g_registryLocks[shard].lock);
+}
+
+void registryUnlock(unsigned shard)
+{
+	ReleaseSRWLockExclusive(&g_registryLocks[shard].lock);
+}
+
 int usock_initialize()
 {
 	WSADATA wsaData;
@@ -148,6 +287,11 @@ int usock_initialize()
 
 void usock_release()
 {
+	/* The sampler walks the registry, so it has to be gone before the nodes are */
+	usock_tcp_sampler_stop();
+	usock_metrics_stop();
+	usock_resolver_stop();
+	traceRelease();
 	freeNodeList();
 	WSACleanup();
 }
@@ -157,19 +301,26 @@ int translateDomain(usock_domain_t domain)
 	const int winsockDomains[] = {
 		AF_UNSPEC,
 		AF_INET,
-		AF_INET6
+		AF_INET6,
+		AF_UNSPEC, /* Local sockets are Linux only */
+		AF_UNSPEC  /* Memory sockets never reach the kernel */
 	};
 	return winsockDomains[domain];
 }
 
 void translateProtocol(usock_socket_type_t type, int *outType, int *outProtocol)
 {
+	/* Shared memory sockets are Linux only, they come out as plain TCP here */
 	const int winsockProtocol[] = {
+		IPPROTO_UDP,
+		IPPROTO_TCP,
 		IPPROTO_UDP,
 		IPPROTO_TCP
 	};
 
 	const int winsockType[] = {
+		SOCK_DGRAM,
+		SOCK_STREAM,
 		SOCK_DGRAM,
 		SOCK_STREAM
 	};
@@ -178,16 +329,21 @@ void translateProtocol(usock_socket_type_t type, int *outType, int *outProtocol)
 	*outProtocol = winsockProtocol[type];
 }
 
-void usock_configure(usock_handle_t hsock, usock_domain_t domain, usock_socket_type_t type, usock_flags_t flags)
+static void configureSocket(usock_handle_t hsock, usock_domain_t domain, usock_socket_type_t type, usock_flags_t flags)
 {
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
 	ZeroMemory(&node->info, sizeof(node->info));
 	node->info.ai_family = translateDomain(domain);
 	translateProtocol(type, &node->info.ai_socktype, &node->info.ai_protocol);
 	node->sockopt = flags;
+
+	if(type == USOCK_SOCKTYPE_RELIABLE_DATAGRAM)
+		rudpCreate(hsock);
+	else
+		rudpDestroy(hsock);
 }
 
-usock_err_t usock_bind(usock_handle_t hsock, usock_port_t port)
+static usock_err_t bindSocket(usock_handle_t hsock, const char *ip_address, usock_port_t port)
 {
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
 	struct addrinfo *result = NULL;
@@ -199,7 +355,7 @@ usock_err_t usock_bind(usock_handle_t hsock, usock_port_t port)
 	node->info.ai_flags = AI_PASSIVE;
 	val = sprintf_s(portStr, PORT_STR_SIZE, "%hu", port);
 	portStr[val] = '\0';
-	ret = getaddrinfo((PCSTR)NULL, portStr, &node->info, &result);
+	ret = getaddrinfo((PCSTR)ip_address, portStr, &node->info, &result);
 	if (ret != 0) {
 		return USOCK_ERROR_INTERNAL;
 	}
@@ -223,13 +379,23 @@ usock_err_t usock_bind(usock_handle_t hsock, usock_port_t port)
 	return ret == SOCKET_ERROR ? USOCK_ERROR_INIT_FAILED : USOCK_OK;
 }
 
-usock_err_t usock_listen(usock_handle_t hsock, int backlog)
+static usock_err_t listenSocket(usock_handle_t hsock, int backlog)
 {
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
 	int ret;
 
 	if(node->sockfd == INVALID_SOCKET)
 		return USOCK_ERROR_NOT_INITIALIZED;
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+#ifdef TCP_FASTOPEN
+	if(node->info.ai_socktype == SOCK_STREAM && (node->sockopt & USOCK_OPTIONS_FAST_OPEN))
+	{
+		int val = 1;
+		setsockopt(node->sockfd, IPPROTO_TCP, TCP_FASTOPEN, (const char*)&val, sizeof(val));
+	}
+#endif
 
 	ret = listen(node->sockfd, backlog);
 	if(ret == SOCKET_ERROR)
@@ -238,7 +404,7 @@ usock_err_t usock_listen(usock_handle_t hsock, int backlog)
 	return USOCK_OK;
 }
 
-usock_err_t usock_accept(usock_handle_t hsock, usock_handle_t *pOutSock)
+static usock_err_t acceptSocket(usock_handle_t hsock, usock_handle_t *pOutSock)
 {
 	SOCKET newSock;
 	unsigned char address[sizeof(struct sockaddr_in6)];
@@ -260,11 +426,20 @@ usock_err_t usock_accept(usock_handle_t hsock, usock_handle_t *pOutSock)
 	/* Cache the returned socket info */
 	outNode->sockfd = newSock;
 	memcpy(&outNode->info, address, len);
+	outNode->sockopt = node->sockopt;
+	statsAttach(*pOutSock, outNode->sockopt & USOCK_OPTIONS_STATS);
+
+	if(outNode->sockopt & USOCK_OPTIONS_NO_DELAY)
+	{
+		int val = 1;
+		setsockopt(newSock, IPPROTO_TCP, TCP_NODELAY, (const char*)&val, sizeof(val));
+	}
 
 	return USOCK_OK;
 }
 
-usock_err_t usock_connect(usock_handle_t hsock, const char *ip_address, usock_port_t port)
+/* Resolve the address and open the socket, ready for connect() */
+static usock_err_t prepareConnect(usock_handle_t hsock, const char *ip_address, usock_port_t port, struct addrinfo **ppResult)
 {
 	int ret, val;
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
@@ -284,39 +459,125 @@ usock_err_t usock_connect(usock_handle_t hsock, const char *ip_address, usock_po
 	node->sockfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
 	if(node->sockfd == INVALID_SOCKET)
 	{
+		freeaddrinfo(result);
 		return USOCK_ERROR_INIT_FAILED;
 	}
 
+	if(result->ai_socktype == SOCK_STREAM && (node->sockopt & USOCK_OPTIONS_NO_DELAY))
+	{
+		val = 1;
+		setsockopt(node->sockfd, IPPROTO_TCP, TCP_NODELAY, (const char*)&val, sizeof(val));
+	}
+
+	*ppResult = result;
+	return USOCK_OK;
+}
+
+static usock_err_t connectSocket(usock_handle_t hsock, const char *ip_address, usock_port_t port)
+{
+	int ret;
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct addrinfo *result;
+	usock_err_t err = prepareConnect(hsock, ip_address, port, &result);
+	if(err != USOCK_OK)
+		return err;
+
 	ret = connect(node->sockfd, result->ai_addr, (int)result->ai_addrlen);
 
 	freeaddrinfo(result);
 
 	if(ret == SOCKET_ERROR)
 		return USOCK_ERROR_INTERNAL;
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		rudpMarkConnected(hsock);
 	return USOCK_OK;
 }
 
-usock_ssize_t usock_recv(usock_handle_t hsock, void *pOutBuffer, usock_size_t buflen)
+/* Check how a non-blocking connect ended, and go back to blocking mode */
+static usock_err_t connectFinish(usock_handle_t hsock)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int soError = 0;
+	int len = sizeof(soError);
+
+	if(getsockopt(node->sockfd, SOL_SOCKET, SO_ERROR, (char*)&soError, &len) == SOCKET_ERROR)
+		return USOCK_ERROR_INTERNAL;
+	if(soError)
+	{
+		WSASetLastError(soError);
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	usock_set_nonblocking(hsock, 0);
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		rudpMarkConnected(hsock);
+	return USOCK_OK;
+}
+
+/* Start a connect without waiting; *pPending is set if it's still in flight */
+static usock_err_t connectStart(usock_handle_t hsock, const char *ip_address, usock_port_t port, int *pPending)
 {
+	int ret;
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	return (usock_ssize_t)recv(node->sockfd, (char*)pOutBuffer, (int)buflen, 0);
+	struct addrinfo *result;
+	usock_err_t err;
+
+	*pPending = 0;
+	err = prepareConnect(hsock, ip_address, port, &result);
+	if(err != USOCK_OK)
+		return err;
+
+	if(usock_set_nonblocking(hsock, 1) != USOCK_OK)
+	{
+		freeaddrinfo(result);
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	ret = connect(node->sockfd, result->ai_addr, (int)result->ai_addrlen);
+	freeaddrinfo(result);
+
+	if(ret != SOCKET_ERROR)
+		return connectFinish(hsock);
+	if(WSAGetLastError() != WSAEWOULDBLOCK)
+		return USOCK_ERROR_INTERNAL;
+
+	*pPending = 1;
+	return USOCK_OK;
 }
 
-usock_ssize_t usock_send(usock_handle_t hsock, const void *buffer, usock_size_t buflen)
+/* Data in the SYN needs ConnectEx, so the message follows the handshake here */
+static usock_err_t connectSendSocket(usock_handle_t hsock, const char *ip_address, usock_port_t port, const void *pBuffer, usock_size_t len, usock_ssize_t *pSent)
 {
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	return (usock_ssize_t)send(node->sockfd, (const char*)buffer, (int)buflen, 0);
+	usock_err_t err = connectSocket(hsock, ip_address, port);
+	if(err != USOCK_OK)
+		return err;
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		*pSent = rudpSend(hsock, 0, pBuffer, len, 0);
+	else
+		*pSent = (usock_ssize_t)send(node->sockfd, (const char*)pBuffer, (int)len, 0);
+	return *pSent < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
 }
 
-usock_ssize_t usock_recv_from(usock_handle_t hsock, void * pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t * pOutClientInfo)
+static usock_ssize_t recvSocket(usock_handle_t hsock, void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t *pOutClientInfo)
 {
 	socklen_t clilen = sizeof(struct sockaddr_in);
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
 	struct SockInfo *cliinfoNode;
 
-	/* Allocate a node to hold the client info */
+	/* Reliable datagram sockets only have a single peer */
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+	{
+		if(pOutClientInfo)
+			*pOutClientInfo = NULL;
+		return rudpRecv(hsock, pBuffer, len, NULL);
+	}
+
 	if(pOutClientInfo)
 	{
+		/* Allocate a node to hold the client info */
 		usock_create_socket("", pOutClientInfo);
 		cliinfoNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, (*pOutClientInfo));
 		return (usock_ssize_t)recvfrom(node->sockfd, pBuffer, (int)len, (int)flags, (struct sockaddr *)&cliinfoNode->info, &clilen);
@@ -326,12 +587,16 @@ usock_ssize_t usock_recv_from(usock_handle_t hsock, void * pBuffer, usock_size_t
 	return (usock_ssize_t)recvfrom(node->sockfd, pBuffer, (int)len, (int)flags, (struct sockaddr *)NULL, NULL);
 }
 
-usock_ssize_t usock_send_to(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest)
+static usock_ssize_t sendSocket(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest)
 {
 	struct SockInfo *srcNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
 	struct SockInfo *dstNode;
 	struct sockaddr *info = NULL;
 	int infolen = 0;
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		return rudpSend(hsock, 0, pBuffer, len, 0);
+
 	if(hdest)
 	{
 		dstNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hdest);
@@ -341,238 +606,2146 @@ usock_ssize_t usock_send_to(usock_handle_t hsock, const void *pBuffer, usock_siz
 	return (usock_ssize_t)sendto(srcNode->sockfd, pBuffer, (int)len, (unsigned)flags, info, infolen);
 }
 
-void usock_close_socket(usock_handle_t hsock)
+usock_ssize_t usock_recv(usock_handle_t hsock, void *pOutBuffer, usock_size_t buflen)
 {
-	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	closesocket(node->sockfd);
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_RECV);
+	ret = GET_TRANSPORT(hsock)->recv(hsock, pOutBuffer, buflen, 0, NULL);
+	LATENCY_END(sampleStart, USOCK_LATENCY_RECV);
+	COUNT_RECV(hsock, ret);
+	TRACE_END(traceStart, USOCK_TRACE_RECV, hsock, ret);
+	return ret;
 }
 
-#elif __APPLE__
-#include "TargetConditionals.h"
-#if TARGET_IPHONE_SIMULATOR
-// iOS Simulator
-#elif TARGET_OS_IPHONE
-// iOS device
-#elif TARGET_OS_MAC
-// Other kinds of Mac OS
-#else
-#   error "Unknown Apple platform"
-#endif
-#elif __linux__
-// linux
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <errno.h>
-
-typedef struct SockInfo
+usock_ssize_t usock_send(usock_handle_t hsock, const void *buffer, usock_size_t buflen)
 {
-	/* All required info about the socket. */
-	int socketfd;
-	struct sockaddr_in info;
-	/* TODO: support other structs as well */
-	int protocol;
-	unsigned sockopt;
-}SockInfo;
-
-const size_t kSockNodeSize = sizeof(SockInfoNode) + sizeof(SockInfo);
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_SEND);
+	ret = GET_TRANSPORT(hsock)->send(hsock, buffer, buflen, 0, NULL);
+	LATENCY_END(sampleStart, USOCK_LATENCY_SEND);
+	COUNT_SEND(hsock, buflen, ret);
+	TRACE_END(traceStart, USOCK_TRACE_SEND, hsock, ret);
+	return ret;
+}
 
-usock_err_t usock_initialize()
+usock_ssize_t usock_recv_from(usock_handle_t hsock, void * pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t * pOutClientInfo)
 {
-	if(g_initialized)
-		return USOCK_ERROR_ALREADY_INITIALIZED;
-
-	return initCommon();
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	ret = GET_TRANSPORT(hsock)->recv(hsock, pBuffer, len, flags, pOutClientInfo);
+	COUNT_RECV(hsock, ret);
+	TRACE_END(traceStart, USOCK_TRACE_RECV_FROM, hsock, ret);
+	return ret;
 }
 
-void usock_release()
+usock_ssize_t usock_send_to(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest)
 {
-	freeNodeList();
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	ret = GET_TRANSPORT(hsock)->send(hsock, pBuffer, len, flags, hdest);
+	COUNT_SEND(hsock, len, ret);
+	TRACE_END(traceStart, USOCK_TRACE_SEND_TO, hsock, ret);
+	return ret;
 }
 
-void usock_configure(usock_handle_t hsock, usock_domain_t domain, usock_socket_type_t type, uint32_t flags)
+usock_ssize_t usock_send_to_batch(usock_handle_t hsock, const usock_msg_t *pMsgs, usock_size_t count, usock_flags_t flags)
 {
-	struct SockInfo *info = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	switch(domain)
-	{
-	case USOCK_DOMAIN_IPV4:
-		info->info.sin_family = AF_INET;
-		break;
-	case USOCK_DOMAIN_IPV6:
-		info->info.sin_family = AF_INET6;
-		break;
-	default:
-		info->info.sin_family = AF_UNSPEC;
-		break;
-	}
+	usock_size_t i;
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
 
-	switch (type)
+	/* Winsock has no batched sendto, so send one message at a time.
+	*  Each usock_send_to call is counted and traced on its own. */
+	for(i = 0; i < count; ++i)
 	{
-	case USOCK_SOCKTYPE_FAST:
-		info->protocol = SOCK_DGRAM;
-		break;
-	case USOCK_SOCKTYPE_RELIABLE:
-		info->protocol = SOCK_STREAM;
-		break;
+		if(usock_send_to(hsock, pMsgs[i].pBuffer, pMsgs[i].len, flags, pMsgs[i].hdest) < 0)
+			break;
 	}
-
-	info->sockopt = flags;
+	ret = i > 0 ? (usock_ssize_t)i : -1;
+	TRACE_END(traceStart, USOCK_TRACE_SEND_BATCH, hsock, ret);
+	return ret;
 }
 
-usock_err_t usock_bind(usock_handle_t hsock, usock_port_t port)
+usock_err_t usock_set_max_pacing_rate(usock_handle_t hsock, usock_size_t bytesPerSecond)
 {
-	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	int ret;
-	int val;
-
-	node->socketfd = socket(node->info.sin_family, node->protocol, 0);
-	if(node->socketfd < 0)
-	{
-		/* Error handling */ 
-		return USOCK_ERROR_INIT_FAILED;
-	}
-
-	/* Set socket options */
-	val = node->sockopt & USOCK_OPTIONS_REUSE_ADDRESS;
-	ret = setsockopt(node->socketfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	/* Kernel pacing is Linux only */
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
 
-	val = node->sockopt & USOCK_OPTIONS_REUSE_PORT;
-	ret = setsockopt(node->socketfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+usock_size_t usock_get_time_ns()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
 
-	/* Bind the socket */
-	node->info.sin_addr.s_addr = INADDR_ANY;
-	node->info.sin_port = htons(port);
+	if(!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
 
-	ret = bind(node->socketfd, (struct sockaddr *)&node->info, sizeof(node->info));
-	return ret < 0 ? USOCK_ERROR_INIT_FAILED : USOCK_OK;
+	return (usock_size_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
 }
 
-usock_err_t usock_listen(usock_handle_t hsock, int backlog)
+#define SENDV_BATCH_SIZE 64
+
+usock_ssize_t usock_sendv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
 {
-	int ret;
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	if(!node->socketfd)
+	WSABUF bufs[SENDV_BATCH_SIZE];
+	DWORD sent = 0;
+	DWORD i, n;
+	TRACE_BEGIN(traceStart);
+
+	/* Only the first SENDV_BATCH_SIZE buffers are sent; the caller sees a short write */
+	n = count < SENDV_BATCH_SIZE ? (DWORD)count : SENDV_BATCH_SIZE;
+	for(i = 0; i < n; ++i)
 	{
-		return USOCK_ERROR_NOT_INITIALIZED;
+		bufs[i].buf = (CHAR *)pIov[i].pBuffer;
+		bufs[i].len = (ULONG)pIov[i].len;
 	}
 
-
-	ret = listen(node->socketfd, backlog);
-	if(ret < 0)
+	/* A reliable datagram socket sends the buffers as one message of its own */
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
 	{
-		return USOCK_ERROR_INTERNAL;
+		usock_ssize_t ret = rudpSendv(hsock, pIov, n);
+		COUNT_SEND(hsock, iovecBytes(pIov, n), ret);
+		TRACE_END(traceStart, USOCK_TRACE_SENDV, hsock, ret);
+		return ret;
 	}
 
-	return USOCK_OK;
-}
-
-usock_err_t usock_accept(usock_handle_t hsock, usock_handle_t *pOutSock)
-{
-	int newSock;
-	struct sockaddr_in address;
-	socklen_t len = sizeof(address);
-	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	struct SockInfo *outNode;
-
-	newSock = accept(node->socketfd, (struct sockaddr *)&address, &len);
-	if(newSock < 0)
+	if(WSASend(node->sockfd, bufs, n, &sent, 0, NULL, NULL) == SOCKET_ERROR)
 	{
-		*pOutSock = NULL;
-		return USOCK_ERROR_INTERNAL;
+		COUNT_SEND(hsock, 0, -1);
+		TRACE_END(traceStart, USOCK_TRACE_SENDV, hsock, -1);
+		return -1;
 	}
-
-	usock_create_socket("client socket", pOutSock);
-	outNode = GET_SOCK_INFO_FROM_HANDLE(SockInfo, (*pOutSock));
-
-	/* Cache the returned socket info */
-	outNode->socketfd = newSock;
-	memcpy(&outNode->info, &address, len);
-
-	return USOCK_OK;
+	COUNT_SEND(hsock, iovecBytes(pIov, n), (usock_ssize_t)sent);
+	TRACE_END(traceStart, USOCK_TRACE_SENDV, hsock, sent);
+	return (usock_ssize_t)sent;
 }
 
-usock_err_t usock_connect( usock_handle_t hsock, const char *ip_address, unsigned short port )
+usock_ssize_t usock_recvv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
 {
-	int ret;
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-
-	/* open socket */
-	node->socketfd = socket(node->info.sin_family, node->protocol, 0);
-	if(node->socketfd < 0)
+	WSABUF bufs[SENDV_BATCH_SIZE];
+	DWORD received = 0;
+	DWORD flags = 0;
+	DWORD i, n;
+	TRACE_BEGIN(traceStart);
+
+	n = count < SENDV_BATCH_SIZE ? (DWORD)count : SENDV_BATCH_SIZE;
+	for(i = 0; i < n; ++i)
 	{
-		return USOCK_ERROR_INIT_FAILED;
+		bufs[i].buf = (CHAR *)pIov[i].pBuffer;
+		bufs[i].len = (ULONG)pIov[i].len;
 	}
 
-	node->info.sin_port = htons(port);
-	if(inet_pton(node->info.sin_family, ip_address, &node->info.sin_addr) <= 0)
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
 	{
-		/* address parse failed */
-		return USOCK_ERROR_INVALID_ARG;
+		usock_ssize_t ret = rudpRecvv(hsock, pIov, n);
+		COUNT_RECV(hsock, ret);
+		TRACE_END(traceStart, USOCK_TRACE_RECVV, hsock, ret);
+		return ret;
 	}
 
-	ret = connect(node->socketfd, (struct sockaddr *)&node->info, sizeof(node->info));
-	if(ret < 0)
+	if(WSARecv(node->sockfd, bufs, n, &received, &flags, NULL, NULL) == SOCKET_ERROR)
 	{
-		/* connect failed */
-		return USOCK_ERROR_INTERNAL;
+		COUNT_RECV(hsock, -1);
+		TRACE_END(traceStart, USOCK_TRACE_RECVV, hsock, -1);
+		return -1;
 	}
+	COUNT_RECV(hsock, (usock_ssize_t)received);
+	TRACE_END(traceStart, USOCK_TRACE_RECVV, hsock, received);
+	return (usock_ssize_t)received;
+}
 
-	return USOCK_OK;
+usock_err_t usock_enable_timestamping(usock_handle_t hsock, unsigned flags)
+{
+	/* Kernel timestamping is Linux only */
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
 }
 
-usock_ssize_t usock_recv(usock_handle_t hsock, void *pOutBuffer, usock_size_t buflen)
+usock_ssize_t usock_recv_from_ts(usock_handle_t hsock, void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t *pOutClientInfo, usock_rx_timestamp_t *pOutTs)
 {
-	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	return read(node->socketfd, pOutBuffer, buflen);
+	memset(pOutTs, 0, sizeof(*pOutTs));
+	return usock_recv_from(hsock, pBuffer, len, flags, pOutClientInfo);
 }
 
-usock_ssize_t usock_send(usock_handle_t hsock, const void *buffer, usock_size_t buflen)
+usock_ssize_t usock_read_tx_timestamps(usock_handle_t hsock, usock_tx_timestamp_t *pOut, usock_size_t count)
 {
-	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	return send(node->socketfd, buffer, buflen, 0);
+	return -1;
 }
 
-usock_ssize_t usock_recv_from(usock_handle_t hsock, void *pBuffer, usock_size_t len, unsigned flags, usock_handle_t *pOutClientInfo)
+typedef SOCKET NativeSocket;
+
+static int reliableNativeSocket(struct SockInfoNode *sockNode, NativeSocket *pOut)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, sockNode);
+	if(!node->sockfd || node->sockfd == INVALID_SOCKET || node->info.ai_socktype != SOCK_STREAM || sockNode->rudp)
+		return 0;
+	*pOut = node->sockfd;
+	return 1;
+}
+
+static usock_err_t tcpInfoFromNative(NativeSocket fd, usock_tcp_info_t *pOut, int *pListening)
+{
+	DWORD version = 0, bytes = 0;
+	TCP_INFO_v0 info;
+
+	/* Windows 10 1703 and later */
+	if(WSAIoctl(fd, SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &bytes, NULL, NULL) == SOCKET_ERROR)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	/* Windows counts bytes where Linux counts segments */
+	memset(pOut, 0, sizeof(*pOut));
+	pOut->rttUs        = (unsigned)info.RttUs;
+	pOut->minRttUs     = (unsigned)info.MinRttUs;
+	pOut->mss          = (unsigned)info.Mss;
+	pOut->cwnd         = info.Mss ? (unsigned)(info.Cwnd / info.Mss) : 0;
+	pOut->unacked      = info.Mss ? (unsigned)(info.BytesInFlight / info.Mss) : 0;
+	pOut->totalRetrans = info.Mss ? info.BytesRetrans / info.Mss : 0;
+	pOut->bytesSent    = info.BytesOut;
+	pOut->bytesAcked   = info.BytesOut >= info.BytesInFlight ? info.BytesOut - info.BytesInFlight : 0;
+	pOut->bytesRetrans = info.BytesRetrans;
+
+	*pListening = info.State == TcpConnectionStateListen;
+	return USOCK_OK;
+}
+
+usock_err_t usock_set_busy_poll(usock_handle_t hsock, unsigned budgetUs)
+{
+	/* Busy polling is Linux only */
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_get_busy_poll_stats(usock_handle_t hsock, usock_busy_poll_stats_t *pOutStats)
+{
+	return USOCK_ERROR_NOT_INITIALIZED;
+}
+
+static usock_err_t getSocketType(usock_handle_t hsock, usock_socket_type_t *pOutType)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		*pOutType = USOCK_SOCKTYPE_RELIABLE_DATAGRAM;
+	else
+		*pOutType = node->info.ai_socktype == SOCK_STREAM ? USOCK_SOCKTYPE_RELIABLE : USOCK_SOCKTYPE_FAST;
+	return USOCK_OK;
+}
+
+static usock_err_t setSocketNonblocking(usock_handle_t hsock, int enable)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	u_long mode = enable ? 1 : 0;
+
+	if(node->sockfd == INVALID_SOCKET)
+		return USOCK_ERROR_NOT_INITIALIZED;
+
+	return ioctlsocket(node->sockfd, FIONBIO, &mode) == SOCKET_ERROR ? USOCK_ERROR_INTERNAL : USOCK_OK;
+}
+
+int usock_get_last_error()
+{
+	return WSAGetLastError();
+}
+
+int usock_would_block()
+{
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+/* Single non-blocking attempts, for the deadline calls. Winsock has no
+   MSG_DONTWAIT, so readiness is checked first; sends are capped so a
+   writable socket takes them without waiting */
+#define TRY_SEND_MAX (64 * 1024)
+
+static usock_ssize_t tryRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int ready = rawWaitReadable(hsock, 0);
+	if(ready == 0)
+		WSASetLastError(WSAEWOULDBLOCK);
+	if(ready <= 0)
+		return -1;
+	return (usock_ssize_t)recv(node->sockfd, (char*)pBuffer, (int)len, 0);
+}
+
+static usock_ssize_t trySend(usock_handle_t hsock, const void *pBuffer, usock_size_t len)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	WSAPOLLFD pfd;
+	int ready;
+
+	pfd.fd = node->sockfd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	ready = WSAPoll(&pfd, 1, 0);
+	if(ready == 0)
+		WSASetLastError(WSAEWOULDBLOCK);
+	if(ready <= 0)
+		return -1;
+
+	if(node->info.ai_socktype == SOCK_STREAM && len > TRY_SEND_MAX)
+		len = TRY_SEND_MAX;
+	return (usock_ssize_t)send(node->sockfd, (const char*)pBuffer, (int)len, 0);
+}
+
+/* Larger poll sets are translated in a heap buffer */
+#define POLL_STACK_SIZE 64
+
+usock_ssize_t usock_poll(usock_pollfd_t *pFds, usock_size_t count, int timeoutMs)
+{
+	WSAPOLLFD stackFds[POLL_STACK_SIZE];
+	WSAPOLLFD *fds = stackFds;
+	usock_size_t i;
+	int ret;
+
+	if(count > POLL_STACK_SIZE)
+	{
+		fds = (WSAPOLLFD *)g_palloc(sizeof(WSAPOLLFD) * count);
+		if(!fds)
+			return -1;
+	}
+
+	for(i = 0; i < count; ++i)
+	{
+		/* Negative descriptors are ignored by WSAPoll */
+		fds[i].fd      = pFds[i].hsock ? (GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, pFds[i].hsock))->sockfd : INVALID_SOCKET;
+		fds[i].events  = (SHORT)(((pFds[i].events & USOCK_POLL_IN) ? POLLIN : 0) | ((pFds[i].events & USOCK_POLL_OUT) ? POLLOUT : 0));
+		fds[i].revents = 0;
+	}
+
+	ret = WSAPoll(fds, (ULONG)count, timeoutMs);
+
+	for(i = 0; i < count; ++i)
+	{
+		pFds[i].revents = (unsigned short)(
+			((fds[i].revents & POLLIN)  ? USOCK_POLL_IN     : 0) |
+			((fds[i].revents & POLLOUT) ? USOCK_POLL_OUT    : 0) |
+			((fds[i].revents & POLLERR) ? USOCK_POLL_ERROR  : 0) |
+			((fds[i].revents & POLLHUP) ? USOCK_POLL_HANGUP : 0));
+	}
+
+	if(fds != stackFds)
+		g_pfree(fds);
+	return ret == SOCKET_ERROR ? -1 : ret;
+}
+
+/* Multicast is only implemented for Linux so far */
+usock_err_t usock_join_multicast_group(usock_handle_t hsock, const char *group, const char *iface_name)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_leave_multicast_group(usock_handle_t hsock, const char *group, const char *iface_name)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_join_source_multicast_group(usock_handle_t hsock, const char *group, const char *source, const char *iface_name)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_leave_source_multicast_group(usock_handle_t hsock, const char *group, const char *source, const char *iface_name)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_set_multicast_ttl(usock_handle_t hsock, int ttl)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_set_multicast_loop(usock_handle_t hsock, int enable)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_set_multicast_interface(usock_handle_t hsock, const char *iface_name)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+/* Local sockets, and so descriptor passing, are Linux only */
+usock_err_t usock_send_socket(usock_handle_t hsock, usock_handle_t hsockSend, const void *pBuffer, usock_size_t len)
+{
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_err_t usock_recv_socket(usock_handle_t hsock, usock_handle_t *pOutSock, void *pOutBuffer, usock_size_t buflen, usock_size_t *pOutReceived)
+{
+	if(pOutSock)
+		*pOutSock = NULL;
+	if(pOutReceived)
+		*pOutReceived = 0;
+	return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+}
+
+usock_domain_t socketDomain(usock_handle_t hsock)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	switch(node->info.ai_family)
+	{
+	case AF_INET:  return USOCK_DOMAIN_IPV4;
+	case AF_INET6: return USOCK_DOMAIN_IPV6;
+	default:       return USOCK_DOMAIN_UNSPECIFIED;
+	}
+}
+
+int rawWaitReadable(usock_handle_t hsock, int timeoutMs)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	WSAPOLLFD pfd;
+
+	pfd.fd      = node->sockfd;
+	pfd.events  = POLLRDNORM;
+	pfd.revents = 0;
+	return WSAPoll(&pfd, 1, timeoutMs);
+}
+
+usock_ssize_t rawSend(usock_handle_t hsock, const void *pBuffer, usock_size_t len)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	return (usock_ssize_t)send(node->sockfd, (const char*)pBuffer, (int)len, 0);
+}
+
+usock_ssize_t rawRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len, int connectSender)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	unsigned char address[sizeof(struct sockaddr_in6)];
+	int addrlen = sizeof(address);
+	u_long avail = 0;
+	int ret;
+
+	/* Winsock has no MSG_DONTWAIT; check for a pending datagram instead */
+	if(ioctlsocket(node->sockfd, FIONREAD, &avail) == SOCKET_ERROR || avail == 0)
+	{
+		if(rawWaitReadable(hsock, 0) <= 0)
+			return -1;
+	}
+
+	ret = recvfrom(node->sockfd, (char*)pBuffer, (int)len, 0, (struct sockaddr *)address, &addrlen);
+	if(ret > 0 && connectSender)
+		connect(node->sockfd, (struct sockaddr *)address, addrlen);
+	return (usock_ssize_t)ret;
+}
+
+static void closeSocket(usock_handle_t hsock)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	unsigned shard = GET_SOCK_NODE_FROM_HANDLE(hsock)->shard;
+	SOCKET fd;
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		rudpFlush(hsock);
+
+	/* Let go of the handle under the shard lock, so the TCP sampler never queries a reused one */
+	registryLock(shard);
+	fd = node->sockfd;
+	node->sockfd = INVALID_SOCKET;
+	registryUnlock(shard);
+	closesocket(fd);
+}
+
+#elif __APPLE__
+#include "TargetConditionals.h"
+#if TARGET_IPHONE_SIMULATOR
+// iOS Simulator
+#elif TARGET_OS_IPHONE
+// iOS device
+#elif TARGET_OS_MAC
+// Other kinds of Mac OS
+#else
+#   error "Unknown Apple platform"
+#endif
+#elif __linux__
+// linux
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <net/if.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stddef.h>
+
+/* Big enough for any of the supported address families */
+typedef union SockAddr
+{
+	struct sockaddr     sa;
+	struct sockaddr_in  in4;
+	struct sockaddr_in6 in6;
+	struct sockaddr_un  un;
+} SockAddr;
+
+typedef struct SockInfo
+{
+	/* All required info about the socket. */
+	int socketfd;
+	SockAddr info;
+	int protocol;
+	unsigned sockopt;
+}SockInfo;
+
+static socklen_t addrLen(const SockAddr *addr)
+{
+	/* Abstract names start with a NUL, and their length is part of the name */
+	if(addr->sa.sa_family == AF_UNIX)
+		return (socklen_t)(offsetof(struct sockaddr_un, sun_path) +
+			(addr->un.sun_path[0] ? strlen(addr->un.sun_path) + 1 : 1 + strlen(addr->un.sun_path + 1)));
+	return addr->sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+/* Fill in a local socket address; a leading '@' picks the abstract namespace */
+static usock_err_t localAddress(SockAddr *addr, const char *path)
+{
+	size_t len;
+	if(!path || !path[0])
+		return USOCK_ERROR_INVALID_ARG;
+
+	len = strlen(path);
+	if(len >= sizeof(addr->un.sun_path))
+		return USOCK_ERROR_INVALID_ARG;
+
+	memset(&addr->un, 0, sizeof(addr->un));
+	addr->un.sun_family = AF_UNIX;
+	memcpy(addr->un.sun_path, path, len);
+	if(path[0] == '@')
+		addr->un.sun_path[0] = '\0';
+	return USOCK_OK;
+}
+
+const size_t kSockNodeSize = sizeof(SockInfoNode) + sizeof(SockInfo);
+
+/* A lock per shard, each on cache lines of its own */
+static struct
+{
+	pthread_mutex_t lock;
+	unsigned char pad[64];
+} g_registryLocks[REGISTRY_SHARDS] = { [0 ... REGISTRY_SHARDS - 1] = { PTHREAD_MUTEX_INITIALIZER } };
+
+void registryLock(unsigned shard)
+{
+	pthread_mutex_lock(&g_registryLocks[shard].lock);
+}
+
+void registryUnlock(unsigned shard)
+{
+	pthread_mutex_unlock(&g_registryLocks[shard].lock);
+}
+
+usock_err_t usock_initialize()
+{
+	if(g_initialized)
+		return USOCK_ERROR_ALREADY_INITIALIZED;
+
+	return initCommon();
+}
+
+void usock_release()
+{
+	/* The sampler walks the registry, so it has to be gone before the nodes are */
+	usock_tcp_sampler_stop();
+	usock_metrics_stop();
+	usock_resolver_stop();
+	traceRelease();
+	freeNodeList();
+}
+
+static void configureSocket(usock_handle_t hsock, usock_domain_t domain, usock_socket_type_t type, usock_flags_t flags)
+{
+	struct SockInfo *info = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	switch(domain)
+	{
+	case USOCK_DOMAIN_IPV4:
+		info->info.sa.sa_family = AF_INET;
+		break;
+	case USOCK_DOMAIN_IPV6:
+		info->info.sa.sa_family = AF_INET6;
+		break;
+	case USOCK_DOMAIN_LOCAL:
+		info->info.sa.sa_family = AF_UNIX;
+		break;
+	default:
+		info->info.sa.sa_family = AF_UNSPEC;
+		break;
+	}
+
+	switch (type)
+	{
+	case USOCK_SOCKTYPE_FAST:
+		info->protocol = SOCK_DGRAM;
+		break;
+	case USOCK_SOCKTYPE_RELIABLE:
+		info->protocol = SOCK_STREAM;
+		break;
+	case USOCK_SOCKTYPE_RELIABLE_DATAGRAM:
+		info->protocol = SOCK_DGRAM;
+		break;
+	case USOCK_SOCKTYPE_SHARED_MEMORY:
+		/* The rings are set up over a local stream */
+		info->info.sa.sa_family = AF_UNIX;
+		info->protocol = SOCK_STREAM;
+		break;
+	}
+
+	info->sockopt = flags;
+
+	if(type == USOCK_SOCKTYPE_RELIABLE_DATAGRAM)
+		rudpCreate(hsock);
+	else
+		rudpDestroy(hsock);
+
+	if(type == USOCK_SOCKTYPE_SHARED_MEMORY)
+		shmCreate(hsock);
+	else
+		shmDestroy(hsock);
+}
+
+static usock_err_t bindSocket(usock_handle_t hsock, const char *ip_address, usock_port_t port)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int ret;
+	int val;
+
+	node->socketfd = socket(node->info.sa.sa_family, node->protocol, 0);
+	if(node->socketfd < 0)
+	{
+		/* Error handling */ 
+		return USOCK_ERROR_INIT_FAILED;
+	}
+
+	/* Set socket options */
+	val = node->sockopt & USOCK_OPTIONS_REUSE_ADDRESS;
+	ret = setsockopt(node->socketfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+	val = node->sockopt & USOCK_OPTIONS_REUSE_PORT;
+	ret = setsockopt(node->socketfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+
+	/* Bind the socket */
+	if(node->info.sa.sa_family == AF_UNIX)
+	{
+		struct stat st;
+		if(localAddress(&node->info, ip_address) != USOCK_OK)
+		{
+			close(node->socketfd);
+			node->socketfd = 0;
+			return USOCK_ERROR_INVALID_ARG;
+		}
+		/* Only ever remove a socket, never some other file at the path */
+		if((node->sockopt & USOCK_OPTIONS_REUSE_ADDRESS) && node->info.un.sun_path[0] &&
+		   stat(node->info.un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(node->info.un.sun_path);
+		ret = 1;
+	}
+	else if(node->info.sa.sa_family == AF_INET6)
+	{
+		node->info.in6.sin6_addr = in6addr_any;
+		node->info.in6.sin6_port = htons(port);
+		if(ip_address)
+			ret = inet_pton(AF_INET6, ip_address, &node->info.in6.sin6_addr);
+	}
+	else
+	{
+		node->info.in4.sin_addr.s_addr = INADDR_ANY;
+		node->info.in4.sin_port = htons(port);
+		if(ip_address)
+			ret = inet_pton(AF_INET, ip_address, &node->info.in4.sin_addr);
+	}
+	if(ip_address && ret != 1)
+	{
+		close(node->socketfd);
+		node->socketfd = 0;
+		return USOCK_ERROR_INVALID_ARG;
+	}
+
+	ret = bind(node->socketfd, &node->info.sa, addrLen(&node->info));
+	return ret < 0 ? USOCK_ERROR_INIT_FAILED : USOCK_OK;
+}
+
+static usock_err_t listenSocket(usock_handle_t hsock, int backlog)
+{
+	int ret;
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	if(!node->socketfd)
+	{
+		return USOCK_ERROR_NOT_INITIALIZED;
+	}
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+	{
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+	}
+
+	/* Best effort, a listener without it just takes normal handshakes */
+	if(node->protocol == SOCK_STREAM && (node->sockopt & USOCK_OPTIONS_FAST_OPEN))
+	{
+		int qlen = backlog > 0 ? backlog : 1;
+		setsockopt(node->socketfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+	}
+
+	ret = listen(node->socketfd, backlog);
+	if(ret < 0)
+	{
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	return USOCK_OK;
+}
+
+static usock_err_t acceptSocket(usock_handle_t hsock, usock_handle_t *pOutSock)
+{
+	int newSock, val;
+	SockAddr address;
+	socklen_t len = sizeof(address);
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct SockInfo *outNode;
+
+	memset(&address, 0, sizeof(address));
+	newSock = accept(node->socketfd, (struct sockaddr *)&address, &len);
+	if(newSock < 0)
+	{
+		*pOutSock = NULL;
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	usock_create_socket("client socket", pOutSock);
+	outNode = GET_SOCK_INFO_FROM_HANDLE(SockInfo, (*pOutSock));
+
+	/* Cache the returned socket info */
+	outNode->socketfd = newSock;
+	memcpy(&outNode->info, &address, len);
+	outNode->protocol = node->protocol;
+	outNode->sockopt  = node->sockopt;
+	statsAttach(*pOutSock, outNode->sockopt & USOCK_OPTIONS_STATS);
+
+	if(outNode->sockopt & USOCK_OPTIONS_NO_DELAY)
+	{
+		val = 1;
+		setsockopt(newSock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+	}
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+	{
+		usock_err_t err = shmAccept(*pOutSock, newSock);
+		if(err != USOCK_OK)
+		{
+			usock_close_socket(*pOutSock);
+			usock_free_socket(*pOutSock);
+			*pOutSock = NULL;
+			return err;
+		}
+	}
+
+	return USOCK_OK;
+}
+
+/* Open the socket and fill in the peer address, ready for connect() */
+static usock_err_t prepareConnect(usock_handle_t hsock, const char *ip_address, usock_port_t port)
+{
+	int ret, val;
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+
+	/* open socket */
+	node->socketfd = socket(node->info.sa.sa_family, node->protocol, 0);
+	if(node->socketfd < 0)
+	{
+		return USOCK_ERROR_INIT_FAILED;
+	}
+
+	if(node->info.sa.sa_family == AF_UNIX)
+	{
+		ret = localAddress(&node->info, ip_address) == USOCK_OK;
+	}
+	else if(node->info.sa.sa_family == AF_INET6)
+	{
+		node->info.in6.sin6_port = htons(port);
+		ret = inet_pton(AF_INET6, ip_address, &node->info.in6.sin6_addr);
+	}
+	else
+	{
+		node->info.in4.sin_port = htons(port);
+		ret = inet_pton(AF_INET, ip_address, &node->info.in4.sin_addr);
+	}
+	if(ret <= 0)
+	{
+		/* address parse failed */
+		return USOCK_ERROR_INVALID_ARG;
+	}
+
+	if(node->protocol == SOCK_STREAM && (node->sockopt & USOCK_OPTIONS_NO_DELAY))
+	{
+		val = 1;
+		setsockopt(node->socketfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+	}
+
+#ifdef TCP_FASTOPEN_CONNECT
+	/* connect() returns at once, and the first send goes out with the SYN */
+	if(node->protocol == SOCK_STREAM && (node->sockopt & USOCK_OPTIONS_FAST_OPEN))
+	{
+		val = 1;
+		setsockopt(node->socketfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val, sizeof(val));
+	}
+#endif
+
+	return USOCK_OK;
+}
+
+static usock_err_t connectSocket(usock_handle_t hsock, const char *ip_address, usock_port_t port)
+{
+	int ret;
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	usock_err_t err = prepareConnect(hsock, ip_address, port);
+	if(err != USOCK_OK)
+		return err;
+
+	ret = connect(node->socketfd, &node->info.sa, addrLen(&node->info));
+	if(ret < 0)
+	{
+		/* connect failed */
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		rudpMarkConnected(hsock);
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+		return shmConnect(hsock, node->socketfd);
+
+	return USOCK_OK;
+}
+
+/* Check how a non-blocking connect ended, and go back to blocking mode */
+static usock_err_t connectFinish(usock_handle_t hsock)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int soError = 0;
+	socklen_t len = sizeof(soError);
+
+	if(getsockopt(node->socketfd, SOL_SOCKET, SO_ERROR, &soError, &len) < 0)
+		return USOCK_ERROR_INTERNAL;
+	if(soError)
+	{
+		errno = soError;
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	usock_set_nonblocking(hsock, 0);
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		rudpMarkConnected(hsock);
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+		return shmConnect(hsock, node->socketfd);
+	return USOCK_OK;
+}
+
+/* Start a connect without waiting; *pPending is set if it's still in flight */
+static usock_err_t connectStart(usock_handle_t hsock, const char *ip_address, usock_port_t port, int *pPending)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	usock_err_t err;
+
+	*pPending = 0;
+	err = prepareConnect(hsock, ip_address, port);
+	if(err != USOCK_OK)
+		return err;
+	if(usock_set_nonblocking(hsock, 1) != USOCK_OK)
+		return USOCK_ERROR_INTERNAL;
+
+	if(connect(node->socketfd, &node->info.sa, addrLen(&node->info)) == 0)
+		return connectFinish(hsock);
+	if(errno != EINPROGRESS)
+		return USOCK_ERROR_INTERNAL;
+
+	*pPending = 1;
+	return USOCK_OK;
+}
+
+/* Single buffer forms of the ring transfers */
+static usock_ssize_t shmSendBuffer(usock_handle_t hsock, const void *pBuffer, usock_size_t len)
+{
+	usock_iovec_t iov;
+	iov.pBuffer = pBuffer;
+	iov.len     = len;
+	return shmSend(hsock, &iov, 1);
+}
+
+static usock_ssize_t shmRecvBuffer(usock_handle_t hsock, void *pBuffer, usock_size_t len)
+{
+	usock_iovec_t iov;
+	iov.pBuffer = pBuffer;
+	iov.len     = len;
+	return shmRecv(hsock, &iov, 1);
+}
+
+static usock_err_t connectSendSocket(usock_handle_t hsock, const char *ip_address, usock_port_t port, const void *pBuffer, usock_size_t len, usock_ssize_t *pSent)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	usock_err_t err;
+
+	if(node->protocol == SOCK_STREAM && !GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+	{
+		err = prepareConnect(hsock, ip_address, port);
+		if(err != USOCK_OK)
+			return err;
+
+		/* Connects and sends; the data rides the SYN if we hold a cookie */
+		*pSent = sendto(node->socketfd, pBuffer, len, MSG_FASTOPEN | MSG_NOSIGNAL, &node->info.sa, addrLen(&node->info));
+		if(*pSent >= 0)
+			return USOCK_OK;
+		if(errno != EOPNOTSUPP)
+			return USOCK_ERROR_INTERNAL;
+
+		/* Fast open is disabled system wide, take the long way */
+		if(connect(node->socketfd, &node->info.sa, addrLen(&node->info)) < 0)
+			return USOCK_ERROR_INTERNAL;
+	}
+	else
+	{
+		err = connectSocket(hsock, ip_address, port);
+		if(err != USOCK_OK)
+			return err;
+	}
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		*pSent = rudpSend(hsock, 0, pBuffer, len, 0);
+	else if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+		*pSent = shmSendBuffer(hsock, pBuffer, len);
+	else
+		*pSent = send(node->socketfd, pBuffer, len, MSG_NOSIGNAL);
+	return *pSent < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+}
+
+/***************************************/
+/*         Busy-poll receives          */
+
+typedef struct BusyPollState
+{
+	usock_size_t budgetNs;
+	usock_busy_poll_stats_t stats;
+} BusyPollState;
+
+/* Spin with non-blocking receives until data arrives or the budget is spent */
+static usock_ssize_t busyPollRecv(usock_handle_t hsock, int fd, void *pBuffer, usock_size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen)
+{
+	BusyPollState *bp = GET_SOCK_NODE_FROM_HANDLE(hsock)->busyPoll;
+	usock_size_t start = usock_get_time_ns();
+	usock_size_t now = start;
+	usock_size_t spins = 0;
+	usock_ssize_t ret;
+
+	do
+	{
+		ret = recvfrom(fd, pBuffer, len, flags | MSG_DONTWAIT, addr, addrlen);
+		++spins;
+		if(ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			break;
+		now = usock_get_time_ns();
+	} while(now - start < bp->budgetNs);
+
+	STAT_ADD(bp->stats.spins, spins);
+	STAT_ADD(bp->stats.spinNs, now - start);
+	if(ret >= 0)
+	{
+		STAT_ADD(bp->stats.hits, 1);
+		return ret;
+	}
+	if(errno != EAGAIN && errno != EWOULDBLOCK)
+		return ret;
+
+	STAT_ADD(bp->stats.fallbacks, 1);
+	return recvfrom(fd, pBuffer, len, flags, addr, addrlen);
+}
+
+static usock_ssize_t recvFromKernel(usock_handle_t hsock, int fd, void *pBuffer, usock_size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen)
+{
+	BusyPollState *bp = GET_SOCK_NODE_FROM_HANDLE(hsock)->busyPoll;
+
+	/* A caller asking not to wait gets a single try; a disabled budget keeps only the counters */
+	if(bp && bp->budgetNs && !(flags & MSG_DONTWAIT))
+		return busyPollRecv(hsock, fd, pBuffer, len, flags, addr, addrlen);
+	return recvfrom(fd, pBuffer, len, flags, addr, addrlen);
+}
+
+usock_err_t usock_set_busy_poll(usock_handle_t hsock, unsigned budgetUs)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct SockInfoNode *sockNode = GET_SOCK_NODE_FROM_HANDLE(hsock);
+	int val;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	if(sockNode->rudp || sockNode->shm)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	/* Best effort, the user space spin works without them */
+	val = (int)budgetUs;
+	setsockopt(node->socketfd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val));
+#ifdef SO_PREFER_BUSY_POLL
+	val = budgetUs ? 1 : 0;
+	setsockopt(node->socketfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val));
+#endif
+
+	if(!budgetUs)
+	{
+		/* Keep the counters readable, just stop spinning */
+		if(sockNode->busyPoll)
+			sockNode->busyPoll->budgetNs = 0;
+		return USOCK_OK;
+	}
+
+	if(!sockNode->busyPoll)
+	{
+		sockNode->busyPoll = (BusyPollState *)g_palloc(sizeof(BusyPollState));
+		if(!sockNode->busyPoll)
+			return USOCK_ERROR_OUT_OF_MEMORY;
+		memset(sockNode->busyPoll, 0, sizeof(BusyPollState));
+	}
+	sockNode->busyPoll->budgetNs = (usock_size_t)budgetUs * 1000;
+	return USOCK_OK;
+}
+
+usock_err_t usock_get_busy_poll_stats(usock_handle_t hsock, usock_busy_poll_stats_t *pOutStats)
+{
+	BusyPollState *bp = GET_SOCK_NODE_FROM_HANDLE(hsock)->busyPoll;
+
+	if(!bp)
+		return USOCK_ERROR_NOT_INITIALIZED;
+
+	pOutStats->spins     = STAT_LOAD(bp->stats.spins);
+	pOutStats->hits      = STAT_LOAD(bp->stats.hits);
+	pOutStats->fallbacks = STAT_LOAD(bp->stats.fallbacks);
+	pOutStats->spinNs    = STAT_LOAD(bp->stats.spinNs);
+	return USOCK_OK;
+}
+
+/***************************************/
+/*         Kernel timestamping         */
+
+/* Send times kept for matching with transmit stamps, a power of two */
+#define TSTAMP_PENDING_SIZE 256
+
+typedef struct TimestampState
+{
+	/* The OPT_ID the kernel gives the next send */
+	unsigned nextId;
+	struct
+	{
+		unsigned id;
+		usock_size_t sendNs;
+		usock_size_t schedNs;
+	} pending[TSTAMP_PENDING_SIZE];
+} TimestampState;
+
+static usock_size_t realtimeNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (usock_size_t)ts.tv_sec * 1000000000ULL + (usock_size_t)ts.tv_nsec;
+}
+
+static void tstampRemember(TimestampState *ts, unsigned id, usock_size_t sendNs)
+{
+	ts->pending[id & (TSTAMP_PENDING_SIZE - 1)].id      = id;
+	ts->pending[id & (TSTAMP_PENDING_SIZE - 1)].sendNs  = sendNs;
+	ts->pending[id & (TSTAMP_PENDING_SIZE - 1)].schedNs = 0;
+}
+
+static void tstampOnSend(usock_handle_t hsock, usock_size_t sendNs, usock_ssize_t ret, usock_size_t datagrams)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	TimestampState *ts = GET_SOCK_NODE_FROM_HANDLE(hsock)->tstamp;
+	usock_size_t i;
+
+	/* Stream ids count bytes, and name the last byte of the send */
+	if(node->protocol == SOCK_STREAM)
+	{
+		ts->nextId += (unsigned)ret;
+		tstampRemember(ts, ts->nextId - 1, sendNs);
+	}
+	else
+	{
+		for(i = 0; i < datagrams; ++i)
+			tstampRemember(ts, ts->nextId++, sendNs);
+	}
+}
+
+/* Only sockets with transmit timestamping on read the clock */
+#define TSTAMP_BEGIN(VAR, HSOCK) usock_size_t VAR = GET_SOCK_NODE_FROM_HANDLE(HSOCK)->tstamp ? realtimeNs() : 0
+#define TSTAMP_END(VAR, HSOCK, RET, DATAGRAMS) \
+	do { if(VAR && (RET) > 0) tstampOnSend((HSOCK), (VAR), (RET), (DATAGRAMS)); } while(0)
+
+static usock_ssize_t recvSocket(usock_handle_t hsock, void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t *pOutClientInfo)
+{
+	socklen_t clilen = sizeof(SockAddr);
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct SockInfo *cliinfoNode;
+
+	/* Reliable datagram and shared memory sockets only have a single peer */
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+	{
+		if(pOutClientInfo)
+			*pOutClientInfo = NULL;
+		return rudpRecv(hsock, pBuffer, len, NULL);
+	}
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+	{
+		if(pOutClientInfo)
+			*pOutClientInfo = NULL;
+		return shmRecvBuffer(hsock, pBuffer, len);
+	}
+
+	if(pOutClientInfo)
+	{
+		/* Allocate a node to hold the client info */
+		usock_create_socket("", pOutClientInfo);
+		cliinfoNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, (*pOutClientInfo));
+		return recvFromKernel(hsock, node->socketfd, pBuffer, len, (int)flags, &cliinfoNode->info.sa, &clilen);
+	}
+
+	/* Receive the client message */
+	return recvFromKernel(hsock, node->socketfd, pBuffer, len, (int)flags, (struct sockaddr *)NULL, NULL);
+}
+
+static usock_ssize_t sendSocket(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest)
+{
+	struct SockInfo *srcNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct SockInfo *dstNode;
+	struct sockaddr *info = NULL;
+	size_t infolen = 0;
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		return rudpSend(hsock, 0, pBuffer, len, 0);
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+		return shmSendBuffer(hsock, pBuffer, len);
+
+	if(hdest)
+	{
+		dstNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hdest);
+		info = &dstNode->info.sa;
+		infolen = addrLen(&dstNode->info);
+	}
+	return sendto(srcNode->socketfd, pBuffer, len, (unsigned)flags, info, infolen);
+}
+
+usock_ssize_t usock_recv(usock_handle_t hsock, void *pOutBuffer, usock_size_t buflen)
+{
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_RECV);
+	ret = GET_TRANSPORT(hsock)->recv(hsock, pOutBuffer, buflen, 0, NULL);
+	LATENCY_END(sampleStart, USOCK_LATENCY_RECV);
+	COUNT_RECV(hsock, ret);
+	TRACE_END(traceStart, USOCK_TRACE_RECV, hsock, ret);
+	return ret;
+}
+
+usock_ssize_t usock_send(usock_handle_t hsock, const void *buffer, usock_size_t buflen)
+{
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_SEND);
+	TSTAMP_BEGIN(sendNs, hsock);
+	ret = GET_TRANSPORT(hsock)->send(hsock, buffer, buflen, 0, NULL);
+	TSTAMP_END(sendNs, hsock, ret, 1);
+	LATENCY_END(sampleStart, USOCK_LATENCY_SEND);
+	COUNT_SEND(hsock, buflen, ret);
+	TRACE_END(traceStart, USOCK_TRACE_SEND, hsock, ret);
+	return ret;
+}
+
+usock_ssize_t usock_recv_from(usock_handle_t hsock, void *pBuffer, usock_size_t len, unsigned flags, usock_handle_t *pOutClientInfo)
+{
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	ret = GET_TRANSPORT(hsock)->recv(hsock, pBuffer, len, flags, pOutClientInfo);
+	COUNT_RECV(hsock, ret);
+	TRACE_END(traceStart, USOCK_TRACE_RECV_FROM, hsock, ret);
+	return ret;
+}
+
+usock_ssize_t usock_send_to(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest)
+{
+	usock_ssize_t ret;
+	TRACE_BEGIN(traceStart);
+	TSTAMP_BEGIN(sendNs, hsock);
+	ret = GET_TRANSPORT(hsock)->send(hsock, pBuffer, len, flags, hdest);
+	TSTAMP_END(sendNs, hsock, ret, 1);
+	COUNT_SEND(hsock, len, ret);
+	TRACE_END(traceStart, USOCK_TRACE_SEND_TO, hsock, ret);
+	return ret;
+}
+
+#define SEND_BATCH_SIZE 64
+
+usock_ssize_t usock_send_to_batch(usock_handle_t hsock, const usock_msg_t *pMsgs, usock_size_t count, usock_flags_t flags)
+{
+	struct SockInfo *srcNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct SockInfo *dstNode;
+	struct mmsghdr msgs[SEND_BATCH_SIZE];
+	struct iovec iovs[SEND_BATCH_SIZE];
+	usock_size_t sent = 0, sentBytes = 0;
+	unsigned i, n;
+	int ret;
+	TRACE_BEGIN(traceStart);
+	TSTAMP_BEGIN(sendNs, hsock);
+
+	/*
+	*  Other transports, reliable datagram sockets whose packets need a
+	*  header and a retransmit slot each, and shared memory sockets whose
+	*  fd is only the control socket, take them one at a time, each
+	*  counted on its own.
+	*/
+	if(GET_TRANSPORT(hsock) != &g_kernelTransport || GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp ||
+		GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+	{
+		while(sent < count && usock_send_to(hsock, pMsgs[sent].pBuffer, pMsgs[sent].len, flags, pMsgs[sent].hdest) >= 0)
+			++sent;
+		TRACE_END(traceStart, USOCK_TRACE_SEND_BATCH, hsock, sent > 0 ? (usock_ssize_t)sent : -1);
+		return sent > 0 ? (usock_ssize_t)sent : -1;
+	}
+
+	/* Hand the messages to the kernel in chunks of SEND_BATCH_SIZE */
+	while(sent < count)
+	{
+		n = (count - sent) < SEND_BATCH_SIZE ? (unsigned)(count - sent) : SEND_BATCH_SIZE;
+		memset(msgs, 0, sizeof(msgs[0]) * n);
+		for(i = 0; i < n; ++i)
+		{
+			const usock_msg_t *msg = &pMsgs[sent + i];
+			iovs[i].iov_base = (void *)msg->pBuffer;
+			iovs[i].iov_len  = msg->len;
+			msgs[i].msg_hdr.msg_iov    = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			if(msg->hdest)
+			{
+				dstNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, msg->hdest);
+				msgs[i].msg_hdr.msg_name    = &dstNode->info;
+				msgs[i].msg_hdr.msg_namelen = addrLen(&dstNode->info);
+			}
+		}
+
+		ret = sendmmsg(srcNode->socketfd, msgs, n, (int)flags);
+		if(ret < 0)
+			break;
+
+		for(i = 0; i < (unsigned)ret; ++i)
+			sentBytes += iovs[i].iov_len;
+		sent += (usock_size_t)ret;
+		if((unsigned)ret < n)
+			break; /* The kernel stopped early, let the caller retry the rest */
+	}
+
+	TSTAMP_END(sendNs, hsock, (usock_ssize_t)sentBytes, sent);
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->stats)
+		statsOnSendBatch(GET_SOCK_NODE_FROM_HANDLE(hsock)->stats, pMsgs, count, sent > 0 ? (usock_ssize_t)sent : -1);
+	TRACE_END(traceStart, USOCK_TRACE_SEND_BATCH, hsock, sent > 0 ? (usock_ssize_t)sent : -1);
+	return sent > 0 ? (usock_ssize_t)sent : -1;
+}
+
+usock_err_t usock_set_max_pacing_rate(usock_handle_t hsock, usock_size_t bytesPerSecond)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	unsigned long long rate = bytesPerSecond ? bytesPerSecond : ~0ULL;
+	int ret;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+
+	/* Older kernels only accept a 32 bit rate */
+	ret = setsockopt(node->socketfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+	if(ret < 0)
+	{
+		unsigned rate32 = rate > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned)rate;
+		ret = setsockopt(node->socketfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, sizeof(rate32));
+	}
+
+	return ret < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+}
+
+usock_size_t usock_get_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (usock_size_t)ts.tv_sec * 1000000000ULL + (usock_size_t)ts.tv_nsec;
+}
+
+#define SENDV_BATCH_SIZE 64
+
+usock_ssize_t usock_sendv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct iovec iovs[SENDV_BATCH_SIZE];
+	struct msghdr msg;
+	usock_ssize_t ret;
+	unsigned i, n;
+	TRACE_BEGIN(traceStart);
+	TSTAMP_BEGIN(sendNs, hsock);
+
+	/* Only the first SENDV_BATCH_SIZE buffers are sent; the caller sees a short write */
+	n = count < SENDV_BATCH_SIZE ? (unsigned)count : SENDV_BATCH_SIZE;
+	for(i = 0; i < n; ++i)
+	{
+		iovs[i].iov_base = (void *)pIov[i].pBuffer;
+		iovs[i].iov_len  = pIov[i].len;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iovs;
+	msg.msg_iovlen = n;
+
+	/* A peer that went away should be an error, not a SIGPIPE */
+	if(GET_TRANSPORT(hsock) != &g_kernelTransport)
+	{
+		errno = EOPNOTSUPP;
+		ret = -1;
+	}
+	else if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+		ret = shmSend(hsock, pIov, n);
+	else if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		ret = rudpSendv(hsock, pIov, n);
+	else
+		ret = sendmsg(node->socketfd, &msg, MSG_NOSIGNAL);
+	TSTAMP_END(sendNs, hsock, ret, 1);
+	COUNT_SEND(hsock, iovecBytes(pIov, n), ret);
+	TRACE_END(traceStart, USOCK_TRACE_SENDV, hsock, ret);
+	return ret;
+}
+
+usock_ssize_t usock_recvv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct iovec iovs[SENDV_BATCH_SIZE];
+	usock_ssize_t ret;
+	unsigned i, n;
+	TRACE_BEGIN(traceStart);
+
+	n = count < SENDV_BATCH_SIZE ? (unsigned)count : SENDV_BATCH_SIZE;
+	for(i = 0; i < n; ++i)
+	{
+		iovs[i].iov_base = (void *)pIov[i].pBuffer;
+		iovs[i].iov_len  = pIov[i].len;
+	}
+
+	if(GET_TRANSPORT(hsock) != &g_kernelTransport)
+	{
+		errno = EOPNOTSUPP;
+		ret = -1;
+	}
+	else if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+		ret = shmRecv(hsock, pIov, n);
+	else if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		ret = rudpRecvv(hsock, pIov, n);
+	else
+		ret = readv(node->socketfd, iovs, (int)n);
+	COUNT_RECV(hsock, ret);
+	TRACE_END(traceStart, USOCK_TRACE_RECVV, hsock, ret);
+	return ret;
+}
+
+static usock_size_t timespecNs(const struct timespec *ts)
+{
+	return (usock_size_t)ts->tv_sec * 1000000000ULL + (usock_size_t)ts->tv_nsec;
+}
+
+usock_err_t usock_enable_timestamping(usock_handle_t hsock, unsigned flags)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct SockInfoNode *sockNode = GET_SOCK_NODE_FROM_HANDLE(hsock);
+	int val = 0, off = 0;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	if(sockNode->rudp || sockNode->shm)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	if(flags & USOCK_TIMESTAMP_RX_SOFTWARE)
+		val |= SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if(flags & USOCK_TIMESTAMP_RX_HARDWARE)
+		val |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	if(flags & USOCK_TIMESTAMP_TX_SOFTWARE)
+	{
+		val |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_SOFTWARE;
+		if(node->protocol == SOCK_STREAM)
+			val |= SOF_TIMESTAMPING_TX_ACK;
+	}
+	if(flags & USOCK_TIMESTAMP_TX_HARDWARE)
+		val |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+	/* Number the sends, and don't loop the payload back with the stamps */
+	if(flags & (USOCK_TIMESTAMP_TX_SOFTWARE | USOCK_TIMESTAMP_TX_HARDWARE))
+		val |= SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+	/* The kernel only restarts the ids when OPT_ID goes from off to on */
+	if(setsockopt(node->socketfd, SOL_SOCKET, SO_TIMESTAMPING, &off, sizeof(off)) < 0)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+	if(val && setsockopt(node->socketfd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)) < 0)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	if(val & SOF_TIMESTAMPING_OPT_ID)
+	{
+		if(!sockNode->tstamp)
+			sockNode->tstamp = (TimestampState *)g_palloc(sizeof(TimestampState));
+		if(!sockNode->tstamp)
+			return USOCK_ERROR_OUT_OF_MEMORY;
+		memset(sockNode->tstamp, 0, sizeof(TimestampState));
+	}
+	else if(sockNode->tstamp)
+	{
+		g_pfree(sockNode->tstamp);
+		sockNode->tstamp = NULL;
+	}
+
+	return USOCK_OK;
+}
+
+usock_ssize_t usock_recv_from_ts(usock_handle_t hsock, void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t *pOutClientInfo, usock_rx_timestamp_t *pOutTs)
 {
-	socklen_t clilen = sizeof(struct sockaddr_in);
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
 	struct SockInfo *cliinfoNode;
+	union { char buf[CMSG_SPACE(sizeof(struct scm_timestamping))]; struct cmsghdr align; } control;
+	struct scm_timestamping *tss;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	usock_ssize_t ret;
+	usock_size_t now;
+	TRACE_BEGIN(traceStart);
+
+	memset(pOutTs, 0, sizeof(*pOutTs));
+
+	/* Reliable datagrams are reassembled, and ring or memory messages never pass the kernel */
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp || GET_SOCK_NODE_FROM_HANDLE(hsock)->shm ||
+	   GET_TRANSPORT(hsock) != &g_kernelTransport)
+		return usock_recv_from(hsock, pBuffer, len, flags, pOutClientInfo);
+
+	iov.iov_base = pBuffer;
+	iov.iov_len  = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if(pOutClientInfo)
+	{
+		/* Allocate a node to hold the client info */
+		usock_create_socket("", pOutClientInfo);
+		cliinfoNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, (*pOutClientInfo));
+		msg.msg_name    = &cliinfoNode->info;
+		msg.msg_namelen = sizeof(SockAddr);
+	}
+
+	ret = recvmsg(node->socketfd, &msg, (int)flags);
+	if(ret >= 0)
+	{
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+				continue;
+			tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			pOutTs->softwareNs = timespecNs(&tss->ts[0]);
+			pOutTs->hardwareNs = timespecNs(&tss->ts[2]);
+		}
+
+		/* Hardware clocks needn't be in sync with ours, so only software stamps are compared */
+		now = realtimeNs();
+		if(pOutTs->softwareNs && now >= pOutTs->softwareNs)
+			latencyRecordNs(USOCK_LATENCY_RX_QUEUE, now - pOutTs->softwareNs);
+	}
+
+	COUNT_RECV(hsock, ret);
+	TRACE_END(traceStart, USOCK_TRACE_RECV_FROM, hsock, ret);
+	return ret;
+}
+
+usock_ssize_t usock_read_tx_timestamps(usock_handle_t hsock, usock_tx_timestamp_t *pOut, usock_size_t count)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	TimestampState *ts = GET_SOCK_NODE_FROM_HANDLE(hsock)->tstamp;
+	union { char buf[512]; struct cmsghdr align; } control;
+	struct scm_timestamping *tss;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	usock_tx_timestamp_t *out;
+	usock_size_t n = 0;
+	unsigned slot;
+
+	while(n < count)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		if(recvmsg(node->socketfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return n > 0 ? (usock_ssize_t)n : -1;
+		}
+
+		tss  = NULL;
+		serr = NULL;
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+				tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			else if((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+			        (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+		}
+
+		/* Other errors on the queue aren't stamps */
+		if(!tss || !serr || serr->ee_errno != ENOMSG || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			continue;
+
+		out = &pOut[n++];
+		out->id       = serr->ee_data;
+		out->hardware = tss->ts[2].tv_sec || tss->ts[2].tv_nsec;
+		out->timestampNs = timespecNs(out->hardware ? &tss->ts[2] : &tss->ts[0]);
+		out->sendNs   = 0;
+		out->type     = serr->ee_info == SCM_TSTAMP_SCHED ? USOCK_TX_STAMP_SCHED :
+		                serr->ee_info == SCM_TSTAMP_ACK   ? USOCK_TX_STAMP_ACKED :
+		                                                    USOCK_TX_STAMP_SENT;
+
+		if(!ts)
+			continue;
+		slot = serr->ee_data & (TSTAMP_PENDING_SIZE - 1);
+		if(ts->pending[slot].id != serr->ee_data || !ts->pending[slot].sendNs)
+			continue;
+
+		out->sendNs = ts->pending[slot].sendNs;
+		if(out->hardware || out->timestampNs < out->sendNs)
+			continue;
+
+		if(out->type == USOCK_TX_STAMP_SCHED)
+		{
+			latencyRecordNs(USOCK_LATENCY_TX_STACK, out->timestampNs - out->sendNs);
+			ts->pending[slot].schedNs = out->timestampNs;
+		}
+		else if(out->type == USOCK_TX_STAMP_SENT && ts->pending[slot].schedNs &&
+		        out->timestampNs >= ts->pending[slot].schedNs)
+		{
+			latencyRecordNs(USOCK_LATENCY_TX_QUEUE, out->timestampNs - ts->pending[slot].schedNs);
+		}
+	}
+
+	return (usock_ssize_t)n;
+}
+
+/*
+* The kernel's struct tcp_info. The copy in netinet/tcp.h stops before
+* the newer fields; older kernels fill in less of it, leaving the rest 0.
+*/
+typedef struct KernelTcpInfo
+{
+	unsigned char tcpi_state;
+	unsigned char tcpi_ca_state;
+	unsigned char tcpi_retransmits;
+	unsigned char tcpi_probes;
+	unsigned char tcpi_backoff;
+	unsigned char tcpi_options;
+	unsigned char tcpi_wscale;
+	unsigned char tcpi_flags;
+
+	uint32_t tcpi_rto;
+	uint32_t tcpi_ato;
+	uint32_t tcpi_snd_mss;
+	uint32_t tcpi_rcv_mss;
+
+	uint32_t tcpi_unacked;
+	uint32_t tcpi_sacked;
+	uint32_t tcpi_lost;
+	uint32_t tcpi_retrans;
+	uint32_t tcpi_fackets;
+
+	uint32_t tcpi_last_data_sent;
+	uint32_t tcpi_last_ack_sent;
+	uint32_t tcpi_last_data_recv;
+	uint32_t tcpi_last_ack_recv;
+
+	uint32_t tcpi_pmtu;
+	uint32_t tcpi_rcv_ssthresh;
+	uint32_t tcpi_rtt;
+	uint32_t tcpi_rttvar;
+	uint32_t tcpi_snd_ssthresh;
+	uint32_t tcpi_snd_cwnd;
+	uint32_t tcpi_advmss;
+	uint32_t tcpi_reordering;
+
+	uint32_t tcpi_rcv_rtt;
+	uint32_t tcpi_rcv_space;
+
+	uint32_t tcpi_total_retrans;
+
+	uint64_t tcpi_pacing_rate;
+	uint64_t tcpi_max_pacing_rate;
+	uint64_t tcpi_bytes_acked;
+	uint64_t tcpi_bytes_received;
+	uint32_t tcpi_segs_out;
+	uint32_t tcpi_segs_in;
+
+	uint32_t tcpi_notsent_bytes;
+	uint32_t tcpi_min_rtt;
+	uint32_t tcpi_data_segs_in;
+	uint32_t tcpi_data_segs_out;
+
+	uint64_t tcpi_delivery_rate;
+
+	uint64_t tcpi_busy_time;
+	uint64_t tcpi_rwnd_limited;
+	uint64_t tcpi_sndbuf_limited;
+
+	uint32_t tcpi_delivered;
+	uint32_t tcpi_delivered_ce;
+
+	uint64_t tcpi_bytes_sent;
+	uint64_t tcpi_bytes_retrans;
+} KernelTcpInfo;
+
+typedef int NativeSocket;
+
+static int reliableNativeSocket(struct SockInfoNode *sockNode, NativeSocket *pOut)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, sockNode);
+	if(!node->socketfd || node->protocol != SOCK_STREAM || node->info.sa.sa_family == AF_UNIX || sockNode->rudp)
+		return 0;
+	*pOut = node->socketfd;
+	return 1;
+}
+
+static usock_err_t tcpInfoFromNative(NativeSocket fd, usock_tcp_info_t *pOut, int *pListening)
+{
+	KernelTcpInfo info;
+	socklen_t len = sizeof(info);
+
+	memset(&info, 0, sizeof(info));
+	if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return USOCK_ERROR_INTERNAL;
+
+	pOut->rttUs        = info.tcpi_rtt;
+	pOut->rttVarUs     = info.tcpi_rttvar;
+	pOut->minRttUs     = info.tcpi_min_rtt;
+	pOut->mss          = info.tcpi_snd_mss;
+	pOut->cwnd         = info.tcpi_snd_cwnd;
+	/* Unset until the first loss */
+	pOut->ssthresh     = info.tcpi_snd_ssthresh >= 0x7FFFFFFF ? 0 : info.tcpi_snd_ssthresh;
+	pOut->unacked      = info.tcpi_unacked;
+	pOut->lost         = info.tcpi_lost;
+	pOut->totalRetrans = info.tcpi_total_retrans;
+	pOut->bytesSent    = info.tcpi_bytes_sent;
+	pOut->bytesAcked   = info.tcpi_bytes_acked;
+	pOut->bytesRetrans = info.tcpi_bytes_retrans;
+	pOut->deliveryRate = info.tcpi_delivery_rate;
+
+	*pListening = info.tcpi_state == TCP_LISTEN;
+	return USOCK_OK;
+}
+
+static usock_err_t getSocketType(usock_handle_t hsock, usock_socket_type_t *pOutType)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		*pOutType = USOCK_SOCKTYPE_RELIABLE_DATAGRAM;
+	else if(GET_SOCK_NODE_FROM_HANDLE(hsock)->shm)
+		*pOutType = USOCK_SOCKTYPE_SHARED_MEMORY;
+	else
+		*pOutType = node->protocol == SOCK_STREAM ? USOCK_SOCKTYPE_RELIABLE : USOCK_SOCKTYPE_FAST;
+	return USOCK_OK;
+}
+
+static usock_err_t setSocketNonblocking(usock_handle_t hsock, int enable)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int fl;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+
+	fl = fcntl(node->socketfd, F_GETFL, 0);
+	if(fl < 0)
+		return USOCK_ERROR_INTERNAL;
+
+	fl = enable ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK);
+	if(fcntl(node->socketfd, F_SETFL, fl) < 0)
+		return USOCK_ERROR_INTERNAL;
+
+	shmSetNonblocking(hsock, enable);
+	return USOCK_OK;
+}
+
+int usock_get_last_error()
+{
+	return errno;
+}
+
+int usock_would_block()
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/* Single non-blocking attempts, for the deadline calls */
+static usock_ssize_t tryRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	return recv(node->socketfd, pBuffer, len, MSG_DONTWAIT);
+}
+
+static usock_ssize_t trySend(usock_handle_t hsock, const void *pBuffer, usock_size_t len)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	return send(node->socketfd, pBuffer, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* Larger poll sets are translated in a heap buffer */
+#define POLL_STACK_SIZE 64
+
+usock_ssize_t usock_poll(usock_pollfd_t *pFds, usock_size_t count, int timeoutMs)
+{
+	struct pollfd stackFds[POLL_STACK_SIZE];
+	struct pollfd *fds = stackFds;
+	usock_size_t i;
+	int ret;
+
+	if(count > POLL_STACK_SIZE)
+	{
+		fds = (struct pollfd *)g_palloc(sizeof(struct pollfd) * count);
+		if(!fds)
+			return -1;
+	}
+
+	for(i = 0; i < count; ++i)
+	{
+		/* Negative descriptors are ignored by poll */
+		fds[i].fd      = pFds[i].hsock ? (GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, pFds[i].hsock))->socketfd : -1;
+		fds[i].events  = (short)(((pFds[i].events & USOCK_POLL_IN) ? POLLIN : 0) | ((pFds[i].events & USOCK_POLL_OUT) ? POLLOUT : 0));
+		fds[i].revents = 0;
+	}
+
+	ret = poll(fds, (nfds_t)count, timeoutMs);
+
+	for(i = 0; i < count; ++i)
+	{
+		pFds[i].revents = (unsigned short)(
+			((fds[i].revents & POLLIN)  ? USOCK_POLL_IN     : 0) |
+			((fds[i].revents & POLLOUT) ? USOCK_POLL_OUT    : 0) |
+			((fds[i].revents & POLLERR) ? USOCK_POLL_ERROR  : 0) |
+			((fds[i].revents & POLLHUP) ? USOCK_POLL_HANGUP : 0));
+	}
+
+	if(fds != stackFds)
+		g_pfree(fds);
+	return ret < 0 ? -1 : ret;
+}
+
+/***************************************/
+/*             Multicast               */
+
+static usock_err_t parseAddress(int family, const char *address, struct sockaddr_storage *pOut)
+{
+	memset(pOut, 0, sizeof(*pOut));
+	pOut->ss_family = (sa_family_t)family;
+	if(family == AF_INET6)
+	{
+		if(inet_pton(AF_INET6, address, &((struct sockaddr_in6 *)pOut)->sin6_addr) <= 0)
+			return USOCK_ERROR_INVALID_ARG;
+	}
+	else
+	{
+		if(inet_pton(AF_INET, address, &((struct sockaddr_in *)pOut)->sin_addr) <= 0)
+			return USOCK_ERROR_INVALID_ARG;
+	}
+	return USOCK_OK;
+}
+
+static usock_err_t interfaceIndex(const char *iface_name, unsigned *pOutIndex)
+{
+	*pOutIndex = 0;
+	if(!iface_name)
+		return USOCK_OK;
+
+	*pOutIndex = if_nametoindex(iface_name);
+	return *pOutIndex ? USOCK_OK : USOCK_ERROR_INVALID_ARG;
+}
+
+static int multicastLevel(const struct SockInfo *node)
+{
+	return node->info.sa.sa_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+}
+
+/*
+* The protocol independent MCAST_* options work for IPv4 and IPv6 alike,
+* and are the only way to do source-specific joins on IPv6.
+*/
+static usock_err_t setMembership(usock_handle_t hsock, int option, const char *group, const char *source, const char *iface_name)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int family = node->info.sa.sa_family;
+	unsigned index;
+	usock_err_t err;
+	int ret;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	if(!group)
+		return USOCK_ERROR_INVALID_ARG;
+
+	err = interfaceIndex(iface_name, &index);
+	if(err != USOCK_OK)
+		return err;
+
+	if(source)
+	{
+		struct group_source_req req;
+		memset(&req, 0, sizeof(req));
+		req.gsr_interface = index;
+		if((err = parseAddress(family, group, &req.gsr_group)) != USOCK_OK ||
+		   (err = parseAddress(family, source, &req.gsr_source)) != USOCK_OK)
+			return err;
+		ret = setsockopt(node->socketfd, multicastLevel(node), option, &req, sizeof(req));
+	}
+	else
+	{
+		struct group_req req;
+		memset(&req, 0, sizeof(req));
+		req.gr_interface = index;
+		if((err = parseAddress(family, group, &req.gr_group)) != USOCK_OK)
+			return err;
+		ret = setsockopt(node->socketfd, multicastLevel(node), option, &req, sizeof(req));
+	}
+
+	return ret < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+}
+
+usock_err_t usock_join_multicast_group(usock_handle_t hsock, const char *group, const char *iface_name)
+{
+	return setMembership(hsock, MCAST_JOIN_GROUP, group, NULL, iface_name);
+}
+
+usock_err_t usock_leave_multicast_group(usock_handle_t hsock, const char *group, const char *iface_name)
+{
+	return setMembership(hsock, MCAST_LEAVE_GROUP, group, NULL, iface_name);
+}
+
+usock_err_t usock_join_source_multicast_group(usock_handle_t hsock, const char *group, const char *source, const char *iface_name)
+{
+	if(!source)
+		return USOCK_ERROR_INVALID_ARG;
+	return setMembership(hsock, MCAST_JOIN_SOURCE_GROUP, group, source, iface_name);
+}
+
+usock_err_t usock_leave_source_multicast_group(usock_handle_t hsock, const char *group, const char *source, const char *iface_name)
+{
+	if(!source)
+		return USOCK_ERROR_INVALID_ARG;
+	return setMembership(hsock, MCAST_LEAVE_SOURCE_GROUP, group, source, iface_name);
+}
+
+usock_err_t usock_set_multicast_ttl(usock_handle_t hsock, int ttl)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int ret;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	if(ttl < 0 || ttl > 255)
+		return USOCK_ERROR_INVALID_ARG;
+
+	if(node->info.sa.sa_family == AF_INET6)
+		ret = setsockopt(node->socketfd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl));
+	else
+		ret = setsockopt(node->socketfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+	return ret < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+}
+
+usock_err_t usock_set_multicast_loop(usock_handle_t hsock, int enable)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	int val = enable ? 1 : 0;
+	int ret;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+
+	if(node->info.sa.sa_family == AF_INET6)
+		ret = setsockopt(node->socketfd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &val, sizeof(val));
+	else
+		ret = setsockopt(node->socketfd, IPPROTO_IP, IP_MULTICAST_LOOP, &val, sizeof(val));
+
+	return ret < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+}
+
+usock_err_t usock_set_multicast_interface(usock_handle_t hsock, const char *iface_name)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	unsigned index;
+	usock_err_t err;
+	int ret;
+
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+
+	err = interfaceIndex(iface_name, &index);
+	if(err != USOCK_OK)
+		return err;
+
+	if(node->info.sa.sa_family == AF_INET6)
+	{
+		ret = setsockopt(node->socketfd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index));
+	}
+	else
+	{
+		struct ip_mreqn req;
+		memset(&req, 0, sizeof(req));
+		req.imr_ifindex = (int)index;
+		ret = setsockopt(node->socketfd, IPPROTO_IP, IP_MULTICAST_IF, &req, sizeof(req));
+	}
+
+	return ret < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+}
+
+/***************************************/
+/*         Descriptor passing          */
+
+usock_err_t usock_send_socket(usock_handle_t hsock, usock_handle_t hsockSend, const void *pBuffer, usock_size_t len)
+{
+	struct SockInfo *node, *sendNode;
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	usock_ssize_t ret;
+
+	if(!hsock || !hsockSend || !pBuffer || len == 0)
+		return USOCK_ERROR_INVALID_ARG;
+	node     = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	sendNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsockSend);
+	if(!node->socketfd || !sendNode->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	if(node->info.sa.sa_family != AF_UNIX)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	/* The descriptor rides along with the message, which can't be empty */
+	iov.iov_base = (void *)pBuffer;
+	iov.iov_len  = len;
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &sendNode->socketfd, sizeof(int));
+
+	do
+	{
+		ret = sendmsg(node->socketfd, &msg, MSG_NOSIGNAL);
+	} while(ret < 0 && errno == EINTR);
+	COUNT_SEND(hsock, len, ret);
+
+	if(ret < 0)
+		return errno == EPIPE || errno == ECONNRESET ? USOCK_ERROR_CONNECTION_CLOSED : USOCK_ERROR_INTERNAL;
+	/* Stream sockets can take part of the message, but the descriptor went with the first byte */
+	return (usock_size_t)ret == len ? USOCK_OK : USOCK_ERROR_INTERNAL;
+}
 
-	/* Allocate a node to hold the client info */
-	if(pOutClientInfo)
+/* Wrap a descriptor received from a peer in a new socket node */
+static usock_err_t adoptSocket(int fd, usock_handle_t *pOutSock)
+{
+	struct SockInfo *outNode;
+	int type = 0;
+	socklen_t optlen = sizeof(type);
+	socklen_t len = sizeof(outNode->info);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optlen) < 0 ||
+	   usock_create_socket("passed socket", pOutSock) != USOCK_OK)
 	{
-		usock_create_socket("", pOutClientInfo);
-		cliinfoNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, (*pOutClientInfo));
-		return recvfrom(node->socketfd, pBuffer, len, (int)flags, (struct sockaddr *)&cliinfoNode->info, &clilen);
+		close(fd);
+		return USOCK_ERROR_INTERNAL;
 	}
 
-	/* Receive the client message */
-	return recvfrom(node->socketfd, pBuffer, len, (int)flags, (struct sockaddr *)NULL, NULL);
+	outNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, (*pOutSock));
+	outNode->socketfd = fd;
+	outNode->protocol = type;
+	outNode->sockopt  = USOCK_OPTIONS_DEFAULT;
+
+	/* The peer address, or at least the family of an unconnected socket */
+	memset(&outNode->info, 0, sizeof(outNode->info));
+	if(getpeername(fd, &outNode->info.sa, &len) < 0)
+	{
+		len = sizeof(outNode->info);
+		getsockname(fd, &outNode->info.sa, &len);
+	}
+	return USOCK_OK;
 }
 
-usock_ssize_t usock_send_to(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest)
+usock_err_t usock_recv_socket(usock_handle_t hsock, usock_handle_t *pOutSock, void *pOutBuffer, usock_size_t buflen, usock_size_t *pOutReceived)
 {
-	struct SockInfo *srcNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	struct SockInfo *dstNode;
-	struct sockaddr *info = NULL;
-	size_t infolen = 0;
-	if(hdest)
+	struct SockInfo *node;
+	union
 	{
-		dstNode = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hdest);
-		info = (struct sockaddr *)&dstNode->info;
-		infolen = sizeof(struct sockaddr_in);
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	usock_ssize_t ret;
+	int fd = -1;
+
+	if(pOutSock)
+		*pOutSock = NULL;
+	if(pOutReceived)
+		*pOutReceived = 0;
+	if(!hsock || !pOutSock || !pOutBuffer || buflen == 0)
+		return USOCK_ERROR_INVALID_ARG;
+	node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	if(!node->socketfd)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	if(node->info.sa.sa_family != AF_UNIX)
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	iov.iov_base = pOutBuffer;
+	iov.iov_len  = buflen;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do
+	{
+		ret = recvmsg(node->socketfd, &msg, MSG_CMSG_CLOEXEC);
+	} while(ret < 0 && errno == EINTR);
+	COUNT_RECV(hsock, ret);
+
+	if(ret < 0)
+		return errno == ECONNRESET ? USOCK_ERROR_CONNECTION_CLOSED : USOCK_ERROR_INTERNAL;
+
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+		   cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
+		{
+			/* Only one is ever sent; anything past it is closed below */
+			int *fds = (int *)CMSG_DATA(cmsg);
+			usock_size_t i, count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(i = 0; i < count; ++i)
+			{
+				if(fd < 0)
+					fd = fds[i];
+				else
+					close(fds[i]);
+			}
+		}
 	}
-	return sendto(srcNode->socketfd, pBuffer, len, (unsigned)flags, info, infolen);
+
+	/* Descriptors that didn't fit are closed by the kernel, which is all we can do too */
+	if(fd >= 0 && (msg.msg_flags & MSG_CTRUNC))
+	{
+		close(fd);
+		fd = -1;
+	}
+
+	if(ret == 0 && fd < 0)
+		return USOCK_ERROR_CONNECTION_CLOSED;
+	if(pOutReceived)
+		*pOutReceived = (usock_size_t)ret;
+	if(fd >= 0)
+		return adoptSocket(fd, pOutSock);
+	return USOCK_OK;
 }
 
-void usock_close_socket(usock_handle_t hsock)
+usock_domain_t socketDomain(usock_handle_t hsock)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	switch(node->info.sa.sa_family)
+	{
+	case AF_INET:  return USOCK_DOMAIN_IPV4;
+	case AF_INET6: return USOCK_DOMAIN_IPV6;
+	case AF_UNIX:  return USOCK_DOMAIN_LOCAL;
+	default:       return USOCK_DOMAIN_UNSPECIFIED;
+	}
+}
+
+int rawWaitReadable(usock_handle_t hsock, int timeoutMs)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd      = node->socketfd;
+	pfd.events  = POLLIN;
+	pfd.revents = 0;
+	do
+	{
+		ret = poll(&pfd, 1, timeoutMs);
+	} while(ret < 0 && errno == EINTR);
+	return ret;
+}
+
+usock_ssize_t rawSend(usock_handle_t hsock, const void *pBuffer, usock_size_t len)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	return send(node->socketfd, pBuffer, len, MSG_DONTWAIT);
+}
+
+usock_ssize_t rawRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len, int connectSender)
+{
+	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
+	SockAddr address;
+	socklen_t addrlen = sizeof(address);
+	usock_ssize_t ret;
+
+	for(;;)
+	{
+		ret = recvfrom(node->socketfd, pBuffer, len, MSG_DONTWAIT, &address.sa, &addrlen);
+		/* A refused send shows up as an error here; skip past it */
+		if(ret < 0 && (errno == ECONNREFUSED || errno == EINTR))
+			continue;
+		break;
+	}
+
+	if(ret > 0 && connectSender)
+		connect(node->socketfd, &address.sa, addrlen);
+	return ret;
+}
+
+static void closeSocket(usock_handle_t hsock)
 {
 	/* Close the connection */
 	struct SockInfo *node = GET_SOCK_INFO_FROM_HANDLE(struct SockInfo, hsock);
-	if(node->socketfd)
-		close(node->socketfd);
+	unsigned shard = GET_SOCK_NODE_FROM_HANDLE(hsock)->shard;
+	int fd;
+	if(node->socketfd && GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp)
+		rudpFlush(hsock);
+	shmDetach(hsock);
+
+	/* Let go of the fd under the shard lock, so the TCP sampler never queries a reused one */
+	registryLock(shard);
+	fd = node->socketfd;
 	node->socketfd = 0;
+	registryUnlock(shard);
+	if(fd)
+		close(fd);
 }
 
 #elif __unix__ // all unices not caught above
@@ -587,10 +2760,9 @@ void usock_close_socket(usock_handle_t hsock)
 /*            COMMON CODE              */
 /***************************************/
 
-void printNodeList();
-
 usock_err_t usock_create_socket(const char *name, usock_handle_t *pOutSocket)
 {
+	TRACE_BEGIN(traceStart);
 	struct SockInfoNode *node = (struct SockInfoNode *)g_palloc(kSockNodeSize);
 	if(!node)
 	{
@@ -598,18 +2770,22 @@ usock_err_t usock_create_socket(const char *name, usock_handle_t *pOutSocket)
 		return USOCK_ERROR_OUT_OF_MEMORY;
 	}
 
-	initSockInfo(node, kSockNodeSize, name);
+	if(initSockInfo(node, kSockNodeSize, name) != USOCK_OK)
+	{
+		g_pfree(node);
+		*pOutSocket = NULL;
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	}
 	
 	*pOutSocket = (void*)node;
 
-	/* Debug code */
-	printNodeList();
-
+	TRACE_END(traceStart, USOCK_TRACE_CREATE, node, 0);
 	return USOCK_OK;
 }
 
 usock_err_t usock_create_socket_ex(const char *name, usock_size_t userBytes, usock_handle_t *pOutSocket, void **ppOutUserData)
 {
+	TRACE_BEGIN(traceStart);
 	struct SockInfoNode *node = (struct SockInfoNode *)g_palloc(kSockNodeSize + userBytes);
 	if(!node)
 	{
@@ -618,14 +2794,18 @@ usock_err_t usock_create_socket_ex(const char *name, usock_size_t userBytes, uso
 		return USOCK_ERROR_OUT_OF_MEMORY;
 	}
 
-	initSockInfo(node, kSockNodeSize + userBytes, name);
+	if(initSockInfo(node, kSockNodeSize + userBytes, name) != USOCK_OK)
+	{
+		g_pfree(node);
+		*pOutSocket = NULL;
+		*ppOutUserData = NULL;
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	}
 	
 	*pOutSocket    = (void*)node;
 	*ppOutUserData = (void*)((unsigned char *)node + kSockNodeSize);
 
-	/* Debug code */
-	printNodeList();
-
+	TRACE_END(traceStart, USOCK_TRACE_CREATE, node, 0);
 	return USOCK_OK;
 }
 
@@ -633,8 +2813,22 @@ void usock_free_socket(usock_handle_t hsock)
 {
 	struct SockInfoNode *node = (struct SockInfoNode *)hsock;
 	// struct SockInfo *node = (struct SockInfo *)hsock;
+	RegistryShard *shard;
+	TRACE_BEGIN(traceStart);
+
+	node->transport->destroy(hsock);
+	statsAttach(hsock, 0);
+	if(node->tstamp)
+		g_pfree(node->tstamp);
+	if(node->busyPoll)
+		g_pfree(node->busyPoll);
 
 	/* Detach the node from the list */
+	shard = &g_shards[node->shard];
+	registryLock(node->shard);
+	shard->nodes[node->registryIndex] = shard->nodes[--shard->count];
+	shard->nodes[node->registryIndex]->registryIndex = node->registryIndex;
+
 	if(node->prev)
 	{
 		node->prev->next = node->next;
@@ -644,47 +2838,581 @@ void usock_free_socket(usock_handle_t hsock)
 		node->next->prev = node->prev;
 	}
 
-	if(node == g_head && node == g_tail)
+	if(node == shard->head && node == shard->tail)
 	{
 		/* Freeing the last node */
-		g_head = g_tail = NULL;
+		shard->head = shard->tail = NULL;
 	}
-	else if(node == g_tail)
+	else if(node == shard->tail)
 	{
 		/* 
 		*  Freeing the tail node. 
 		*  Update tail pointer.
 		*/
-		g_tail = g_tail->prev;
+		shard->tail = shard->tail->prev;
 	}
-	else if(node == g_head)
+	else if(node == shard->head)
 	{
 		/* 
 		*  Freeing the head node. 
 		*  Update head pointer.
 		*/
-		g_head = g_head->next;
+		shard->head = shard->head->next;
 	}
+	registryUnlock(node->shard);
+	STAT_ADD(shard->liveSockets, -1);
 	
 	/* Free allocated node */
 	g_pfree(node);
 
-	/* Debug code */
-	printNodeList();
+	/* The handle is only an identifier from here on */
+	TRACE_END(traceStart, USOCK_TRACE_FREE, hsock, 0);
+}
+
+/***************************************/
+/*             Transports              */
+
+static void destroySocket(usock_handle_t hsock)
+{
+	rudpDestroy(hsock);
+	shmDestroy(hsock);
+}
+
+const Transport g_kernelTransport =
+{
+	"kernel",
+	configureSocket,
+	bindSocket,
+	listenSocket,
+	acceptSocket,
+	connectSocket,
+	sendSocket,
+	recvSocket,
+	setSocketNonblocking,
+	getSocketType,
+	closeSocket,
+	destroySocket
+};
+
+void usock_configure(usock_handle_t hsock, usock_domain_t domain, usock_socket_type_t type, usock_flags_t flags)
+{
+	struct SockInfoNode *node = GET_SOCK_NODE_FROM_HANDLE(hsock);
+	const Transport *transport = domain == USOCK_DOMAIN_MEMORY ? &g_memoryTransport : &g_kernelTransport;
+
+	/* Moving to another transport drops whatever the old one kept */
+	if(node->transport != transport)
+	{
+		node->transport->destroy(hsock);
+		node->transport = transport;
+	}
+	transport->configure(hsock, domain, type, flags);
+	statsAttach(hsock, flags & USOCK_OPTIONS_STATS);
+}
+
+usock_err_t usock_get_socket_type(usock_handle_t hsock, usock_socket_type_t *pOutType)
+{
+	return GET_TRANSPORT(hsock)->socketType(hsock, pOutType);
+}
+
+usock_err_t usock_set_nonblocking(usock_handle_t hsock, int enable)
+{
+	return GET_TRANSPORT(hsock)->setNonblocking(hsock, enable);
+}
+
+/***************************************/
+/*     Traced connection lifecycle     */
+
+usock_err_t usock_bind(usock_handle_t hsock, usock_port_t port)
+{
+	return usock_bind_address(hsock, NULL, port);
+}
+
+usock_err_t usock_bind_address(usock_handle_t hsock, const char *ip_address, usock_port_t port)
+{
+	usock_err_t err;
+	TRACE_BEGIN(traceStart);
+	err = GET_TRANSPORT(hsock)->bind(hsock, ip_address, port);
+	TRACE_END(traceStart, USOCK_TRACE_BIND, hsock, err);
+	return err;
+}
+
+usock_err_t usock_listen(usock_handle_t hsock, int backlog)
+{
+	usock_err_t err;
+	TRACE_BEGIN(traceStart);
+	err = GET_TRANSPORT(hsock)->listen(hsock, backlog);
+	TRACE_END(traceStart, USOCK_TRACE_LISTEN, hsock, err);
+	return err;
+}
+
+usock_err_t usock_accept(usock_handle_t hsock, usock_handle_t *pOutSock)
+{
+	usock_err_t err;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_ACCEPT);
+	err = GET_TRANSPORT(hsock)->accept(hsock, pOutSock);
+	LATENCY_END(sampleStart, USOCK_LATENCY_ACCEPT);
+	TRACE_END(traceStart, USOCK_TRACE_ACCEPT, hsock, err);
+	return err;
+}
+
+usock_err_t usock_connect(usock_handle_t hsock, const char *ip_address, usock_port_t port)
+{
+	usock_err_t err;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_CONNECT);
+	err = GET_TRANSPORT(hsock)->connect(hsock, ip_address, port);
+	LATENCY_END(sampleStart, USOCK_LATENCY_CONNECT);
+	TRACE_END(traceStart, USOCK_TRACE_CONNECT, hsock, err);
+	return err;
+}
+
+usock_err_t usock_connect_send(usock_handle_t hsock, const char *ip_address, usock_port_t port, const void *pBuffer, usock_size_t len, usock_size_t *pOutSent)
+{
+	usock_err_t err;
+	usock_ssize_t sent = -1;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_CONNECT);
+	if(GET_TRANSPORT(hsock) == &g_kernelTransport)
+		err = connectSendSocket(hsock, ip_address, port, pBuffer, len, &sent);
+	else if((err = GET_TRANSPORT(hsock)->connect(hsock, ip_address, port)) == USOCK_OK)
+		err = (sent = GET_TRANSPORT(hsock)->send(hsock, pBuffer, len, 0, NULL)) < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+	LATENCY_END(sampleStart, USOCK_LATENCY_CONNECT);
+	/* A failure here is usually the connect, so only sends that made it are counted */
+	if(err == USOCK_OK)
+		COUNT_SEND(hsock, len, sent);
+	TRACE_END(traceStart, USOCK_TRACE_CONNECT, hsock, err);
+	if(pOutSent)
+		*pOutSent = sent > 0 ? (usock_size_t)sent : 0;
+	return err;
+}
+
+void usock_close_socket(usock_handle_t hsock)
+{
+	TRACE_BEGIN(traceStart);
+	GET_TRANSPORT(hsock)->close(hsock);
+	TRACE_END(traceStart, USOCK_TRACE_CLOSE, hsock, 0);
+}
+
+/***************************************/
+/*           Batch connects            */
+
+/* A connect that's still in flight, next to its entry in the poll set */
+typedef struct PendingConnect
+{
+	usock_size_t index;
+	usock_size_t deadlineNs; /* 0 for no limit */
+} PendingConnect;
+
+static void connectBatchDone(usock_connect_request_t *pRequest, usock_err_t err, usock_size_t *pConnected)
+{
+	pRequest->result = err;
+	if(err == USOCK_OK)
+		++*pConnected;
+	else
+		GET_TRANSPORT(pRequest->hsock)->close(pRequest->hsock);
+}
+
+usock_size_t usock_connect_batch(usock_connect_request_t *pRequests, usock_size_t count)
+{
+	usock_pollfd_t *fds;
+	PendingConnect *pending;
+	usock_size_t pendingCount = 0, connected = 0, i;
+	int inFlight;
+	usock_err_t err;
+
+	if(!pRequests || count == 0)
+		return 0;
+
+	fds = (usock_pollfd_t *)g_palloc(sizeof(usock_pollfd_t) * count);
+	pending = (PendingConnect *)g_palloc(sizeof(PendingConnect) * count);
+	if(!fds || !pending)
+	{
+		for(i = 0; i < count; ++i)
+			pRequests[i].result = USOCK_ERROR_OUT_OF_MEMORY;
+		if(fds)
+			g_pfree(fds);
+		if(pending)
+			g_pfree(pending);
+		return 0;
+	}
+
+	/* Start everything before waiting on anything */
+	for(i = 0; i < count; ++i)
+	{
+		usock_connect_request_t *req = &pRequests[i];
+		usock_size_t startNs = usock_get_time_ns();
+
+		/* Only kernel connects take time to finish */
+		inFlight = 0;
+		if(GET_TRANSPORT(req->hsock) == &g_kernelTransport)
+			err = connectStart(req->hsock, req->ip_address, req->port, &inFlight);
+		else
+			err = GET_TRANSPORT(req->hsock)->connect(req->hsock, req->ip_address, req->port);
+		if(err != USOCK_OK || !inFlight)
+		{
+			connectBatchDone(req, err, &connected);
+			continue;
+		}
+
+		fds[pendingCount].hsock   = req->hsock;
+		fds[pendingCount].events  = USOCK_POLL_OUT;
+		fds[pendingCount].revents = 0;
+		pending[pendingCount].index      = i;
+		pending[pendingCount].deadlineNs = req->timeoutMs < 0 ? 0 : startNs + (usock_size_t)req->timeoutMs * 1000000ull;
+		++pendingCount;
+	}
+
+	while(pendingCount)
+	{
+		usock_size_t now = usock_get_time_ns();
+		usock_size_t nextNs = 0;
+		int timeoutMs = -1;
+		usock_ssize_t ready;
+
+		/* Expire what's overdue and find the next deadline; removal swaps in the last entry */
+		for(i = 0; i < pendingCount; )
+		{
+			usock_size_t deadline = pending[i].deadlineNs;
+			if(deadline && deadline <= now)
+			{
+				connectBatchDone(&pRequests[pending[i].index], USOCK_ERROR_TIMEOUT, &connected);
+				--pendingCount;
+				fds[i] = fds[pendingCount];
+				pending[i] = pending[pendingCount];
+				continue;
+			}
+			if(deadline && (!nextNs || deadline < nextNs))
+				nextNs = deadline;
+			++i;
+		}
+		if(!pendingCount)
+			break;
+
+		/* Round up, so we don't wake a little early and spin */
+		if(nextNs)
+			timeoutMs = (int)((nextNs - now + 999999) / 1000000);
+
+		ready = usock_poll(fds, pendingCount, timeoutMs);
+		if(ready < 0)
+		{
+			for(i = 0; i < pendingCount; ++i)
+				connectBatchDone(&pRequests[pending[i].index], USOCK_ERROR_INTERNAL, &connected);
+			break;
+		}
+
+		for(i = 0; ready > 0 && i < pendingCount; )
+		{
+			if(!fds[i].revents)
+			{
+				++i;
+				continue;
+			}
+			--ready;
+			connectBatchDone(&pRequests[pending[i].index], connectFinish(fds[i].hsock), &connected);
+			--pendingCount;
+			fds[i] = fds[pendingCount];
+			pending[i] = pending[pendingCount];
+		}
+	}
+
+	g_pfree(fds);
+	g_pfree(pending);
+	return connected;
+}
+
+/***************************************/
+/*            Deadline I/O             */
+
+/* Wait for the socket until the deadline; \return - >0 if ready, 0 on timeout, <0 on error */
+static int waitUntil(usock_handle_t hsock, unsigned short events, usock_size_t deadlineNs)
+{
+	usock_size_t now = usock_get_time_ns();
+	usock_pollfd_t fd;
+
+	fd.hsock = hsock;
+	fd.events = events;
+	fd.revents = 0;
+
+	/* Round up, so we don't wake a little early and spin */
+	return (int)usock_poll(&fd, 1, deadlineNs > now ? (int)((deadlineNs - now + 999999) / 1000000) : 0);
+}
+
+usock_err_t usock_recv_deadline(usock_handle_t hsock, void *pOutBuffer, usock_size_t buflen, usock_size_t deadlineNs, usock_size_t *pOutReceived)
+{
+	usock_ssize_t ret = -1;
+	usock_err_t err = USOCK_OK;
+	int ready;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_RECV);
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp || GET_SOCK_NODE_FROM_HANDLE(hsock)->shm ||
+	   GET_TRANSPORT(hsock) != &g_kernelTransport)
+		err = USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	/* Try first, data that's already waiting costs no poll */
+	while(err == USOCK_OK)
+	{
+		ret = tryRecv(hsock, pOutBuffer, buflen);
+		if(ret >= 0)
+			break;
+		if(!usock_would_block())
+			err = USOCK_ERROR_INTERNAL;
+		else if((ready = waitUntil(hsock, USOCK_POLL_IN, deadlineNs)) <= 0)
+			err = ready == 0 ? USOCK_ERROR_TIMEOUT : USOCK_ERROR_INTERNAL;
+	}
+
+	LATENCY_END(sampleStart, USOCK_LATENCY_RECV);
+	if(err != USOCK_ERROR_PROTOCOL_NOT_SUPPORTED)
+		COUNT_RECV(hsock, ret);
+	TRACE_END(traceStart, USOCK_TRACE_RECV, hsock, ret);
+	if(pOutReceived)
+		*pOutReceived = ret > 0 ? (usock_size_t)ret : 0;
+	return err;
+}
+
+usock_err_t usock_send_deadline(usock_handle_t hsock, const void *pBuffer, usock_size_t buflen, usock_size_t deadlineNs, usock_size_t *pOutSent)
+{
+	usock_size_t sent = 0;
+	usock_ssize_t ret;
+	usock_err_t err = USOCK_OK;
+	int ready;
+	TRACE_BEGIN(traceStart);
+	LATENCY_BEGIN(sampleStart, USOCK_LATENCY_SEND);
+
+	if(GET_SOCK_NODE_FROM_HANDLE(hsock)->rudp || GET_SOCK_NODE_FROM_HANDLE(hsock)->shm ||
+	   GET_TRANSPORT(hsock) != &g_kernelTransport)
+		err = USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	while(err == USOCK_OK)
+	{
+		ret = trySend(hsock, (const unsigned char *)pBuffer + sent, buflen - sent);
+		if(ret >= 0)
+		{
+			sent += (usock_size_t)ret;
+			if(sent == buflen)
+				break;
+		}
+		else if(!usock_would_block())
+			err = USOCK_ERROR_INTERNAL;
+		else if((ready = waitUntil(hsock, USOCK_POLL_OUT, deadlineNs)) <= 0)
+			err = ready == 0 ? USOCK_ERROR_TIMEOUT : USOCK_ERROR_INTERNAL;
+	}
+
+	ret = sent || err == USOCK_OK ? (usock_ssize_t)sent : -1;
+	LATENCY_END(sampleStart, USOCK_LATENCY_SEND);
+	if(err != USOCK_ERROR_PROTOCOL_NOT_SUPPORTED)
+		COUNT_SEND(hsock, buflen, ret);
+	TRACE_END(traceStart, USOCK_TRACE_SEND, hsock, ret);
+	if(pOutSent)
+		*pOutSent = sent;
+	return err;
+}
+
+/***************************************/
+/*          TCP info sampling          */
+
+/* Sockets picked per registry lock */
+#define TCP_SAMPLE_BATCH 128
+
+usock_err_t usock_get_tcp_info(usock_handle_t hsock, usock_tcp_info_t *pOutInfo)
+{
+	NativeSocket fd;
+	int listening;
+
+	if(!reliableNativeSocket(GET_SOCK_NODE_FROM_HANDLE(hsock), &fd))
+		return USOCK_ERROR_INVALID_ARG;
+	return tcpInfoFromNative(fd, pOutInfo, &listening);
 }
 
-void printNodeList()
+usock_size_t usock_sample_tcp_info(usock_tcp_sample_callback_t callback, void *pUserData)
 {
-	struct SockInfoNode *node = g_head;
-	while(node)
+	usock_tcp_sample_t samples[TCP_SAMPLE_BATCH];
+	usock_size_t pos = 0, total = 0, scanned, n;
+	unsigned s = 0;
+	int listening, done;
+	NativeSocket fd;
+	RegistryShard *shard;
+
+	while(s < REGISTRY_SHARDS)
 	{
-		/* printf("%s", node->name); */
-		/* TODO: Provide callback for debug printing */
-		if(node->next)
+		/* 
+		*  Query the kernel under the shard lock: freeing a node and closing
+		*  its socket both take it, so neither the node nor its descriptor
+		*  can go away, or the descriptor be reused, in the meantime.
+		*  Sockets freed between batches move an unvisited one into a
+		*  visited slot, so a walk can miss a socket.
+		*/
+		n = scanned = 0;
+		shard = &g_shards[s];
+		registryLock(s);
+		while(pos < shard->count && scanned < TCP_SAMPLE_BATCH)
+		{
+			struct SockInfoNode *node = shard->nodes[pos++];
+			++scanned;
+			if(!reliableNativeSocket(node, &fd))
+				continue;
+			if(tcpInfoFromNative(fd, &samples[n].info, &listening) != USOCK_OK || listening)
+				continue;
+			samples[n++].hsock = node;
+		}
+		done = pos >= shard->count;
+		registryUnlock(s);
+		if(done)
+		{
+			++s;
+			pos = 0;
+		}
+
+		/* The callback runs unlocked, so it's free to create or free sockets */
+		if(n)
+			callback(samples, n, pUserData);
+		total += n;
+	}
+
+	return total;
+}
+
+/***************************************/
+/*          Socket counters            */
+
+#define STATS_FIELD_COUNT (sizeof(usock_stats_t) / sizeof(usock_size_t))
+
+void statsAttach(usock_handle_t hsock, int enable)
+{
+	struct SockInfoNode *node = GET_SOCK_NODE_FROM_HANDLE(hsock);
+	usock_size_t *retired = (usock_size_t *)&g_shards[node->shard].retiredStats;
+	usock_size_t *counters;
+	size_t i;
+
+	if(enable && !node->stats)
+	{
+		node->stats = (usock_stats_t *)g_palloc(sizeof(usock_stats_t));
+		if(node->stats)
+			memset(node->stats, 0, sizeof(usock_stats_t));
+	}
+	else if(!enable && node->stats)
+	{
+		/* Keep the totals, so the aggregate never goes backwards */
+		counters = (usock_size_t *)node->stats;
+		registryLock(node->shard);
+		for(i = 0; i < STATS_FIELD_COUNT; ++i)
+			retired[i] += STAT_LOAD(counters[i]);
+		node->stats = NULL;
+		registryUnlock(node->shard);
+		g_pfree(counters);
+	}
+}
+
+static void statsOnError(usock_size_t *wouldBlock, usock_size_t *errors)
+{
+	if(usock_would_block())
+		STAT_ADD(*wouldBlock, 1);
+	else
+		STAT_ADD(*errors, 1);
+}
+
+void statsOnSend(usock_stats_t *stats, usock_size_t requested, usock_ssize_t ret)
+{
+	STAT_ADD(stats->sendCalls, 1);
+	if(ret < 0)
+	{
+		statsOnError(&stats->sendWouldBlock, &stats->sendErrors);
+		return;
+	}
+
+	STAT_ADD(stats->bytesSent, (usock_size_t)ret);
+	STAT_ADD(stats->messagesSent, 1);
+	if((usock_size_t)ret < requested)
+		STAT_ADD(stats->shortWrites, 1);
+}
+
+void statsOnSendBatch(usock_stats_t *stats, const usock_msg_t *pMsgs, usock_size_t count, usock_ssize_t ret)
+{
+	usock_size_t i, bytes = 0;
+
+	STAT_ADD(stats->sendCalls, 1);
+	if(ret < 0)
+	{
+		statsOnError(&stats->sendWouldBlock, &stats->sendErrors);
+		return;
+	}
+
+	for(i = 0; i < (usock_size_t)ret; ++i)
+		bytes += pMsgs[i].len;
+	STAT_ADD(stats->bytesSent, bytes);
+	STAT_ADD(stats->messagesSent, (usock_size_t)ret);
+	if((usock_size_t)ret < count)
+		STAT_ADD(stats->shortWrites, 1);
+}
+
+void statsOnRecv(usock_stats_t *stats, usock_ssize_t ret)
+{
+	STAT_ADD(stats->recvCalls, 1);
+	if(ret < 0)
+	{
+		statsOnError(&stats->recvWouldBlock, &stats->recvErrors);
+		return;
+	}
+
+	STAT_ADD(stats->bytesReceived, (usock_size_t)ret);
+	if(ret > 0)
+		STAT_ADD(stats->messagesReceived, 1);
+}
+
+usock_err_t usock_get_stats(usock_handle_t hsock, usock_stats_t *pOutStats)
+{
+	struct SockInfoNode *node = GET_SOCK_NODE_FROM_HANDLE(hsock);
+	usock_size_t *counters = (usock_size_t *)node->stats;
+	usock_size_t *out = (usock_size_t *)pOutStats;
+	size_t i;
+
+	if(!counters)
+	{
+		memset(pOutStats, 0, sizeof(usock_stats_t));
+		return USOCK_ERROR_NOT_INITIALIZED;
+	}
+
+	for(i = 0; i < STATS_FIELD_COUNT; ++i)
+		out[i] = STAT_LOAD(counters[i]);
+	return USOCK_OK;
+}
+
+void usock_reset_stats(usock_handle_t hsock)
+{
+	usock_size_t *counters = (usock_size_t *)GET_SOCK_NODE_FROM_HANDLE(hsock)->stats;
+	size_t i;
+
+	if(!counters)
+		return;
+	for(i = 0; i < STATS_FIELD_COUNT; ++i)
+		STAT_STORE(counters[i], 0);
+}
+
+void usock_get_aggregate_stats(usock_stats_t *pOutStats)
+{
+	usock_size_t *out = (usock_size_t *)pOutStats;
+	usock_size_t *counters;
+	struct SockInfoNode *node;
+	unsigned s;
+	size_t i;
+
+	memset(pOutStats, 0, sizeof(usock_stats_t));
+	for(s = 0; s < REGISTRY_SHARDS; ++s)
+	{
+		registryLock(s);
+		counters = (usock_size_t *)&g_shards[s].retiredStats;
+		for(i = 0; i < STATS_FIELD_COUNT; ++i)
+			out[i] += counters[i];
+		for(node = g_shards[s].head; node; node = node->next)
 		{
-			/* printf("->"); */
+			counters = (usock_size_t *)node->stats;
+			if(!counters)
+				continue;
+			for(i = 0; i < STATS_FIELD_COUNT; ++i)
+				out[i] += STAT_LOAD(counters[i]);
 		}
-		node = node->next;
+		registryUnlock(s);
 	}
-	/* printf("\n"); */
 }
+
@@ -0,0 +1,304 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_fanout.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace usock
+{
+	// Max buffers handed to a single gathered write
+	static constexpr size_t kMaxIov = 64;
+
+	void payload::ref::reset()
+	{
+		if(m_ptr && m_ptr->m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			m_ptr->~payload();
+			std::free(m_ptr);
+		}
+		m_ptr = nullptr;
+	}
+
+	payload::ref payload::create(const void *data, size_t size)
+	{
+		// Header and data share one allocation
+		void *mem = std::malloc(offsetof(payload, m_data) + (size ? size : 1));
+		if(!mem)
+			throw std::bad_alloc();
+
+		payload *p = new (mem) payload(size);
+		std::memcpy(p->m_data, data, size);
+		return ref(p);
+	}
+
+	fanout::fanout() : fanout(limits()) {}
+
+	fanout::fanout(const limits &lim) : m_limits(lim) {}
+
+	fanout::~fanout()
+	{
+		for(auto &sub : m_subscribers)
+			delete sub.second;
+		free_retired();
+	}
+
+	void fanout::set_evict_callback(evict_callback callback)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_onEvict = std::move(callback);
+	}
+
+	err_t fanout::subscribe(const std::string &topic, handle_t hsock)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		subscriber *&sub = m_subscribers[hsock];
+		if(!sub)
+		{
+			err_t err = usock_set_nonblocking(hsock, 1);
+			if(err != USOCK_OK)
+			{
+				m_subscribers.erase(hsock);
+				return err;
+			}
+			sub = new subscriber;
+			sub->hsock = hsock;
+		}
+
+		subscriber_list &list = m_topics[topic];
+		if(std::find(list.begin(), list.end(), sub) == list.end())
+		{
+			list.push_back(sub);
+			++sub->topicCount;
+		}
+		return USOCK_OK;
+	}
+
+	void fanout::unsubscribe(const std::string &topic, handle_t hsock)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto sub = m_subscribers.find(hsock);
+		auto list = m_topics.find(topic);
+		if(sub == m_subscribers.end() || list == m_topics.end())
+			return;
+
+		auto it = std::find(list->second.begin(), list->second.end(), sub->second);
+		if(it == list->second.end())
+			return;
+
+		list->second.erase(it);
+		if(list->second.empty())
+			m_topics.erase(list);
+
+		// Keep the subscriber around until its queue is drained
+		if(--sub->second->topicCount == 0 && sub->second->queue.empty())
+		{
+			drop_subscriber(*sub->second);
+			free_retired();
+		}
+	}
+
+	void fanout::remove(handle_t hsock)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto sub = m_subscribers.find(hsock);
+		if(sub != m_subscribers.end())
+		{
+			drop_subscriber(*sub->second);
+			free_retired();
+		}
+	}
+
+	size_t fanout::publish(const std::string &topic, const void *data, size_t size)
+	{
+		return publish(topic, payload::create(data, size));
+	}
+
+	size_t fanout::publish(const std::string &topic, const payload::ref &msg)
+	{
+		std::vector<handle_t> evicted;
+		size_t queued = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			auto list = m_topics.find(topic);
+			if(list == m_topics.end())
+				return 0;
+
+			// Copy the list, eviction modifies it
+			subscriber_list subs = list->second;
+			for(subscriber *sub : subs)
+			{
+				if(sub->evicted)
+					continue;
+
+				sub->queue.push_back(entry{ msg, 0 });
+				sub->queuedBytes += msg->size();
+				++queued;
+
+				if(!write_queued(*sub) ||
+				   sub->queuedBytes > m_limits.maxQueuedBytes ||
+				   sub->queue.size() > m_limits.maxQueuedMessages)
+				{
+					evict(*sub, evicted);
+				}
+			}
+		}
+
+		run_evict_callbacks(evicted);
+		return queued;
+	}
+
+	size_t fanout::flush()
+	{
+		std::vector<handle_t> evicted;
+		size_t pending = 0;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			std::vector<subscriber *> subs;
+			subs.reserve(m_subscribers.size());
+			for(auto &sub : m_subscribers)
+				subs.push_back(sub.second);
+
+			for(subscriber *sub : subs)
+			{
+				if(sub->evicted)
+					continue;
+				if(!write_queued(*sub))
+				{
+					evict(*sub, evicted);
+					continue;
+				}
+
+				if(sub->queue.empty() && sub->topicCount == 0)
+					drop_subscriber(*sub);
+				else
+					pending += sub->queuedBytes;
+			}
+		}
+
+		run_evict_callbacks(evicted);
+		return pending;
+	}
+
+	size_t fanout::subscriber_count(const std::string &topic) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto list = m_topics.find(topic);
+		return list == m_topics.end() ? 0 : list->second.size();
+	}
+
+	bool fanout::write_queued(subscriber &sub)
+	{
+		usock_iovec_t iov[kMaxIov];
+
+		while(!sub.queue.empty())
+		{
+			// Gather as many queued messages as fit in one write
+			size_t n = 0;
+			for(auto it = sub.queue.begin(); it != sub.queue.end() && n < kMaxIov; ++it, ++n)
+			{
+				iov[n].pBuffer = static_cast<const unsigned char *>(it->msg->data()) + it->offset;
+				iov[n].len     = it->msg->size() - it->offset;
+			}
+
+			usock_ssize_t sent = usock_sendv(sub.hsock, iov, n);
+			if(sent < 0)
+				return usock_would_block() != 0;
+
+			// Retire whatever was fully written
+			size_t left = static_cast<size_t>(sent);
+			sub.queuedBytes -= left;
+			while(left > 0)
+			{
+				entry &front = sub.queue.front();
+				size_t remaining = front.msg->size() - front.offset;
+				if(left < remaining)
+				{
+					front.offset += left;
+					return true; // Short write, the socket buffer is full
+				}
+				left -= remaining;
+				sub.queue.pop_front();
+			}
+			// Zero length messages have nothing to write
+			while(!sub.queue.empty() && sub.queue.front().msg->size() == sub.queue.front().offset)
+				sub.queue.pop_front();
+		}
+		return true;
+	}
+
+	void fanout::evict(subscriber &sub, std::vector<handle_t> &evicted)
+	{
+		evicted.push_back(sub.hsock);
+		drop_subscriber(sub);
+	}
+
+	void fanout::drop_subscriber(subscriber &sub)
+	{
+		for(auto it = m_topics.begin(); it != m_topics.end();)
+		{
+			subscriber_list &list = it->second;
+			list.erase(std::remove(list.begin(), list.end(), &sub), list.end());
+			if(list.empty())
+				it = m_topics.erase(it);
+			else
+				++it;
+		}
+
+		// Mark it, callers may still hold a pointer in a copied list
+		sub.evicted = true;
+		m_subscribers.erase(sub.hsock);
+		m_retired.push_back(&sub);
+	}
+
+	void fanout::free_retired()
+	{
+		for(subscriber *sub : m_retired)
+			delete sub;
+		m_retired.clear();
+	}
+
+	void fanout::run_evict_callbacks(const std::vector<handle_t> &evicted)
+	{
+		evict_callback callback;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			callback = m_onEvict;
+			free_retired();
+		}
+
+		for(handle_t hsock : evicted)
+		{
+			if(callback)
+				callback(hsock);
+			else
+				usock_close_socket(hsock);
+		}
+	}
+}
@@ -0,0 +1,542 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_frame.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define USOCK_CRC32C_X64 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define TARGET_SSE42
+#else
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/***************************************/
+/*              CRC32C                 */
+/***************************************/
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78u
+
+/* Block sizes for the three way interleaved hardware loop */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *data, size_t len);
+
+static uint32_t g_crcTable[8][256];
+static crc32c_fn g_crcImpl;
+static const char *g_crcName;
+
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t len)
+{
+	crc = ~crc;
+
+	while(len && ((uintptr_t)data & 7))
+	{
+		crc = g_crcTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		--len;
+	}
+
+	/* Slicing by 8 */
+	while(len >= 8)
+	{
+		uint32_t lo = crc ^ ((uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+		uint32_t hi = (uint32_t)data[4] | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+		crc = g_crcTable[7][lo & 0xFF] ^ g_crcTable[6][(lo >> 8) & 0xFF] ^
+		      g_crcTable[5][(lo >> 16) & 0xFF] ^ g_crcTable[4][lo >> 24] ^
+		      g_crcTable[3][hi & 0xFF] ^ g_crcTable[2][(hi >> 8) & 0xFF] ^
+		      g_crcTable[1][(hi >> 16) & 0xFF] ^ g_crcTable[0][hi >> 24];
+		data += 8;
+		len -= 8;
+	}
+
+	while(len--)
+		crc = g_crcTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+#ifdef USOCK_CRC32C_X64
+
+/*
+* Tables that advance a CRC over CRC32C_LONG or CRC32C_SHORT zero bytes.
+* They let three independent crc32 streams be merged, which hides the
+* latency of the crc32 instruction.
+*/
+static uint32_t g_crcLong[4][256];
+static uint32_t g_crcShort[4][256];
+
+static uint32_t gf2MatrixTimes(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+	while(vec)
+	{
+		if(vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		++mat;
+	}
+	return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+	for(n = 0; n < 32; ++n)
+		square[n] = gf2MatrixTimes(mat, mat[n]);
+}
+
+/* Build the operator that applies len zero bytes; len must be a power of two */
+static void crc32cZerosOp(uint32_t *even, size_t len)
+{
+	uint32_t odd[32];
+	uint32_t row = 1;
+	int n;
+
+	odd[0] = CRC32C_POLY; /* One zero bit */
+	for(n = 1; n < 32; ++n)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	gf2MatrixSquare(even, odd); /* Two zero bits */
+	gf2MatrixSquare(odd, even); /* Four zero bits */
+
+	/* Each square doubles the number of zero bits, starting from one byte */
+	do
+	{
+		gf2MatrixSquare(even, odd);
+		len >>= 1;
+		if(len == 0)
+			return;
+		gf2MatrixSquare(odd, even);
+		len >>= 1;
+	} while(len);
+
+	for(n = 0; n < 32; ++n)
+		even[n] = odd[n];
+}
+
+static void crc32cZeros(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t op[32];
+	uint32_t n;
+
+	crc32cZerosOp(op, len);
+	for(n = 0; n < 256; ++n)
+	{
+		zeros[0][n] = gf2MatrixTimes(op, n);
+		zeros[1][n] = gf2MatrixTimes(op, n << 8);
+		zeros[2][n] = gf2MatrixTimes(op, n << 16);
+		zeros[3][n] = gf2MatrixTimes(op, n << 24);
+	}
+}
+
+static uint32_t crc32cShift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+	       zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+static uint64_t load64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+TARGET_SSE42
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t len)
+{
+	uint64_t crc0 = ~crc, crc1, crc2;
+	const unsigned char *end;
+
+	while(len && ((uintptr_t)data & 7))
+	{
+		crc0 = _mm_crc32_u8((uint32_t)crc0, *data++);
+		--len;
+	}
+
+	/* Three streams over consecutive blocks, merged with the shift tables */
+	while(len >= CRC32C_LONG * 3)
+	{
+		crc1 = crc2 = 0;
+		end = data + CRC32C_LONG;
+		do
+		{
+			crc0 = _mm_crc32_u64(crc0, load64(data));
+			crc1 = _mm_crc32_u64(crc1, load64(data + CRC32C_LONG));
+			crc2 = _mm_crc32_u64(crc2, load64(data + CRC32C_LONG * 2));
+			data += 8;
+		} while(data < end);
+		crc0 = crc32cShift(g_crcLong, (uint32_t)crc0) ^ (uint32_t)crc1;
+		crc0 = crc32cShift(g_crcLong, (uint32_t)crc0) ^ (uint32_t)crc2;
+		data += CRC32C_LONG * 2;
+		len -= CRC32C_LONG * 3;
+	}
+
+	while(len >= CRC32C_SHORT * 3)
+	{
+		crc1 = crc2 = 0;
+		end = data + CRC32C_SHORT;
+		do
+		{
+			crc0 = _mm_crc32_u64(crc0, load64(data));
+			crc1 = _mm_crc32_u64(crc1, load64(data + CRC32C_SHORT));
+			crc2 = _mm_crc32_u64(crc2, load64(data + CRC32C_SHORT * 2));
+			data += 8;
+		} while(data < end);
+		crc0 = crc32cShift(g_crcShort, (uint32_t)crc0) ^ (uint32_t)crc1;
+		crc0 = crc32cShift(g_crcShort, (uint32_t)crc0) ^ (uint32_t)crc2;
+		data += CRC32C_SHORT * 2;
+		len -= CRC32C_SHORT * 3;
+	}
+
+	while(len >= 8)
+	{
+		crc0 = _mm_crc32_u64(crc0, load64(data));
+		data += 8;
+		len -= 8;
+	}
+
+	while(len--)
+		crc0 = _mm_crc32_u8((uint32_t)crc0, *data++);
+
+	return ~(uint32_t)crc0;
+}
+
+static int cpuHasSse42()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] >> 20) & 1;
+#else
+	unsigned eax, ebx, ecx, edx;
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_SSE4_2) != 0;
+#endif
+}
+
+#endif /* USOCK_CRC32C_X64 */
+
+static void initCrc32c()
+{
+	uint32_t n, k, crc;
+
+	for(n = 0; n < 256; ++n)
+	{
+		crc = n;
+		for(k = 0; k < 8; ++k)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		g_crcTable[0][n] = crc;
+	}
+	for(n = 0; n < 256; ++n)
+	{
+		crc = g_crcTable[0][n];
+		for(k = 1; k < 8; ++k)
+		{
+			crc = g_crcTable[0][crc & 0xFF] ^ (crc >> 8);
+			g_crcTable[k][n] = crc;
+		}
+	}
+
+	g_crcImpl = crc32cSoftware;
+	g_crcName = "software";
+
+#ifdef USOCK_CRC32C_X64
+	if(cpuHasSse42())
+	{
+		crc32cZeros(g_crcLong, CRC32C_LONG);
+		crc32cZeros(g_crcShort, CRC32C_SHORT);
+		g_crcImpl = crc32cSse42;
+		g_crcName = "sse4.2";
+	}
+#endif
+}
+
+#ifdef _WIN32
+static INIT_ONCE g_crcOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK initCrc32cOnce(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	initCrc32c();
+	return TRUE;
+}
+
+static void ensureCrc32c()
+{
+	InitOnceExecuteOnce(&g_crcOnce, initCrc32cOnce, NULL, NULL);
+}
+#else
+static pthread_once_t g_crcOnce = PTHREAD_ONCE_INIT;
+
+static void ensureCrc32c()
+{
+	pthread_once(&g_crcOnce, initCrc32c);
+}
+#endif
+
+unsigned usock_crc32c(unsigned crc, const void *data, usock_size_t len)
+{
+	ensureCrc32c();
+	return g_crcImpl(crc, (const unsigned char *)data, (size_t)len);
+}
+
+const char *usock_crc32c_implementation()
+{
+	ensureCrc32c();
+	return g_crcName;
+}
+
+/***************************************/
+/*              Framing                */
+/***************************************/
+
+#define FRAME_CRC_BIT     0x80000000u
+#define FRAME_DRAIN_CHUNK 4096
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+usock_err_t usock_send_frame(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags)
+{
+	unsigned char header[USOCK_FRAME_HEADER_SIZE];
+	usock_iovec_t iov[2];
+	usock_size_t total = USOCK_FRAME_HEADER_SIZE + len;
+	usock_size_t sent = 0;
+	usock_socket_type_t type;
+	usock_ssize_t ret;
+
+	if(len > USOCK_FRAME_MAX_SIZE)
+		return USOCK_ERROR_INVALID_ARG;
+
+	put32(header, (uint32_t)len | ((flags & USOCK_FRAME_CRC32C) ? FRAME_CRC_BIT : 0));
+	put32(header + 4, (flags & USOCK_FRAME_CRC32C) ? usock_crc32c(0, pBuffer, len) : 0);
+
+	if(usock_get_socket_type(hsock, &type) != USOCK_OK)
+		return USOCK_ERROR_INVALID_ARG;
+
+	/* Reliable datagrams are sent whole, so stage the frame in one message */
+	if(type == USOCK_SOCKTYPE_RELIABLE_DATAGRAM)
+	{
+		unsigned char message[USOCK_RUDP_MAX_MESSAGE_SIZE];
+		if(total > sizeof(message))
+			return USOCK_ERROR_INVALID_ARG;
+		memcpy(message, header, USOCK_FRAME_HEADER_SIZE);
+		memcpy(message + USOCK_FRAME_HEADER_SIZE, pBuffer, len);
+		return usock_send(hsock, message, total) < 0 ? USOCK_ERROR_INTERNAL : USOCK_OK;
+	}
+
+	/* Header and payload go out in one gathered write */
+	while(sent < total)
+	{
+		int n = 0;
+		if(sent < USOCK_FRAME_HEADER_SIZE)
+		{
+			iov[n].pBuffer = header + sent;
+			iov[n].len     = USOCK_FRAME_HEADER_SIZE - sent;
+			++n;
+			iov[n].pBuffer = pBuffer;
+			iov[n].len     = len;
+			++n;
+		}
+		else
+		{
+			iov[n].pBuffer = (const unsigned char *)pBuffer + (sent - USOCK_FRAME_HEADER_SIZE);
+			iov[n].len     = total - sent;
+			++n;
+		}
+
+		ret = usock_sendv(hsock, iov, n);
+		if(ret < 0)
+			return USOCK_ERROR_INTERNAL;
+		sent += (usock_size_t)ret;
+	}
+
+	return USOCK_OK;
+}
+
+/* Receive exactly len bytes from a stream, checksumming each chunk as it lands */
+static usock_err_t recvExact(usock_handle_t hsock, unsigned char *pBuffer, usock_size_t len, unsigned *pCrc)
+{
+	usock_size_t got = 0;
+	usock_ssize_t ret;
+
+	while(got < len)
+	{
+		ret = usock_recv(hsock, pBuffer + got, len - got);
+		if(ret == 0)
+			return USOCK_ERROR_CONNECTION_CLOSED;
+		if(ret < 0)
+			return USOCK_ERROR_INTERNAL;
+
+		/* The chunk is still in cache, so this doesn't cost a second pass */
+		if(pCrc)
+			*pCrc = usock_crc32c(*pCrc, pBuffer + got, (usock_size_t)ret);
+		got += (usock_size_t)ret;
+	}
+	return USOCK_OK;
+}
+
+static usock_err_t recvStreamFrame(usock_handle_t hsock, void *pBuffer, usock_size_t buflen, usock_size_t *pOutLen)
+{
+	unsigned char header[USOCK_FRAME_HEADER_SIZE];
+	unsigned char drain[FRAME_DRAIN_CHUNK];
+	uint32_t word, expected;
+	usock_size_t len, left;
+	unsigned crc = 0;
+	int hasCrc;
+	usock_err_t err;
+
+	err = recvExact(hsock, header, USOCK_FRAME_HEADER_SIZE, NULL);
+	if(err != USOCK_OK)
+		return err;
+
+	word     = get32(header);
+	expected = get32(header + 4);
+	hasCrc   = (word & FRAME_CRC_BIT) != 0;
+	len      = word & ~FRAME_CRC_BIT;
+	*pOutLen = len;
+
+	if(len > buflen)
+	{
+		/* Skip the payload so the next frame starts in the right place */
+		for(left = len; left > 0; left -= len)
+		{
+			len = left < FRAME_DRAIN_CHUNK ? left : FRAME_DRAIN_CHUNK;
+			err = recvExact(hsock, drain, len, NULL);
+			if(err != USOCK_OK)
+				return err;
+		}
+		return USOCK_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	err = recvExact(hsock, (unsigned char *)pBuffer, len, hasCrc ? &crc : NULL);
+	if(err != USOCK_OK)
+		return err;
+
+	return hasCrc && crc != expected ? USOCK_ERROR_CHECKSUM_MISMATCH : USOCK_OK;
+}
+
+static usock_err_t checkDatagramFrame(const unsigned char *header, const void *pBuffer, usock_size_t buflen, usock_ssize_t ret, usock_size_t *pOutLen)
+{
+	uint32_t word;
+	usock_size_t len;
+
+	if(ret < 0)
+		return USOCK_ERROR_INTERNAL;
+	if(ret < USOCK_FRAME_HEADER_SIZE)
+		return USOCK_ERROR_INVALID_ARG;
+
+	word = get32(header);
+	len  = word & ~FRAME_CRC_BIT;
+	*pOutLen = len;
+
+	if(len > buflen)
+		return USOCK_ERROR_BUFFER_TOO_SMALL;
+	if((usock_size_t)ret - USOCK_FRAME_HEADER_SIZE != len)
+		return USOCK_ERROR_INVALID_ARG;
+
+	if((word & FRAME_CRC_BIT) && usock_crc32c(0, pBuffer, len) != get32(header + 4))
+		return USOCK_ERROR_CHECKSUM_MISMATCH;
+	return USOCK_OK;
+}
+
+static usock_err_t recvReliableDatagramFrame(usock_handle_t hsock, void *pBuffer, usock_size_t buflen, usock_size_t *pOutLen)
+{
+	unsigned char message[USOCK_RUDP_MAX_MESSAGE_SIZE];
+	usock_ssize_t ret = usock_recv(hsock, message, sizeof(message));
+	usock_size_t len;
+	usock_err_t err;
+
+	err = checkDatagramFrame(message, message + USOCK_FRAME_HEADER_SIZE, buflen, ret, pOutLen);
+	len = *pOutLen <= buflen ? *pOutLen : 0;
+	if(err == USOCK_OK || err == USOCK_ERROR_CHECKSUM_MISMATCH)
+		memcpy(pBuffer, message + USOCK_FRAME_HEADER_SIZE, len);
+	return err;
+}
+
+static usock_err_t recvDatagramFrame(usock_handle_t hsock, void *pBuffer, usock_size_t buflen, usock_size_t *pOutLen)
+{
+	unsigned char header[USOCK_FRAME_HEADER_SIZE];
+	usock_iovec_t iov[2];
+	usock_ssize_t ret;
+
+	/* Scatter the header and payload straight into place */
+	iov[0].pBuffer = header;
+	iov[0].len     = USOCK_FRAME_HEADER_SIZE;
+	iov[1].pBuffer = pBuffer;
+	iov[1].len     = buflen;
+
+	ret = usock_recvv(hsock, iov, 2);
+	return checkDatagramFrame(header, pBuffer, buflen, ret, pOutLen);
+}
+
+usock_err_t usock_recv_frame(usock_handle_t hsock, void *pBuffer, usock_size_t buflen, usock_size_t *pOutLen)
+{
+	usock_socket_type_t type;
+	usock_size_t len = 0;
+	usock_err_t err;
+
+	err = usock_get_socket_type(hsock, &type);
+	if(err != USOCK_OK)
+		return err;
+
+	if(type == USOCK_SOCKTYPE_FAST)
+		err = recvDatagramFrame(hsock, pBuffer, buflen, &len);
+	else if(type == USOCK_SOCKTYPE_RELIABLE_DATAGRAM)
+		err = recvReliableDatagramFrame(hsock, pBuffer, buflen, &len);
+	else
+		err = recvStreamFrame(hsock, pBuffer, buflen, &len);
+
+	if(pOutLen)
+		*pOutLen = len;
+	return err;
+}
@@ -0,0 +1,270 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+#ifndef USOCK_INTERNAL_H
+#define USOCK_INTERNAL_H
+
+/*
+* Declarations shared between the core usock modules.
+* Nothing in here is part of the public API.
+*/
+
+#include <usock.h>
+
+#define MAX_SOCKET_NAME_LEN 32
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+struct RudpState;
+struct TimestampState;
+struct BusyPollState;
+struct ShmState;
+struct MemoryState;
+struct Transport;
+
+typedef struct SockInfoNode
+{
+	char name[MAX_SOCKET_NAME_LEN];
+	struct SockInfoNode *prev, *next;
+	size_t blockSize;
+	/* Carries the socket's calls, kernel sockets unless configured otherwise */
+	const struct Transport *transport;
+	/* Endpoint state for USOCK_DOMAIN_MEMORY sockets */
+	struct MemoryState *memory;
+	/* Protocol state for USOCK_SOCKTYPE_RELIABLE_DATAGRAM sockets */
+	struct RudpState *rudp;
+	/* Traffic counters, only allocated with USOCK_OPTIONS_STATS */
+	usock_stats_t *stats;
+	/* Send times awaiting their transmit stamps, with transmit timestamping on */
+	struct TimestampState *tstamp;
+	/* Spin budget and counters, with busy polling on */
+	struct BusyPollState *busyPoll;
+	/* Ring pair for USOCK_SOCKTYPE_SHARED_MEMORY sockets */
+	struct ShmState *shm;
+	/* Registry shard it was created in, and its position in the shard's nodes */
+	unsigned shard;
+	usock_size_t registryIndex;
+} SockInfoNode;
+
+#define GET_SOCK_INFO_FROM_HANDLE(SOCKINFO_T, HSOCK) (SOCKINFO_T*)(((unsigned char*)HSOCK) + sizeof(SockInfoNode))
+#define GET_SOCK_NODE_FROM_HANDLE(HSOCK) ((SockInfoNode *)(HSOCK))
+#define GET_TRANSPORT(HSOCK) (GET_SOCK_NODE_FROM_HANDLE(HSOCK)->transport)
+
+/***************************************/
+/*        Allocator functions          */
+extern usock_palloc_t g_palloc;
+extern usock_pfree_t  g_pfree;
+
+/***************************************/
+/*        Socket node registry         */
+/*   (lock implemented per platform)   */
+
+/*
+* The registry is split into shards, each with its own lock, so threads
+* creating and freeing sockets don't contend. A thread works in one shard
+* (see threadShard), and a socket stays in the shard it was created in.
+*/
+#define REGISTRY_SHARDS USOCK_REGISTRY_SHARDS
+
+typedef struct RegistryShard
+{
+	struct SockInfoNode *head;
+	struct SockInfoNode *tail;
+	/* The same nodes in a dense array, for walks that drop the lock in between */
+	struct SockInfoNode **nodes;
+	usock_size_t count;
+	usock_size_t capacity;
+	/* Counters of sockets that have been freed */
+	usock_stats_t retiredStats;
+	/* Gauges updated with STAT_ADD; only their sum over the shards means anything */
+	usock_size_t liveSockets;
+	usock_size_t allocatedBytes;
+	/* Keeps the next shard off these cache lines */
+	unsigned char pad[64];
+} RegistryShard;
+
+extern RegistryShard g_shards[REGISTRY_SHARDS];
+
+void registryLock(unsigned shard);
+void registryUnlock(unsigned shard);
+
+/* The calling thread's shard, handed out round robin unless it picked one */
+unsigned threadShard();
+
+/* Sums over the shards, for metrics */
+usock_size_t registryLiveSockets();
+usock_size_t registryAllocatedBytes();
+
+/***************************************/
+/*          Socket counters            */
+
+/* Relaxed atomics: counters only need to be exact, not ordered */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define STAT_ADD(FIELD, VALUE) _InterlockedExchangeAdd64((volatile __int64 *)&(FIELD), (__int64)(VALUE))
+#define STAT_LOAD(FIELD)       ((usock_size_t)_InterlockedOr64((volatile __int64 *)&(FIELD), 0))
+#define STAT_STORE(FIELD, VALUE) _InterlockedExchange64((volatile __int64 *)&(FIELD), (__int64)(VALUE))
+#else
+#define STAT_ADD(FIELD, VALUE) __atomic_fetch_add(&(FIELD), (VALUE), __ATOMIC_RELAXED)
+#define STAT_LOAD(FIELD)       __atomic_load_n(&(FIELD), __ATOMIC_RELAXED)
+#define STAT_STORE(FIELD, VALUE) __atomic_store_n(&(FIELD), (VALUE), __ATOMIC_RELAXED)
+#endif
+
+/* Allocate or drop the counters of a socket */
+void statsAttach(usock_handle_t hsock, int enable);
+
+/* Record the outcome of a call; these must run before errno is touched */
+void statsOnSend(usock_stats_t *stats, usock_size_t requested, usock_ssize_t ret);
+void statsOnSendBatch(usock_stats_t *stats, const usock_msg_t *pMsgs, usock_size_t count, usock_ssize_t ret);
+void statsOnRecv(usock_stats_t *stats, usock_ssize_t ret);
+
+#define COUNT_SEND(HSOCK, REQUESTED, RET) \
+	do { usock_stats_t *s_ = GET_SOCK_NODE_FROM_HANDLE(HSOCK)->stats; if(s_) statsOnSend(s_, (REQUESTED), (RET)); } while(0)
+#define COUNT_RECV(HSOCK, RET) \
+	do { usock_stats_t *s_ = GET_SOCK_NODE_FROM_HANDLE(HSOCK)->stats; if(s_) statsOnRecv(s_, (RET)); } while(0)
+
+/***************************************/
+/*            Event tracing            */
+/*           (usock_trace.c)           */
+
+/* Plain flag read on every call, so disabled tracing costs one branch */
+extern volatile int g_traceEnabled;
+
+/* Record a finished call into the calling thread's ring; keeps errno */
+void traceRecord(unsigned event, usock_handle_t hsock, usock_size_t startNs, usock_ssize_t result);
+
+/* Stop tracing and free every ring; called by usock_release */
+void traceRelease();
+
+#define TRACE_BEGIN(VAR) usock_size_t VAR = g_traceEnabled ? usock_get_time_ns() : 0
+#define TRACE_END(VAR, EVENT, HSOCK, RESULT) \
+	do { if(VAR) traceRecord((EVENT), (HSOCK), (VAR), (usock_ssize_t)(RESULT)); } while(0)
+
+/***************************************/
+/*          Latency sampling           */
+/*          (usock_latency.c)          */
+
+/* 0 while sampling is off */
+extern volatile unsigned g_latencySampleRate;
+
+/* Start timing if this call is sampled; \return - 0 if it isn't */
+usock_size_t latencySampleStart(unsigned op);
+void latencyRecord(unsigned op, usock_size_t startTicks);
+/* Record a latency measured elsewhere, unsampled */
+void latencyRecordNs(unsigned op, usock_size_t ns);
+
+#define LATENCY_BEGIN(VAR, OP) usock_size_t VAR = g_latencySampleRate ? latencySampleStart(OP) : 0
+#define LATENCY_END(VAR, OP) do { if(VAR) latencyRecord((OP), (VAR)); } while(0)
+
+/***************************************/
+/*             Transports              */
+
+/*
+* The calls behind the public socket functions, picked per socket by
+* usock_configure. Tracing, counters and latency sampling stay in the
+* public functions, so every transport gets them.
+* send and recv serve the _to/_from forms too; hdest and pOutClientInfo
+* are NULL for the connected ones.
+*/
+typedef struct Transport
+{
+	const char   *name;
+	void          (*configure)(usock_handle_t hsock, usock_domain_t domain, usock_socket_type_t type, usock_flags_t flags);
+	usock_err_t   (*bind)(usock_handle_t hsock, const char *address, usock_port_t port);
+	usock_err_t   (*listen)(usock_handle_t hsock, int backlog);
+	usock_err_t   (*accept)(usock_handle_t hsock, usock_handle_t *pOutSock);
+	usock_err_t   (*connect)(usock_handle_t hsock, const char *address, usock_port_t port);
+	usock_ssize_t (*send)(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest);
+	usock_ssize_t (*recv)(usock_handle_t hsock, void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t *pOutClientInfo);
+	usock_err_t   (*setNonblocking)(usock_handle_t hsock, int enable);
+	usock_err_t   (*socketType)(usock_handle_t hsock, usock_socket_type_t *pOutType);
+	void          (*close)(usock_handle_t hsock);
+	/* Free what configure set up; the node itself is freed by the caller */
+	void          (*destroy)(usock_handle_t hsock);
+} Transport;
+
+/* Kernel sockets (usock.c) */
+extern const Transport g_kernelTransport;
+/* In-process sockets for USOCK_DOMAIN_MEMORY (usock_memory.c) */
+extern const Transport g_memoryTransport;
+
+/***************************************/
+/*           Socket queries            */
+/*  (implemented per platform, usock.c) */
+
+/* The domain the socket was configured with */
+usock_domain_t socketDomain(usock_handle_t hsock);
+
+/***************************************/
+/*     Raw kernel datagram helpers     */
+/*  (implemented per platform, usock.c) */
+
+/*
+* Wait until the kernel socket is readable.
+* \return - >0 if readable, 0 on timeout, <0 on error.
+*/
+int rawWaitReadable(usock_handle_t hsock, int timeoutMs);
+
+/*
+* Send a datagram to the connected peer. Never blocks.
+*/
+usock_ssize_t rawSend(usock_handle_t hsock, const void *pBuffer, usock_size_t len);
+
+/*
+* Receive a datagram without blocking.
+* If connectSender is set, the socket is connected to the sender so that
+* rawSend() replies to it.
+*/
+usock_ssize_t rawRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len, int connectSender);
+
+/***************************************/
+/*    Reliable datagram transport      */
+/*          (usock_rudp.c)             */
+usock_err_t   rudpCreate(usock_handle_t hsock);
+void          rudpDestroy(usock_handle_t hsock);
+void          rudpMarkConnected(usock_handle_t hsock);
+usock_ssize_t rudpSend(usock_handle_t hsock, unsigned channel, const void *pBuffer, usock_size_t len, usock_flags_t flags);
+usock_ssize_t rudpRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len, unsigned *pOutChannel);
+usock_ssize_t rudpSendv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count);
+usock_ssize_t rudpRecvv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count);
+void          rudpFlush(usock_handle_t hsock);
+
+/***************************************/
+/*     Shared memory transport         */
+/*          (usock_shm.c)              */
+void          shmDestroy(usock_handle_t hsock);
+#ifdef __linux__
+usock_err_t   shmCreate(usock_handle_t hsock);
+/* Unmap the rings and tell the peer; the state stays for a new connection */
+void          shmDetach(usock_handle_t hsock);
+void          shmSetNonblocking(usock_handle_t hsock, int enable);
+/* Set up the rings over a freshly connected or accepted local stream */
+usock_err_t   shmConnect(usock_handle_t hsock, int sockfd);
+usock_err_t   shmAccept(usock_handle_t hsock, int sockfd);
+usock_ssize_t shmSend(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count);
+usock_ssize_t shmRecv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count);
+#endif
+
+#endif /* USOCK_INTERNAL_H */
@@ -0,0 +1,61 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_isock.hpp>
+
+namespace usock
+{
+	err_t isock::join_multicast_group(const char *group, const char *iface_name)
+	{
+		return usock_join_multicast_group(m_handle, group, iface_name);
+	}
+
+	err_t isock::leave_multicast_group(const char *group, const char *iface_name)
+	{
+		return usock_leave_multicast_group(m_handle, group, iface_name);
+	}
+
+	err_t isock::join_source_multicast_group(const char *group, const char *source, const char *iface_name)
+	{
+		return usock_join_source_multicast_group(m_handle, group, source, iface_name);
+	}
+
+	err_t isock::leave_source_multicast_group(const char *group, const char *source, const char *iface_name)
+	{
+		return usock_leave_source_multicast_group(m_handle, group, source, iface_name);
+	}
+
+	err_t isock::set_multicast_ttl(int ttl)
+	{
+		return usock_set_multicast_ttl(m_handle, ttl);
+	}
+
+	err_t isock::set_multicast_loop(bool enable)
+	{
+		return usock_set_multicast_loop(m_handle, enable ? 1 : 0);
+	}
+
+	err_t isock::set_multicast_interface(const char *iface_name)
+	{
+		return usock_set_multicast_interface(m_handle, iface_name);
+	}
+}
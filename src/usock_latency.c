@@ -0,0 +1,244 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+/*
+* Sampled call latency.
+* Each thread counts down to its next sample of every operation, so an unsampled call costs
+* a flag test and a decrement. Sampled calls are stamped with the CPU
+* timestamp counter, converted to nanoseconds with a ratio measured
+* once against usock_get_time_ns, and counted into shared histograms
+* with relaxed atomics.
+*/
+
+#include <usock.h>
+#include <string.h>
+#include "usock_internal.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define HAS_TSC 1
+static usock_size_t readTicks() { return (usock_size_t)__rdtsc(); }
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAS_TSC 1
+static usock_size_t readTicks() { return (usock_size_t)__rdtsc(); }
+#else
+#define HAS_TSC 0
+static usock_size_t readTicks() { return usock_get_time_ns(); }
+#endif
+
+#if defined(_MSC_VER)
+#define STAT_CAS(FIELD, EXPECTED, VALUE) \
+	((usock_size_t)_InterlockedCompareExchange64((volatile __int64 *)&(FIELD), (__int64)(VALUE), (__int64)(EXPECTED)) == (EXPECTED))
+#else
+#define STAT_CAS(FIELD, EXPECTED, VALUE) \
+	__atomic_compare_exchange_n(&(FIELD), &(EXPECTED), (VALUE), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#endif
+
+/* Buckets per power of two, as a shift */
+#define SUB_BUCKET_BITS  4
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+
+/* How long the tick rate is measured for */
+#define CALIBRATION_NS 2000000ULL
+
+volatile unsigned g_latencySampleRate = 0;
+
+static usock_latency_histogram_t g_histograms[USOCK_LATENCY_OP_COUNT];
+static double g_nsPerTick = 1.0;
+static volatile int g_calibrated = 0;
+
+/* Per operation, so alternating calls don't always land on the same one */
+static THREAD_LOCAL unsigned t_countdown[USOCK_LATENCY_OP_COUNT];
+
+/***************************************/
+/*              Buckets                */
+
+static unsigned highestBit(usock_size_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (unsigned)index;
+#else
+	return 63 - (unsigned)__builtin_clzll(value);
+#endif
+}
+
+static unsigned bucketOf(usock_size_t ns)
+{
+	unsigned exponent, index;
+
+	if(ns < SUB_BUCKET_COUNT)
+		return (unsigned)ns;
+
+	exponent = highestBit(ns);
+	index = SUB_BUCKET_COUNT
+	      + (exponent - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT
+	      + (unsigned)((ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1));
+	return index < USOCK_LATENCY_BUCKET_COUNT ? index : USOCK_LATENCY_BUCKET_COUNT - 1;
+}
+
+usock_size_t usock_latency_bucket_bound(unsigned bucket)
+{
+	unsigned k;
+
+	if(bucket < SUB_BUCKET_COUNT)
+		return bucket;
+
+	k = bucket - SUB_BUCKET_COUNT;
+	return (usock_size_t)(SUB_BUCKET_COUNT + k % SUB_BUCKET_COUNT) << (k / SUB_BUCKET_COUNT);
+}
+
+/***************************************/
+/*             Recording               */
+
+static void calibrate()
+{
+#if HAS_TSC
+	usock_size_t startNs, startTicks, endNs, endTicks;
+
+	startNs    = usock_get_time_ns();
+	startTicks = readTicks();
+	do
+	{
+		endNs    = usock_get_time_ns();
+		endTicks = readTicks();
+	} while(endNs - startNs < CALIBRATION_NS);
+
+	if(endTicks > startTicks)
+		g_nsPerTick = (double)(endNs - startNs) / (double)(endTicks - startTicks);
+#endif
+	g_calibrated = 1;
+}
+
+usock_size_t latencySampleStart(unsigned op)
+{
+	if(t_countdown[op] > 1)
+	{
+		--t_countdown[op];
+		return 0;
+	}
+	t_countdown[op] = g_latencySampleRate;
+
+	/* 0 means "not sampled", so never hand it out */
+	return readTicks() | 1;
+}
+
+void latencyRecord(unsigned op, usock_size_t startTicks)
+{
+	latencyRecordNs(op, (usock_size_t)((double)(readTicks() - startTicks) * g_nsPerTick));
+}
+
+void latencyRecordNs(unsigned op, usock_size_t ns)
+{
+	usock_latency_histogram_t *hist = &g_histograms[op];
+	usock_size_t seen;
+
+	STAT_ADD(hist->count, 1);
+	STAT_ADD(hist->sumNs, ns);
+	STAT_ADD(hist->buckets[bucketOf(ns)], 1);
+
+	seen = STAT_LOAD(hist->maxNs);
+	while(ns > seen && !STAT_CAS(hist->maxNs, seen, ns))
+		seen = STAT_LOAD(hist->maxNs);
+
+	/* A min of 0 means no samples yet */
+	seen = STAT_LOAD(hist->minNs);
+	while((seen == 0 || ns < seen) && !STAT_CAS(hist->minNs, seen, ns))
+		seen = STAT_LOAD(hist->minNs);
+}
+
+/***************************************/
+/*             Public API              */
+
+void usock_latency_set_sample_rate(unsigned oneIn)
+{
+	/* Samples must not be taken before the tick rate is known */
+	if(oneIn && !g_calibrated)
+		calibrate();
+	g_latencySampleRate = oneIn;
+}
+
+unsigned usock_latency_get_sample_rate()
+{
+	return g_latencySampleRate;
+}
+
+usock_err_t usock_latency_get_histogram(usock_latency_op_t op, usock_latency_histogram_t *pOut)
+{
+	const usock_latency_histogram_t *hist;
+	unsigned i;
+
+	if((unsigned)op >= USOCK_LATENCY_OP_COUNT || !pOut)
+		return USOCK_ERROR_INVALID_ARG;
+
+	hist = &g_histograms[op];
+	pOut->count = STAT_LOAD(hist->count);
+	pOut->sumNs = STAT_LOAD(hist->sumNs);
+	pOut->minNs = STAT_LOAD(hist->minNs);
+	pOut->maxNs = STAT_LOAD(hist->maxNs);
+	for(i = 0; i < USOCK_LATENCY_BUCKET_COUNT; ++i)
+		pOut->buckets[i] = STAT_LOAD(hist->buckets[i]);
+
+	return USOCK_OK;
+}
+
+void usock_latency_reset()
+{
+	usock_latency_histogram_t *hist;
+	unsigned op, i;
+
+	for(op = 0; op < USOCK_LATENCY_OP_COUNT; ++op)
+	{
+		hist = &g_histograms[op];
+		STAT_STORE(hist->count, 0);
+		STAT_STORE(hist->sumNs, 0);
+		STAT_STORE(hist->minNs, 0);
+		STAT_STORE(hist->maxNs, 0);
+		for(i = 0; i < USOCK_LATENCY_BUCKET_COUNT; ++i)
+			STAT_STORE(hist->buckets[i], 0);
+	}
+}
+
+usock_size_t usock_latency_percentile(const usock_latency_histogram_t *pHist, double percentile)
+{
+	usock_size_t target, seen = 0;
+	unsigned i;
+
+	if(!pHist->count)
+		return 0;
+
+	target = (usock_size_t)((double)pHist->count * percentile / 100.0 + 0.5);
+	if(target < 1)
+		target = 1;
+
+	for(i = 0; i < USOCK_LATENCY_BUCKET_COUNT - 1; ++i)
+	{
+		seen += pHist->buckets[i];
+		if(seen >= target)
+		{
+			usock_size_t upper = usock_latency_bucket_bound(i + 1) - 1;
+			return upper < pHist->maxNs ? upper : pHist->maxNs;
+		}
+	}
+	return pHist->maxNs;
+}
@@ -0,0 +1,274 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_line_reader.hpp>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define USOCK_SCAN_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace usock
+{
+	typedef const char *(*find_byte_fn)(const char *begin, const char *end, char c);
+
+#ifdef USOCK_SCAN_X64
+	static inline unsigned firstSet(unsigned mask)
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	// SSE2 is always there on x86-64
+	static const char *findByteSse2(const char *begin, const char *end, char c)
+	{
+		const __m128i needle = _mm_set1_epi8(c);
+		const char *p = begin;
+
+		for(; end - p >= 16; p += 16)
+		{
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+			if(mask)
+				return p + firstSet(mask);
+		}
+		for(; p < end; ++p)
+		{
+			if(*p == c)
+				return p;
+		}
+		return end;
+	}
+
+	TARGET_AVX2
+	static const char *findByteAvx2(const char *begin, const char *end, char c)
+	{
+		const __m256i needle = _mm256_set1_epi8(c);
+		const char *p = begin;
+
+		// Two vectors per iteration so the compare and branch overlap
+		for(; end - p >= 64; p += 64)
+		{
+			__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+			__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+			__m256i eqa = _mm256_cmpeq_epi8(a, needle);
+			__m256i eqb = _mm256_cmpeq_epi8(b, needle);
+			if(!_mm256_testz_si256(_mm256_or_si256(eqa, eqb), _mm256_or_si256(eqa, eqb)))
+			{
+				unsigned ma = (unsigned)_mm256_movemask_epi8(eqa);
+				if(ma)
+					return p + firstSet(ma);
+				return p + 32 + firstSet((unsigned)_mm256_movemask_epi8(eqb));
+			}
+		}
+		for(; end - p >= 32; p += 32)
+		{
+			__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+			unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+			if(mask)
+				return p + firstSet(mask);
+		}
+		return findByteSse2(p, end, c);
+	}
+
+	static bool cpuHasAvx2()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#else
+	static const char *findByteScalar(const char *begin, const char *end, char c)
+	{
+		const void *p = std::memchr(begin, c, end - begin);
+		return p ? static_cast<const char *>(p) : end;
+	}
+#endif
+
+	struct find_byte_impl
+	{
+		find_byte_fn fn;
+		const char *name;
+	};
+
+	static find_byte_impl pickFindByte()
+	{
+#ifdef USOCK_SCAN_X64
+		if(cpuHasAvx2())
+			return { findByteAvx2, "avx2" };
+		return { findByteSse2, "sse2" };
+#else
+		return { findByteScalar, "scalar" };
+#endif
+	}
+
+	// Function local static, so the first caller picks it thread safely
+	static const find_byte_impl &findByteImpl()
+	{
+		static const find_byte_impl impl = pickFindByte();
+		return impl;
+	}
+
+	const char *find_byte(const char *begin, const char *end, char c)
+	{
+		return findByteImpl().fn(begin, end, c);
+	}
+
+	const char *find_byte_implementation()
+	{
+		return findByteImpl().name;
+	}
+
+	line_reader::line_reader(usock_handle_t hsock, std::string delimiter, size_t maxLineLength, size_t readSize)
+		: m_socket(hsock)
+		, m_delimiter(delimiter.empty() ? std::string("\n") : std::move(delimiter))
+		, m_maxLineLength(maxLineLength)
+		, m_readSize(readSize ? readSize : 1)
+		, m_buffer(m_readSize)
+		, m_begin(0)
+		, m_scanned(0)
+		, m_end(0)
+		, m_status(STATUS_OK)
+	{
+	}
+
+	bool line_reader::findLine(std::string_view &line)
+	{
+		const char *base = m_buffer.data();
+		const char last = m_delimiter.back();
+		const size_t prefix = m_delimiter.size() - 1;
+
+		// Search for the delimiter's last byte; the rest of it is behind that,
+		// so a delimiter split across reads is still found in one pass
+		while(m_scanned < m_end)
+		{
+			const char *hit = find_byte(base + m_scanned, base + m_end, last);
+			if(hit == base + m_end)
+			{
+				m_scanned = m_end;
+				return false;
+			}
+
+			size_t pos = hit - base;
+			m_scanned = pos + 1;
+			if(pos - m_begin >= prefix && std::memcmp(hit - prefix, m_delimiter.data(), prefix) == 0)
+			{
+				line = std::string_view(base + m_begin, pos - prefix - m_begin);
+				m_begin = m_scanned;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool line_reader::fill()
+	{
+		if(m_buffer.size() - m_end < m_readSize)
+		{
+			// Move the partial line to the front, keeping the scan position
+			if(m_begin > 0)
+			{
+				std::memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+				m_scanned -= m_begin;
+				m_end -= m_begin;
+				m_begin = 0;
+			}
+			if(m_buffer.size() - m_end < m_readSize)
+				m_buffer.resize(m_end + m_readSize);
+		}
+
+		usock_ssize_t ret = usock_recv(m_socket, m_buffer.data() + m_end, m_buffer.size() - m_end);
+		if(ret > 0)
+		{
+			m_end += ret;
+			return true;
+		}
+
+		if(ret == 0)
+			m_status = STATUS_CLOSED;
+		else
+			m_status = usock_would_block() ? STATUS_WOULD_BLOCK : STATUS_ERROR;
+		return false;
+	}
+
+	bool line_reader::next(std::string_view &line)
+	{
+		if(m_status == STATUS_CLOSED || m_status == STATUS_ERROR || m_status == STATUS_LINE_TOO_LONG)
+		{
+			// Hand out whatever was left when the peer closed, once
+			if(m_status == STATUS_CLOSED && m_begin < m_end)
+			{
+				line = std::string_view(m_buffer.data() + m_begin, m_end - m_begin);
+				m_begin = m_scanned = m_end;
+				return true;
+			}
+			return false;
+		}
+
+		m_status = STATUS_OK;
+		for(;;)
+		{
+			if(findLine(line))
+				return true;
+
+			if(m_end - m_begin >= m_maxLineLength)
+			{
+				m_status = STATUS_LINE_TOO_LONG;
+				return false;
+			}
+
+			if(!fill())
+				return m_status == STATUS_CLOSED ? next(line) : false;
+		}
+	}
+
+	std::string_view line_reader::pending() const
+	{
+		return std::string_view(m_buffer.data() + m_begin, m_end - m_begin);
+	}
+
+	void line_reader::consume(size_t n)
+	{
+		if(n > m_end - m_begin)
+			n = m_end - m_begin;
+		m_begin += n;
+		if(m_scanned < m_begin)
+			m_scanned = m_begin;
+	}
+}
@@ -0,0 +1,1050 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+/*
+* In-process transport (USOCK_DOMAIN_MEMORY).
+*
+* Bound sockets live in a registry keyed by name and port. A datagram is
+* pushed straight into the inbox of whatever is bound at its destination,
+* and a reliable connect leaves a pair of queues, one per direction, in
+* the listener's inbox for accept to pick up. Every message carries the
+* time it may be delivered at, which is all latency, jitter and bandwidth
+* come down to; receivers wait on their queue until the first one is due.
+*/
+
+#include <usock.h>
+#include "usock_internal.h"
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <winsock2.h>
+#else
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+#define MEMORY_BUCKETS          256
+#define MEMORY_MAX_NAME         64
+/* Like a socket buffer: reliable senders wait for room, datagrams are dropped */
+#define MEMORY_QUEUE_BYTES      (4u << 20)
+#define MEMORY_EPHEMERAL_FIRST  49152
+
+/***************************************/
+/*          Platform helpers           */
+
+#ifdef _WIN32
+
+typedef SRWLOCK MemoryLock;
+typedef CONDITION_VARIABLE MemoryCond;
+
+#define MEMORY_LOCK_INIT SRWLOCK_INIT
+#define ERR_WOULD_BLOCK   WSAEWOULDBLOCK
+#define ERR_RESET         WSAECONNRESET
+#define ERR_NOT_CONNECTED WSAENOTCONN
+#define ERR_REFUSED       WSAECONNREFUSED
+#define ERR_INVALID       WSAEINVAL
+#define ERR_TOO_BIG       WSAEMSGSIZE
+
+static void setError(int err)             { WSASetLastError(err); }
+static void lockInit(MemoryLock *l)       { InitializeSRWLock(l); }
+static void lockFree(MemoryLock *l)       { (void)l; }
+static void lockAcquire(MemoryLock *l)    { AcquireSRWLockExclusive(l); }
+static void lockRelease(MemoryLock *l)    { ReleaseSRWLockExclusive(l); }
+static void condInit(MemoryCond *c)       { InitializeConditionVariable(c); }
+static void condFree(MemoryCond *c)       { (void)c; }
+static void condWake(MemoryCond *c)       { WakeAllConditionVariable(c); }
+
+/* Wait until untilNs on the usock_get_time_ns() clock, or for a wake when 0 */
+static void condWait(MemoryCond *c, MemoryLock *l, usock_size_t untilNs)
+{
+	usock_size_t now = untilNs ? usock_get_time_ns() : 0;
+	DWORD ms = !untilNs ? INFINITE : untilNs > now ? (DWORD)((untilNs - now + 999999) / 1000000) : 0;
+	SleepConditionVariableSRW(c, l, ms, 0);
+}
+
+#else
+
+typedef pthread_mutex_t MemoryLock;
+typedef pthread_cond_t MemoryCond;
+
+#define MEMORY_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#define ERR_WOULD_BLOCK   EAGAIN
+#define ERR_RESET         EPIPE
+#define ERR_NOT_CONNECTED ENOTCONN
+#define ERR_REFUSED       ECONNREFUSED
+#define ERR_INVALID       EINVAL
+#define ERR_TOO_BIG       EMSGSIZE
+
+static void setError(int err)             { errno = err; }
+static void lockInit(MemoryLock *l)       { pthread_mutex_init(l, NULL); }
+static void lockFree(MemoryLock *l)       { pthread_mutex_destroy(l); }
+static void lockAcquire(MemoryLock *l)    { pthread_mutex_lock(l); }
+static void lockRelease(MemoryLock *l)    { pthread_mutex_unlock(l); }
+static void condFree(MemoryCond *c)       { pthread_cond_destroy(c); }
+static void condWake(MemoryCond *c)       { pthread_cond_broadcast(c); }
+
+/* Timed waits run on the monotonic clock, the same one as usock_get_time_ns() */
+static void condInit(MemoryCond *c)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(c, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Wait until untilNs on the usock_get_time_ns() clock, or for a wake when 0 */
+static void condWait(MemoryCond *c, MemoryLock *l, usock_size_t untilNs)
+{
+	struct timespec ts;
+	if(!untilNs)
+	{
+		pthread_cond_wait(c, l);
+		return;
+	}
+	ts.tv_sec  = (time_t)(untilNs / 1000000000ULL);
+	ts.tv_nsec = (long)(untilNs % 1000000000ULL);
+	pthread_cond_timedwait(c, l, &ts);
+}
+
+#endif
+
+/***************************************/
+/*         Queues and messages         */
+
+typedef struct MemoryAddress
+{
+	char         name[MEMORY_MAX_NAME];
+	usock_port_t port;
+} MemoryAddress;
+
+typedef struct MemoryMessage
+{
+	struct MemoryMessage *next;
+	usock_size_t  deliverNs;
+	MemoryAddress from;
+	usock_size_t  len;
+	usock_size_t  offset; /* Already received, a reliable message can be read in parts */
+	unsigned char data[];
+} MemoryMessage;
+
+typedef struct MemoryQueue
+{
+	MemoryLock     lock;
+	MemoryCond     cond;
+	MemoryMessage *head;
+	MemoryMessage *tail;
+	usock_size_t   count;
+	usock_size_t   bytes;
+	usock_size_t   lastDeliverNs; /* Keeps reliable messages in order under jitter */
+	int            writerClosed;  /* Nothing more will arrive */
+	int            readerClosed;  /* Nothing more will be read */
+	int            refs;
+} MemoryQueue;
+
+/* What a connect leaves in the listener's inbox */
+typedef struct MemoryConnect
+{
+	MemoryQueue *toServer;
+	MemoryQueue *toClient;
+} MemoryConnect;
+
+static MemoryQueue *queueCreate(int refs)
+{
+	MemoryQueue *q = (MemoryQueue *)g_palloc(sizeof(MemoryQueue));
+	if(!q)
+		return NULL;
+	memset(q, 0, sizeof(*q));
+	lockInit(&q->lock);
+	condInit(&q->cond);
+	q->refs = refs;
+	return q;
+}
+
+static void queueFree(MemoryQueue *q)
+{
+	MemoryMessage *m;
+	while((m = q->head) != NULL)
+	{
+		q->head = m->next;
+		g_pfree(m);
+	}
+	condFree(&q->cond);
+	lockFree(&q->lock);
+	g_pfree(q);
+}
+
+static void queueRelease(MemoryQueue *q)
+{
+	int refs;
+	lockAcquire(&q->lock);
+	refs = --q->refs;
+	lockRelease(&q->lock);
+	if(refs == 0)
+		queueFree(q);
+}
+
+/* Shut one end of a queue and drop our reference to it */
+static void queueShut(MemoryQueue *q, int writer)
+{
+	lockAcquire(&q->lock);
+	if(writer)
+		q->writerClosed = 1;
+	else
+		q->readerClosed = 1;
+	condWake(&q->cond);
+	lockRelease(&q->lock);
+	queueRelease(q);
+}
+
+static MemoryMessage *messageCreate(const void *pBuffer, usock_size_t len)
+{
+	MemoryMessage *m = (MemoryMessage *)g_palloc(sizeof(MemoryMessage) + (len ? len : 1));
+	if(!m)
+		return NULL;
+	memset(m, 0, sizeof(*m));
+	m->len = len;
+	memcpy(m->data, pBuffer, len);
+	return m;
+}
+
+/* Datagrams may overtake each other under jitter, so they go in by delivery time */
+static void queueInsert(MemoryQueue *q, MemoryMessage *m)
+{
+	MemoryMessage **pp;
+
+	if(!q->tail || q->tail->deliverNs <= m->deliverNs)
+	{
+		if(q->tail)
+			q->tail->next = m;
+		else
+			q->head = m;
+		q->tail = m;
+	}
+	else
+	{
+		for(pp = &q->head; (*pp)->deliverNs <= m->deliverNs; pp = &(*pp)->next)
+		{
+		}
+		m->next = *pp;
+		*pp = m;
+	}
+	++q->count;
+	q->bytes += m->len;
+	condWake(&q->cond);
+}
+
+/*
+* Wait for the first message to be due.
+* \return - The message, still queued, or NULL with the error set; NULL
+*           without an error is the end of a reliable stream.
+*/
+static MemoryMessage *queueWait(MemoryQueue *q, int nonblocking, int *pError)
+{
+	*pError = 0;
+	for(;;)
+	{
+		if(q->readerClosed)
+		{
+			*pError = ERR_NOT_CONNECTED;
+			return NULL;
+		}
+		if(q->head)
+		{
+			if(!q->head->deliverNs || q->head->deliverNs <= usock_get_time_ns())
+				return q->head;
+		}
+		else if(q->writerClosed)
+		{
+			return NULL;
+		}
+
+		if(nonblocking)
+		{
+			*pError = ERR_WOULD_BLOCK;
+			return NULL;
+		}
+		condWait(&q->cond, &q->lock, q->head ? q->head->deliverNs : 0);
+	}
+}
+
+static void queuePop(MemoryQueue *q)
+{
+	MemoryMessage *m = q->head;
+	q->head = m->next;
+	if(!q->head)
+		q->tail = NULL;
+	--q->count;
+	q->bytes -= m->len;
+	g_pfree(m);
+	/* A reliable sender may be waiting for room */
+	condWake(&q->cond);
+}
+
+/***************************************/
+/*              Registry               */
+
+typedef struct MemoryPort
+{
+	struct MemoryPort *next;
+	MemoryAddress      addr;
+	MemoryQueue       *inbox; /* Datagrams, or connects waiting for accept */
+	usock_socket_type_t type;
+	int                listening;
+	int                backlog;
+} MemoryPort;
+
+struct MemoryState
+{
+	MemoryLock     lock;    /* Guards port, rx and tx against a close from another thread */
+	usock_socket_type_t type;
+	usock_flags_t  flags;
+	int            nonblocking;
+	MemoryPort    *port;    /* Where we're bound */
+	MemoryQueue   *rx;      /* Both set on a connected reliable socket */
+	MemoryQueue   *tx;
+	MemoryAddress  peer;    /* Where datagrams go by default, or who sent one */
+	int            hasPeer;
+	usock_memory_conditions_t conditions;
+	usock_size_t   rng;
+	usock_size_t   linkFreeNs; /* When the simulated link is done with the last send */
+};
+
+#define GET_MEMORY(HSOCK) (GET_SOCK_NODE_FROM_HANDLE(HSOCK)->memory)
+#define IS_RELIABLE(ST)   ((ST)->type != USOCK_SOCKTYPE_FAST)
+
+/* Everything below is guarded by g_lock */
+static MemoryLock g_lock = MEMORY_LOCK_INIT;
+static MemoryPort *g_buckets[MEMORY_BUCKETS];
+static usock_memory_conditions_t g_conditions;
+static usock_size_t g_sequence = 0;
+static usock_port_t g_nextEphemeral = MEMORY_EPHEMERAL_FIRST;
+
+static unsigned hashAddress(const MemoryAddress *addr)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	const char *c;
+	for(c = addr->name; *c; ++c)
+		h = (h ^ (unsigned char)*c) * 16777619u;
+	h = (h ^ (addr->port & 0xff)) * 16777619u;
+	h = (h ^ (addr->port >> 8)) * 16777619u;
+	return h % MEMORY_BUCKETS;
+}
+
+static MemoryPort *findPort(const MemoryAddress *addr)
+{
+	MemoryPort *p;
+	for(p = g_buckets[hashAddress(addr)]; p; p = p->next)
+	{
+		if(p->addr.port == addr->port && strcmp(p->addr.name, addr->name) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+static int setAddress(MemoryAddress *addr, const char *name, usock_port_t port)
+{
+	size_t len = name ? strlen(name) : 0;
+	if(len >= MEMORY_MAX_NAME)
+		return 0;
+	memset(addr, 0, sizeof(*addr));
+	memcpy(addr->name, name ? name : "", len);
+	addr->port = port;
+	return 1;
+}
+
+/* Pick a free port for the name; g_lock must be held */
+static int ephemeralPort(MemoryAddress *addr)
+{
+	unsigned tries;
+	for(tries = 0; tries < 65536 - MEMORY_EPHEMERAL_FIRST; ++tries)
+	{
+		addr->port = g_nextEphemeral;
+		g_nextEphemeral = g_nextEphemeral == 65535 ? MEMORY_EPHEMERAL_FIRST : (usock_port_t)(g_nextEphemeral + 1);
+		if(!findPort(addr))
+			return 1;
+	}
+	return 0;
+}
+
+/***************************************/
+/*         Simulated conditions        */
+
+/* splitmix64, small and good enough to pick losses */
+static usock_size_t nextRandom(usock_size_t *pState)
+{
+	usock_size_t z = (*pState += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static double randomUnit(usock_size_t *pState)
+{
+	return (double)(nextRandom(pState) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static usock_size_t deliveryTime(struct MemoryState *st, usock_size_t len)
+{
+	const usock_memory_conditions_t *c = &st->conditions;
+	usock_size_t at;
+
+	/* Due right away, a perfect link doesn't need the clock */
+	if(!c->bytesPerSecond && !c->latencyNs && !c->jitterNs)
+		return 0;
+	at = usock_get_time_ns();
+
+	/* The link carries one message at a time */
+	if(c->bytesPerSecond)
+	{
+		if(st->linkFreeNs > at)
+			at = st->linkFreeNs;
+		at += (usock_size_t)((double)len * 1e9 / (double)c->bytesPerSecond);
+		st->linkFreeNs = at;
+	}
+	at += c->latencyNs;
+	if(c->jitterNs)
+		at += nextRandom(&st->rng) % (c->jitterNs + 1);
+	return at;
+}
+
+/***************************************/
+/*              Endpoints              */
+
+static struct MemoryState *stateCreate(usock_handle_t hsock)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	if(st)
+		return st;
+	st = (struct MemoryState *)g_palloc(sizeof(struct MemoryState));
+	if(st)
+	{
+		memset(st, 0, sizeof(*st));
+		lockInit(&st->lock);
+	}
+	GET_MEMORY(hsock) = st;
+	return st;
+}
+
+enum
+{
+	MEMORY_QUEUE_RX,    /* What recv reads: the stream, or the datagram inbox */
+	MEMORY_QUEUE_TX,
+	MEMORY_QUEUE_INBOX, /* Connects waiting for accept */
+};
+
+/*
+* Lock one of the socket's queues and hold a reference to it, so a close
+* from another thread can't free it while a call is using it. Close takes
+* the queues away under the state lock, so the pointer can't go stale
+* between reading it and taking the reference.
+* \return - The queue, locked, or NULL if the socket doesn't have one.
+*/
+static MemoryQueue *queuePin(struct MemoryState *st, int which)
+{
+	MemoryQueue *q;
+
+	lockAcquire(&st->lock);
+	if(which == MEMORY_QUEUE_TX)
+		q = st->tx;
+	else if(which == MEMORY_QUEUE_RX && IS_RELIABLE(st))
+		q = st->rx;
+	else
+		q = st->port ? st->port->inbox : NULL;
+	if(q)
+	{
+		lockAcquire(&q->lock);
+		++q->refs;
+	}
+	lockRelease(&st->lock);
+	return q;
+}
+
+/* Unlock a queue from queuePin and drop the reference */
+static void queueUnpin(MemoryQueue *q)
+{
+	int freeQueue = --q->refs == 0;
+	lockRelease(&q->lock);
+	if(freeQueue)
+		queueFree(q);
+}
+
+/* Take a message the listener will never accept back out of the picture */
+static void refuseConnect(MemoryMessage *m)
+{
+	MemoryConnect conn;
+	memcpy(&conn, m->data, sizeof(conn));
+	queueShut(conn.toServer, 0);
+	queueShut(conn.toClient, 1);
+}
+
+static void unbind(struct MemoryState *st)
+{
+	MemoryPort *port = st->port, **pp;
+	MemoryMessage *pending, *m;
+
+	lockAcquire(&st->lock);
+	st->port = NULL;
+	lockRelease(&st->lock);
+	if(!port)
+		return;
+
+	lockAcquire(&g_lock);
+	for(pp = &g_buckets[hashAddress(&port->addr)]; *pp; pp = &(*pp)->next)
+	{
+		if(*pp == port)
+		{
+			*pp = port->next;
+			break;
+		}
+	}
+	lockRelease(&g_lock);
+
+	/* Nobody can find the inbox any more, empty it */
+	lockAcquire(&port->inbox->lock);
+	pending = port->inbox->head;
+	port->inbox->head = port->inbox->tail = NULL;
+	port->inbox->count = port->inbox->bytes = 0;
+	port->inbox->readerClosed = port->inbox->writerClosed = 1;
+	condWake(&port->inbox->cond);
+	lockRelease(&port->inbox->lock);
+
+	while((m = pending) != NULL)
+	{
+		pending = m->next;
+		if(port->listening)
+			refuseConnect(m);
+		g_pfree(m);
+	}
+	queueRelease(port->inbox);
+	g_pfree(port);
+}
+
+static void memoryClose(usock_handle_t hsock)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	MemoryQueue *tx, *rx;
+	if(!st)
+		return;
+
+	lockAcquire(&st->lock);
+	tx = st->tx;
+	rx = st->rx;
+	st->tx = st->rx = NULL;
+	lockRelease(&st->lock);
+
+	/* The peer reads what's left, then sees the end */
+	if(tx)
+		queueShut(tx, 1);
+	if(rx)
+		queueShut(rx, 0);
+	st->hasPeer = 0;
+	unbind(st);
+}
+
+static void memoryDestroy(usock_handle_t hsock)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	if(!st)
+		return;
+	memoryClose(hsock);
+	lockFree(&st->lock);
+	g_pfree(st);
+	GET_MEMORY(hsock) = NULL;
+}
+
+static void memoryConfigure(usock_handle_t hsock, usock_domain_t domain, usock_socket_type_t type, usock_flags_t flags)
+{
+	struct MemoryState *st;
+
+	memoryClose(hsock);
+	st = stateCreate(hsock);
+	if(!st)
+		return;
+
+	st->type        = type;
+	st->flags       = flags;
+	st->nonblocking = 0;
+	st->linkFreeNs  = 0;
+
+	lockAcquire(&g_lock);
+	st->conditions = g_conditions;
+	st->rng        = g_conditions.seed ^ (++g_sequence * 0xD1B54A32D192ED03ULL);
+	lockRelease(&g_lock);
+}
+
+static usock_err_t bindTo(struct MemoryState *st, const char *address, usock_port_t port)
+{
+	MemoryPort *p;
+
+	if(st->port)
+		return USOCK_ERROR_INIT_FAILED;
+	p = (MemoryPort *)g_palloc(sizeof(MemoryPort));
+	if(!p)
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	memset(p, 0, sizeof(*p));
+	if(!setAddress(&p->addr, address, port))
+	{
+		g_pfree(p);
+		return USOCK_ERROR_INVALID_ARG;
+	}
+	p->type  = st->type;
+	p->inbox = queueCreate(1);
+	if(!p->inbox)
+	{
+		g_pfree(p);
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	}
+
+	lockAcquire(&g_lock);
+	if(port == 0 ? !ephemeralPort(&p->addr) : findPort(&p->addr) != NULL)
+	{
+		lockRelease(&g_lock);
+		queueFree(p->inbox);
+		g_pfree(p);
+		return USOCK_ERROR_INIT_FAILED;
+	}
+	p->next = g_buckets[hashAddress(&p->addr)];
+	g_buckets[hashAddress(&p->addr)] = p;
+	lockRelease(&g_lock);
+
+	lockAcquire(&st->lock);
+	st->port = p;
+	lockRelease(&st->lock);
+	return USOCK_OK;
+}
+
+static usock_err_t memoryBind(usock_handle_t hsock, const char *address, usock_port_t port)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	if(!st)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	return bindTo(st, address, port);
+}
+
+static usock_err_t memoryListen(usock_handle_t hsock, int backlog)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	if(!st || !st->port)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	if(!IS_RELIABLE(st))
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	lockAcquire(&g_lock);
+	st->port->listening = 1;
+	st->port->backlog   = backlog > 0 ? backlog : 1;
+	lockRelease(&g_lock);
+	return USOCK_OK;
+}
+
+static usock_err_t memoryConnect(usock_handle_t hsock, const char *address, usock_port_t port)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	MemoryConnect conn;
+	MemoryMessage *m;
+	MemoryPort *listener;
+	MemoryAddress self;
+
+	if(!st)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	memoryClose(hsock);
+	if(!setAddress(&st->peer, address, port))
+		return USOCK_ERROR_INVALID_ARG;
+
+	/* Datagram sockets just remember the peer, and get an address replies can find */
+	if(!IS_RELIABLE(st))
+	{
+		usock_err_t err = bindTo(st, "", 0);
+		if(err != USOCK_OK)
+			return err;
+		st->hasPeer = 1;
+		return USOCK_OK;
+	}
+
+	conn.toServer = queueCreate(2);
+	conn.toClient = queueCreate(2);
+	m = messageCreate(&conn, sizeof(conn));
+	if(!conn.toServer || !conn.toClient || !m)
+	{
+		if(conn.toServer)
+			queueFree(conn.toServer);
+		if(conn.toClient)
+			queueFree(conn.toClient);
+		if(m)
+			g_pfree(m);
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	}
+
+	/* The server sees the client under a made up port */
+	setAddress(&self, "", 0);
+	m->deliverNs = deliveryTime(st, 0);
+
+	lockAcquire(&g_lock);
+	ephemeralPort(&self);
+	m->from  = self;
+	listener = findPort(&st->peer);
+	if(listener && listener->listening && listener->type == st->type)
+	{
+		lockAcquire(&listener->inbox->lock);
+		if(listener->inbox->count < (usock_size_t)listener->backlog)
+		{
+			queueInsert(listener->inbox, m);
+			m = NULL;
+		}
+		lockRelease(&listener->inbox->lock);
+	}
+	lockRelease(&g_lock);
+
+	if(m)
+	{
+		g_pfree(m);
+		queueFree(conn.toServer);
+		queueFree(conn.toClient);
+		setError(ERR_REFUSED);
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	lockAcquire(&st->lock);
+	st->tx = conn.toServer;
+	st->rx = conn.toClient;
+	lockRelease(&st->lock);
+	st->hasPeer = 1;
+	return USOCK_OK;
+}
+
+static usock_err_t memoryAccept(usock_handle_t hsock, usock_handle_t *pOutSock)
+{
+	struct MemoryState *st = GET_MEMORY(hsock), *outSt;
+	MemoryQueue *inbox;
+	MemoryMessage *m;
+	MemoryConnect conn;
+	MemoryAddress from;
+	usock_err_t err;
+	int error;
+
+	*pOutSock = NULL;
+	if(!st || !st->port || !st->port->listening)
+		return USOCK_ERROR_NOT_INITIALIZED;
+
+	inbox = queuePin(st, MEMORY_QUEUE_INBOX);
+	if(!inbox)
+	{
+		setError(ERR_NOT_CONNECTED);
+		return USOCK_ERROR_INTERNAL;
+	}
+	m = queueWait(inbox, st->nonblocking, &error);
+	if(m)
+	{
+		memcpy(&conn, m->data, sizeof(conn));
+		from = m->from;
+		queuePop(inbox);
+	}
+	queueUnpin(inbox);
+	if(!m)
+	{
+		setError(error ? error : ERR_NOT_CONNECTED);
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	err = usock_create_socket("client socket", pOutSock);
+	outSt = err == USOCK_OK ? stateCreate(*pOutSock) : NULL;
+	if(!outSt)
+	{
+		queueShut(conn.toServer, 0);
+		queueShut(conn.toClient, 1);
+		if(*pOutSock)
+			usock_free_socket(*pOutSock);
+		*pOutSock = NULL;
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	}
+
+	/* Like an accepted kernel socket, it takes after the listener */
+	GET_TRANSPORT(*pOutSock) = &g_memoryTransport;
+	outSt->type       = st->type;
+	outSt->flags      = st->flags;
+	outSt->conditions = st->conditions;
+	outSt->rng        = nextRandom(&st->rng);
+	outSt->rx         = conn.toServer;
+	outSt->tx         = conn.toClient;
+	outSt->peer       = from;
+	outSt->hasPeer    = 1;
+	statsAttach(*pOutSock, st->flags & USOCK_OPTIONS_STATS);
+	return USOCK_OK;
+}
+
+static usock_ssize_t sendReliable(struct MemoryState *st, const void *pBuffer, usock_size_t len)
+{
+	MemoryQueue *q;
+	MemoryMessage *m;
+
+	if(len == 0)
+		return 0;
+	m = messageCreate(pBuffer, len);
+	if(!m)
+		return -1;
+
+	q = queuePin(st, MEMORY_QUEUE_TX);
+	if(!q)
+	{
+		g_pfree(m);
+		setError(ERR_NOT_CONNECTED);
+		return -1;
+	}
+	/* A message bigger than the whole queue still goes once the queue is empty */
+	while(!q->readerClosed && q->bytes > 0 && q->bytes + len > MEMORY_QUEUE_BYTES)
+	{
+		if(st->nonblocking)
+		{
+			queueUnpin(q);
+			g_pfree(m);
+			setError(ERR_WOULD_BLOCK);
+			return -1;
+		}
+		condWait(&q->cond, &q->lock, 0);
+	}
+	if(q->readerClosed)
+	{
+		queueUnpin(q);
+		g_pfree(m);
+		setError(ERR_RESET);
+		return -1;
+	}
+
+	m->deliverNs = deliveryTime(st, len);
+	if(m->deliverNs < q->lastDeliverNs)
+		m->deliverNs = q->lastDeliverNs;
+	q->lastDeliverNs = m->deliverNs;
+	queueInsert(q, m);
+	queueUnpin(q);
+	return (usock_ssize_t)len;
+}
+
+static usock_ssize_t sendDatagram(struct MemoryState *st, const void *pBuffer, usock_size_t len, const MemoryAddress *to)
+{
+	MemoryMessage *m;
+	MemoryPort *dest;
+
+	if(len > MEMORY_QUEUE_BYTES)
+	{
+		setError(ERR_TOO_BIG);
+		return -1;
+	}
+	if(!st->port && bindTo(st, "", 0) != USOCK_OK)
+		return -1;
+
+	/* Lost on the way; as far as the sender knows it went out fine */
+	if(st->conditions.lossRate > 0.0 && randomUnit(&st->rng) < st->conditions.lossRate)
+	{
+		deliveryTime(st, len);
+		return (usock_ssize_t)len;
+	}
+
+	m = messageCreate(pBuffer, len);
+	if(!m)
+		return -1;
+	m->from      = st->port->addr;
+	m->deliverNs = deliveryTime(st, len);
+
+	/* The lock keeps the port from going away while we push */
+	lockAcquire(&g_lock);
+	dest = findPort(to);
+	if(dest && dest->type == USOCK_SOCKTYPE_FAST)
+	{
+		lockAcquire(&dest->inbox->lock);
+		if(!dest->inbox->readerClosed && dest->inbox->bytes + len <= MEMORY_QUEUE_BYTES)
+		{
+			queueInsert(dest->inbox, m);
+			m = NULL;
+		}
+		lockRelease(&dest->inbox->lock);
+	}
+	lockRelease(&g_lock);
+
+	/* Nobody there, or no room: dropped like a UDP datagram */
+	if(m)
+		g_pfree(m);
+	return (usock_ssize_t)len;
+}
+
+static usock_ssize_t memorySend(usock_handle_t hsock, const void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t hdest)
+{
+	struct MemoryState *st = GET_MEMORY(hsock), *destSt;
+	(void)flags;
+
+	if(!st)
+	{
+		setError(ERR_NOT_CONNECTED);
+		return -1;
+	}
+	if(IS_RELIABLE(st))
+	{
+		if(!st->tx)
+		{
+			setError(ERR_NOT_CONNECTED);
+			return -1;
+		}
+		return sendReliable(st, pBuffer, len);
+	}
+
+	if(!hdest)
+	{
+		if(!st->hasPeer)
+		{
+			setError(ERR_NOT_CONNECTED);
+			return -1;
+		}
+		return sendDatagram(st, pBuffer, len, &st->peer);
+	}
+
+	/* The destination has to be a memory address, from usock_recv_from or connect */
+	destSt = GET_TRANSPORT(hdest) == &g_memoryTransport ? GET_MEMORY(hdest) : NULL;
+	if(!destSt || !destSt->hasPeer)
+	{
+		setError(ERR_INVALID);
+		return -1;
+	}
+	return sendDatagram(st, pBuffer, len, &destSt->peer);
+}
+
+static usock_ssize_t memoryRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len, usock_flags_t flags, usock_handle_t *pOutClientInfo)
+{
+	struct MemoryState *st = GET_MEMORY(hsock), *cliSt;
+	MemoryQueue *q;
+	MemoryMessage *m;
+	MemoryAddress from;
+	usock_size_t n = 0;
+	int error;
+	(void)flags;
+
+	if(pOutClientInfo)
+		*pOutClientInfo = NULL;
+	q = st ? queuePin(st, MEMORY_QUEUE_RX) : NULL;
+	if(!q)
+	{
+		setError(ERR_NOT_CONNECTED);
+		return -1;
+	}
+
+	m = queueWait(q, st->nonblocking, &error);
+	if(m)
+	{
+		from = m->from;
+		n = m->len - m->offset < len ? m->len - m->offset : len;
+		memcpy(pBuffer, m->data + m->offset, n);
+		m->offset += n;
+
+		/* Datagrams that don't fit are cut, the rest of a reliable message waits */
+		if(!IS_RELIABLE(st) || m->offset == m->len)
+			queuePop(q);
+	}
+	queueUnpin(q);
+
+	if(!m)
+	{
+		if(!error)
+			return 0;
+		setError(error);
+		return -1;
+	}
+
+	if(pOutClientInfo && usock_create_socket("", pOutClientInfo) == USOCK_OK)
+	{
+		cliSt = stateCreate(*pOutClientInfo);
+		GET_TRANSPORT(*pOutClientInfo) = &g_memoryTransport;
+		if(cliSt)
+		{
+			cliSt->type    = st->type;
+			cliSt->peer    = from;
+			cliSt->hasPeer = 1;
+		}
+	}
+	return (usock_ssize_t)n;
+}
+
+static usock_err_t memorySetNonblocking(usock_handle_t hsock, int enable)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	if(!st)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	st->nonblocking = enable;
+	return USOCK_OK;
+}
+
+static usock_err_t memorySocketType(usock_handle_t hsock, usock_socket_type_t *pOutType)
+{
+	struct MemoryState *st = GET_MEMORY(hsock);
+	if(!st)
+		return USOCK_ERROR_NOT_INITIALIZED;
+	*pOutType = st->type;
+	return USOCK_OK;
+}
+
+const Transport g_memoryTransport =
+{
+	"memory",
+	memoryConfigure,
+	memoryBind,
+	memoryListen,
+	memoryAccept,
+	memoryConnect,
+	memorySend,
+	memoryRecv,
+	memorySetNonblocking,
+	memorySocketType,
+	memoryClose,
+	memoryDestroy
+};
+
+/***************************************/
+/*             Public API              */
+
+void usock_memory_set_conditions(const usock_memory_conditions_t *pConditions)
+{
+	lockAcquire(&g_lock);
+	if(pConditions)
+		g_conditions = *pConditions;
+	else
+		memset(&g_conditions, 0, sizeof(g_conditions));
+	g_sequence = 0;
+	lockRelease(&g_lock);
+}
+
+usock_err_t usock_memory_set_socket_conditions(usock_handle_t hsock, const usock_memory_conditions_t *pConditions)
+{
+	struct MemoryState *st;
+
+	if(!hsock)
+		return USOCK_ERROR_INVALID_ARG;
+	if(GET_TRANSPORT(hsock) != &g_memoryTransport || !(st = GET_MEMORY(hsock)))
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+
+	if(pConditions)
+		st->conditions = *pConditions;
+	else
+		memset(&st->conditions, 0, sizeof(st->conditions));
+	st->rng ^= st->conditions.seed;
+	return USOCK_OK;
+}
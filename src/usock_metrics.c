@@ -0,0 +1,615 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+/*
+* Prometheus text exporter.
+* Gauges and histograms are read with relaxed atomic loads, so taking a
+* snapshot never holds up the threads doing I/O. Only the per-socket
+* counters need the registry lock, for as long as it takes to copy them.
+*/
+
+#include <usock.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "usock_internal.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+/* Largest request the HTTP exporter reads before answering */
+#define REQUEST_BUFFER_SIZE 2048
+/* How long the HTTP exporter waits for a request */
+#define REQUEST_TIMEOUT_MS  1000
+/* How often the exporter thread checks whether it should stop */
+#define STOP_POLL_MS        100
+
+/* The smallest and largest power of two, in ns, given a histogram le bound */
+#define LE_FIRST_EXPONENT 4
+#define LE_LAST_EXPONENT  39
+
+typedef struct
+{
+	char  *data;
+	size_t len;
+	size_t cap;
+	int    failed;
+} MetricsText;
+
+typedef struct
+{
+	char           name[MAX_SOCKET_NAME_LEN + 1];
+	usock_handle_t hsock;
+	usock_stats_t  stats;
+} SocketSnapshot;
+
+static const struct
+{
+	const char *name;
+	const char *help;
+	size_t      offset;
+} kStatFields[] = {
+	{ "bytes_sent",        "Bytes sent.",                                offsetof(usock_stats_t, bytesSent) },
+	{ "bytes_received",    "Bytes received.",                            offsetof(usock_stats_t, bytesReceived) },
+	{ "messages_sent",     "Messages sent.",                             offsetof(usock_stats_t, messagesSent) },
+	{ "messages_received", "Receive calls that returned data.",          offsetof(usock_stats_t, messagesReceived) },
+	{ "send_calls",        "Send calls.",                                offsetof(usock_stats_t, sendCalls) },
+	{ "recv_calls",        "Receive calls.",                             offsetof(usock_stats_t, recvCalls) },
+	{ "send_would_block",  "Send calls that found the socket not ready.", offsetof(usock_stats_t, sendWouldBlock) },
+	{ "recv_would_block",  "Receive calls that found no data ready.",    offsetof(usock_stats_t, recvWouldBlock) },
+	{ "send_errors",       "Send calls that failed.",                    offsetof(usock_stats_t, sendErrors) },
+	{ "recv_errors",       "Receive calls that failed.",                 offsetof(usock_stats_t, recvErrors) },
+	{ "short_writes",      "Sends that took less than they were given.", offsetof(usock_stats_t, shortWrites) },
+};
+
+static const char *const kLatencyOps[USOCK_LATENCY_OP_COUNT] = {
+	"send", "recv", "accept", "connect", "tx_stack", "tx_queue", "rx_queue"
+};
+
+/* Exporter state, only touched by the thread that starts and stops it */
+static volatile int g_running = 0;
+static usock_handle_t g_listener = NULL;
+static char *g_path = NULL;
+static unsigned g_intervalMs = 0;
+
+/***************************************/
+/*          Platform helpers           */
+
+#ifdef _WIN32
+
+static HANDLE g_thread = NULL;
+
+static DWORD WINAPI exporterMain(LPVOID param);
+
+static int startThread()
+{
+	g_thread = CreateThread(NULL, 0, exporterMain, NULL, 0, NULL);
+	return g_thread != NULL;
+}
+
+static void joinThread()
+{
+	WaitForSingleObject(g_thread, INFINITE);
+	CloseHandle(g_thread);
+	g_thread = NULL;
+}
+
+static void sleepMs(unsigned ms)
+{
+	Sleep(ms);
+}
+
+static int replaceFile(const char *from, const char *to)
+{
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+}
+
+#else
+
+static pthread_t g_thread;
+
+static void *exporterMain(void *param);
+
+static int startThread()
+{
+	return pthread_create(&g_thread, NULL, exporterMain, NULL) == 0;
+}
+
+static void joinThread()
+{
+	pthread_join(g_thread, NULL);
+}
+
+static void sleepMs(unsigned ms)
+{
+	struct timespec ts;
+	ts.tv_sec  = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+static int replaceFile(const char *from, const char *to)
+{
+	return rename(from, to);
+}
+
+#endif
+
+/***************************************/
+/*             Rendering               */
+
+static int reserve(MetricsText *text, size_t extra)
+{
+	char *data;
+	size_t cap;
+
+	if(text->failed)
+		return 0;
+	if(text->len + extra < text->cap)
+		return 1;
+
+	cap = text->cap ? text->cap * 2 : 16384;
+	while(cap <= text->len + extra)
+		cap *= 2;
+
+	data = (char *)g_palloc(cap);
+	if(!data)
+	{
+		text->failed = 1;
+		return 0;
+	}
+	if(text->data)
+	{
+		memcpy(data, text->data, text->len);
+		g_pfree(text->data);
+	}
+	text->data = data;
+	text->cap  = cap;
+	return 1;
+}
+
+static void append(MetricsText *text, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	if(n < 0 || !reserve(text, (size_t)n + 1))
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(text->data + text->len, (size_t)n + 1, fmt, args);
+	va_end(args);
+	text->len += (size_t)n;
+}
+
+/* Label values may not contain raw quotes, backslashes or line breaks */
+static void appendLabel(MetricsText *text, const char *value)
+{
+	for(; *value; ++value)
+	{
+		if(*value == '"' || *value == '\\')
+			append(text, "\\%c", *value);
+		else if(*value == '\n')
+			append(text, "\\n");
+		else
+			append(text, "%c", *value);
+	}
+}
+
+static void appendHeader(MetricsText *text, const char *name, const char *type, const char *help)
+{
+	append(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static usock_size_t statField(const usock_stats_t *stats, size_t offset)
+{
+	return *(const usock_size_t *)((const unsigned char *)stats + offset);
+}
+
+/* Copy the counters of every socket that has them */
+static SocketSnapshot *snapshotSockets(usock_size_t *pOutCount)
+{
+	SocketSnapshot *snapshot;
+	struct SockInfoNode *node;
+	usock_size_t count = 0, n = 0;
+	usock_size_t *counters;
+	unsigned s;
+	size_t i;
+
+	for(s = 0; s < REGISTRY_SHARDS; ++s)
+	{
+		registryLock(s);
+		for(node = g_shards[s].head; node; node = node->next)
+			count += node->stats != NULL;
+		registryUnlock(s);
+	}
+
+	*pOutCount = 0;
+	if(!count)
+		return NULL;
+
+	snapshot = (SocketSnapshot *)g_palloc(sizeof(SocketSnapshot) * count);
+	if(!snapshot)
+		return NULL;
+
+	/* Sockets created in between are left for the next snapshot */
+	for(s = 0; s < REGISTRY_SHARDS && n < count; ++s)
+	{
+		registryLock(s);
+		for(node = g_shards[s].head; node && n < count; node = node->next)
+		{
+			if(!node->stats)
+				continue;
+			memcpy(snapshot[n].name, node->name, MAX_SOCKET_NAME_LEN);
+			snapshot[n].name[MAX_SOCKET_NAME_LEN] = '\0';
+			snapshot[n].hsock = node;
+			counters = (usock_size_t *)&snapshot[n].stats;
+			for(i = 0; i < sizeof(usock_stats_t) / sizeof(usock_size_t); ++i)
+				counters[i] = STAT_LOAD(((usock_size_t *)node->stats)[i]);
+			++n;
+		}
+		registryUnlock(s);
+	}
+
+	*pOutCount = n;
+	return snapshot;
+}
+
+static void renderLatency(MetricsText *text)
+{
+	usock_latency_histogram_t *hist;
+	usock_size_t cumulative;
+	unsigned op, bucket, exponent;
+
+	hist = (usock_latency_histogram_t *)g_palloc(sizeof(usock_latency_histogram_t));
+	if(!hist)
+		return;
+
+	appendHeader(text, "usock_call_duration_seconds", "histogram",
+	             "Sampled duration of socket calls, and kernel timestamping delays.");
+	for(op = 0; op < USOCK_LATENCY_OP_COUNT; ++op)
+	{
+		usock_latency_get_histogram((usock_latency_op_t)op, hist);
+
+		/* Powers of two are bucket edges, so these sums are exact */
+		cumulative = 0;
+		bucket = 0;
+		for(exponent = LE_FIRST_EXPONENT; exponent <= LE_LAST_EXPONENT; ++exponent)
+		{
+			for(; bucket < USOCK_LATENCY_BUCKET_COUNT && usock_latency_bucket_bound(bucket) < (1ULL << exponent); ++bucket)
+				cumulative += hist->buckets[bucket];
+			append(text, "usock_call_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n",
+			       kLatencyOps[op], (double)(1ULL << exponent) / 1e9, (unsigned long long)cumulative);
+		}
+		append(text, "usock_call_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+		       kLatencyOps[op], (unsigned long long)hist->count);
+		append(text, "usock_call_duration_seconds_sum{op=\"%s\"} %.9f\n",
+		       kLatencyOps[op], (double)hist->sumNs / 1e9);
+		append(text, "usock_call_duration_seconds_count{op=\"%s\"} %llu\n",
+		       kLatencyOps[op], (unsigned long long)hist->count);
+	}
+
+	g_pfree(hist);
+}
+
+static void render(MetricsText *text)
+{
+	SocketSnapshot *sockets;
+	usock_stats_t totals;
+	usock_size_t count, s;
+	size_t f;
+	char name[64];
+
+	appendHeader(text, "usock_sockets", "gauge", "Socket handles that have not been freed.");
+	append(text, "usock_sockets %llu\n", (unsigned long long)registryLiveSockets());
+
+	appendHeader(text, "usock_allocated_bytes", "gauge", "Bytes allocated by the library and not yet freed.");
+	append(text, "usock_allocated_bytes %llu\n", (unsigned long long)registryAllocatedBytes());
+
+	usock_get_aggregate_stats(&totals);
+	sockets = snapshotSockets(&count);
+
+	for(f = 0; f < sizeof(kStatFields) / sizeof(kStatFields[0]); ++f)
+	{
+		snprintf(name, sizeof(name), "usock_%s_total", kStatFields[f].name);
+		appendHeader(text, name, "counter", kStatFields[f].help);
+		append(text, "%s %llu\n", name, (unsigned long long)statField(&totals, kStatFields[f].offset));
+
+		if(!count)
+			continue;
+
+		snprintf(name, sizeof(name), "usock_socket_%s_total", kStatFields[f].name);
+		appendHeader(text, name, "counter", kStatFields[f].help);
+		for(s = 0; s < count; ++s)
+		{
+			append(text, "%s{socket=\"", name);
+			appendLabel(text, sockets[s].name);
+			append(text, "\",handle=\"%p\"} %llu\n", sockets[s].hsock,
+			       (unsigned long long)statField(&sockets[s].stats, kStatFields[f].offset));
+		}
+	}
+
+	if(sockets)
+		g_pfree(sockets);
+
+	renderLatency(text);
+}
+
+/***************************************/
+/*             Exporters               */
+
+static void sendAll(usock_handle_t hsock, const char *data, size_t len)
+{
+	usock_ssize_t sent;
+
+	while(len > 0)
+	{
+		sent = usock_send(hsock, data, len);
+		if(sent <= 0)
+			return;
+		data += sent;
+		len  -= (size_t)sent;
+	}
+}
+
+static void serveClient(usock_handle_t client)
+{
+	char request[REQUEST_BUFFER_SIZE];
+	usock_pollfd_t pfd;
+	usock_ssize_t n;
+	size_t received = 0;
+	MetricsText text = { NULL, 0, 0, 0 };
+	char header[128];
+	int headerLen;
+
+	/* Any request gets the metrics; just wait for the end of its headers */
+	while(received < sizeof(request) - 1)
+	{
+		pfd.hsock   = client;
+		pfd.events  = USOCK_POLL_IN;
+		pfd.revents = 0;
+		if(usock_poll(&pfd, 1, REQUEST_TIMEOUT_MS) <= 0)
+			return;
+
+		n = usock_recv(client, request + received, sizeof(request) - 1 - received);
+		if(n <= 0)
+			return;
+		received += (size_t)n;
+		request[received] = '\0';
+		if(strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+
+	render(&text);
+	if(text.failed)
+	{
+		static const char kUnavailable[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		sendAll(client, kUnavailable, sizeof(kUnavailable) - 1);
+	}
+	else
+	{
+		headerLen = snprintf(header, sizeof(header),
+		                     "HTTP/1.0 200 OK\r\n"
+		                     "Content-Type: text/plain; version=0.0.4\r\n"
+		                     "Content-Length: %llu\r\n"
+		                     "Connection: close\r\n\r\n",
+		                     (unsigned long long)text.len);
+		sendAll(client, header, (size_t)headerLen);
+		sendAll(client, text.data, text.len);
+	}
+
+	if(text.data)
+		g_pfree(text.data);
+}
+
+static void serveLoop()
+{
+	usock_handle_t client;
+	usock_pollfd_t pfd;
+
+	while(g_running)
+	{
+		pfd.hsock   = g_listener;
+		pfd.events  = USOCK_POLL_IN;
+		pfd.revents = 0;
+		if(usock_poll(&pfd, 1, STOP_POLL_MS) <= 0)
+			continue;
+
+		if(usock_accept(g_listener, &client) != USOCK_OK)
+			continue;
+		serveClient(client);
+		usock_close_socket(client);
+		usock_free_socket(client);
+	}
+}
+
+static void writeSnapshot()
+{
+	MetricsText text = { NULL, 0, 0, 0 };
+	size_t pathLen = strlen(g_path);
+	char *tmpPath;
+	FILE *file = NULL;
+
+	render(&text);
+	tmpPath = (char *)g_palloc(pathLen + 5);
+	if(text.failed || !tmpPath)
+		goto done;
+
+	memcpy(tmpPath, g_path, pathLen);
+	memcpy(tmpPath + pathLen, ".tmp", 5);
+
+#ifdef _WIN32
+	if(fopen_s(&file, tmpPath, "wb") != 0)
+		file = NULL;
+#else
+	file = fopen(tmpPath, "wb");
+#endif
+	if(!file)
+		goto done;
+
+	fwrite(text.data, 1, text.len, file);
+	if(fclose(file) == 0)
+		replaceFile(tmpPath, g_path);
+
+done:
+	if(tmpPath)
+		g_pfree(tmpPath);
+	if(text.data)
+		g_pfree(text.data);
+}
+
+static void fileLoop()
+{
+	unsigned waited;
+
+	while(g_running)
+	{
+		writeSnapshot();
+		for(waited = 0; g_running && waited < g_intervalMs; waited += STOP_POLL_MS)
+			sleepMs(g_intervalMs - waited < STOP_POLL_MS ? g_intervalMs - waited : STOP_POLL_MS);
+	}
+	writeSnapshot();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI exporterMain(LPVOID param)
+#else
+static void *exporterMain(void *param)
+#endif
+{
+	if(g_listener)
+		serveLoop();
+	else
+		fileLoop();
+	return 0;
+}
+
+/***************************************/
+/*             Public API              */
+
+usock_size_t usock_metrics_format(char *pBuffer, usock_size_t len)
+{
+	MetricsText text = { NULL, 0, 0, 0 };
+	usock_size_t total;
+
+	render(&text);
+	total = text.len;
+	if(len > 0)
+	{
+		usock_size_t n = total < len ? total : len - 1;
+		if(n)
+			memcpy(pBuffer, text.data, (size_t)n);
+		pBuffer[n] = '\0';
+	}
+
+	if(text.data)
+		g_pfree(text.data);
+	return total;
+}
+
+usock_err_t usock_metrics_serve(usock_port_t port)
+{
+	usock_err_t err;
+
+	if(g_running)
+		return USOCK_ERROR_ALREADY_INITIALIZED;
+
+	err = usock_create_socket("usock-metrics", &g_listener);
+	if(err != USOCK_OK)
+		return err;
+
+	usock_configure(g_listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	err = usock_bind_address(g_listener, "127.0.0.1", port);
+	if(err == USOCK_OK)
+		err = usock_listen(g_listener, 16);
+
+	g_running = 1;
+	if(err == USOCK_OK && !startThread())
+		err = USOCK_ERROR_INTERNAL;
+
+	if(err != USOCK_OK)
+	{
+		g_running = 0;
+		usock_close_socket(g_listener);
+		usock_free_socket(g_listener);
+		g_listener = NULL;
+	}
+	return err;
+}
+
+usock_err_t usock_metrics_write_file(const char *path, unsigned intervalMs)
+{
+	size_t pathLen;
+
+	if(!path || !intervalMs)
+		return USOCK_ERROR_INVALID_ARG;
+	if(g_running)
+		return USOCK_ERROR_ALREADY_INITIALIZED;
+
+	pathLen = strlen(path);
+	g_path = (char *)g_palloc(pathLen + 1);
+	if(!g_path)
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	memcpy(g_path, path, pathLen + 1);
+	g_intervalMs = intervalMs;
+
+	g_running = 1;
+	if(!startThread())
+	{
+		g_running = 0;
+		g_pfree(g_path);
+		g_path = NULL;
+		return USOCK_ERROR_INTERNAL;
+	}
+	return USOCK_OK;
+}
+
+void usock_metrics_stop()
+{
+	if(!g_running)
+		return;
+
+	g_running = 0;
+	joinThread();
+
+	if(g_listener)
+	{
+		usock_close_socket(g_listener);
+		usock_free_socket(g_listener);
+		g_listener = NULL;
+	}
+	if(g_path)
+	{
+		g_pfree(g_path);
+		g_path = NULL;
+	}
+}
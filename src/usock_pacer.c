@@ -0,0 +1,181 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_pacer.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+static void sleepNs(usock_size_t ns)
+{
+#ifdef _WIN32
+	/* Sleep has millisecond granularity; round up so we never wake early */
+	Sleep((DWORD)((ns + 999999) / 1000000));
+#else
+	struct timespec ts;
+	ts.tv_sec  = (time_t)(ns / 1000000000ULL);
+	ts.tv_nsec = (long)(ns % 1000000000ULL);
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void refill(usock_pacer_t *pacer)
+{
+	usock_size_t now = usock_get_time_ns();
+	pacer->tokens += (double)(now - pacer->lastRefill) * pacer->rate;
+	if(pacer->tokens > pacer->burst)
+		pacer->tokens = pacer->burst;
+	pacer->lastRefill = now;
+}
+
+/*
+* Count how many of the messages fit in the bucket right now.
+* A message bigger than the bucket is let through once the bucket is
+* full, so that it doesn't stall the sender forever.
+*/
+static usock_size_t fitMessages(const usock_pacer_t *pacer, const usock_msg_t *pMsgs, usock_size_t count)
+{
+	double tokens = pacer->tokens;
+	usock_size_t n;
+
+	for(n = 0; n < count; ++n)
+	{
+		if((double)pMsgs[n].len > tokens && !(n == 0 && tokens >= pacer->burst))
+			break;
+		tokens -= (double)pMsgs[n].len;
+	}
+	return n;
+}
+
+static void consume(usock_pacer_t *pacer, const usock_msg_t *pMsgs, usock_size_t count)
+{
+	usock_size_t i;
+	for(i = 0; i < count; ++i)
+		pacer->tokens -= (double)pMsgs[i].len;
+}
+
+static int useKernelPacing(usock_pacer_t *pacer, usock_handle_t hsock)
+{
+	if(!(pacer->flags & USOCK_PACER_KERNEL))
+		return 0;
+
+	if(pacer->kernelSock != hsock)
+	{
+		if(usock_set_max_pacing_rate(hsock, pacer->bytesPerSecond) != USOCK_OK)
+		{
+			/* Not supported here; pace in user space from now on */
+			pacer->flags &= ~USOCK_PACER_KERNEL;
+			return 0;
+		}
+		pacer->kernelSock = hsock;
+	}
+	return 1;
+}
+
+usock_err_t usock_pacer_init(usock_pacer_t *pPacer, usock_size_t bytesPerSecond, usock_size_t burstBytes, usock_flags_t flags)
+{
+	if(!pPacer || bytesPerSecond == 0 || burstBytes == 0)
+		return USOCK_ERROR_INVALID_ARG;
+
+	pPacer->rate           = (double)bytesPerSecond / 1e9;
+	pPacer->burst          = (double)burstBytes;
+	pPacer->tokens         = (double)burstBytes;
+	pPacer->lastRefill     = usock_get_time_ns();
+	pPacer->bytesPerSecond = bytesPerSecond;
+	pPacer->flags          = flags;
+	pPacer->kernelSock     = NULL;
+	return USOCK_OK;
+}
+
+usock_ssize_t usock_pacer_try_send_to(usock_pacer_t *pPacer, usock_handle_t hsock, const usock_msg_t *pMsgs, usock_size_t count, usock_flags_t flags)
+{
+	usock_size_t n;
+	usock_ssize_t ret;
+
+	refill(pPacer);
+	n = fitMessages(pPacer, pMsgs, count);
+	if(n == 0)
+		return 0;
+
+	ret = usock_send_to_batch(hsock, pMsgs, n, flags);
+	if(ret > 0)
+		consume(pPacer, pMsgs, (usock_size_t)ret);
+	return ret;
+}
+
+usock_ssize_t usock_pacer_send_to(usock_pacer_t *pPacer, usock_handle_t hsock, const usock_msg_t *pMsgs, usock_size_t count, usock_flags_t flags)
+{
+	usock_size_t sent = 0;
+	usock_size_t n;
+	usock_ssize_t ret;
+	int kernel = useKernelPacing(pPacer, hsock);
+
+	while(sent < count)
+	{
+		if(kernel)
+		{
+			/* 
+			*  The kernel spaces out the packets, we only need to keep
+			*  each burst within the bucket size.
+			*/
+			pPacer->tokens = pPacer->burst;
+		}
+		else
+		{
+			refill(pPacer);
+		}
+
+		n = fitMessages(pPacer, pMsgs + sent, count - sent);
+		if(n == 0)
+		{
+			sleepNs(usock_pacer_delay_ns(pPacer, pMsgs[sent].len));
+			continue;
+		}
+
+		ret = usock_send_to_batch(hsock, pMsgs + sent, n, flags);
+		if(ret < 0)
+			return sent > 0 ? (usock_ssize_t)sent : -1;
+
+		consume(pPacer, pMsgs + sent, (usock_size_t)ret);
+		sent += (usock_size_t)ret;
+	}
+
+	return (usock_ssize_t)sent;
+}
+
+usock_size_t usock_pacer_delay_ns(usock_pacer_t *pPacer, usock_size_t bytes)
+{
+	double needed;
+
+	refill(pPacer);
+
+	/* Oversized messages only have to wait for a full bucket */
+	needed = (double)bytes < pPacer->burst ? (double)bytes : pPacer->burst;
+	if(pPacer->tokens >= needed)
+		return 0;
+
+	return (usock_size_t)((needed - pPacer->tokens) / pPacer->rate) + 1;
+}
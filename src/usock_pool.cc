@@ -0,0 +1,319 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_pool.hpp>
+#include <cstdio>
+#include <vector>
+
+namespace usock
+{
+	struct pool::connection
+	{
+		handle_t hsock;
+		host *owner;
+		usock_size_t lastUsedNs;
+		connection *next;
+	};
+
+	struct pool::host
+	{
+		pool *owner;
+		// Leases push back here without locking
+		std::atomic<connection *> returned{ nullptr };
+		// Guards idle; most recently used on top
+		std::mutex lock;
+		connection *idle = nullptr;
+		std::atomic<size_t> open{ 0 };
+	};
+
+	pool::lease::lease(connection *conn) : m_conn(conn), m_broken(false)
+	{
+		m_handle = conn->hsock;
+	}
+
+	handle_t pool::lease::release()
+	{
+		handle_t hsock = m_handle;
+		if(m_conn)
+		{
+			m_conn->owner->open.fetch_sub(1, std::memory_order_relaxed);
+			delete m_conn;
+		}
+		m_conn = nullptr;
+		m_handle = nullptr;
+		return hsock;
+	}
+
+	void pool::lease::reset()
+	{
+		connection *conn = m_conn;
+		m_conn = nullptr;
+		m_handle = nullptr;
+		if(!conn)
+			return;
+
+		if(m_broken)
+		{
+			m_broken = false;
+			conn->owner->owner->m_broken.fetch_add(1, std::memory_order_relaxed);
+			conn->owner->owner->close(conn);
+			return;
+		}
+
+		// Push-only, so there's no ABA; acquire() takes the whole stack at once
+		conn->lastUsedNs = usock_get_time_ns();
+		host *h = conn->owner;
+		conn->next = h->returned.load(std::memory_order_relaxed);
+		while(!h->returned.compare_exchange_weak(conn->next, conn, std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	pool::pool() : pool(options()) {}
+
+	pool::pool(const options &opts) :
+		m_opts(opts), m_reused(0), m_connected(0), m_expired(0), m_broken(0)
+	{
+	}
+
+	pool::~pool()
+	{
+		for(auto &entry : m_hosts)
+		{
+			host &h = *entry.second;
+			connection *conn = h.returned.exchange(nullptr, std::memory_order_acquire);
+			while(conn)
+			{
+				connection *next = conn->next;
+				close(conn);
+				conn = next;
+			}
+			for(conn = h.idle; conn; )
+			{
+				connection *next = conn->next;
+				close(conn);
+				conn = next;
+			}
+		}
+	}
+
+	pool::lease pool::acquire(const char *ip_address, port_t port, err_t *pErr)
+	{
+		host *h = find_host(ip_address, port);
+		err_t err = USOCK_OK;
+
+		for(;;)
+		{
+			connection *conn = take_idle(*h, usock_get_time_ns());
+			if(!conn)
+				break;
+			if(is_healthy(conn))
+			{
+				m_reused.fetch_add(1, std::memory_order_relaxed);
+				if(pErr)
+					*pErr = USOCK_OK;
+				return lease(conn);
+			}
+			m_broken.fetch_add(1, std::memory_order_relaxed);
+			close(conn);
+		}
+
+		// Claim a slot before connecting, so racing callers can't overshoot
+		if(h->open.fetch_add(1, std::memory_order_relaxed) >= m_opts.maxPerHost)
+		{
+			h->open.fetch_sub(1, std::memory_order_relaxed);
+			if(pErr)
+				*pErr = USOCK_ERROR_LIMIT_REACHED;
+			return lease();
+		}
+
+		handle_t hsock = nullptr;
+		err = usock_create_socket("pooled connection", &hsock);
+		if(err == USOCK_OK)
+		{
+			usock_configure(hsock, m_opts.domain, USOCK_SOCKTYPE_RELIABLE, m_opts.flags);
+			err = usock_connect(hsock, ip_address, port);
+		}
+		if(pErr)
+			*pErr = err;
+		if(err != USOCK_OK)
+		{
+			if(hsock)
+			{
+				usock_close_socket(hsock);
+				usock_free_socket(hsock);
+			}
+			h->open.fetch_sub(1, std::memory_order_relaxed);
+			return lease();
+		}
+
+		m_connected.fetch_add(1, std::memory_order_relaxed);
+		return lease(new connection{ hsock, h, 0, nullptr });
+	}
+
+	size_t pool::evict_idle()
+	{
+		std::vector<host *> hosts;
+		{
+			std::lock_guard<std::mutex> lock(m_hostsLock);
+			hosts.reserve(m_hosts.size());
+			for(auto &entry : m_hosts)
+				hosts.push_back(entry.second.get());
+		}
+
+		const usock_size_t now = usock_get_time_ns();
+		const usock_size_t maxIdleNs = m_opts.maxIdleMs * 1000000ull;
+		size_t closed = 0;
+		for(host *h : hosts)
+		{
+			connection *expired = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(h->lock);
+				collect_returned(*h);
+
+				connection **link = &h->idle;
+				while(*link)
+				{
+					connection *conn = *link;
+					if(conn->lastUsedNs + maxIdleNs < now)
+					{
+						*link = conn->next;
+						conn->next = expired;
+						expired = conn;
+					}
+					else
+						link = &conn->next;
+				}
+			}
+
+			// Closing can block, so it happens outside the lock
+			while(expired)
+			{
+				connection *next = expired->next;
+				close(expired);
+				expired = next;
+				++closed;
+			}
+		}
+		m_expired.fetch_add(closed, std::memory_order_relaxed);
+		return closed;
+	}
+
+	size_t pool::open_count(const char *ip_address, port_t port)
+	{
+		return find_host(ip_address, port)->open.load(std::memory_order_relaxed);
+	}
+
+	pool::stats pool::get_stats() const
+	{
+		stats s;
+		s.reused    = m_reused.load(std::memory_order_relaxed);
+		s.connected = m_connected.load(std::memory_order_relaxed);
+		s.expired   = m_expired.load(std::memory_order_relaxed);
+		s.broken    = m_broken.load(std::memory_order_relaxed);
+		return s;
+	}
+
+	pool::host *pool::find_host(const char *ip_address, port_t port)
+	{
+		char key[64];
+		snprintf(key, sizeof(key), "%s:%hu", ip_address, port);
+
+		// Hosts are never removed, so the pointer outlives the lock
+		std::lock_guard<std::mutex> lock(m_hostsLock);
+		std::unique_ptr<host> &h = m_hosts[key];
+		if(!h)
+		{
+			h.reset(new host);
+			h->owner = this;
+		}
+		return h.get();
+	}
+
+	// Caller holds h.lock
+	void pool::collect_returned(host &h)
+	{
+		// Everything returned is newer than what's already idle
+		connection *returned = h.returned.exchange(nullptr, std::memory_order_acquire);
+		if(!returned)
+			return;
+
+		connection *tail = returned;
+		while(tail->next)
+			tail = tail->next;
+		tail->next = h.idle;
+		h.idle = returned;
+	}
+
+	pool::connection *pool::take_idle(host &h, usock_size_t now)
+	{
+		const usock_size_t maxIdleNs = m_opts.maxIdleMs * 1000000ull;
+		connection *conn = nullptr;
+		connection *expired = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(h.lock);
+			collect_returned(h);
+
+			// The top is the newest, so once it's too old the rest are too.
+			// A racing return can stamp a time after now, hence no subtraction.
+			conn = h.idle;
+			if(conn && conn->lastUsedNs + maxIdleNs < now)
+			{
+				expired = conn;
+				conn = nullptr;
+				h.idle = nullptr;
+			}
+			else if(conn)
+				h.idle = conn->next;
+		}
+
+		size_t count = 0;
+		while(expired)
+		{
+			connection *next = expired->next;
+			close(expired);
+			expired = next;
+			++count;
+		}
+		if(count)
+			m_expired.fetch_add(count, std::memory_order_relaxed);
+		return conn;
+	}
+
+	// A quiet connection has nothing to read; if it's readable the peer hung up or sent junk
+	bool pool::is_healthy(connection *conn) const
+	{
+		usock_pollfd_t fd;
+		fd.hsock = conn->hsock;
+		fd.events = USOCK_POLL_IN;
+		fd.revents = 0;
+		return usock_poll(&fd, 1, 0) == 0;
+	}
+
+	void pool::close(connection *conn)
+	{
+		conn->owner->open.fetch_sub(1, std::memory_order_relaxed);
+		usock_close_socket(conn->hsock);
+		usock_free_socket(conn->hsock);
+		delete conn;
+	}
+}
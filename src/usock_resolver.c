@@ -0,0 +1,539 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+/*
+* Cached, asynchronous name resolution.
+* Names live in a small hash table. A lookup that misses queues the entry
+* for the worker thread and leaves a waiter on it; later lookups of the
+* same name while it's in flight just add their waiters, so they share
+* the one getaddrinfo call.
+*/
+
+#include <usock.h>
+#include "usock_internal.h"
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#endif
+
+#define RESOLVER_BUCKETS   256
+#define RESOLVER_MAX_NAME  256
+
+typedef struct ResolveWaiter
+{
+	struct ResolveWaiter *next;
+	usock_resolve_callback_t callback;
+	void *pUserData;
+} ResolveWaiter;
+
+typedef struct ResolveEntry
+{
+	struct ResolveEntry *next;      /* Bucket chain */
+	struct ResolveEntry *queueNext; /* Work queue, while pending */
+	char name[RESOLVER_MAX_NAME];
+	int family;
+	int pending;
+	usock_err_t result;
+	usock_size_t count;
+	char addresses[USOCK_RESOLVE_MAX_ADDRESSES][USOCK_ADDRESS_STRLEN];
+	usock_size_t expiresNs;
+	ResolveWaiter *waiters;
+} ResolveEntry;
+
+/* An answer copied out of the table, to run callbacks without the lock */
+typedef struct ResolveAnswer
+{
+	usock_err_t result;
+	usock_size_t count;
+	char addresses[USOCK_RESOLVE_MAX_ADDRESSES][USOCK_ADDRESS_STRLEN];
+	const char *pointers[USOCK_RESOLVE_MAX_ADDRESSES];
+} ResolveAnswer;
+
+/* Everything below is guarded by the resolver lock */
+static volatile int g_running = 0;
+static usock_size_t g_ttlNs = 0;
+static usock_size_t g_negativeTtlNs = 0;
+static ResolveEntry *g_buckets[RESOLVER_BUCKETS];
+static ResolveEntry *g_queueHead = NULL;
+static ResolveEntry *g_queueTail = NULL;
+
+/***************************************/
+/*          Platform helpers           */
+
+#ifdef _WIN32
+
+static HANDLE g_thread = NULL;
+static SRWLOCK g_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE g_workCond = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE g_doneCond = CONDITION_VARIABLE_INIT;
+
+static DWORD WINAPI resolverMain(LPVOID param);
+
+static int startThread()
+{
+	g_thread = CreateThread(NULL, 0, resolverMain, NULL, 0, NULL);
+	return g_thread != NULL;
+}
+
+static void joinThread()
+{
+	WaitForSingleObject(g_thread, INFINITE);
+	CloseHandle(g_thread);
+	g_thread = NULL;
+}
+
+static void lockResolver()   { AcquireSRWLockExclusive(&g_lock); }
+static void unlockResolver() { ReleaseSRWLockExclusive(&g_lock); }
+static void waitWork()       { SleepConditionVariableSRW(&g_workCond, &g_lock, INFINITE, 0); }
+static void signalWork()     { WakeAllConditionVariable(&g_workCond); }
+static void waitDone()       { SleepConditionVariableSRW(&g_doneCond, &g_lock, INFINITE, 0); }
+static void signalDone()     { WakeAllConditionVariable(&g_doneCond); }
+
+#else
+
+static pthread_t g_thread;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_workCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_doneCond = PTHREAD_COND_INITIALIZER;
+
+static void *resolverMain(void *param);
+
+static int startThread()
+{
+	return pthread_create(&g_thread, NULL, resolverMain, NULL) == 0;
+}
+
+static void joinThread()
+{
+	pthread_join(g_thread, NULL);
+}
+
+static void lockResolver()   { pthread_mutex_lock(&g_lock); }
+static void unlockResolver() { pthread_mutex_unlock(&g_lock); }
+static void waitWork()       { pthread_cond_wait(&g_workCond, &g_lock); }
+static void signalWork()     { pthread_cond_broadcast(&g_workCond); }
+static void waitDone()       { pthread_cond_wait(&g_doneCond, &g_lock); }
+static void signalDone()     { pthread_cond_broadcast(&g_doneCond); }
+
+#endif
+
+static int familyOf(usock_domain_t domain)
+{
+	switch(domain)
+	{
+	case USOCK_DOMAIN_IPV4: return AF_INET;
+	case USOCK_DOMAIN_IPV6: return AF_INET6;
+	default:                return AF_UNSPEC;
+	}
+}
+
+/* True if the name is already an address of the family, no lookup needed */
+static int isNumeric(const char *hostname, int family)
+{
+	unsigned char addr[sizeof(struct in6_addr)];
+	if(family != AF_INET6 && inet_pton(AF_INET, hostname, addr) == 1)
+		return 1;
+	return family != AF_INET && inet_pton(AF_INET6, hostname, addr) == 1;
+}
+
+/***************************************/
+/*             The cache               */
+
+/* FNV-1a */
+static unsigned hashName(const char *name, int family)
+{
+	unsigned hash = 2166136261u ^ (unsigned)family;
+	for(; *name; ++name)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash % RESOLVER_BUCKETS;
+}
+
+static void copyAnswer(const ResolveEntry *entry, ResolveAnswer *pOut)
+{
+	usock_size_t i;
+	pOut->result = entry->result;
+	pOut->count  = entry->count;
+	memcpy(pOut->addresses, entry->addresses, sizeof(pOut->addresses));
+	for(i = 0; i < USOCK_RESOLVE_MAX_ADDRESSES; ++i)
+		pOut->pointers[i] = pOut->addresses[i];
+}
+
+static void runWaiters(ResolveWaiter *waiter, const ResolveAnswer *answer)
+{
+	while(waiter)
+	{
+		ResolveWaiter *next = waiter->next;
+		waiter->callback(waiter->pUserData, answer->result, answer->pointers, answer->count);
+		g_pfree(waiter);
+		waiter = next;
+	}
+}
+
+/*
+* Find the entry for a name, dropping expired answers from its bucket on
+* the way. Caller holds the lock.
+*/
+static ResolveEntry *findEntry(const char *hostname, int family, usock_size_t now)
+{
+	ResolveEntry **link = &g_buckets[hashName(hostname, family)];
+	ResolveEntry *found = NULL;
+
+	while(*link)
+	{
+		ResolveEntry *entry = *link;
+		if(entry->family == family && strcmp(entry->name, hostname) == 0)
+		{
+			found = entry;
+			link = &entry->next;
+		}
+		else if(!entry->pending && entry->expiresNs <= now)
+		{
+			*link = entry->next;
+			g_pfree(entry);
+		}
+		else
+			link = &entry->next;
+	}
+	return found;
+}
+
+static void enqueue(ResolveEntry *entry)
+{
+	entry->pending = 1;
+	entry->queueNext = NULL;
+	if(g_queueTail)
+		g_queueTail->queueNext = entry;
+	else
+		g_queueHead = entry;
+	g_queueTail = entry;
+	signalWork();
+}
+
+/***************************************/
+/*            Worker thread            */
+
+static void lookup(const char *hostname, int family, ResolveAnswer *pOut)
+{
+	struct addrinfo hints, *result, *ai;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = family;
+	hints.ai_socktype = SOCK_STREAM; /* One entry per address, not per socket type */
+
+	pOut->count = 0;
+	if(getaddrinfo(hostname, NULL, &hints, &result) != 0)
+	{
+		pOut->result = USOCK_ERROR_INTERNAL;
+		return;
+	}
+
+	for(ai = result; ai && pOut->count < USOCK_RESOLVE_MAX_ADDRESSES; ai = ai->ai_next)
+	{
+		if(getnameinfo(ai->ai_addr, (socklen_t)ai->ai_addrlen, pOut->addresses[pOut->count], USOCK_ADDRESS_STRLEN, NULL, 0, NI_NUMERICHOST) == 0)
+			++pOut->count;
+	}
+	freeaddrinfo(result);
+	pOut->result = pOut->count ? USOCK_OK : USOCK_ERROR_INTERNAL;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI resolverMain(LPVOID param)
+#else
+static void *resolverMain(void *param)
+#endif
+{
+	char name[RESOLVER_MAX_NAME];
+	ResolveAnswer answer;
+	ResolveWaiter *waiters;
+	ResolveEntry *entry;
+	int family;
+
+	lockResolver();
+	while(g_running)
+	{
+		if(!g_queueHead)
+		{
+			waitWork();
+			continue;
+		}
+
+		entry = g_queueHead;
+		g_queueHead = entry->queueNext;
+		if(!g_queueHead)
+			g_queueTail = NULL;
+		memcpy(name, entry->name, sizeof(name));
+		family = entry->family;
+
+		/* getaddrinfo may take seconds, the table stays usable meanwhile */
+		unlockResolver();
+		lookup(name, family, &answer);
+		lockResolver();
+
+		/* Pending entries are never freed, so the pointer is still good */
+		entry->result = answer.result;
+		entry->count = answer.count;
+		memcpy(entry->addresses, answer.addresses, sizeof(entry->addresses));
+		entry->expiresNs = usock_get_time_ns() + (answer.result == USOCK_OK ? g_ttlNs : g_negativeTtlNs);
+		entry->pending = 0;
+		waiters = entry->waiters;
+		entry->waiters = NULL;
+		copyAnswer(entry, &answer);
+
+		unlockResolver();
+		runWaiters(waiters, &answer);
+		lockResolver();
+	}
+	unlockResolver();
+	return 0;
+}
+
+/***************************************/
+/*             Public API              */
+
+usock_err_t usock_resolver_start(unsigned ttlMs, unsigned negativeTtlMs)
+{
+	lockResolver();
+	if(g_running)
+	{
+		unlockResolver();
+		return USOCK_ERROR_ALREADY_INITIALIZED;
+	}
+	g_ttlNs = (usock_size_t)ttlMs * 1000000ull;
+	g_negativeTtlNs = (usock_size_t)negativeTtlMs * 1000000ull;
+	g_running = 1;
+	unlockResolver();
+
+	if(!startThread())
+	{
+		g_running = 0;
+		return USOCK_ERROR_INTERNAL;
+	}
+	return USOCK_OK;
+}
+
+void usock_resolver_stop()
+{
+	ResolveWaiter *waiters = NULL;
+	ResolveAnswer failed;
+	unsigned i;
+
+	lockResolver();
+	if(!g_running)
+	{
+		unlockResolver();
+		return;
+	}
+	g_running = 0;
+	signalWork();
+	unlockResolver();
+	joinThread();
+
+	/* Nothing else touches the table once the worker is gone */
+	for(i = 0; i < RESOLVER_BUCKETS; ++i)
+	{
+		while(g_buckets[i])
+		{
+			ResolveEntry *entry = g_buckets[i];
+			ResolveWaiter *last = entry->waiters;
+			if(last)
+			{
+				while(last->next)
+					last = last->next;
+				last->next = waiters;
+				waiters = entry->waiters;
+			}
+			g_buckets[i] = entry->next;
+			g_pfree(entry);
+		}
+	}
+	g_queueHead = g_queueTail = NULL;
+
+	memset(&failed, 0, sizeof(failed));
+	failed.result = USOCK_ERROR_NOT_INITIALIZED;
+	runWaiters(waiters, &failed);
+}
+
+usock_err_t usock_resolve_async(const char *hostname, usock_domain_t domain, usock_resolve_callback_t callback, void *pUserData)
+{
+	int family = familyOf(domain);
+	ResolveEntry *entry;
+	ResolveWaiter *waiter;
+	ResolveAnswer answer;
+
+	if(!hostname || !callback || strlen(hostname) >= RESOLVER_MAX_NAME)
+		return USOCK_ERROR_INVALID_ARG;
+
+	if(isNumeric(hostname, family))
+	{
+		answer.result = USOCK_OK;
+		answer.count = 1;
+		answer.pointers[0] = hostname;
+		callback(pUserData, answer.result, answer.pointers, answer.count);
+		return USOCK_OK;
+	}
+
+	/* Allocated up front, so the lock is never held across the allocator */
+	waiter = (ResolveWaiter *)g_palloc(sizeof(ResolveWaiter));
+	if(!waiter)
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	waiter->callback = callback;
+	waiter->pUserData = pUserData;
+	waiter->next = NULL;
+
+	lockResolver();
+	if(!g_running)
+	{
+		unlockResolver();
+		g_pfree(waiter);
+		return USOCK_ERROR_NOT_INITIALIZED;
+	}
+
+	entry = findEntry(hostname, family, usock_get_time_ns());
+	if(entry && !entry->pending && entry->expiresNs > usock_get_time_ns())
+	{
+		copyAnswer(entry, &answer);
+		unlockResolver();
+		waiter->next = NULL;
+		runWaiters(waiter, &answer);
+		return USOCK_OK;
+	}
+
+	if(!entry)
+	{
+		entry = (ResolveEntry *)g_palloc(sizeof(ResolveEntry));
+		if(!entry)
+		{
+			unlockResolver();
+			g_pfree(waiter);
+			return USOCK_ERROR_OUT_OF_MEMORY;
+		}
+		memset(entry, 0, sizeof(ResolveEntry));
+		strcpy(entry->name, hostname);
+		entry->family = family;
+		entry->next = g_buckets[hashName(hostname, family)];
+		g_buckets[hashName(hostname, family)] = entry;
+	}
+
+	/* Join the lookup in flight, or start one */
+	waiter->next = entry->waiters;
+	entry->waiters = waiter;
+	if(!entry->pending)
+		enqueue(entry);
+	unlockResolver();
+	return USOCK_OK;
+}
+
+/* State of a caller blocked in usock_resolve, on its stack */
+typedef struct ResolveWait
+{
+	int done;
+	usock_err_t result;
+	usock_size_t count;
+	char addresses[USOCK_RESOLVE_MAX_ADDRESSES][USOCK_ADDRESS_STRLEN];
+} ResolveWait;
+
+static void onResolved(void *pUserData, usock_err_t result, const char *const *ppAddresses, usock_size_t count)
+{
+	ResolveWait *wait = (ResolveWait *)pUserData;
+	usock_size_t i;
+
+	lockResolver();
+	wait->result = result;
+	wait->count = count;
+	for(i = 0; i < count; ++i)
+	{
+		strncpy(wait->addresses[i], ppAddresses[i], USOCK_ADDRESS_STRLEN - 1);
+		wait->addresses[i][USOCK_ADDRESS_STRLEN - 1] = '\0';
+	}
+	wait->done = 1;
+	signalDone();
+	unlockResolver();
+}
+
+static usock_err_t resolveWait(const char *hostname, usock_domain_t domain, ResolveWait *wait)
+{
+	usock_err_t err;
+
+	memset(wait, 0, sizeof(ResolveWait));
+	err = usock_resolve_async(hostname, domain, onResolved, wait);
+	if(err != USOCK_OK)
+		return err;
+
+	lockResolver();
+	while(!wait->done)
+		waitDone();
+	unlockResolver();
+	return wait->result;
+}
+
+usock_err_t usock_resolve(const char *hostname, usock_domain_t domain, char *pOutAddress, usock_size_t len)
+{
+	ResolveWait wait;
+	usock_err_t err;
+
+	if(!pOutAddress || len == 0)
+		return USOCK_ERROR_INVALID_ARG;
+
+	err = resolveWait(hostname, domain, &wait);
+	if(err != USOCK_OK)
+		return err;
+	if(strlen(wait.addresses[0]) >= len)
+		return USOCK_ERROR_BUFFER_TOO_SMALL;
+
+	strcpy(pOutAddress, wait.addresses[0]);
+	return USOCK_OK;
+}
+
+usock_err_t usock_connect_host(usock_handle_t hsock, const char *hostname, usock_port_t port)
+{
+	ResolveWait wait;
+	usock_err_t err;
+	usock_size_t i;
+
+	/* Local addresses are paths and memory ones are names, there's nothing to look up */
+	if(GET_TRANSPORT(hsock) != &g_kernelTransport || socketDomain(hsock) == USOCK_DOMAIN_LOCAL)
+		return usock_connect(hsock, hostname, port);
+
+	err = resolveWait(hostname, socketDomain(hsock), &wait);
+	if(err != USOCK_OK)
+		return err;
+
+	for(i = 0; i < wait.count; ++i)
+	{
+		/* Each attempt opens a fresh socket, don't leak the failed one */
+		if(i > 0)
+			usock_close_socket(hsock);
+		err = usock_connect(hsock, wait.addresses[i], port);
+		if(err == USOCK_OK)
+			break;
+	}
+	return err;
+}
@@ -0,0 +1,863 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+/*
+* Reliable datagram transport (USOCK_SOCKTYPE_RELIABLE_DATAGRAM).
+*
+* Every packet gets a connection wide sequence number that is acked with a
+* cumulative ack plus a selective ack bitmap. Lost packets are detected
+* either by three later packets being acked (fast retransmit) or by the
+* retransmission timer, and the send rate follows a Reno style congestion
+* window. Ordering is tracked separately per channel on the receiving end,
+* so a loss only delays messages on the channel it happened on.
+*/
+
+#include "usock_internal.h"
+#include <string.h>
+#include <stddef.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <errno.h>
+#endif
+
+#define RUDP_WINDOW          256
+#define RUDP_HEADER_SIZE     20
+#define RUDP_ACK_SIZE        (16 + RUDP_WINDOW / 8)
+#define RUDP_MAX_PACKET      (RUDP_HEADER_SIZE + USOCK_RUDP_MAX_MESSAGE_SIZE)
+#define RUDP_DUP_THRESH      3
+#define RUDP_INITIAL_CWND    4.0
+#define RUDP_INITIAL_RTO_NS  200000000ULL
+#define RUDP_MIN_RTO_NS      20000000ULL
+#define RUDP_MAX_RTO_NS      2000000000ULL
+#define RUDP_LINGER_NS       2000000000ULL
+/* Retransmission timeouts in a row, with nothing acked, before the peer is given up on */
+#define RUDP_MAX_BACKOFFS    8
+
+enum
+{
+	RUDP_PACKET_DATA = 1,
+	RUDP_PACKET_ACK  = 2,
+};
+
+/* Header flags on the wire */
+#define RUDP_WIRE_UNORDERED 0x1
+
+/*
+* Wire format, all fields big endian.
+* DATA: type(1) channel(1) flags(1) pad(1) conv(4) seq(4) chanSeq(4) ts(4) payload
+* ACK:  type(1) pad(3) conv(4) cumAck(4) echoTs(4) bitmap(RUDP_WINDOW / 8)
+*       Bit i of the bitmap acks sequence number cumAck + 1 + i.
+*/
+
+typedef struct RudpMessage
+{
+	struct RudpMessage *next;
+	unsigned            channel;
+	unsigned            chanSeq;
+	usock_size_t        len;
+	unsigned char       data[];
+} RudpMessage;
+
+typedef struct RudpSendSlot
+{
+	unsigned char *packet; /* Header and payload, ready to go on the wire */
+	unsigned       len;
+	unsigned       lossMark; /* sndNxt at the time this slot was last sent */
+	usock_size_t   sentAt;
+	unsigned char  used;
+	unsigned char  sacked;
+	unsigned char  inFlight;
+	unsigned char  lost;
+} RudpSendSlot;
+
+typedef struct RudpChannel
+{
+	unsigned     sendSeq;  /* Next ordered sequence number to assign */
+	unsigned     recvSeq;  /* Next ordered sequence number to deliver */
+	RudpMessage *pending;  /* Early arrivals, sorted by chanSeq */
+} RudpChannel;
+
+struct RudpState
+{
+	unsigned           conv;
+	int                connected;
+	usock_size_t       epoch;
+
+	/* Send side */
+	unsigned           sndUna;
+	unsigned           sndNxt;
+	unsigned           highestSacked;
+	int                haveSacked;
+	unsigned           inflight;
+	double             cwnd;
+	double             ssthresh;
+	int                inRecovery;
+	unsigned           recoveryPoint;
+	usock_size_t       srtt;
+	usock_size_t       rttvar;
+	usock_size_t       rto;
+	int                haveRtt;
+	unsigned           backoffs;
+	int                failed;
+	RudpSendSlot       snd[RUDP_WINDOW];
+
+	/* Receive side */
+	unsigned           rcvNxt;
+	unsigned           echoTs;
+	int                ackPending;
+	unsigned char      rcvMask[RUDP_WINDOW];
+	RudpChannel        channels[USOCK_RUDP_MAX_CHANNELS];
+	RudpMessage       *readyHead;
+	RudpMessage       *readyTail;
+	usock_size_t       readyCount;
+
+	/* Simulated loss */
+	double             loss;
+	unsigned long long rng;
+
+	usock_rudp_stats_t stats;
+	unsigned char      scratch[RUDP_MAX_PACKET];
+};
+
+#define GET_RUDP(HSOCK) (GET_SOCK_NODE_FROM_HANDLE(HSOCK)->rudp)
+
+/* Wrap-around safe sequence number comparisons */
+#define SEQ_LT(A, B) ((int)((unsigned)(A) - (unsigned)(B)) < 0)
+#define SEQ_GE(A, B) (!SEQ_LT(A, B))
+
+static void put32(unsigned char *p, unsigned v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static unsigned get32(const unsigned char *p)
+{
+	return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | (unsigned)p[3];
+}
+
+static unsigned long long nextRandom(struct RudpState *st)
+{
+	/* xorshift64* */
+	st->rng ^= st->rng >> 12;
+	st->rng ^= st->rng << 25;
+	st->rng ^= st->rng >> 27;
+	return st->rng * 2685821657736338717ULL;
+}
+
+static unsigned timestampUs(struct RudpState *st, usock_size_t now)
+{
+	/* Never 0, so that 0 can mean "no timestamp" */
+	return (unsigned)((now - st->epoch) / 1000) | 1u;
+}
+
+static void sendPacket(usock_handle_t hsock, struct RudpState *st, const void *packet, usock_size_t len)
+{
+	++st->stats.packetsSent;
+	if(st->loss > 0.0 && (double)(nextRandom(st) >> 11) / 9007199254740992.0 < st->loss)
+		return;
+
+	/* 
+	*  Errors are treated like loss. In particular a peer that isn't up
+	*  yet makes the kernel report ECONNREFUSED, which the retransmission
+	*  timer already takes care of.
+	*/
+	rawSend(hsock, packet, len);
+}
+
+static void transmit(usock_handle_t hsock, struct RudpState *st, RudpSendSlot *slot, usock_size_t now)
+{
+	put32(slot->packet + 16, timestampUs(st, now));
+	slot->sentAt   = now;
+	slot->lossMark = st->sndNxt;
+	slot->lost     = 0;
+	if(!slot->inFlight)
+	{
+		slot->inFlight = 1;
+		++st->inflight;
+	}
+	sendPacket(hsock, st, slot->packet, slot->len);
+}
+
+static void releaseSlot(struct RudpState *st, RudpSendSlot *slot)
+{
+	if(slot->inFlight)
+	{
+		slot->inFlight = 0;
+		--st->inflight;
+	}
+	if(slot->packet)
+	{
+		g_pfree(slot->packet);
+		slot->packet = NULL;
+	}
+}
+
+static void markLost(struct RudpState *st, RudpSendSlot *slot)
+{
+	if(slot->inFlight)
+	{
+		slot->inFlight = 0;
+		--st->inflight;
+	}
+	slot->lost = 1;
+}
+
+static void enterRecovery(struct RudpState *st, double cwnd)
+{
+	st->ssthresh = st->cwnd / 2.0 < 2.0 ? 2.0 : st->cwnd / 2.0;
+	st->cwnd = cwnd < 1.0 ? st->ssthresh : cwnd;
+	st->inRecovery = 1;
+	st->recoveryPoint = st->sndNxt;
+}
+
+static void updateRtt(struct RudpState *st, usock_size_t sample)
+{
+	/* RFC 6298 */
+	if(!st->haveRtt)
+	{
+		st->srtt    = sample;
+		st->rttvar  = sample / 2;
+		st->haveRtt = 1;
+	}
+	else
+	{
+		usock_size_t delta = st->srtt > sample ? st->srtt - sample : sample - st->srtt;
+		st->rttvar = (3 * st->rttvar + delta) / 4;
+		st->srtt   = (7 * st->srtt + sample) / 8;
+	}
+
+	st->rto = st->srtt + 4 * st->rttvar;
+	if(st->rto < RUDP_MIN_RTO_NS)
+		st->rto = RUDP_MIN_RTO_NS;
+	if(st->rto > RUDP_MAX_RTO_NS)
+		st->rto = RUDP_MAX_RTO_NS;
+}
+
+/* Retransmit lost packets, oldest first, as far as the window allows */
+static void retransmitLost(usock_handle_t hsock, struct RudpState *st, usock_size_t now)
+{
+	unsigned seq;
+	for(seq = st->sndUna; SEQ_LT(seq, st->sndNxt) && st->inflight < (unsigned)st->cwnd; ++seq)
+	{
+		RudpSendSlot *slot = &st->snd[seq % RUDP_WINDOW];
+		if(slot->used && slot->lost)
+		{
+			++st->stats.retransmits;
+			transmit(hsock, st, slot, now);
+		}
+	}
+}
+
+static void checkTimeouts(usock_handle_t hsock, struct RudpState *st, usock_size_t now)
+{
+	unsigned seq;
+	int expired = 0;
+
+	for(seq = st->sndUna; SEQ_LT(seq, st->sndNxt); ++seq)
+	{
+		RudpSendSlot *slot = &st->snd[seq % RUDP_WINDOW];
+		if(slot->used && slot->inFlight && now - slot->sentAt >= st->rto)
+		{
+			expired = 1;
+			break;
+		}
+	}
+	if(!expired)
+		return;
+
+	/* Everything still in flight is presumed lost; restart from slow start */
+	for(seq = st->sndUna; SEQ_LT(seq, st->sndNxt); ++seq)
+	{
+		RudpSendSlot *slot = &st->snd[seq % RUDP_WINDOW];
+		if(slot->used && !slot->sacked)
+			markLost(st, slot);
+	}
+
+	++st->stats.timeouts;
+	if(++st->backoffs >= RUDP_MAX_BACKOFFS)
+	{
+		st->failed = 1;
+		return;
+	}
+	enterRecovery(st, 1.0);
+	st->rto = st->rto * 2 > RUDP_MAX_RTO_NS ? RUDP_MAX_RTO_NS : st->rto * 2;
+	retransmitLost(hsock, st, now);
+}
+
+static usock_size_t nextDeadline(struct RudpState *st)
+{
+	usock_size_t deadline = 0;
+	unsigned seq;
+
+	for(seq = st->sndUna; SEQ_LT(seq, st->sndNxt); ++seq)
+	{
+		RudpSendSlot *slot = &st->snd[seq % RUDP_WINDOW];
+		if(slot->used && slot->inFlight && (!deadline || slot->sentAt + st->rto < deadline))
+			deadline = slot->sentAt + st->rto;
+	}
+	return deadline;
+}
+
+static void processAck(usock_handle_t hsock, struct RudpState *st, const unsigned char *pkt, usock_size_t now)
+{
+	unsigned cumAck = get32(pkt + 8);
+	unsigned echoTs = get32(pkt + 12);
+	const unsigned char *bitmap = pkt + 16;
+	unsigned newlyAcked = 0;
+	unsigned seq, i;
+
+	if(SEQ_LT(st->sndNxt, cumAck))
+		return; /* Acks something we never sent */
+
+	/* Cumulative part */
+	for(seq = st->sndUna; SEQ_LT(seq, cumAck); ++seq)
+	{
+		RudpSendSlot *slot = &st->snd[seq % RUDP_WINDOW];
+		if(slot->used && !slot->sacked)
+			++newlyAcked;
+		releaseSlot(st, slot);
+		slot->used = 0;
+		slot->sacked = 0;
+		slot->lost = 0;
+	}
+	if(SEQ_LT(st->sndUna, cumAck))
+		st->sndUna = cumAck;
+
+	/* Selective part */
+	for(i = 0; i < RUDP_WINDOW; ++i)
+	{
+		RudpSendSlot *slot;
+		if(!(bitmap[i / 8] & (1u << (i % 8))))
+			continue;
+
+		seq = cumAck + 1 + i;
+		if(SEQ_GE(seq, st->sndNxt))
+			break;
+		/* A stale ack; this slot already holds a newer packet */
+		if(SEQ_LT(seq, st->sndUna))
+			continue;
+
+		slot = &st->snd[seq % RUDP_WINDOW];
+		if(slot->used && !slot->sacked)
+		{
+			slot->sacked = 1;
+			slot->lost = 0;
+			releaseSlot(st, slot);
+			++newlyAcked;
+		}
+		if(!st->haveSacked || SEQ_LT(st->highestSacked, seq))
+		{
+			st->highestSacked = seq;
+			st->haveSacked = 1;
+		}
+	}
+
+	if(!newlyAcked)
+		return;
+	st->backoffs = 0;
+
+	if(echoTs)
+	{
+		unsigned elapsedUs = timestampUs(st, now) - echoTs;
+		updateRtt(st, (usock_size_t)elapsedUs * 1000);
+	}
+
+	if(st->inRecovery && SEQ_GE(st->sndUna, st->recoveryPoint))
+		st->inRecovery = 0;
+
+	/* Grow the congestion window */
+	if(!st->inRecovery)
+	{
+		for(i = 0; i < newlyAcked; ++i)
+			st->cwnd += st->cwnd < st->ssthresh ? 1.0 : 1.0 / st->cwnd;
+		if(st->cwnd > RUDP_WINDOW)
+			st->cwnd = RUDP_WINDOW;
+	}
+
+	/* 
+	*  Fast retransmit: a packet is lost once RUDP_DUP_THRESH packets sent
+	*  after it have been acked.
+	*/
+	if(st->haveSacked)
+	{
+		for(seq = st->sndUna; SEQ_LT(seq, st->highestSacked); ++seq)
+		{
+			RudpSendSlot *slot = &st->snd[seq % RUDP_WINDOW];
+			if(!slot->used || slot->sacked || slot->lost)
+				continue;
+			if(SEQ_LT(st->highestSacked, slot->lossMark + RUDP_DUP_THRESH - 1))
+				continue;
+
+			if(!st->inRecovery)
+				enterRecovery(st, 0.0);
+			markLost(st, slot);
+			++st->stats.fastRetransmits;
+			++st->stats.retransmits;
+			/* The first retransmission doesn't wait for the window */
+			transmit(hsock, st, slot, now);
+		}
+	}
+}
+
+static void queueReady(struct RudpState *st, RudpMessage *msg)
+{
+	msg->next = NULL;
+	if(st->readyTail)
+		st->readyTail->next = msg;
+	else
+		st->readyHead = msg;
+	st->readyTail = msg;
+	++st->readyCount;
+}
+
+static void deliver(struct RudpState *st, RudpMessage *msg, int unordered)
+{
+	RudpChannel *ch = &st->channels[msg->channel];
+	RudpMessage **pp;
+
+	if(unordered)
+	{
+		queueReady(st, msg);
+		return;
+	}
+
+	if(msg->chanSeq != ch->recvSeq)
+	{
+		/* Early arrival; park it until the gap is filled */
+		pp = &ch->pending;
+		while(*pp && SEQ_LT((*pp)->chanSeq, msg->chanSeq))
+			pp = &(*pp)->next;
+		msg->next = *pp;
+		*pp = msg;
+		return;
+	}
+
+	queueReady(st, msg);
+	++ch->recvSeq;
+	while(ch->pending && ch->pending->chanSeq == ch->recvSeq)
+	{
+		msg = ch->pending;
+		ch->pending = msg->next;
+		queueReady(st, msg);
+		++ch->recvSeq;
+	}
+}
+
+static void processData(struct RudpState *st, const unsigned char *pkt, usock_size_t len)
+{
+	unsigned channel = pkt[1];
+	unsigned flags   = pkt[2];
+	unsigned seq     = get32(pkt + 8);
+	usock_size_t payload = len - RUDP_HEADER_SIZE;
+	RudpMessage *msg;
+
+	st->ackPending = 1;
+	st->echoTs = get32(pkt + 16);
+
+	if(seq - st->rcvNxt >= RUDP_WINDOW && !SEQ_LT(seq, st->rcvNxt))
+		return; /* Beyond the window, the peer will resend it */
+	if(SEQ_LT(seq, st->rcvNxt) || st->rcvMask[seq % RUDP_WINDOW])
+	{
+		++st->stats.duplicates;
+		return;
+	}
+	if(channel >= USOCK_RUDP_MAX_CHANNELS)
+		return;
+
+	msg = (RudpMessage *)g_palloc(offsetof(RudpMessage, data) + payload);
+	if(!msg)
+		return; /* Not acked, so the peer will retry */
+
+	st->rcvMask[seq % RUDP_WINDOW] = 1;
+	while(st->rcvMask[st->rcvNxt % RUDP_WINDOW])
+	{
+		st->rcvMask[st->rcvNxt % RUDP_WINDOW] = 0;
+		++st->rcvNxt;
+	}
+
+	msg->channel = channel;
+	msg->chanSeq = get32(pkt + 12);
+	msg->len     = payload;
+	memcpy(msg->data, pkt + RUDP_HEADER_SIZE, payload);
+	++st->stats.messagesReceived;
+	deliver(st, msg, flags & RUDP_WIRE_UNORDERED);
+}
+
+static void sendAck(usock_handle_t hsock, struct RudpState *st)
+{
+	unsigned char pkt[RUDP_ACK_SIZE];
+	unsigned i, seq;
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = RUDP_PACKET_ACK;
+	put32(pkt + 4, st->conv);
+	put32(pkt + 8, st->rcvNxt);
+	put32(pkt + 12, st->echoTs);
+	for(i = 0; i + 1 < RUDP_WINDOW; ++i)
+	{
+		seq = st->rcvNxt + 1 + i;
+		if(st->rcvMask[seq % RUDP_WINDOW])
+			pkt[16 + i / 8] |= (unsigned char)(1u << (i % 8));
+	}
+
+	st->ackPending = 0;
+	sendPacket(hsock, st, pkt, sizeof(pkt));
+}
+
+static long long timeUntilDeadline(struct RudpState *st)
+{
+	usock_size_t deadline = nextDeadline(st);
+	usock_size_t now;
+
+	if(!deadline)
+		return -1;
+	now = usock_get_time_ns();
+	return deadline > now ? (long long)(deadline - now) : 0;
+}
+
+static int failTimedOut(void)
+{
+#ifdef _WIN32
+	WSASetLastError(WSAETIMEDOUT);
+#else
+	errno = ETIMEDOUT;
+#endif
+	return -1;
+}
+
+/*
+* Wait up to timeoutNs for packets, process everything that arrived,
+* then ack and retransmit as needed.
+* Fails with ETIMEDOUT once the peer has stopped acking.
+*/
+static int service(usock_handle_t hsock, struct RudpState *st, long long timeoutNs)
+{
+	usock_ssize_t n;
+	usock_size_t now;
+	int timeoutMs = timeoutNs < 0 ? -1 : (int)((timeoutNs + 999999) / 1000000);
+	int ret;
+
+	if(st->failed)
+		return failTimedOut();
+
+	/* Lost packets have no timer running, so resend them before waiting */
+	retransmitLost(hsock, st, usock_get_time_ns());
+	if(timeoutMs < 0 && st->inflight)
+		timeoutMs = (int)((timeUntilDeadline(st) + 999999) / 1000000);
+
+	ret = rawWaitReadable(hsock, timeoutMs);
+	if(ret < 0)
+		return -1;
+
+	while((n = rawRecv(hsock, st->scratch, sizeof(st->scratch), !st->connected)) > 0)
+	{
+		unsigned conv;
+		now = usock_get_time_ns();
+		st->connected = 1;
+
+		if(n < 8)
+			continue;
+		conv = get32(st->scratch + 4);
+		if(!st->conv)
+			st->conv = conv; /* Server side adopts the client's conversation */
+		if(conv != st->conv)
+			continue;
+
+		if(st->scratch[0] == RUDP_PACKET_DATA && n >= RUDP_HEADER_SIZE)
+			processData(st, st->scratch, (usock_size_t)n);
+		else if(st->scratch[0] == RUDP_PACKET_ACK && n >= RUDP_ACK_SIZE)
+			processAck(hsock, st, st->scratch, now);
+	}
+
+	if(st->ackPending)
+		sendAck(hsock, st);
+
+	now = usock_get_time_ns();
+	checkTimeouts(hsock, st, now);
+	if(st->failed)
+		return failTimedOut();
+	retransmitLost(hsock, st, now);
+	return 0;
+}
+
+usock_err_t rudpCreate(usock_handle_t hsock)
+{
+	struct RudpState *st;
+
+	rudpDestroy(hsock);
+	st = (struct RudpState *)g_palloc(sizeof(struct RudpState));
+	if(!st)
+		return USOCK_ERROR_OUT_OF_MEMORY;
+
+	memset(st, 0, sizeof(*st));
+	st->epoch    = usock_get_time_ns();
+	st->rng      = st->epoch ^ (unsigned long long)(size_t)hsock ^ 0x9E3779B97F4A7C15ULL;
+	st->cwnd     = RUDP_INITIAL_CWND;
+	st->ssthresh = RUDP_WINDOW;
+	st->rto      = RUDP_INITIAL_RTO_NS;
+
+	GET_RUDP(hsock) = st;
+	return USOCK_OK;
+}
+
+void rudpDestroy(usock_handle_t hsock)
+{
+	struct RudpState *st = GET_RUDP(hsock);
+	RudpMessage *msg;
+	unsigned i;
+
+	if(!st)
+		return;
+
+	for(i = 0; i < RUDP_WINDOW; ++i)
+		releaseSlot(st, &st->snd[i]);
+	for(i = 0; i < USOCK_RUDP_MAX_CHANNELS; ++i)
+	{
+		while((msg = st->channels[i].pending) != NULL)
+		{
+			st->channels[i].pending = msg->next;
+			g_pfree(msg);
+		}
+	}
+	while((msg = st->readyHead) != NULL)
+	{
+		st->readyHead = msg->next;
+		g_pfree(msg);
+	}
+
+	g_pfree(st);
+	GET_RUDP(hsock) = NULL;
+}
+
+void rudpMarkConnected(usock_handle_t hsock)
+{
+	struct RudpState *st = GET_RUDP(hsock);
+
+	st->connected = 1;
+	/* The client picks the conversation id */
+	while(!st->conv)
+		st->conv = (unsigned)nextRandom(st);
+}
+
+usock_ssize_t rudpSend(usock_handle_t hsock, unsigned channel, const void *pBuffer, usock_size_t len, usock_flags_t flags)
+{
+	struct RudpState *st = GET_RUDP(hsock);
+	RudpSendSlot *slot;
+	unsigned char *pkt;
+	unsigned chanSeq = 0;
+
+	if(channel >= USOCK_RUDP_MAX_CHANNELS || len > USOCK_RUDP_MAX_MESSAGE_SIZE)
+		return -1;
+	if(!st->connected)
+		return -1; /* No peer to send to yet */
+
+	/* Wait for room in the window */
+	while(st->sndNxt - st->sndUna >= RUDP_WINDOW || st->inflight >= (unsigned)st->cwnd)
+	{
+		if(service(hsock, st, timeUntilDeadline(st)) < 0)
+			return -1;
+	}
+
+	pkt = (unsigned char *)g_palloc(RUDP_HEADER_SIZE + len);
+	if(!pkt)
+		return -1;
+
+	if(!(flags & USOCK_RUDP_UNORDERED))
+		chanSeq = st->channels[channel].sendSeq++;
+
+	pkt[0] = RUDP_PACKET_DATA;
+	pkt[1] = (unsigned char)channel;
+	pkt[2] = (flags & USOCK_RUDP_UNORDERED) ? RUDP_WIRE_UNORDERED : 0;
+	pkt[3] = 0;
+	put32(pkt + 4, st->conv);
+	put32(pkt + 8, st->sndNxt);
+	put32(pkt + 12, chanSeq);
+	memcpy(pkt + RUDP_HEADER_SIZE, pBuffer, len);
+
+	slot = &st->snd[st->sndNxt % RUDP_WINDOW];
+	slot->packet   = pkt;
+	slot->len      = (unsigned)(RUDP_HEADER_SIZE + len);
+	slot->used     = 1;
+	slot->sacked   = 0;
+	slot->inFlight = 0;
+	++st->sndNxt;
+	++st->stats.messagesSent;
+	transmit(hsock, st, slot, usock_get_time_ns());
+
+	/* Pick up acks and replies without blocking */
+	if(service(hsock, st, 0) < 0)
+		return -1;
+
+	return (usock_ssize_t)len;
+}
+
+usock_ssize_t rudpSendv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
+{
+	unsigned char message[USOCK_RUDP_MAX_MESSAGE_SIZE];
+	usock_size_t len = 0, i;
+
+	/* The buffers make up a single message, so they must fit in one */
+	for(i = 0; i < count; ++i)
+	{
+		if(pIov[i].len > USOCK_RUDP_MAX_MESSAGE_SIZE - len)
+		{
+#ifdef _WIN32
+			WSASetLastError(WSAEMSGSIZE);
+#else
+			errno = EMSGSIZE;
+#endif
+			return -1;
+		}
+		memcpy(message + len, pIov[i].pBuffer, pIov[i].len);
+		len += pIov[i].len;
+	}
+	return rudpSend(hsock, 0, message, len, 0);
+}
+
+/* Wait for the next message in order, which the caller then owns */
+static RudpMessage *takeMessage(usock_handle_t hsock, struct RudpState *st)
+{
+	RudpMessage *msg;
+
+	while(!st->readyHead)
+	{
+		if(service(hsock, st, timeUntilDeadline(st)) < 0)
+			return NULL;
+	}
+
+	msg = st->readyHead;
+	st->readyHead = msg->next;
+	if(!st->readyHead)
+		st->readyTail = NULL;
+	--st->readyCount;
+	return msg;
+}
+
+usock_ssize_t rudpRecv(usock_handle_t hsock, void *pBuffer, usock_size_t len, unsigned *pOutChannel)
+{
+	RudpMessage *msg = takeMessage(hsock, GET_RUDP(hsock));
+	usock_size_t n;
+
+	if(!msg)
+		return -1;
+
+	n = msg->len < len ? msg->len : len;
+	memcpy(pBuffer, msg->data, n);
+	if(pOutChannel)
+		*pOutChannel = msg->channel;
+	g_pfree(msg);
+
+	return (usock_ssize_t)n;
+}
+
+usock_ssize_t rudpRecvv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
+{
+	RudpMessage *msg = takeMessage(hsock, GET_RUDP(hsock));
+	usock_size_t got = 0, n, i;
+
+	if(!msg)
+		return -1;
+
+	/* Like a datagram, whatever doesn't fit the buffers is dropped */
+	for(i = 0; i < count && got < msg->len; ++i)
+	{
+		n = msg->len - got < pIov[i].len ? msg->len - got : pIov[i].len;
+		memcpy((void *)pIov[i].pBuffer, msg->data + got, n);
+		got += n;
+	}
+	g_pfree(msg);
+
+	return (usock_ssize_t)got;
+}
+
+void rudpFlush(usock_handle_t hsock)
+{
+	struct RudpState *st = GET_RUDP(hsock);
+	usock_size_t giveUp = usock_get_time_ns() + RUDP_LINGER_NS;
+	long long wait;
+
+	/* Linger until everything is acked, so the last messages aren't lost */
+	while(st->connected && st->sndUna != st->sndNxt)
+	{
+		usock_size_t now = usock_get_time_ns();
+		if(now >= giveUp)
+			break;
+
+		wait = timeUntilDeadline(st);
+		if(wait < 0 || wait > (long long)(giveUp - now))
+			wait = (long long)(giveUp - now);
+		if(service(hsock, st, wait) < 0)
+			break;
+	}
+}
+
+/***************************************/
+/*            Public API               */
+/***************************************/
+
+usock_ssize_t usock_rudp_send(usock_handle_t hsock, unsigned channel, const void *pBuffer, usock_size_t len, usock_flags_t flags)
+{
+	if(!GET_RUDP(hsock))
+		return -1;
+	return rudpSend(hsock, channel, pBuffer, len, flags);
+}
+
+usock_ssize_t usock_rudp_recv(usock_handle_t hsock, void *pBuffer, usock_size_t len, unsigned *pOutChannel)
+{
+	if(!GET_RUDP(hsock))
+		return -1;
+	return rudpRecv(hsock, pBuffer, len, pOutChannel);
+}
+
+usock_ssize_t usock_rudp_service(usock_handle_t hsock, int timeoutMs)
+{
+	struct RudpState *st = GET_RUDP(hsock);
+	if(!st)
+		return -1;
+	if(service(hsock, st, timeoutMs < 0 ? -1 : (long long)timeoutMs * 1000000) < 0)
+		return -1;
+	return (usock_ssize_t)st->readyCount;
+}
+
+void usock_rudp_set_loss(usock_handle_t hsock, double lossRate)
+{
+	struct RudpState *st = GET_RUDP(hsock);
+	if(st)
+		st->loss = lossRate;
+}
+
+usock_err_t usock_rudp_get_stats(usock_handle_t hsock, usock_rudp_stats_t *pOutStats)
+{
+	struct RudpState *st = GET_RUDP(hsock);
+	if(!st || !pOutStats)
+		return USOCK_ERROR_INVALID_ARG;
+
+	*pOutStats = st->stats;
+	pOutStats->srttUs = st->srtt / 1000;
+	pOutStats->rtoUs  = st->rto / 1000;
+	pOutStats->cwnd   = (usock_size_t)st->cwnd;
+	return USOCK_OK;
+}
@@ -0,0 +1,404 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_runtime.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace usock
+{
+	// Best effort: a core on a CPU that isn't there just isn't pinned
+	static void pinThread(unsigned cpu)
+	{
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu % CPU_SETSIZE, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+		(void)cpu;
+#endif
+	}
+
+	static void destroySocket(handle_t hsock)
+	{
+		if(!hsock)
+			return;
+		usock_close_socket(hsock);
+		usock_free_socket(hsock);
+	}
+
+	runtime::core::core(runtime &owner, unsigned index) :
+		m_owner(&owner), m_index(index), m_listener(nullptr), m_doorbell(nullptr), m_ringer(nullptr), m_sleeping(false)
+	{
+		for(unsigned i = 0; i < owner.m_opts.cores; ++i)
+			m_inbox.emplace_back(new spsc_queue<message>(owner.m_opts.channelCapacity));
+	}
+
+	runtime::core::~core()
+	{
+		// Every thread is gone by now, nobody rings or posts any more
+		destroySocket(m_ringer);
+		message msg;
+		for(auto &channel : m_inbox)
+		{
+			while(channel->pop(msg))
+				destroySocket(msg.hsock);
+		}
+	}
+
+	void runtime::core::watch(handle_t hsock)
+	{
+		if(m_watched.count(hsock))
+			return;
+		m_watched[hsock] = m_fds.size();
+		m_fds.push_back(usock_pollfd_t{ hsock, USOCK_POLL_IN, 0 });
+	}
+
+	void runtime::core::unwatch(handle_t hsock)
+	{
+		auto it = m_watched.find(hsock);
+		if(it == m_watched.end())
+			return;
+
+		// The doorbell and listener sit in front and are never watched, so never moved
+		size_t pos = it->second;
+		m_watched.erase(it);
+		if(pos != m_fds.size() - 1)
+		{
+			m_fds[pos] = m_fds.back();
+			m_watched[m_fds[pos].hsock] = pos;
+		}
+		m_fds.pop_back();
+	}
+
+	void runtime::core::close(handle_t hsock)
+	{
+		unwatch(hsock);
+		destroySocket(hsock);
+	}
+
+	bool runtime::core::post(unsigned to, const message &msg)
+	{
+		core &dest = *m_owner->m_cores[to];
+		message out = msg;
+		out.from = m_index;
+		if(!dest.m_inbox[m_index]->push(out))
+			return false;
+		if(msg.hsock)
+			unwatch(msg.hsock);
+
+		// Pairs with the fence in run(): either it sees the message, or we see it asleep
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if(dest.m_sleeping.load(std::memory_order_relaxed) && dest.m_sleeping.exchange(false, std::memory_order_relaxed))
+			dest.ring();
+		return true;
+	}
+
+	void *runtime::core::alloc_buffer()
+	{
+		if(!m_buffers.empty())
+		{
+			void *buffer = m_buffers.back();
+			m_buffers.pop_back();
+			return buffer;
+		}
+		void *buffer = std::malloc(m_owner->m_opts.bufferSize);
+		if(!buffer)
+			throw std::bad_alloc();
+		return buffer;
+	}
+
+	void runtime::core::free_buffer(void *buffer)
+	{
+		if(!buffer)
+			return;
+		// Reserved up front, so this never allocates
+		if(m_buffers.size() < m_owner->m_opts.cachedBuffers)
+			m_buffers.push_back(buffer);
+		else
+			std::free(buffer);
+	}
+
+	err_t runtime::core::setup()
+	{
+		const options &opts = m_owner->m_opts;
+		err_t err = usock_timer_wheel_init(&m_wheel, opts.tickMs);
+		if(err != USOCK_OK)
+			return err;
+		m_buffers.reserve(opts.cachedBuffers);
+
+#ifdef __linux__
+		// An abstract name, unique to this runtime and core
+		char name[96];
+		snprintf(name, sizeof(name), "@usock-runtime-%d-%p-%u", (int)getpid(), (void *)m_owner, m_index);
+#else
+		const char *name = "";
+#endif
+
+		// usock_configure returns nothing; a socket it couldn't set up fails to bind
+		if((err = usock_create_socket("runtime doorbell", &m_doorbell)) != USOCK_OK)
+		{
+			m_doorbell = nullptr;
+			return err;
+		}
+		usock_configure(m_doorbell, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+		if((err = usock_bind_address(m_doorbell, name, 0)) != USOCK_OK ||
+		   (err = usock_set_nonblocking(m_doorbell, 1)) != USOCK_OK)
+			return err;
+
+		if((err = usock_create_socket("runtime ringer", &m_ringer)) != USOCK_OK)
+		{
+			m_ringer = nullptr;
+			return err;
+		}
+		usock_configure(m_ringer, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+		if((err = usock_connect(m_ringer, name, 0)) != USOCK_OK ||
+		   (err = usock_set_nonblocking(m_ringer, 1)) != USOCK_OK)
+			return err;
+		m_fds.push_back(usock_pollfd_t{ m_doorbell, USOCK_POLL_IN, 0 });
+
+		if(opts.port)
+		{
+			if((err = usock_create_socket("runtime listener", &m_listener)) != USOCK_OK)
+			{
+				m_listener = nullptr;
+				return err;
+			}
+			usock_configure(m_listener, opts.domain, USOCK_SOCKTYPE_RELIABLE,
+			                opts.flags | USOCK_OPTIONS_REUSE_ADDRESS | USOCK_OPTIONS_REUSE_PORT);
+			if((err = usock_bind_address(m_listener, opts.address.empty() ? nullptr : opts.address.c_str(), opts.port)) != USOCK_OK ||
+			   (err = usock_listen(m_listener, opts.backlog)) != USOCK_OK ||
+			   (err = usock_set_nonblocking(m_listener, 1)) != USOCK_OK)
+				return err;
+			m_fds.push_back(usock_pollfd_t{ m_listener, USOCK_POLL_IN, 0 });
+		}
+		return USOCK_OK;
+	}
+
+	void runtime::core::run()
+	{
+		const handlers &h = m_owner->m_handlers;
+		std::vector<handle_t> ready;
+
+		while(!m_owner->m_stopping.load(std::memory_order_acquire))
+		{
+			drain_channels();
+
+			// Announce the nap, then look once more; see post()
+			m_sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int timeoutMs = pending() || m_owner->m_stopping.load(std::memory_order_relaxed) ? 0 : -1;
+			usock_ssize_t count = usock_timer_wheel_poll(&m_wheel, m_fds.data(), m_fds.size(), timeoutMs);
+			m_sleeping.store(false, std::memory_order_relaxed);
+			if(count <= 0)
+				continue;
+
+			// Handlers change m_fds, so work from a copy
+			ready.clear();
+			for(const usock_pollfd_t &fd : m_fds)
+			{
+				if(fd.revents)
+					ready.push_back(fd.hsock);
+			}
+
+			for(handle_t hsock : ready)
+			{
+				if(hsock == m_doorbell)
+				{
+					char bell[16];
+					while(usock_recv(m_doorbell, bell, sizeof(bell)) > 0)
+					{
+					}
+				}
+				else if(hsock == m_listener)
+					accept_all();
+				else if(m_watched.count(hsock) && h.onReadable)
+					h.onReadable(*this, hsock);
+			}
+		}
+	}
+
+	void runtime::core::teardown()
+	{
+		for(auto &entry : m_watched)
+			destroySocket(entry.first);
+		m_watched.clear();
+		m_fds.clear();
+		destroySocket(m_listener);
+		destroySocket(m_doorbell);
+		m_listener = m_doorbell = nullptr;
+
+		for(void *buffer : m_buffers)
+			std::free(buffer);
+		m_buffers.clear();
+	}
+
+	void runtime::core::ring()
+	{
+		const char bell = 0;
+		usock_send(m_ringer, &bell, 1);
+	}
+
+	void runtime::core::drain_channels()
+	{
+		const handlers &h = m_owner->m_handlers;
+		message msg;
+		for(auto &channel : m_inbox)
+		{
+			while(channel->pop(msg))
+			{
+				if(msg.hsock)
+					watch(msg.hsock);
+				if(h.onMessage)
+					h.onMessage(*this, msg);
+			}
+		}
+	}
+
+	bool runtime::core::pending() const
+	{
+		for(auto &channel : m_inbox)
+		{
+			if(!channel->empty())
+				return true;
+		}
+		return false;
+	}
+
+	void runtime::core::accept_all()
+	{
+		const handlers &h = m_owner->m_handlers;
+		handle_t client = nullptr;
+
+		// Until the listener would block; the kernel only hands this core its share
+		while(usock_accept(m_listener, &client) == USOCK_OK)
+		{
+			usock_set_nonblocking(client, 1);
+			watch(client);
+			if(h.onConnection)
+				h.onConnection(*this, client);
+		}
+	}
+
+	runtime::runtime(const options &opts, const handlers &h) :
+		m_opts(opts), m_handlers(h), m_stopping(false), m_ready(0), m_startErr(USOCK_OK)
+	{
+	}
+
+	runtime::~runtime()
+	{
+		stop();
+		join();
+	}
+
+	err_t runtime::start()
+	{
+#ifndef __linux__
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+#else
+		if(!m_threads.empty())
+			return USOCK_ERROR_ALREADY_INITIALIZED;
+
+		if(!m_opts.cores)
+			m_opts.cores = std::thread::hardware_concurrency();
+		if(!m_opts.cores)
+			m_opts.cores = 1;
+		if(m_opts.cores > USOCK_REGISTRY_SHARDS)
+			m_opts.cores = USOCK_REGISTRY_SHARDS;
+
+		m_stopping.store(false);
+		m_ready = 0;
+		m_startErr = USOCK_OK;
+		for(unsigned i = 0; i < m_opts.cores; ++i)
+			m_cores.emplace_back(new core(*this, i));
+		for(unsigned i = 0; i < m_opts.cores; ++i)
+			m_threads.emplace_back(&runtime::core_main, this, std::ref(*m_cores[i]));
+
+		err_t err;
+		{
+			std::unique_lock<std::mutex> lock(m_startLock);
+			m_started.wait(lock, [this]() { return m_ready == m_opts.cores; });
+			err = m_startErr;
+		}
+		if(err != USOCK_OK)
+			join();
+		return err;
+#endif
+	}
+
+	void runtime::stop()
+	{
+		m_stopping.store(true, std::memory_order_release);
+		for(auto &c : m_cores)
+		{
+			if(c->m_ringer)
+				c->ring();
+		}
+	}
+
+	void runtime::join()
+	{
+		for(std::thread &t : m_threads)
+			t.join();
+		m_threads.clear();
+		m_cores.clear();
+	}
+
+	void runtime::core_main(core &c)
+	{
+		if(m_opts.pin)
+			pinThread(m_opts.firstCpu + c.m_index);
+		// Sockets this core creates go in a registry shard of its own
+		usock_set_thread_shard(c.m_index);
+
+		err_t err = c.setup();
+		{
+			// Nobody runs until every core is set up, so nobody posts to a core that isn't
+			std::unique_lock<std::mutex> lock(m_startLock);
+			if(err != USOCK_OK && m_startErr == USOCK_OK)
+				m_startErr = err;
+			if(++m_ready == m_opts.cores)
+				m_started.notify_all();
+			else
+				m_started.wait(lock, [this]() { return m_ready == m_opts.cores; });
+			err = m_startErr;
+		}
+
+		if(err == USOCK_OK)
+		{
+			if(m_handlers.onStart)
+				m_handlers.onStart(c);
+			c.run();
+			if(m_handlers.onStop)
+				m_handlers.onStop(c);
+		}
+		c.teardown();
+	}
+}
@@ -0,0 +1,593 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+/*
+* Shared memory transport (USOCK_SOCKTYPE_SHARED_MEMORY).
+*
+* The connecting side creates a memfd holding one single producer, single
+* consumer ring per direction and passes it to the server over the local
+* stream socket, which then stays open only to notice the peer going away.
+* Messages are copied in and out of the rings behind an 8 byte length
+* header, keeping every record 8 byte aligned so headers never wrap.
+*
+* The reader spins for a while when a ring is empty, then raises its
+* waiting flag and sleeps on a futex; the writer only makes the wake call
+* when it sees that flag after publishing, and the same goes for a writer
+* waiting on a full ring. Both sides check the flag after a full fence, so
+* one of them always sees the other.
+*/
+
+#ifdef __linux__
+
+#define _GNU_SOURCE
+#include "usock_internal.h"
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC        0x4D485355u /* "USHM" */
+#define SHM_VERSION      1u
+#define SHM_RECORD_HEADER 8u
+#define SHM_HEADER_SIZE  4096u
+#define SHM_SEGMENT_SIZE (SHM_HEADER_SIZE + 2u * USOCK_SHM_RING_SIZE)
+
+/* Spin this long on an empty or full ring before going to sleep */
+#define SHM_SPIN_NS      20000ULL
+/* How often a sleeper wakes to check that the peer is still there */
+#define SHM_LIVENESS_MS  100
+/* How long accept waits for the client's segment */
+#define SHM_HANDSHAKE_MS 1000
+
+/* Each side's fields on its own cache line, the other side only reads them */
+typedef struct ShmRing
+{
+	/* Written by the producer */
+	usock_size_t head;
+	unsigned     dataSeq;       /* Futex word, bumped to wake the consumer */
+	unsigned     writerWaiting;
+	unsigned     writerClosed;
+	unsigned char pad0[64 - sizeof(usock_size_t) - 3 * sizeof(unsigned)];
+
+	/* Written by the consumer */
+	usock_size_t tail;
+	unsigned     spaceSeq;      /* Futex word, bumped to wake the producer */
+	unsigned     readerWaiting;
+	unsigned     readerClosed;
+	unsigned char pad1[64 - sizeof(usock_size_t) - 3 * sizeof(unsigned)];
+} ShmRing;
+
+typedef struct ShmHeader
+{
+	unsigned     magic;
+	unsigned     version;
+	usock_size_t ringSize;
+	unsigned char pad[64 - 2 * sizeof(unsigned) - sizeof(usock_size_t)];
+	ShmRing      rings[2]; /* Client to server, then server to client */
+} ShmHeader;
+
+struct ShmState
+{
+	ShmHeader     *seg;
+	ShmRing       *tx;
+	ShmRing       *rx;
+	unsigned char *txData;
+	unsigned char *rxData;
+	usock_size_t   rxOffset;   /* Bytes of the current message already received */
+	int            fd;         /* The local stream socket the segment came over */
+	int            nonblocking;
+	int            peerGone;
+	int            corrupt;    /* The peer wrote a record that doesn't fit its ring */
+};
+
+#define GET_SHM(HSOCK) (GET_SOCK_NODE_FROM_HANDLE(HSOCK)->shm)
+
+/* On a single CPU the peer can't run while we spin, so go straight to sleep */
+static usock_size_t g_spinNs = SHM_SPIN_NS;
+
+#define LOAD_ACQUIRE(FIELD)          __atomic_load_n(&(FIELD), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(FIELD, VALUE)  __atomic_store_n(&(FIELD), (VALUE), __ATOMIC_RELEASE)
+
+static void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* Shared, not private, futexes: the peer is usually another process */
+static void futexWait(unsigned *addr, unsigned seq, int timeoutMs)
+{
+	struct timespec ts;
+	ts.tv_sec  = timeoutMs / 1000;
+	ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000L;
+	syscall(SYS_futex, addr, FUTEX_WAIT, seq, &ts, NULL, 0);
+}
+
+static void futexWake(unsigned *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Wake the other side if it went to sleep on this word */
+static void signalPeer(unsigned *seq, unsigned *waiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(waiting, __ATOMIC_RELAXED))
+	{
+		__atomic_fetch_add(seq, 1, __ATOMIC_RELEASE);
+		futexWake(seq);
+	}
+}
+
+/* The segment can't say that a crashed peer is gone, the socket can */
+static int peerHungUp(struct ShmState *st)
+{
+	struct pollfd pfd;
+	pfd.fd      = st->fd;
+	pfd.events  = POLLRDHUP;
+	pfd.revents = 0;
+	if(poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)))
+		st->peerGone = 1;
+	return st->peerGone;
+}
+
+static usock_size_t recordSize(usock_size_t len)
+{
+	return SHM_RECORD_HEADER + ((len + 7) & ~(usock_size_t)7);
+}
+
+static void ringWrite(unsigned char *data, usock_size_t pos, const void *src, usock_size_t len)
+{
+	usock_size_t off   = pos & (USOCK_SHM_RING_SIZE - 1);
+	usock_size_t first = len < USOCK_SHM_RING_SIZE - off ? len : USOCK_SHM_RING_SIZE - off;
+	memcpy(data + off, src, first);
+	memcpy(data, (const unsigned char *)src + first, len - first);
+}
+
+static void ringRead(const unsigned char *data, usock_size_t pos, void *dst, usock_size_t len)
+{
+	usock_size_t off   = pos & (USOCK_SHM_RING_SIZE - 1);
+	usock_size_t first = len < USOCK_SHM_RING_SIZE - off ? len : USOCK_SHM_RING_SIZE - off;
+	memcpy(dst, data + off, first);
+	memcpy((unsigned char *)dst + first, data, len - first);
+}
+
+/* Map a segment and pick the rings for our side */
+static usock_err_t mapSegment(struct ShmState *st, int memfd, int isClient)
+{
+	void *mem = mmap(NULL, SHM_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if(mem == MAP_FAILED)
+		return USOCK_ERROR_INTERNAL;
+
+	st->seg      = (ShmHeader *)mem;
+	st->tx       = &st->seg->rings[isClient ? 0 : 1];
+	st->rx       = &st->seg->rings[isClient ? 1 : 0];
+	st->txData   = (unsigned char *)mem + SHM_HEADER_SIZE + (isClient ? 0 : USOCK_SHM_RING_SIZE);
+	st->rxData   = (unsigned char *)mem + SHM_HEADER_SIZE + (isClient ? USOCK_SHM_RING_SIZE : 0);
+	st->rxOffset = 0;
+	st->peerGone = 0;
+	st->corrupt  = 0;
+	return USOCK_OK;
+}
+
+static int sendDescriptor(int sockfd, int fd)
+{
+	union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int))]; } control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char byte = 'S';
+	ssize_t ret;
+
+	iov.iov_base = &byte;
+	iov.iov_len  = 1;
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do
+	{
+		ret = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+	} while(ret < 0 && errno == EINTR);
+	return ret == 1 ? 0 : -1;
+}
+
+static int recvDescriptor(int sockfd)
+{
+	union { struct cmsghdr hdr; char buf[CMSG_SPACE(sizeof(int))]; } control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct pollfd pfd;
+	char byte;
+	ssize_t ret;
+	int fd = -1;
+
+	pfd.fd      = sockfd;
+	pfd.events  = POLLIN;
+	pfd.revents = 0;
+	if(poll(&pfd, 1, SHM_HANDSHAKE_MS) <= 0)
+		return -1;
+
+	iov.iov_base = &byte;
+	iov.iov_len  = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do
+	{
+		ret = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	} while(ret < 0 && errno == EINTR);
+
+	cmsg = ret == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+	   cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+usock_err_t shmCreate(usock_handle_t hsock)
+{
+	struct ShmState *st;
+
+	if(GET_SHM(hsock))
+		return USOCK_OK;
+	st = (struct ShmState *)g_palloc(sizeof(struct ShmState));
+	if(!st)
+		return USOCK_ERROR_OUT_OF_MEMORY;
+
+	memset(st, 0, sizeof(*st));
+	st->fd = -1;
+	GET_SHM(hsock) = st;
+
+	if(sysconf(_SC_NPROCESSORS_ONLN) <= 1)
+		g_spinNs = 0;
+	return USOCK_OK;
+}
+
+void shmDetach(usock_handle_t hsock)
+{
+	struct ShmState *st = GET_SHM(hsock);
+	if(!st || !st->seg)
+		return;
+
+	/* Whatever is still in our ring stays readable; the peer sees the end after it */
+	STORE_RELEASE(st->tx->writerClosed, 1);
+	STORE_RELEASE(st->rx->readerClosed, 1);
+	signalPeer(&st->tx->dataSeq, &st->tx->readerWaiting);
+	signalPeer(&st->rx->spaceSeq, &st->rx->writerWaiting);
+
+	munmap(st->seg, SHM_SEGMENT_SIZE);
+	st->seg = NULL;
+	st->tx  = st->rx = NULL;
+	st->fd  = -1;
+}
+
+void shmDestroy(usock_handle_t hsock)
+{
+	struct ShmState *st = GET_SHM(hsock);
+	if(!st)
+		return;
+
+	shmDetach(hsock);
+	g_pfree(st);
+	GET_SHM(hsock) = NULL;
+}
+
+void shmSetNonblocking(usock_handle_t hsock, int enable)
+{
+	struct ShmState *st = GET_SHM(hsock);
+	if(st)
+		st->nonblocking = enable;
+}
+
+usock_err_t shmConnect(usock_handle_t hsock, int sockfd)
+{
+	struct ShmState *st = GET_SHM(hsock);
+	ShmHeader *hdr;
+	usock_err_t err;
+	char ack;
+	int memfd;
+
+	shmDetach(hsock);
+	memfd = memfd_create("usock-shm", MFD_CLOEXEC);
+	if(memfd < 0)
+		return USOCK_ERROR_INIT_FAILED;
+	if(ftruncate(memfd, SHM_SEGMENT_SIZE) < 0)
+	{
+		close(memfd);
+		return USOCK_ERROR_OUT_OF_MEMORY;
+	}
+
+	err = mapSegment(st, memfd, 1);
+	if(err != USOCK_OK)
+	{
+		close(memfd);
+		return err;
+	}
+
+	/* A fresh memfd is zeroed, only the identification needs filling in */
+	hdr = st->seg;
+	hdr->ringSize = USOCK_SHM_RING_SIZE;
+	hdr->version  = SHM_VERSION;
+	STORE_RELEASE(hdr->magic, SHM_MAGIC);
+
+	/* The server answers once it has the segment mapped; the mapping keeps it alive from here */
+	st->fd = sockfd;
+	if(sendDescriptor(sockfd, memfd) < 0 || recv(sockfd, &ack, 1, 0) != 1)
+	{
+		close(memfd);
+		shmDetach(hsock);
+		return USOCK_ERROR_INTERNAL;
+	}
+	close(memfd);
+	return USOCK_OK;
+}
+
+usock_err_t shmAccept(usock_handle_t hsock, int sockfd)
+{
+	struct ShmState *st;
+	struct stat info;
+	usock_err_t err;
+	char ack = 'A';
+	int memfd;
+
+	err = shmCreate(hsock);
+	if(err != USOCK_OK)
+		return err;
+	st = GET_SHM(hsock);
+
+	memfd = recvDescriptor(sockfd);
+	if(memfd < 0)
+		return USOCK_ERROR_INTERNAL;
+
+	/* Don't trust the segment further than its size and header */
+	if(fstat(memfd, &info) < 0 || (usock_size_t)info.st_size != SHM_SEGMENT_SIZE ||
+	   mapSegment(st, memfd, 0) != USOCK_OK)
+	{
+		close(memfd);
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+	}
+	close(memfd);
+
+	st->fd = sockfd;
+	if(LOAD_ACQUIRE(st->seg->magic) != SHM_MAGIC || st->seg->version != SHM_VERSION ||
+	   st->seg->ringSize != USOCK_SHM_RING_SIZE)
+	{
+		shmDetach(hsock);
+		return USOCK_ERROR_PROTOCOL_NOT_SUPPORTED;
+	}
+
+	if(send(sockfd, &ack, 1, MSG_NOSIGNAL) != 1)
+	{
+		shmDetach(hsock);
+		return USOCK_ERROR_INTERNAL;
+	}
+	return USOCK_OK;
+}
+
+/*
+* Spin, then sleep, until ready() holds or the wait is over.
+* \return - 1 when ready, 0 when the other end is gone, -1 with errno set.
+*/
+static int waitRing(struct ShmState *st, unsigned *seq, unsigned *waiting, usock_size_t need,
+                    int (*ready)(struct ShmState *, usock_size_t), int (*closed)(struct ShmState *))
+{
+	usock_size_t spinUntil = 0;
+	unsigned spins = 0, snapshot;
+
+	for(;;)
+	{
+		/* Closed comes first: a reader that left won't read what fits in its ring */
+		if(closed(st))
+			return 0;
+		if(ready(st, need))
+			return 1;
+		if(st->peerGone)
+			return 0;
+		if(st->nonblocking)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
+		/* Only read the clock every so often while spinning */
+		if(g_spinNs)
+		{
+			if((++spins & 63) != 0)
+			{
+				cpuRelax();
+				continue;
+			}
+			if(!spinUntil)
+				spinUntil = usock_get_time_ns() + g_spinNs;
+			if(usock_get_time_ns() < spinUntil)
+				continue;
+		}
+
+		snapshot = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+		if(!ready(st, need) && !closed(st))
+			futexWait(seq, snapshot, SHM_LIVENESS_MS);
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+		if(!ready(st, need) && !closed(st))
+			peerHungUp(st);
+	}
+}
+
+static int rxReady(struct ShmState *st, usock_size_t need)
+{
+	(void)need;
+	return LOAD_ACQUIRE(st->rx->head) != st->rx->tail;
+}
+
+static int rxClosed(struct ShmState *st)
+{
+	/* The writer closes after its last publish, so look at the ring again */
+	return LOAD_ACQUIRE(st->rx->writerClosed) && !rxReady(st, 0);
+}
+
+static int txReady(struct ShmState *st, usock_size_t need)
+{
+	return st->tx->head - LOAD_ACQUIRE(st->tx->tail) + need <= USOCK_SHM_RING_SIZE;
+}
+
+static int txClosed(struct ShmState *st)
+{
+	return LOAD_ACQUIRE(st->tx->readerClosed) != 0;
+}
+
+usock_ssize_t shmSend(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
+{
+	struct ShmState *st = GET_SHM(hsock);
+	usock_size_t len = 0, left, pos, i, n;
+	unsigned header[2];
+	int ret;
+
+	if(!st || !st->seg)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	for(i = 0; i < count; ++i)
+		len += pIov[i].len;
+	/* Like a stream, anything past the largest message is left for the next call */
+	if(len > USOCK_SHM_MAX_MESSAGE_SIZE)
+		len = USOCK_SHM_MAX_MESSAGE_SIZE;
+	if(len == 0)
+		return 0;
+
+	ret = waitRing(st, &st->tx->spaceSeq, &st->tx->writerWaiting, recordSize(len), txReady, txClosed);
+	if(ret <= 0)
+	{
+		if(ret == 0)
+			errno = EPIPE;
+		return -1;
+	}
+
+	pos = st->tx->head;
+	header[0] = (unsigned)len;
+	header[1] = 0;
+	ringWrite(st->txData, pos, header, sizeof(header));
+	pos += SHM_RECORD_HEADER;
+	for(i = 0, left = len; left > 0; ++i)
+	{
+		n = pIov[i].len < left ? pIov[i].len : left;
+		ringWrite(st->txData, pos, pIov[i].pBuffer, n);
+		pos  += n;
+		left -= n;
+	}
+
+	STORE_RELEASE(st->tx->head, st->tx->head + recordSize(len));
+	signalPeer(&st->tx->dataSeq, &st->tx->readerWaiting);
+	return (usock_ssize_t)len;
+}
+
+usock_ssize_t shmRecv(usock_handle_t hsock, const usock_iovec_t *pIov, usock_size_t count)
+{
+	struct ShmState *st = GET_SHM(hsock);
+	usock_size_t total = 0, len, pos, i, n;
+	unsigned header[2];
+	int ret;
+
+	if(!st || !st->seg)
+	{
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if(st->corrupt)
+	{
+		errno = EPROTO;
+		return -1;
+	}
+
+	ret = waitRing(st, &st->rx->dataSeq, &st->rx->readerWaiting, 0, rxReady, rxClosed);
+	if(ret <= 0)
+		return ret; /* 0 is the end of the stream, like a closed TCP connection */
+
+	/* The peer can write anything to the segment, so the length must fit what it published */
+	ringRead(st->rxData, st->rx->tail, header, sizeof(header));
+	len = header[0];
+	if(len > USOCK_SHM_MAX_MESSAGE_SIZE || len < st->rxOffset ||
+	   recordSize(len) > LOAD_ACQUIRE(st->rx->head) - st->rx->tail)
+	{
+		st->corrupt = 1;
+		errno = EPROTO;
+		return -1;
+	}
+	pos = st->rx->tail + SHM_RECORD_HEADER + st->rxOffset;
+	for(i = 0; i < count && st->rxOffset + total < len; ++i)
+	{
+		n = len - st->rxOffset - total;
+		if(pIov[i].len < n)
+			n = pIov[i].len;
+		ringRead(st->rxData, pos, (void *)pIov[i].pBuffer, n);
+		pos   += n;
+		total += n;
+	}
+
+	/* Keep the rest of a message the buffer was too short for */
+	st->rxOffset += total;
+	if(st->rxOffset == len)
+	{
+		st->rxOffset = 0;
+		STORE_RELEASE(st->rx->tail, st->rx->tail + recordSize(len));
+		signalPeer(&st->rx->spaceSeq, &st->rx->writerWaiting);
+	}
+	return (usock_ssize_t)total;
+}
+
+#else
+
+#include "usock_internal.h"
+
+/* Shared memory sockets are Linux only, there is never anything to free */
+void shmDestroy(usock_handle_t hsock)
+{
+	(void)hsock;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+/*
+* Periodic TCP info sampling.
+* A background thread runs usock_sample_tcp_info at a fixed interval.
+*/
+
+#include <usock.h>
+#include "usock_internal.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+/* How often the sampler checks whether it should stop */
+#define STOP_POLL_MS 100
+
+/* Sampler state, only touched by the thread that starts and stops it */
+static volatile int g_running = 0;
+static unsigned g_intervalMs = 0;
+static usock_tcp_sample_callback_t g_callback = NULL;
+static void *g_pUserData = NULL;
+
+/***************************************/
+/*          Platform helpers           */
+
+#ifdef _WIN32
+
+static HANDLE g_thread = NULL;
+
+static DWORD WINAPI samplerMain(LPVOID param);
+
+static int startThread()
+{
+	g_thread = CreateThread(NULL, 0, samplerMain, NULL, 0, NULL);
+	return g_thread != NULL;
+}
+
+static void joinThread()
+{
+	WaitForSingleObject(g_thread, INFINITE);
+	CloseHandle(g_thread);
+	g_thread = NULL;
+}
+
+static void sleepMs(unsigned ms)
+{
+	Sleep(ms);
+}
+
+#else
+
+static pthread_t g_thread;
+
+static void *samplerMain(void *param);
+
+static int startThread()
+{
+	return pthread_create(&g_thread, NULL, samplerMain, NULL) == 0;
+}
+
+static void joinThread()
+{
+	pthread_join(g_thread, NULL);
+}
+
+static void sleepMs(unsigned ms)
+{
+	struct timespec ts;
+	ts.tv_sec  = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+#endif
+
+/***************************************/
+/*              Sampler                */
+
+#ifdef _WIN32
+static DWORD WINAPI samplerMain(LPVOID param)
+#else
+static void *samplerMain(void *param)
+#endif
+{
+	unsigned waited;
+
+	while(g_running)
+	{
+		usock_sample_tcp_info(g_callback, g_pUserData);
+		for(waited = 0; g_running && waited < g_intervalMs; waited += STOP_POLL_MS)
+			sleepMs(g_intervalMs - waited < STOP_POLL_MS ? g_intervalMs - waited : STOP_POLL_MS);
+	}
+	return 0;
+}
+
+usock_err_t usock_tcp_sampler_start(unsigned intervalMs, usock_tcp_sample_callback_t callback, void *pUserData)
+{
+	if(!callback || !intervalMs)
+		return USOCK_ERROR_INVALID_ARG;
+	if(g_running)
+		return USOCK_ERROR_ALREADY_INITIALIZED;
+
+	g_intervalMs = intervalMs;
+	g_callback   = callback;
+	g_pUserData  = pUserData;
+
+	g_running = 1;
+	if(!startThread())
+	{
+		g_running = 0;
+		return USOCK_ERROR_INTERNAL;
+	}
+	return USOCK_OK;
+}
+
+void usock_tcp_sampler_stop()
+{
+	if(!g_running)
+		return;
+
+	g_running = 0;
+	joinThread();
+}
@@ -0,0 +1,309 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <usock_timer.h>
+#include <stddef.h>
+
+#define SLOT_BITS 8
+#define SLOT_MASK (USOCK_TIMER_SLOTS - 1)
+
+/***************************************/
+/*            List helpers             */
+
+static void listInit(usock_timer_link_t *head)
+{
+	head->next = head->prev = head;
+}
+
+static int listEmpty(const usock_timer_link_t *head)
+{
+	return head->next == head;
+}
+
+static void listAppend(usock_timer_link_t *head, usock_timer_link_t *link)
+{
+	link->prev = head->prev;
+	link->next = head;
+	head->prev->next = link;
+	head->prev = link;
+}
+
+static void listRemove(usock_timer_link_t *link)
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->next = link->prev = link;
+}
+
+/* Move every entry of from onto the empty list to */
+static void listTake(usock_timer_link_t *from, usock_timer_link_t *to)
+{
+	if(listEmpty(from))
+	{
+		listInit(to);
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	listInit(from);
+}
+
+static usock_timer_t *timerOf(usock_timer_link_t *link)
+{
+	return (usock_timer_t *)((unsigned char *)link - offsetof(usock_timer_t, link));
+}
+
+/***************************************/
+/*            Slot bitmaps             */
+
+static void markSlot(usock_timer_wheel_t *pWheel, unsigned level, unsigned index)
+{
+	pWheel->occupied[level][index / 64] |= 1ull << (index % 64);
+}
+
+static void clearSlot(usock_timer_wheel_t *pWheel, unsigned level, unsigned index)
+{
+	pWheel->occupied[level][index / 64] &= ~(1ull << (index % 64));
+}
+
+/* Distance from index to the next occupied slot of a level, wrapping; 0 if there's none */
+static unsigned nextOccupied(const usock_timer_wheel_t *pWheel, unsigned level, unsigned index)
+{
+	unsigned d;
+	for(d = 1; d < USOCK_TIMER_SLOTS; ++d)
+	{
+		unsigned i = (index + d) & SLOT_MASK;
+		usock_size_t word = pWheel->occupied[level][i / 64] >> (i % 64);
+		if(word & 1)
+			return d;
+		/* Skip the rest of an empty word */
+		if(!word)
+			d += 63 - (i % 64);
+	}
+	return 0;
+}
+
+static int upperOccupied(const usock_timer_wheel_t *pWheel)
+{
+	unsigned level, word;
+	for(level = 1; level < USOCK_TIMER_LEVELS; ++level)
+	{
+		for(word = 0; word < USOCK_TIMER_SLOTS / 64; ++word)
+		{
+			if(pWheel->occupied[level][word])
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/***************************************/
+/*             The wheel               */
+
+/* File a timer by its expiry; anything due before firstTick goes into firstTick */
+static void insertTimer(usock_timer_wheel_t *pWheel, usock_timer_t *pTimer, usock_size_t firstTick)
+{
+	usock_size_t expires = pTimer->expires < firstTick ? firstTick : pTimer->expires;
+	usock_size_t delta = expires - pWheel->current;
+	unsigned level, index;
+
+
+	for(level = 0; level < USOCK_TIMER_LEVELS - 1; ++level)
+	{
+		if(delta < (1ull << (SLOT_BITS * (level + 1))))
+			break;
+	}
+
+	/* Past the top level's reach, park it as far out as it goes; it's re-filed on the way down */
+	if(delta >= (1ull << (SLOT_BITS * USOCK_TIMER_LEVELS)))
+		expires = pWheel->current + (1ull << (SLOT_BITS * USOCK_TIMER_LEVELS)) - 1;
+
+	index = (unsigned)(expires >> (SLOT_BITS * level)) & SLOT_MASK;
+	pTimer->slot = level * USOCK_TIMER_SLOTS + index;
+	listAppend(&pWheel->slots[level][index], &pTimer->link);
+	markSlot(pWheel, level, index);
+}
+
+/* Re-file the timers of an upper slot into the levels below */
+static void cascade(usock_timer_wheel_t *pWheel, unsigned level, unsigned index)
+{
+	usock_timer_link_t pending;
+
+	listTake(&pWheel->slots[level][index], &pending);
+	clearSlot(pWheel, level, index);
+	while(!listEmpty(&pending))
+	{
+		usock_timer_t *timer = timerOf(pending.next);
+		listRemove(&timer->link);
+		/* The current tick's slot is processed right after the cascade */
+		insertTimer(pWheel, timer, pWheel->current);
+	}
+}
+
+usock_err_t usock_timer_wheel_init(usock_timer_wheel_t *pWheel, unsigned tickMs)
+{
+	unsigned level, index;
+
+	if(!pWheel || tickMs == 0)
+		return USOCK_ERROR_INVALID_ARG;
+
+	pWheel->tickNs  = (usock_size_t)tickMs * 1000000ull;
+	pWheel->startNs = usock_get_time_ns();
+	pWheel->current = 0;
+	pWheel->count   = 0;
+	for(level = 0; level < USOCK_TIMER_LEVELS; ++level)
+	{
+		for(index = 0; index < USOCK_TIMER_SLOTS / 64; ++index)
+			pWheel->occupied[level][index] = 0;
+		for(index = 0; index < USOCK_TIMER_SLOTS; ++index)
+			listInit(&pWheel->slots[level][index]);
+	}
+	return USOCK_OK;
+}
+
+void usock_timer_init(usock_timer_t *pTimer, usock_timer_callback_t callback, void *pUserData)
+{
+	pTimer->link.next = pTimer->link.prev = &pTimer->link;
+	pTimer->expires   = 0;
+	pTimer->slot      = USOCK_TIMER_IDLE;
+	pTimer->callback  = callback;
+	pTimer->pUserData = pUserData;
+}
+
+void usock_timer_arm(usock_timer_wheel_t *pWheel, usock_timer_t *pTimer, usock_size_t delayMs)
+{
+	usock_size_t now = usock_get_time_ns();
+
+	usock_timer_cancel(pWheel, pTimer);
+
+	/* Round up, a timer never fires early */
+	pTimer->expires = (now - pWheel->startNs + delayMs * 1000000ull + pWheel->tickNs - 1) / pWheel->tickNs;
+	insertTimer(pWheel, pTimer, pWheel->current + 1);
+	++pWheel->count;
+}
+
+void usock_timer_cancel(usock_timer_wheel_t *pWheel, usock_timer_t *pTimer)
+{
+	unsigned level, index;
+
+	if(pTimer->slot == USOCK_TIMER_IDLE)
+		return;
+
+	level = pTimer->slot / USOCK_TIMER_SLOTS;
+	index = pTimer->slot % USOCK_TIMER_SLOTS;
+	listRemove(&pTimer->link);
+	if(listEmpty(&pWheel->slots[level][index]))
+		clearSlot(pWheel, level, index);
+	pTimer->slot = USOCK_TIMER_IDLE;
+	--pWheel->count;
+}
+
+int usock_timer_armed(const usock_timer_t *pTimer)
+{
+	return pTimer->slot != USOCK_TIMER_IDLE;
+}
+
+usock_size_t usock_timer_wheel_advance(usock_timer_wheel_t *pWheel, usock_size_t nowNs)
+{
+	usock_size_t target, fired = 0;
+	usock_timer_link_t due;
+	unsigned level, index;
+
+	if(nowNs < pWheel->startNs)
+		return 0;
+	target = (nowNs - pWheel->startNs) / pWheel->tickNs;
+
+	while(pWheel->current < target)
+	{
+		/* Nothing to visit on the way, jump straight there */
+		if(pWheel->count == 0)
+		{
+			pWheel->current = target;
+			break;
+		}
+
+		++pWheel->current;
+		index = (unsigned)pWheel->current & SLOT_MASK;
+
+		/* Turning over: bring the next slot of each level above down, highest first */
+		if(index == 0)
+		{
+			for(level = 1; level < USOCK_TIMER_LEVELS; ++level)
+			{
+				if((pWheel->current >> (SLOT_BITS * level)) & SLOT_MASK)
+					break;
+			}
+			if(level == USOCK_TIMER_LEVELS)
+				--level;
+			for(; level >= 1; --level)
+				cascade(pWheel, level, (unsigned)(pWheel->current >> (SLOT_BITS * level)) & SLOT_MASK);
+		}
+
+		/* Callbacks may arm and cancel timers, so work off a detached list */
+		listTake(&pWheel->slots[0][index], &due);
+		clearSlot(pWheel, 0, index);
+		while(!listEmpty(&due))
+		{
+			usock_timer_t *timer = timerOf(due.next);
+			listRemove(&timer->link);
+			timer->slot = USOCK_TIMER_IDLE;
+			--pWheel->count;
+			++fired;
+			timer->callback(timer, timer->pUserData);
+		}
+	}
+	return fired;
+}
+
+int usock_timer_wheel_timeout_ms(const usock_timer_wheel_t *pWheel, usock_size_t nowNs)
+{
+	unsigned index = (unsigned)pWheel->current & SLOT_MASK;
+	usock_size_t ticks, dueNs;
+
+	if(pWheel->count == 0)
+		return -1;
+
+	/* The lowest level holds the next 255 ticks, anything above waits for it to turn over */
+	ticks = nextOccupied(pWheel, 0, index);
+	if(ticks == 0 || (ticks > USOCK_TIMER_SLOTS - index && upperOccupied(pWheel)))
+		ticks = USOCK_TIMER_SLOTS - index;
+
+	dueNs = pWheel->startNs + (pWheel->current + ticks) * pWheel->tickNs;
+	if(dueNs <= nowNs)
+		return 0;
+	return (int)((dueNs - nowNs + 999999) / 1000000);
+}
+
+usock_ssize_t usock_timer_wheel_poll(usock_timer_wheel_t *pWheel, usock_pollfd_t *pFds, usock_size_t count, int maxTimeoutMs)
+{
+	int timeoutMs = usock_timer_wheel_timeout_ms(pWheel, usock_get_time_ns());
+	usock_ssize_t ret;
+
+	if(timeoutMs < 0 || (maxTimeoutMs >= 0 && maxTimeoutMs < timeoutMs))
+		timeoutMs = maxTimeoutMs;
+
+	ret = usock_poll(pFds, count, timeoutMs);
+	usock_timer_wheel_advance(pWheel, usock_get_time_ns());
+	return ret;
+}
@@ -0,0 +1,475 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+/*
+* Event tracing.
+* Each thread records into its own single producer, single consumer ring,
+* so recording never takes a lock. A drain thread empties the rings every
+* few milliseconds and hands the records to the sink. Rings of threads
+* that have exited are freed once they are empty.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <usock.h>
+#include <stdio.h>
+#include <string.h>
+#include "usock_internal.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+/* Records per thread ring, a power of two */
+#define TRACE_RING_SIZE  4096
+/* Records handed to the sink at once */
+#define TRACE_DRAIN_BATCH 256
+/* How often the drain thread wakes up */
+#define TRACE_DRAIN_INTERVAL_MS 10
+
+#define TRACE_FILE_MAGIC "USOCKTR1"
+
+#if defined(_MSC_VER)
+/* Aligned loads and stores are atomic on x86/x64; the barrier keeps the compiler in order */
+#define LOAD_ACQUIRE(VAR)         (_ReadWriteBarrier(), (VAR))
+#define STORE_RELEASE(VAR, VALUE) do { _ReadWriteBarrier(); (VAR) = (VALUE); } while(0)
+#else
+#define LOAD_ACQUIRE(VAR)         __atomic_load_n(&(VAR), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(VAR, VALUE) __atomic_store_n(&(VAR), (VALUE), __ATOMIC_RELEASE)
+#endif
+
+typedef struct TraceRing
+{
+	/* Written by the owning thread only */
+	usock_size_t head;
+	unsigned char padHead[64 - sizeof(usock_size_t)];
+	/* Written by the drain thread only */
+	usock_size_t tail;
+	unsigned char padTail[64 - sizeof(usock_size_t)];
+
+	usock_size_t dropped;
+	int ownerExited;
+	unsigned short thread;
+	struct TraceRing *next;
+	usock_trace_record_t records[TRACE_RING_SIZE];
+} TraceRing;
+
+volatile int g_traceEnabled = 0;
+
+/* Every ring, guarded by the list lock */
+static TraceRing *g_rings = NULL;
+static unsigned short g_nextThreadId = 0;
+/* Drops of rings that have been freed, less those before the last release, guarded by the list lock */
+static usock_size_t g_droppedRetired = 0;
+
+/* The sink */
+static usock_trace_callback_t g_callback = NULL;
+static void *g_pUserData = NULL;
+static FILE *g_file = NULL;
+
+static volatile int g_drainRunning = 0;
+
+/***************************************/
+/*          Platform helpers           */
+
+#ifdef _WIN32
+
+static SRWLOCK g_listLock = SRWLOCK_INIT;
+static INIT_ONCE g_tlsOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_tlsIndex = FLS_OUT_OF_INDEXES;
+static HANDLE g_drainThread = NULL;
+
+static void listLock()   { AcquireSRWLockExclusive(&g_listLock); }
+static void listUnlock() { ReleaseSRWLockExclusive(&g_listLock); }
+
+static void WINAPI ringOrphaned(void *ring)
+{
+	if(ring)
+		STORE_RELEASE(((TraceRing *)ring)->ownerExited, 1);
+}
+
+static BOOL CALLBACK initTls(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	g_tlsIndex = FlsAlloc(ringOrphaned);
+	return g_tlsIndex != FLS_OUT_OF_INDEXES;
+}
+
+static TraceRing *currentRing()
+{
+	InitOnceExecuteOnce(&g_tlsOnce, initTls, NULL, NULL);
+	return (TraceRing *)FlsGetValue(g_tlsIndex);
+}
+
+static void setCurrentRing(TraceRing *ring)
+{
+	FlsSetValue(g_tlsIndex, ring);
+}
+
+static void sleepMs(unsigned ms)
+{
+	Sleep(ms);
+}
+
+static DWORD WINAPI drainMain(LPVOID param);
+
+static int startDrainThread()
+{
+	g_drainThread = CreateThread(NULL, 0, drainMain, NULL, 0, NULL);
+	return g_drainThread != NULL;
+}
+
+static void joinDrainThread()
+{
+	WaitForSingleObject(g_drainThread, INFINITE);
+	CloseHandle(g_drainThread);
+	g_drainThread = NULL;
+}
+
+#define SAVE_ERROR(VAR)    int VAR = WSAGetLastError()
+#define RESTORE_ERROR(VAR) WSASetLastError(VAR)
+
+#else
+
+static pthread_mutex_t g_listLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_tlsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_tlsKey;
+static pthread_t g_drainThread;
+
+static void listLock()   { pthread_mutex_lock(&g_listLock); }
+static void listUnlock() { pthread_mutex_unlock(&g_listLock); }
+
+static void ringOrphaned(void *ring)
+{
+	STORE_RELEASE(((TraceRing *)ring)->ownerExited, 1);
+}
+
+static void initTls()
+{
+	pthread_key_create(&g_tlsKey, ringOrphaned);
+}
+
+static TraceRing *currentRing()
+{
+	pthread_once(&g_tlsOnce, initTls);
+	return (TraceRing *)pthread_getspecific(g_tlsKey);
+}
+
+static void setCurrentRing(TraceRing *ring)
+{
+	pthread_setspecific(g_tlsKey, ring);
+}
+
+static void sleepMs(unsigned ms)
+{
+	struct timespec ts;
+	ts.tv_sec  = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+static void *drainMain(void *param);
+
+static int startDrainThread()
+{
+	return pthread_create(&g_drainThread, NULL, drainMain, NULL) == 0;
+}
+
+static void joinDrainThread()
+{
+	pthread_join(g_drainThread, NULL);
+}
+
+#define SAVE_ERROR(VAR)    int VAR = errno
+#define RESTORE_ERROR(VAR) errno = VAR
+
+#endif
+
+/***************************************/
+/*             Recording               */
+
+static TraceRing *createRing()
+{
+	TraceRing *ring = (TraceRing *)g_palloc(sizeof(TraceRing));
+	if(!ring)
+		return NULL;
+
+	memset(ring, 0, sizeof(TraceRing) - sizeof(ring->records));
+
+	listLock();
+	ring->thread = g_nextThreadId++;
+	ring->next = g_rings;
+	g_rings = ring;
+	listUnlock();
+
+	setCurrentRing(ring);
+	return ring;
+}
+
+void traceRecord(unsigned event, usock_handle_t hsock, usock_size_t startNs, usock_ssize_t result)
+{
+	SAVE_ERROR(savedError);
+	usock_size_t endNs = usock_get_time_ns();
+	usock_size_t elapsed = endNs - startNs;
+	usock_trace_record_t *rec;
+	TraceRing *ring;
+	usock_size_t head;
+
+	ring = currentRing();
+	if(!ring)
+		ring = createRing();
+	if(!ring)
+	{
+		RESTORE_ERROR(savedError);
+		return;
+	}
+
+	head = ring->head;
+	if(head - LOAD_ACQUIRE(ring->tail) >= TRACE_RING_SIZE)
+	{
+		/* Full; only this thread writes the counter */
+		STORE_RELEASE(ring->dropped, ring->dropped + 1);
+		RESTORE_ERROR(savedError);
+		return;
+	}
+
+	rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+	rec->timestampNs = startNs;
+	rec->hsock       = hsock;
+	rec->result      = result;
+	rec->durationNs  = elapsed > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (unsigned)elapsed;
+	rec->event       = (unsigned short)event;
+	rec->thread      = ring->thread;
+	STORE_RELEASE(ring->head, head + 1);
+
+	RESTORE_ERROR(savedError);
+}
+
+/***************************************/
+/*              Draining               */
+
+static void emit(const usock_trace_record_t *pRecords, usock_size_t count)
+{
+	if(g_callback)
+		g_callback(pRecords, count, g_pUserData);
+	else if(g_file)
+		fwrite(pRecords, sizeof(usock_trace_record_t), (size_t)count, g_file);
+}
+
+/* Empty every ring once, and free the rings of exited threads */
+static void drainOnce()
+{
+	usock_trace_record_t batch[TRACE_DRAIN_BATCH];
+	TraceRing **link;
+	TraceRing *ring;
+	usock_size_t head, tail, n, i;
+
+	listLock();
+	link = &g_rings;
+	while((ring = *link) != NULL)
+	{
+		int exited = LOAD_ACQUIRE(ring->ownerExited);
+		head = LOAD_ACQUIRE(ring->head);
+		tail = ring->tail;
+
+		while(tail != head)
+		{
+			n = head - tail < TRACE_DRAIN_BATCH ? head - tail : TRACE_DRAIN_BATCH;
+			for(i = 0; i < n; ++i)
+				batch[i] = ring->records[(tail + i) & (TRACE_RING_SIZE - 1)];
+			tail += n;
+			STORE_RELEASE(ring->tail, tail);
+			emit(batch, n);
+		}
+
+		if(exited)
+		{
+			*link = ring->next;
+			g_droppedRetired += LOAD_ACQUIRE(ring->dropped);
+			g_pfree(ring);
+		}
+		else
+		{
+			link = &ring->next;
+		}
+	}
+	listUnlock();
+
+	if(g_file)
+		fflush(g_file);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI drainMain(LPVOID param)
+#else
+static void *drainMain(void *param)
+#endif
+{
+	while(g_drainRunning)
+	{
+		drainOnce();
+		sleepMs(TRACE_DRAIN_INTERVAL_MS);
+	}
+	drainOnce();
+	return 0;
+}
+
+/***************************************/
+/*             Public API              */
+
+static usock_err_t startTracing(usock_trace_callback_t callback, void *pUserData, FILE *file)
+{
+	TraceRing *ring;
+
+	if(g_drainRunning)
+		return USOCK_ERROR_ALREADY_INITIALIZED;
+
+	g_callback  = callback;
+	g_pUserData = pUserData;
+	g_file      = file;
+
+	/* Throw away whatever raced with the last stop */
+	listLock();
+	for(ring = g_rings; ring; ring = ring->next)
+		STORE_RELEASE(ring->tail, LOAD_ACQUIRE(ring->head));
+	listUnlock();
+
+	g_drainRunning = 1;
+	if(!startDrainThread())
+	{
+		g_drainRunning = 0;
+		g_callback = NULL;
+		g_file = NULL;
+		return USOCK_ERROR_INTERNAL;
+	}
+
+	g_traceEnabled = 1;
+	return USOCK_OK;
+}
+
+usock_err_t usock_trace_start(usock_trace_callback_t callback, void *pUserData)
+{
+	if(!callback)
+		return USOCK_ERROR_INVALID_ARG;
+	return startTracing(callback, pUserData, NULL);
+}
+
+usock_err_t usock_trace_start_file(const char *path)
+{
+	unsigned char header[12];
+	unsigned size = (unsigned)sizeof(usock_trace_record_t);
+	usock_err_t err;
+	FILE *file;
+
+	if(g_drainRunning)
+		return USOCK_ERROR_ALREADY_INITIALIZED;
+
+#ifdef _WIN32
+	if(fopen_s(&file, path, "wb") != 0)
+		file = NULL;
+#else
+	file = fopen(path, "wb");
+#endif
+	if(!file)
+		return USOCK_ERROR_INVALID_ARG;
+
+	memcpy(header, TRACE_FILE_MAGIC, 8);
+	header[8]  = (unsigned char)size;
+	header[9]  = (unsigned char)(size >> 8);
+	header[10] = (unsigned char)(size >> 16);
+	header[11] = (unsigned char)(size >> 24);
+	fwrite(header, 1, sizeof(header), file);
+
+	err = startTracing(NULL, NULL, file);
+	if(err != USOCK_OK)
+		fclose(file);
+	return err;
+}
+
+void usock_trace_stop()
+{
+	if(!g_drainRunning)
+		return;
+
+	g_traceEnabled = 0;
+	g_drainRunning = 0;
+	joinDrainThread();
+
+	if(g_file)
+		fclose(g_file);
+	g_file      = NULL;
+	g_callback  = NULL;
+	g_pUserData = NULL;
+}
+
+usock_size_t usock_trace_get_dropped()
+{
+	usock_size_t dropped;
+	TraceRing *ring;
+
+	listLock();
+	dropped = g_droppedRetired;
+	for(ring = g_rings; ring; ring = ring->next)
+		dropped += LOAD_ACQUIRE(ring->dropped);
+	listUnlock();
+	return dropped;
+}
+
+void traceRelease()
+{
+	TraceRing **link;
+	TraceRing *ring;
+	usock_size_t liveDropped = 0;
+
+	usock_trace_stop();
+
+	/* 
+	*  Only the rings of exited threads can be freed. A live thread keeps
+	*  a pointer to its ring in thread local storage, and writes to it
+	*  when it traces again or exits, so its ring stays on the list for
+	*  the next usock_initialize.
+	*/
+	listLock();
+	link = &g_rings;
+	while((ring = *link) != NULL)
+	{
+		if(LOAD_ACQUIRE(ring->ownerExited))
+		{
+			*link = ring->next;
+			g_pfree(ring);
+		}
+		else
+		{
+			liveDropped += LOAD_ACQUIRE(ring->dropped);
+			link = &ring->next;
+		}
+	}
+	/* Start the count from zero again; it wraps back as those rings add theirs */
+	g_droppedRetired = 0 - liveDropped;
+	listUnlock();
+}
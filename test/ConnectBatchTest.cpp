@@ -0,0 +1,215 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <usock.hpp>
+
+#define PORT 8089
+// Listens with a backlog of one and never accepts, so its queue fills up
+#define FULL_PORT 8090
+#define FULL_PORT_QUEUE 2
+// Nobody listens here
+#define REFUSED_PORT 8091
+#define TIMEOUT_MS 200
+// Past the first SYN retransmission, which comes after a second
+#define RETRANSMIT_WAIT_MS 1500
+#define SHM_ADDRESS "@usock-batch-test"
+
+static usock_handle_t Listen(usock_port_t port, int backlog)
+{
+	usock_handle_t listener;
+	usock_create_socket("Listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(listener, port) != USOCK_OK || usock_listen(listener, backlog) != USOCK_OK)
+	{
+		usock_free_socket(listener);
+		return nullptr;
+	}
+	return listener;
+}
+
+static usock_handle_t ListenShm()
+{
+	usock_handle_t listener;
+	usock_create_socket("Shared memory listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_SHARED_MEMORY, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind_address(listener, SHM_ADDRESS, 0) != USOCK_OK || usock_listen(listener, 1) != USOCK_OK)
+	{
+		usock_free_socket(listener);
+		return nullptr;
+	}
+	return listener;
+}
+
+static usock_connect_request_t ShmRequest()
+{
+	usock_connect_request_t req = {};
+	usock_create_socket("Shared memory socket", &req.hsock);
+	usock_configure(req.hsock, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_SHARED_MEMORY, USOCK_OPTIONS_DEFAULT);
+	req.ip_address = SHM_ADDRESS;
+	req.port = 0;
+	req.timeoutMs = -1;
+	req.result = USOCK_ERROR_INTERNAL;
+	return req;
+}
+
+static usock_connect_request_t Request(usock_port_t port, int timeoutMs)
+{
+	usock_connect_request_t req = {};
+	usock_create_socket("Client socket", &req.hsock);
+	usock_configure(req.hsock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	req.ip_address = "127.0.0.1";
+	req.port = port;
+	req.timeoutMs = timeoutMs;
+	req.result = USOCK_ERROR_INTERNAL;
+	return req;
+}
+
+// A connected socket is back in blocking mode and carries data
+static bool Exchange(usock_handle_t client, usock_handle_t listener)
+{
+	usock_handle_t server;
+	char byte = 0;
+	if(usock_accept(listener, &server) != USOCK_OK)
+	{
+		printf("Connected socket not accepted\n");
+		return false;
+	}
+	bool ok = usock_send(client, "b", 1) == 1 && usock_recv(server, &byte, 1) == 1 && byte == 'b';
+	usock_close_socket(server);
+	usock_free_socket(server);
+	if(!ok)
+		printf("Connected socket doesn't carry data\n");
+	return ok;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	usock_handle_t listener = Listen(PORT, 16);
+	usock_handle_t full = Listen(FULL_PORT, 1);
+	usock_handle_t shmListener = ListenShm();
+	if(!listener || !full || !shmListener)
+	{
+		printf("Failed to listen\n");
+		return 1;
+	}
+
+	// The full listener queues FULL_PORT_QUEUE connections, the last one times out
+	usock_connect_request_t requests[] = {
+		Request(PORT, -1),
+		Request(REFUSED_PORT, -1),
+		Request(FULL_PORT, TIMEOUT_MS),
+		Request(FULL_PORT, TIMEOUT_MS),
+		Request(FULL_PORT, TIMEOUT_MS),
+		ShmRequest(),
+	};
+	const usock_size_t count = sizeof(requests) / sizeof(requests[0]);
+
+	// The shared memory handshake finishes the connect, so accept alongside
+	usock_handle_t shmServer = nullptr;
+	std::thread acceptor([&]() { usock_accept(shmListener, &shmServer); });
+	usock_size_t start = usock_get_time_ns();
+	usock_size_t connected = usock_connect_batch(requests, count);
+	usock_size_t elapsedMs = (usock_get_time_ns() - start) / 1000000;
+	acceptor.join();
+
+	if(requests[0].result != USOCK_OK || !Exchange(requests[0].hsock, listener))
+	{
+		printf("Connect to a listener failed with %d\n", (int)requests[0].result);
+		return 2;
+	}
+	if(requests[1].result == USOCK_OK || requests[1].result == USOCK_ERROR_TIMEOUT)
+	{
+		printf("Connect to a closed port ended with %d\n", (int)requests[1].result);
+		return 3;
+	}
+
+	// Connected all the way to the ring, not just the local socket
+	usock_connect_request_t &shm = requests[count - 1];
+	char byte = 0;
+	if(shm.result != USOCK_OK || !shmServer || usock_send(shm.hsock, "s", 1) != 1 || usock_recv(shmServer, &byte, 1) != 1 || byte != 's')
+	{
+		printf("Shared memory connect ended with %d, without a working ring\n", (int)shm.result);
+		return 9;
+	}
+
+	usock_size_t timedOut = 0;
+	for(usock_size_t i = 2; i < count - 1; ++i)
+	{
+		if(requests[i].result == USOCK_ERROR_TIMEOUT)
+			++timedOut;
+		else if(requests[i].result != USOCK_OK)
+		{
+			printf("Connect to the full listener failed with %d\n", (int)requests[i].result);
+			return 4;
+		}
+	}
+	if(timedOut != 1 || elapsedMs < TIMEOUT_MS || elapsedMs > 5 * TIMEOUT_MS)
+	{
+		printf("%llu connects timed out after %llu ms\n", (unsigned long long)timedOut, (unsigned long long)elapsedMs);
+		return 6;
+	}
+
+	if(connected != count - 1 - timedOut)
+	{
+		printf("Batch reported %llu connected\n", (unsigned long long)connected);
+		return 7;
+	}
+
+	// Make room in the full listener's queue. A timed out socket that was
+	// left open would get in on its next SYN; a closed one never comes.
+	usock_handle_t queued[FULL_PORT_QUEUE];
+	for(usock_handle_t &hsock : queued)
+		usock_accept(full, &hsock);
+	std::this_thread::sleep_for(std::chrono::milliseconds(RETRANSMIT_WAIT_MS));
+	usock_handle_t late;
+	usock_set_nonblocking(full, 1);
+	if(usock_accept(full, &late) == USOCK_OK)
+	{
+		printf("Timed out socket left open\n");
+		return 8;
+	}
+	for(usock_handle_t hsock : queued)
+	{
+		usock_close_socket(hsock);
+		usock_free_socket(hsock);
+	}
+
+	for(usock_connect_request_t &req : requests)
+	{
+		usock_close_socket(req.hsock);
+		usock_free_socket(req.hsock);
+	}
+	usock_close_socket(shmServer);
+	usock_free_socket(shmServer);
+	usock_close_socket(shmListener);
+	usock_free_socket(shmListener);
+	usock_close_socket(full);
+	usock_free_socket(full);
+	usock_close_socket(listener);
+	usock_free_socket(listener);
+	return 0;
+}
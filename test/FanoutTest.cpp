@@ -0,0 +1,246 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <usock.hpp>
+#include <usock_fanout.hpp>
+
+#define PORT 8088
+#define RUDP_PORT 8092
+#define CLIENTS 3
+#define MESSAGE_SIZE 16384
+// Bounds the publishing loop; the kernel buffers only a few MB
+#define MAX_PUBLISHES 10000
+
+struct Connection
+{
+	usock_handle_t client;
+	usock_handle_t server;
+};
+
+static bool Connect(usock_handle_t listener, Connection &conn)
+{
+	usock_create_socket("Client socket", &conn.client);
+	usock_configure(conn.client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_connect(conn.client, "127.0.0.1", PORT) != USOCK_OK || usock_accept(listener, &conn.server) != USOCK_OK)
+	{
+		printf("Failed to connect\n");
+		return false;
+	}
+	return true;
+}
+
+static bool Received(usock_handle_t client, const char *expected)
+{
+	char buffer[64] = {};
+	size_t len = strlen(expected), got = 0;
+	while(got < len)
+	{
+		usock_ssize_t ret = usock_recv(client, buffer + got, len - got);
+		if(ret <= 0)
+			break;
+		got += (size_t)ret;
+	}
+	if(got != len || memcmp(buffer, expected, len) != 0)
+	{
+		printf("Expected \"%s\", got \"%.*s\"\n", expected, (int)got, buffer);
+		return false;
+	}
+	return true;
+}
+
+// Nothing arrives within a short wait
+static bool NothingReceived(usock_handle_t client)
+{
+	char byte;
+	usock_size_t got = 0;
+	usock_err_t err = usock_recv_deadline(client, &byte, 1, usock_get_time_ns() + 50000000ULL, &got);
+	if(err != USOCK_ERROR_TIMEOUT)
+	{
+		printf("Received a message for a topic that wasn't subscribed to\n");
+		return false;
+	}
+	return true;
+}
+
+static bool TestMembership(Connection *conns)
+{
+	usock::fanout fan;
+
+	// One socket on two topics shares one queue between them
+	fan.subscribe("a", conns[0].server);
+	fan.subscribe("a", conns[1].server);
+	fan.subscribe("a", conns[1].server);
+	fan.subscribe("b", conns[1].server);
+	if(fan.subscriber_count("a") != 2 || fan.subscriber_count("b") != 1 || fan.subscriber_count("c") != 0)
+	{
+		printf("Wrong subscriber counts\n");
+		return false;
+	}
+
+	usock::payload::ref msg = usock::payload::create("one|", 4);
+	if(fan.publish("a", msg) != 2 || !Received(conns[0].client, "one|") || !Received(conns[1].client, "one|"))
+		return false;
+	// Written straight away, so no queue holds on to it
+	if(msg->use_count() != 1)
+	{
+		printf("Payload still referenced %lld times\n", (long long)msg->use_count());
+		return false;
+	}
+
+	if(fan.publish("b", "two|", 4) != 1 || !Received(conns[1].client, "two|") || !NothingReceived(conns[0].client))
+		return false;
+	if(fan.publish("c", "none|", 5) != 0)
+	{
+		printf("Published to a topic nobody subscribed to\n");
+		return false;
+	}
+
+	fan.unsubscribe("a", conns[0].server);
+	if(fan.subscriber_count("a") != 1 || fan.publish("a", "three|", 6) != 1 || !Received(conns[1].client, "three|") || !NothingReceived(conns[0].client))
+	{
+		printf("Unsubscribed socket still receives\n");
+		return false;
+	}
+
+	fan.remove(conns[1].server);
+	if(fan.subscriber_count("a") != 0 || fan.subscriber_count("b") != 0 || fan.publish("b", "four|", 5) != 0)
+	{
+		printf("Removed socket still subscribed\n");
+		return false;
+	}
+	return true;
+}
+
+static bool TestEviction(Connection *conns)
+{
+	usock::fanout::limits lim;
+	lim.maxQueuedBytes = 4 * MESSAGE_SIZE;
+	usock::fanout fan(lim);
+
+	std::vector<usock_handle_t> evicted;
+	fan.set_evict_callback([&evicted](usock_handle_t hsock) { evicted.push_back(hsock); });
+
+	// The first client never reads, the second one does
+	fan.subscribe("slow", conns[0].server);
+	fan.subscribe("fast", conns[1].server);
+	std::vector<char> message(MESSAGE_SIZE, 'x');
+	for(int i = 0; i < MAX_PUBLISHES && evicted.empty(); ++i)
+		fan.publish("slow", message.data(), message.size());
+
+	if(evicted.size() != 1 || evicted[0] != conns[0].server || fan.subscriber_count("slow") != 0)
+	{
+		printf("Slow subscriber not evicted\n");
+		return false;
+	}
+	if(fan.subscriber_count("fast") != 1 || fan.publish("fast", "five|", 5) != 1 || !Received(conns[1].client, "five|"))
+	{
+		printf("Other subscriber affected by the eviction\n");
+		return false;
+	}
+
+	// A subscriber whose connection fails is evicted too
+	fan.subscribe("closed", conns[2].server);
+	usock_close_socket(conns[2].client);
+	for(int i = 0; i < 100 && evicted.size() < 2; ++i)
+	{
+		fan.publish("closed", "six|", 4);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	if(evicted.size() != 2 || evicted[1] != conns[2].server || fan.subscriber_count("closed") != 0)
+	{
+		printf("Subscriber with a closed connection not evicted\n");
+		return false;
+	}
+	return true;
+}
+
+static bool TestReliableDatagram()
+{
+	usock_handle_t server, client;
+	usock_create_socket("RUDP server", &server);
+	usock_configure(server, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE_DATAGRAM, USOCK_OPTIONS_REUSE_ADDRESS);
+	usock_create_socket("RUDP client", &client);
+	usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE_DATAGRAM, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind(server, RUDP_PORT) != USOCK_OK || usock_connect(client, "127.0.0.1", RUDP_PORT) != USOCK_OK)
+	{
+		printf("Failed to set up reliable datagram sockets\n");
+		return false;
+	}
+
+	// The server takes the client as its peer from the first message
+	char buffer[64] = {};
+	if(usock_send(client, "hi", 2) != 2 || usock_recv(server, buffer, sizeof(buffer)) != 2)
+	{
+		printf("Reliable datagram handshake failed\n");
+		return false;
+	}
+
+	// Messages to a reliable datagram subscriber go through the protocol, not raw
+	usock::fanout fan;
+	fan.subscribe("rudp", server);
+	if(fan.publish("rudp", "seven|", 6) != 1 || !Received(client, "seven|"))
+	{
+		printf("Reliable datagram subscriber didn't get the message\n");
+		return false;
+	}
+
+	fan.remove(server);
+	usock_close_socket(client);
+	usock_free_socket(client);
+	usock_close_socket(server);
+	usock_free_socket(server);
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	usock_handle_t listener;
+	usock_create_socket("Listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(listener, PORT) != USOCK_OK || usock_listen(listener, CLIENTS) != USOCK_OK)
+	{
+		printf("Failed to listen\n");
+		return 1;
+	}
+
+	Connection conns[CLIENTS];
+	for(Connection &conn : conns)
+	{
+		if(!Connect(listener, conn))
+			return 2;
+	}
+
+	if(!TestMembership(conns))
+		return 3;
+	if(!TestEviction(conns))
+		return 4;
+	if(!TestReliableDatagram())
+		return 5;
+	return 0;
+}
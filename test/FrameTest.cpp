@@ -0,0 +1,255 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <usock.hpp>
+#include <usock_frame.h>
+
+#define PORT 8086
+#define RUDP_PORT 8093
+
+// A frame bigger than the receive buffer, and than the drain chunk
+#define BIG_FRAME_SIZE 10000
+
+// Bit at a time, straight from the polynomial, to check the fast paths against
+static unsigned ReferenceCrc(unsigned crc, const unsigned char *data, size_t len)
+{
+	crc = ~crc;
+	for(size_t i = 0; i < len; ++i)
+	{
+		crc ^= data[i];
+		for(int k = 0; k < 8; ++k)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+	}
+	return ~crc;
+}
+
+static bool TestCheckValue()
+{
+	unsigned crc = usock_crc32c(0, "123456789", 9);
+	if(crc != 0xE3069283u)
+	{
+		printf("CRC32C(\"123456789\") = %08X, expected E3069283\n", crc);
+		return false;
+	}
+	return true;
+}
+
+static bool TestLengths()
+{
+	// The hardware path interleaves three streams of 8192 bytes, then of 256
+	const size_t blocks[] = { 3 * 256, 3 * 8192 };
+	std::vector<unsigned char> data(4 * 8192 + 64);
+	unsigned seed = 12345;
+	for(unsigned char &byte : data)
+	{
+		seed = seed * 1103515245u + 12345u;
+		byte = (unsigned char)(seed >> 16);
+	}
+
+	for(size_t block : blocks)
+	{
+		for(size_t len = block - 9; len <= block + 9; ++len)
+		{
+			// Misaligned starts too, as the hardware path reads 8 bytes at a time
+			for(size_t offset = 0; offset < 8; ++offset)
+			{
+				const unsigned char *p = data.data() + offset;
+				unsigned expected = ReferenceCrc(0, p, len);
+				if(usock_crc32c(0, p, len) != expected)
+				{
+					printf("%s CRC32C differs for %zu bytes at offset %zu\n", usock_crc32c_implementation(), len, offset);
+					return false;
+				}
+
+				// Continuing a checksum must match doing it in one go
+				unsigned split = usock_crc32c(usock_crc32c(0, p, len / 3), p + len / 3, len - len / 3);
+				if(split != expected)
+				{
+					printf("%s CRC32C differs when continued for %zu bytes\n", usock_crc32c_implementation(), len);
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+static void Put32(unsigned char *p, unsigned v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static bool TestStream()
+{
+	usock::instance usockInst;
+
+	usock_handle_t listener, client, server;
+	usock_create_socket("Listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(listener, PORT) != USOCK_OK || usock_listen(listener, 1) != USOCK_OK)
+	{
+		printf("Failed to listen\n");
+		return false;
+	}
+	usock_create_socket("Client socket", &client);
+	usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_connect(client, "127.0.0.1", PORT) != USOCK_OK || usock_accept(listener, &server) != USOCK_OK)
+	{
+		printf("Failed to connect\n");
+		return false;
+	}
+
+	const char message[] = "Framed message";
+	char buffer[1024];
+	usock_size_t len;
+
+	// Round trip, with and without a checksum, and an empty frame
+	usock_send_frame(client, message, sizeof(message), USOCK_FRAME_CRC32C);
+	usock_send_frame(client, message, sizeof(message), USOCK_FRAME_DEFAULT);
+	usock_send_frame(client, message, 0, USOCK_FRAME_CRC32C);
+	for(int i = 0; i < 2; ++i)
+	{
+		if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_OK || len != sizeof(message) || memcmp(buffer, message, len) != 0)
+		{
+			printf("Frame %d didn't round trip\n", i);
+			return false;
+		}
+	}
+	if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_OK || len != 0)
+	{
+		printf("Empty frame didn't round trip\n");
+		return false;
+	}
+
+	// A frame whose payload doesn't match its checksum, followed by a good one
+	unsigned char corrupt[USOCK_FRAME_HEADER_SIZE + sizeof(message)];
+	Put32(corrupt, (unsigned)sizeof(message) | 0x80000000u);
+	Put32(corrupt + 4, usock_crc32c(0, message, sizeof(message)));
+	memcpy(corrupt + USOCK_FRAME_HEADER_SIZE, message, sizeof(message));
+	corrupt[USOCK_FRAME_HEADER_SIZE] ^= 0x01;
+	usock_send(client, corrupt, sizeof(corrupt));
+	usock_send_frame(client, message, sizeof(message), USOCK_FRAME_CRC32C);
+	if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_ERROR_CHECKSUM_MISMATCH)
+	{
+		printf("Corrupt frame accepted\n");
+		return false;
+	}
+	if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_OK || memcmp(buffer, message, sizeof(message)) != 0)
+	{
+		printf("Stream out of sync after a corrupt frame\n");
+		return false;
+	}
+
+	// A frame too big for the buffer is drained, and the next one still arrives
+	std::vector<char> big(BIG_FRAME_SIZE, 'x');
+	usock_send_frame(client, big.data(), big.size(), USOCK_FRAME_CRC32C);
+	usock_send_frame(client, message, sizeof(message), USOCK_FRAME_CRC32C);
+	if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_ERROR_BUFFER_TOO_SMALL || len != BIG_FRAME_SIZE)
+	{
+		printf("Oversized frame not reported\n");
+		return false;
+	}
+	if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_OK || memcmp(buffer, message, sizeof(message)) != 0)
+	{
+		printf("Stream out of sync after an oversized frame\n");
+		return false;
+	}
+
+	// The peer closing shows up as such, not as a bad frame
+	usock_close_socket(client);
+	if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_ERROR_CONNECTION_CLOSED)
+	{
+		printf("Closed connection not reported\n");
+		return false;
+	}
+
+	usock_free_socket(client);
+	usock_close_socket(server);
+	usock_free_socket(server);
+	usock_close_socket(listener);
+	usock_free_socket(listener);
+	return true;
+}
+
+static bool TestReliableDatagram()
+{
+	usock::instance usockInst;
+
+	usock_handle_t server, client;
+	usock_create_socket("RUDP server", &server);
+	usock_configure(server, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE_DATAGRAM, USOCK_OPTIONS_REUSE_ADDRESS);
+	usock_create_socket("RUDP client", &client);
+	usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE_DATAGRAM, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind(server, RUDP_PORT) != USOCK_OK || usock_connect(client, "127.0.0.1", RUDP_PORT) != USOCK_OK)
+	{
+		printf("Failed to set up reliable datagram sockets\n");
+		return false;
+	}
+
+	const char message[] = "Framed message";
+	char buffer[1024];
+	usock_size_t len;
+	usock_send_frame(client, message, sizeof(message), USOCK_FRAME_CRC32C);
+	if(usock_recv_frame(server, buffer, sizeof(buffer), &len) != USOCK_OK || len != sizeof(message) || memcmp(buffer, message, len) != 0)
+	{
+		printf("Frame didn't round trip over a reliable datagram socket\n");
+		return false;
+	}
+
+	// Gathered and scattered buffers carry one protocol message, acks stay out of them
+	char head[4], tail[64] = {};
+	usock_iovec_t out[2] = { { "gath", 4 }, { "ered", 4 } };
+	usock_iovec_t in[2] = { { head, sizeof(head) }, { tail, sizeof(tail) } };
+	for(int i = 0; i < 3; ++i)
+	{
+		if(usock_sendv(client, out, 2) != 8 || usock_recvv(server, in, 2) != 8 || memcmp(head, "gath", 4) != 0 || memcmp(tail, "ered", 4) != 0)
+		{
+			printf("Vectored message %d didn't round trip over a reliable datagram socket\n", i);
+			return false;
+		}
+	}
+
+	usock_close_socket(client);
+	usock_free_socket(client);
+	usock_close_socket(server);
+	usock_free_socket(server);
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	if(!TestCheckValue())
+		return 1;
+	if(!TestLengths())
+		return 2;
+	if(!TestStream())
+		return 3;
+	if(!TestReliableDatagram())
+		return 4;
+	return 0;
+}
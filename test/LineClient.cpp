@@ -0,0 +1,105 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <usock.hpp>
+
+#define PORT 8087
+#define CONNECT_ATTEMPTS 50
+
+// Sent in pieces, each given time to arrive on its own.
+// Must match the lines LineServer expects.
+static const char *const g_pieces[] = {
+	"split ", "across ", "sends\r\n",
+	"delimiter split\r", "\n",
+	"lone \r and \n stay in the line\r\n",
+	"\r\n",
+	"partial line ", "at close",
+};
+
+static bool Connect(usock_handle_t hsock, const char *ip)
+{
+	// The server is started first, but may not be listening yet
+	for(int i = 0; i < CONNECT_ATTEMPTS; ++i)
+	{
+		if(usock_connect(hsock, ip, PORT) == USOCK_OK)
+			return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	return false;
+}
+
+static bool SendPiece(usock_handle_t hsock, const std::string &piece)
+{
+	if(usock_send(hsock, piece.data(), piece.size()) != (usock_ssize_t)piece.size())
+	{
+		printf("Send failed\n");
+		return false;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	const char *ip = "127.0.0.1";
+	if(argc >= 2)
+	{
+		ip = argv[1];
+	}
+
+	usock::instance usockInst;
+
+	usock_handle_t sock;
+	usock_create_socket("Client socket", &sock);
+	usock_configure(sock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_NO_DELAY);
+	if(!Connect(sock, ip))
+	{
+		printf("Connect failed\n");
+		return 1;
+	}
+	for(const char *piece : g_pieces)
+	{
+		if(!SendPiece(sock, piece))
+			return 2;
+	}
+	// Closing ends the stream part way through the last line
+	usock_close_socket(sock);
+	usock_free_socket(sock);
+
+	usock_create_socket("Client socket", &sock);
+	usock_configure(sock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_NO_DELAY);
+	if(!Connect(sock, ip))
+	{
+		printf("Connect failed\n");
+		return 3;
+	}
+	if(!SendPiece(sock, "short\n") || !SendPiece(sock, std::string(100, 'x')))
+		return 4;
+	usock_close_socket(sock);
+	usock_free_socket(sock);
+	return 0;
+}
@@ -0,0 +1,122 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string>
+#include <usock.hpp>
+#include <usock_line_reader.hpp>
+
+#define PORT 8087
+
+// Small reads, so lines and delimiters straddle them
+#define READ_SIZE 4
+#define MAX_LINE_LENGTH 64
+
+static const char *const g_expected[] = {
+	"split across sends",
+	"delimiter split",
+	"lone \r and \n stay in the line",
+	"",
+	"partial line at close",
+};
+
+static bool ExpectLine(usock::line_reader &reader, const std::string &expected)
+{
+	std::string_view line;
+	if(!reader.next(line))
+	{
+		printf("Expected \"%s\", got status %d\n", expected.c_str(), (int)reader.status());
+		return false;
+	}
+	if(line != expected)
+	{
+		printf("Expected \"%s\", got \"%.*s\"\n", expected.c_str(), (int)line.size(), line.data());
+		return false;
+	}
+	return true;
+}
+
+static bool ReadLines(usock_handle_t hsock)
+{
+	usock::line_reader reader(hsock, "\r\n", MAX_LINE_LENGTH, READ_SIZE);
+	for(const char *expected : g_expected)
+	{
+		if(!ExpectLine(reader, expected))
+			return false;
+	}
+
+	std::string_view line;
+	if(reader.next(line) || reader.status() != usock::line_reader::STATUS_CLOSED)
+	{
+		printf("Expected the end of the stream, got status %d\n", (int)reader.status());
+		return false;
+	}
+	return true;
+}
+
+static bool ReadTooLong(usock_handle_t hsock)
+{
+	usock::line_reader reader(hsock, "\n", MAX_LINE_LENGTH, READ_SIZE);
+	if(!ExpectLine(reader, "short"))
+		return false;
+
+	std::string_view line;
+	if(reader.next(line) || reader.status() != usock::line_reader::STATUS_LINE_TOO_LONG)
+	{
+		printf("Expected a line too long, got status %d\n", (int)reader.status());
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	usock_handle_t listener;
+	usock_create_socket("Listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(listener, PORT) != USOCK_OK || usock_listen(listener, 2) != USOCK_OK)
+	{
+		printf("Failed to listen\n");
+		return 1;
+	}
+
+	usock_handle_t hsock;
+	if(usock_accept(listener, &hsock) != USOCK_OK)
+		return 2;
+	if(!ReadLines(hsock))
+		return 3;
+	usock_close_socket(hsock);
+	usock_free_socket(hsock);
+
+	if(usock_accept(listener, &hsock) != USOCK_OK)
+		return 4;
+	if(!ReadTooLong(hsock))
+		return 5;
+	usock_close_socket(hsock);
+	usock_free_socket(hsock);
+
+	usock_close_socket(listener);
+	usock_free_socket(listener);
+	return 0;
+}
@@ -0,0 +1,234 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <usock.hpp>
+
+// Passed over a local socket once accepted
+#define PORT 8096
+#define STREAM_ADDRESS "@usock-local-stream"
+#define DATAGRAM_ADDRESS "@usock-local-datagram"
+#define PATH_ADDRESS "/tmp/usock-local-test.sock"
+
+static usock_handle_t ListenLocal(const char *address, usock_flags_t flags)
+{
+	usock_handle_t listener;
+	usock_create_socket("Local listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_RELIABLE, flags);
+	if(usock_bind_address(listener, address, 0) != USOCK_OK || usock_listen(listener, 1) != USOCK_OK)
+	{
+		usock_free_socket(listener);
+		return nullptr;
+	}
+	return listener;
+}
+
+static void Destroy(usock_handle_t hsock)
+{
+	usock_close_socket(hsock);
+	usock_free_socket(hsock);
+}
+
+// Connect a client to the listener and accept it
+static bool ConnectLocal(usock_handle_t listener, const char *address, usock_handle_t *pClient, usock_handle_t *pServer)
+{
+	usock_create_socket("Local client socket", pClient);
+	usock_configure(*pClient, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_connect(*pClient, address, 0) != USOCK_OK)
+	{
+		printf("Failed to connect to %s\n", address);
+		usock_free_socket(*pClient);
+		return false;
+	}
+	if(usock_accept(listener, pServer) != USOCK_OK)
+	{
+		printf("Failed to accept on %s\n", address);
+		Destroy(*pClient);
+		return false;
+	}
+	return true;
+}
+
+static bool Exchange(usock_handle_t from, usock_handle_t to, const char *message)
+{
+	char buffer[64] = {};
+	usock_ssize_t len = (usock_ssize_t)strlen(message);
+	if(usock_send(from, message, len) != len || usock_recv(to, buffer, sizeof(buffer)) != len ||
+	   memcmp(buffer, message, len) != 0)
+	{
+		printf("Failed to send \"%s\"\n", message);
+		return false;
+	}
+	return true;
+}
+
+static bool TestStream(const char *address, usock_flags_t flags)
+{
+	usock_handle_t listener = ListenLocal(address, flags), client, server;
+	if(!listener)
+	{
+		printf("Failed to listen on %s\n", address);
+		return false;
+	}
+	bool ok = ConnectLocal(listener, address, &client, &server);
+	if(ok)
+	{
+		ok = Exchange(client, server, "ping") && Exchange(server, client, "pong");
+		Destroy(client);
+		Destroy(server);
+	}
+	Destroy(listener);
+	return ok;
+}
+
+// Each send arrives as a message of its own
+static bool TestDatagram()
+{
+	usock_handle_t server, client, sender = nullptr;
+	usock_create_socket("Local datagram server", &server);
+	usock_configure(server, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind_address(server, DATAGRAM_ADDRESS, 0) != USOCK_OK)
+	{
+		printf("Failed to bind %s\n", DATAGRAM_ADDRESS);
+		usock_free_socket(server);
+		return false;
+	}
+	usock_create_socket("Local datagram client", &client);
+	usock_configure(client, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+	bool ok = usock_connect(client, DATAGRAM_ADDRESS, 0) == USOCK_OK &&
+	          usock_send(client, "one", 3) == 3 && usock_send(client, "three", 5) == 5;
+	if(!ok)
+		printf("Failed to send to %s\n", DATAGRAM_ADDRESS);
+
+	const char *expected[] = { "one", "three" };
+	for(const char *message : expected)
+	{
+		char buffer[64] = {};
+		usock_ssize_t len = (usock_ssize_t)strlen(message);
+		if(ok && (usock_recv_from(server, buffer, sizeof(buffer), 0, &sender) != len ||
+		          memcmp(buffer, message, len) != 0))
+		{
+			printf("Expected the datagram \"%s\", got \"%s\"\n", message, buffer);
+			ok = false;
+		}
+		if(sender)
+			usock_free_socket(sender);
+		sender = nullptr;
+	}
+	Destroy(client);
+	Destroy(server);
+	return ok;
+}
+
+// A stale socket file left at the path doesn't stop the next bind
+static bool TestPath()
+{
+	usock_handle_t stale = ListenLocal(PATH_ADDRESS, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(!stale)
+	{
+		printf("Failed to listen on %s\n", PATH_ADDRESS);
+		return false;
+	}
+	Destroy(stale);
+	return TestStream(PATH_ADDRESS, USOCK_OPTIONS_REUSE_ADDRESS);
+}
+
+// Hand an accepted TCP connection over a local socket, and serve it from the other end
+static bool TestPassSocket()
+{
+	usock_handle_t client, server;
+	usock_handle_t listener = ListenLocal(STREAM_ADDRESS, USOCK_OPTIONS_DEFAULT);
+	if(!listener || !ConnectLocal(listener, STREAM_ADDRESS, &client, &server))
+		return false;
+	Destroy(listener);
+
+	usock_handle_t tcpListener, tcpClient, tcpAccepted, passed = nullptr;
+	usock_create_socket("Listen socket", &tcpListener);
+	usock_configure(tcpListener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	usock_create_socket("Client socket", &tcpClient);
+	usock_configure(tcpClient, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind(tcpListener, PORT) != USOCK_OK || usock_listen(tcpListener, 1) != USOCK_OK ||
+	   usock_connect(tcpClient, "127.0.0.1", PORT) != USOCK_OK || usock_accept(tcpListener, &tcpAccepted) != USOCK_OK)
+	{
+		printf("Failed to set up the connection to pass\n");
+		return false;
+	}
+	Destroy(tcpListener);
+
+	// A message without a socket comes back with none
+	char buffer[64] = {};
+	usock_size_t received = 0;
+	if(usock_send(client, "x", 1) != 1 ||
+	   usock_recv_socket(server, &passed, buffer, sizeof(buffer), &received) != USOCK_OK ||
+	   passed || received != 1)
+	{
+		printf("Received a socket that wasn't sent\n");
+		return false;
+	}
+
+	if(usock_send_socket(client, tcpAccepted, "s", 1) != USOCK_OK ||
+	   usock_recv_socket(server, &passed, buffer, sizeof(buffer), &received) != USOCK_OK ||
+	   !passed || received != 1 || buffer[0] != 's')
+	{
+		printf("Failed to pass the socket\n");
+		return false;
+	}
+
+	// The receiver's descriptor outlives the sender's
+	Destroy(tcpAccepted);
+	bool ok = Exchange(tcpClient, passed, "request") && Exchange(passed, tcpClient, "response");
+
+	// Closing the last descriptor ends the connection
+	Destroy(passed);
+	if(ok && usock_recv(tcpClient, buffer, sizeof(buffer)) != 0)
+	{
+		printf("Connection still open after the passed socket closed\n");
+		ok = false;
+	}
+
+	// And the peer closing the local socket ends the exchange
+	Destroy(client);
+	if(ok && usock_recv_socket(server, &passed, buffer, sizeof(buffer), &received) != USOCK_ERROR_CONNECTION_CLOSED)
+	{
+		printf("Expected the local connection to be closed\n");
+		ok = false;
+	}
+	Destroy(server);
+	Destroy(tcpClient);
+	return ok;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	if(!TestStream(STREAM_ADDRESS, USOCK_OPTIONS_DEFAULT))
+		return 1;
+	if(!TestDatagram())
+		return 2;
+	if(!TestPath())
+		return 3;
+	if(!TestPassSocket())
+		return 4;
+	return 0;
+}
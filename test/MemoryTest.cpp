@@ -0,0 +1,232 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <usock.hpp>
+
+#define DATAGRAMS 1000
+#define LOSS_RATE 0.3
+#define LATENCY_NS 30000000ULL
+
+static usock_handle_t MemorySocket(const char *name, usock_socket_type_t type)
+{
+	usock_handle_t hsock;
+	usock_create_socket(name, &hsock);
+	usock_configure(hsock, USOCK_DOMAIN_MEMORY, type, USOCK_OPTIONS_DEFAULT);
+	return hsock;
+}
+
+static void FreeSocket(usock_handle_t hsock)
+{
+	usock_close_socket(hsock);
+	usock_free_socket(hsock);
+}
+
+static bool TestConnect()
+{
+	usock_handle_t listener = MemorySocket("Listen socket", USOCK_SOCKTYPE_RELIABLE);
+	if(usock_bind_address(listener, "server", 80) != USOCK_OK || usock_listen(listener, 4) != USOCK_OK)
+	{
+		printf("Failed to listen\n");
+		return false;
+	}
+
+	usock_handle_t client = MemorySocket("Client socket", USOCK_SOCKTYPE_RELIABLE);
+	if(usock_connect(client, "server", 81) == USOCK_OK)
+	{
+		printf("Connected to a port nobody listens on\n");
+		return false;
+	}
+
+	usock_handle_t server;
+	if(usock_connect(client, "server", 80) != USOCK_OK || usock_accept(listener, &server) != USOCK_OK)
+	{
+		printf("Failed to connect\n");
+		return false;
+	}
+
+	// Each send stays a message of its own
+	char buffer[64];
+	usock_send(client, "first", 5);
+	usock_send(client, "second", 6);
+	if(usock_recv(server, buffer, sizeof(buffer)) != 5 || usock_recv(server, buffer, sizeof(buffer)) != 6 || memcmp(buffer, "second", 6) != 0)
+	{
+		printf("Messages merged or out of order\n");
+		return false;
+	}
+	usock_send(server, "reply", 5);
+	if(usock_recv(client, buffer, sizeof(buffer)) != 5 || memcmp(buffer, "reply", 5) != 0)
+	{
+		printf("Reply not received\n");
+		return false;
+	}
+
+	// A close reads as end of stream on the other side
+	FreeSocket(client);
+	if(usock_recv(server, buffer, sizeof(buffer)) != 0)
+	{
+		printf("End of stream not seen\n");
+		return false;
+	}
+
+	FreeSocket(server);
+	FreeSocket(listener);
+	return true;
+}
+
+// Send datagrams over a lossy link and return which of them arrived
+static std::vector<bool> LossPattern(usock_size_t seed)
+{
+	usock_memory_conditions_t conditions = {};
+	conditions.lossRate = LOSS_RATE;
+	conditions.seed = seed;
+	usock_memory_set_conditions(&conditions);
+	usock_handle_t sender = MemorySocket("Sender", USOCK_SOCKTYPE_FAST);
+	usock_memory_set_conditions(nullptr);
+	usock_handle_t receiver = MemorySocket("Receiver", USOCK_SOCKTYPE_FAST);
+
+	std::vector<bool> arrived(DATAGRAMS, false);
+	usock_bind_address(receiver, "lossy", 9);
+	usock_connect(sender, "lossy", 9);
+	for(int i = 0; i < DATAGRAMS; ++i)
+		usock_send(sender, &i, sizeof(i));
+
+	// Nothing is held back, so whatever wasn't lost is there already
+	usock_set_nonblocking(receiver, 1);
+	int index;
+	usock_handle_t from;
+	while(usock_recv_from(receiver, &index, sizeof(index), 0, &from) == sizeof(index))
+	{
+		usock_free_socket(from);
+		if(index >= 0 && index < DATAGRAMS)
+			arrived[index] = true;
+	}
+
+	FreeSocket(sender);
+	FreeSocket(receiver);
+	return arrived;
+}
+
+static bool TestSeededLoss()
+{
+	std::vector<bool> first = LossPattern(42);
+	std::vector<bool> second = LossPattern(42);
+	if(first != second)
+	{
+		printf("Same seed lost different datagrams\n");
+		return false;
+	}
+
+	size_t count = 0;
+	for(bool b : first)
+		count += b;
+	if(count < DATAGRAMS * (1 - LOSS_RATE) * 0.8 || count > DATAGRAMS * (1 - LOSS_RATE) * 1.2)
+	{
+		printf("%zu of %d datagrams arrived at a loss rate of %.1f\n", count, DATAGRAMS, LOSS_RATE);
+		return false;
+	}
+
+	if(LossPattern(43) == first)
+	{
+		printf("Different seeds lost the same datagrams\n");
+		return false;
+	}
+	return true;
+}
+
+static bool TestLatency()
+{
+	usock_memory_conditions_t slowLink = {};
+	slowLink.latencyNs = LATENCY_NS;
+
+	// The slow sender goes first, but the fast one's datagram lands first
+	usock_handle_t receiver = MemorySocket("Receiver", USOCK_SOCKTYPE_FAST);
+	usock_handle_t slow = MemorySocket("Slow sender", USOCK_SOCKTYPE_FAST);
+	usock_handle_t fast = MemorySocket("Fast sender", USOCK_SOCKTYPE_FAST);
+	usock_memory_set_socket_conditions(slow, &slowLink);
+	usock_bind_address(receiver, "ordered", 9);
+	usock_connect(slow, "ordered", 9);
+	usock_connect(fast, "ordered", 9);
+
+	usock_size_t start = usock_get_time_ns();
+	char order[2];
+	usock_send(slow, "s", 1);
+	usock_send(fast, "f", 1);
+	usock_recv(receiver, &order[0], 1);
+	usock_recv(receiver, &order[1], 1);
+	usock_size_t elapsed = usock_get_time_ns() - start;
+	if(order[0] != 'f' || order[1] != 's' || elapsed < LATENCY_NS)
+	{
+		printf("Delivered %c then %c after %llu ns\n", order[0], order[1], (unsigned long long)elapsed);
+		return false;
+	}
+	FreeSocket(receiver);
+	FreeSocket(slow);
+	FreeSocket(fast);
+
+	// Jitter shuffles delivery times, yet a reliable socket keeps its order
+	usock_memory_conditions_t jittery = {};
+	jittery.jitterNs = LATENCY_NS / 10;
+	usock_memory_set_conditions(&jittery);
+	usock_handle_t listener = MemorySocket("Listen socket", USOCK_SOCKTYPE_RELIABLE);
+	usock_handle_t client = MemorySocket("Client socket", USOCK_SOCKTYPE_RELIABLE);
+	usock_memory_set_conditions(nullptr);
+	usock_handle_t server;
+	usock_bind_address(listener, "jittery", 80);
+	usock_listen(listener, 1);
+	if(usock_connect(client, "jittery", 80) != USOCK_OK || usock_accept(listener, &server) != USOCK_OK)
+	{
+		printf("Failed to connect\n");
+		return false;
+	}
+	for(int i = 0; i < 100; ++i)
+		usock_send(client, &i, sizeof(i));
+	for(int i = 0; i < 100; ++i)
+	{
+		int index = -1;
+		if(usock_recv(server, &index, sizeof(index)) != sizeof(index) || index != i)
+		{
+			printf("Message %d arrived as %d\n", i, index);
+			return false;
+		}
+	}
+
+	FreeSocket(server);
+	FreeSocket(client);
+	FreeSocket(listener);
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	if(!TestConnect())
+		return 1;
+	if(!TestSeededLoss())
+		return 2;
+	if(!TestLatency())
+		return 3;
+	return 0;
+}
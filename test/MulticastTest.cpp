@@ -0,0 +1,182 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <usock.hpp>
+
+#define PORT 8098
+#define SOURCE_PORT 8099
+#define GROUP "239.255.80.98"
+// The source-specific range
+#define SOURCE_GROUP "232.80.80.99"
+// Nobody sends from here
+#define OTHER_SOURCE "192.0.2.254"
+#define WAIT_MS 1000
+
+static usock_handle_t Receiver(usock_port_t port)
+{
+	usock_handle_t hsock;
+	usock_create_socket("Multicast receiver", &hsock);
+	usock_configure(hsock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(hsock, port) != USOCK_OK)
+	{
+		usock_free_socket(hsock);
+		return nullptr;
+	}
+	return hsock;
+}
+
+static usock_handle_t Sender(const char *group, usock_port_t port)
+{
+	usock_handle_t hsock;
+	usock_create_socket("Multicast sender", &hsock);
+	usock_configure(hsock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+	if(usock_connect(hsock, group, port) != USOCK_OK || usock_set_multicast_loop(hsock, 1) != USOCK_OK ||
+	   usock_set_multicast_ttl(hsock, 0) != USOCK_OK)
+	{
+		usock_free_socket(hsock);
+		return nullptr;
+	}
+	return hsock;
+}
+
+static void Destroy(usock_handle_t hsock)
+{
+	usock_close_socket(hsock);
+	usock_free_socket(hsock);
+}
+
+// The address datagrams to the group go out from, which a source-specific join has to name
+static bool SourceAddress(const char *group, char *address, socklen_t len)
+{
+	struct sockaddr_in addr = {}, local = {};
+	socklen_t localLen = sizeof(local);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(SOURCE_PORT);
+	bool ok = fd >= 0 && inet_pton(AF_INET, group, &addr.sin_addr) == 1 &&
+	          connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+	          getsockname(fd, (struct sockaddr *)&local, &localLen) == 0 &&
+	          inet_ntop(AF_INET, &local.sin_addr, address, len);
+	if(fd >= 0)
+		close(fd);
+	return ok;
+}
+
+static bool Receive(usock_handle_t hsock, const char *expected)
+{
+	usock_pollfd_t fd = { hsock, USOCK_POLL_IN, 0 };
+	if(usock_poll(&fd, 1, WAIT_MS) != 1)
+		return false;
+
+	char buffer[64] = {};
+	usock_handle_t sender = nullptr;
+	usock_ssize_t n = usock_recv_from(hsock, buffer, sizeof(buffer), 0, &sender);
+	if(sender)
+		usock_free_socket(sender);
+	return n == (usock_ssize_t)strlen(expected) && memcmp(buffer, expected, n) == 0;
+}
+
+static bool NothingArrives(usock_handle_t hsock)
+{
+	usock_pollfd_t fd = { hsock, USOCK_POLL_IN, 0 };
+	return usock_poll(&fd, 1, WAIT_MS / 4) == 0;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	usock_handle_t receiver = Receiver(PORT);
+	if(!receiver)
+	{
+		printf("Failed to bind the receiver\n");
+		return 1;
+	}
+	// Without a multicast route there's nothing to test
+	usock_err_t err = usock_join_multicast_group(receiver, GROUP, nullptr);
+	if(err != USOCK_OK)
+	{
+		printf("Can't join %s, no multicast route; skipping\n", GROUP);
+		Destroy(receiver);
+		return 0;
+	}
+
+	usock_handle_t sender = Sender(GROUP, PORT);
+	if(!sender)
+	{
+		printf("Failed to set up the sender\n");
+		return 2;
+	}
+	if(usock_send(sender, "group", 5) != 5 || !Receive(receiver, "group"))
+	{
+		printf("Looped back datagram not received\n");
+		return 3;
+	}
+
+	// Left the group, nothing more arrives
+	if(usock_leave_multicast_group(receiver, GROUP, nullptr) != USOCK_OK ||
+	   usock_send(sender, "left", 4) != 4 || !NothingArrives(receiver))
+	{
+		printf("Datagram received after leaving the group\n");
+		return 4;
+	}
+	Destroy(sender);
+	Destroy(receiver);
+
+	// One receiver accepts the sender, the other a source that stays silent
+	char source[INET_ADDRSTRLEN];
+	usock_handle_t accepting = Receiver(SOURCE_PORT), filtering = Receiver(SOURCE_PORT);
+	if(!accepting || !filtering || !SourceAddress(SOURCE_GROUP, source, sizeof(source)))
+	{
+		printf("Failed to set up the source-specific receivers\n");
+		return 5;
+	}
+	if(usock_join_source_multicast_group(accepting, SOURCE_GROUP, nullptr, nullptr) != USOCK_ERROR_INVALID_ARG ||
+	   usock_join_source_multicast_group(accepting, SOURCE_GROUP, source, nullptr) != USOCK_OK ||
+	   usock_join_source_multicast_group(filtering, SOURCE_GROUP, OTHER_SOURCE, nullptr) != USOCK_OK)
+	{
+		printf("Failed to join %s from %s\n", SOURCE_GROUP, source);
+		return 6;
+	}
+
+	sender = Sender(SOURCE_GROUP, SOURCE_PORT);
+	if(!sender || usock_send(sender, "source", 6) != 6 || !Receive(accepting, "source"))
+	{
+		printf("Datagram from %s not received\n", source);
+		return 7;
+	}
+	if(!NothingArrives(filtering))
+	{
+		printf("Datagram from %s received by a socket only accepting %s\n", source, OTHER_SOURCE);
+		return 8;
+	}
+
+	Destroy(sender);
+	Destroy(accepting);
+	Destroy(filtering);
+	return 0;
+}
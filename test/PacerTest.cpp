@@ -0,0 +1,163 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <usock.hpp>
+#include <usock_pacer.h>
+
+#define PORT 8097
+// Slow enough that a loaded machine doesn't refill a message between calls
+#define RATE 10000
+#define BURST 1000
+#define MESSAGE_SIZE 100
+#define OVERSIZED 1500
+#define NS_PER_BYTE (1000000000ULL / RATE)
+
+static unsigned char g_buffer[OVERSIZED];
+
+static usock_msg_t Message(usock_size_t len)
+{
+	usock_msg_t msg = { g_buffer, len, nullptr };
+	return msg;
+}
+
+static bool TestBurst(usock_handle_t client)
+{
+	usock_pacer_t pacer;
+	usock_msg_t msgs[BURST / MESSAGE_SIZE * 2];
+	for(usock_msg_t &msg : msgs)
+		msg = Message(MESSAGE_SIZE);
+
+	if(usock_pacer_init(&pacer, 0, BURST, USOCK_PACER_DEFAULT) != USOCK_ERROR_INVALID_ARG ||
+	   usock_pacer_init(&pacer, RATE, 0, USOCK_PACER_DEFAULT) != USOCK_ERROR_INVALID_ARG ||
+	   usock_pacer_init(&pacer, RATE, BURST, USOCK_PACER_DEFAULT) != USOCK_OK)
+	{
+		printf("Failed to initialize the pacer\n");
+		return false;
+	}
+
+	// A full bucket lets the burst through, and nothing after it
+	usock_ssize_t sent = usock_pacer_try_send_to(&pacer, client, msgs, sizeof(msgs) / sizeof(msgs[0]), 0);
+	if(sent != BURST / MESSAGE_SIZE)
+	{
+		printf("Sent %lld messages from a full bucket, expected %d\n", (long long)sent, BURST / MESSAGE_SIZE);
+		return false;
+	}
+	sent = usock_pacer_try_send_to(&pacer, client, msgs, 1, 0);
+	if(sent != 0)
+	{
+		printf("Sent %lld messages from an empty bucket\n", (long long)sent);
+		return false;
+	}
+
+	// The next message waits for the bucket to refill at the configured rate
+	usock_size_t delay = usock_pacer_delay_ns(&pacer, MESSAGE_SIZE);
+	if(delay > MESSAGE_SIZE * NS_PER_BYTE + 1 || delay < MESSAGE_SIZE * NS_PER_BYTE / 2)
+	{
+		printf("Delay of %llu ns for %d bytes at %d bytes per second\n", (unsigned long long)delay, MESSAGE_SIZE, RATE);
+		return false;
+	}
+
+	// And a blocking send sleeps until each one fits
+	const usock_size_t count = 3;
+	usock_size_t start = usock_get_time_ns();
+	sent = usock_pacer_send_to(&pacer, client, msgs, count, 0);
+	usock_size_t elapsed = usock_get_time_ns() - start;
+	if(sent != (usock_ssize_t)count || elapsed < (count - 1) * MESSAGE_SIZE * NS_PER_BYTE)
+	{
+		printf("Sent %lld messages in %llu ns\n", (long long)sent, (unsigned long long)elapsed);
+		return false;
+	}
+	return true;
+}
+
+// A message larger than the bucket goes out once the bucket is full
+static bool TestOversized(usock_handle_t client)
+{
+	usock_pacer_t pacer;
+	usock_msg_t msg = Message(OVERSIZED);
+	usock_pacer_init(&pacer, RATE, BURST, USOCK_PACER_DEFAULT);
+	if(usock_pacer_delay_ns(&pacer, OVERSIZED) != 0 || usock_pacer_try_send_to(&pacer, client, &msg, 1, 0) != 1)
+	{
+		printf("Oversized message held back by a full bucket\n");
+		return false;
+	}
+
+	// It overdraws the bucket, so the next one waits for it to fill up from below zero
+	usock_size_t delay = usock_pacer_delay_ns(&pacer, OVERSIZED);
+	if(usock_pacer_try_send_to(&pacer, client, &msg, 1, 0) != 0 ||
+	   delay > OVERSIZED * NS_PER_BYTE + 1 || delay < (OVERSIZED - MESSAGE_SIZE) * NS_PER_BYTE)
+	{
+		printf("Delay of %llu ns after an oversized message\n", (unsigned long long)delay);
+		return false;
+	}
+	return true;
+}
+
+static bool ReceiveAll(usock_handle_t server, usock_size_t count, usock_size_t len)
+{
+	for(usock_size_t i = 0; i < count; ++i)
+	{
+		usock_handle_t sender = nullptr;
+		usock_ssize_t n = usock_recv_from(server, g_buffer, sizeof(g_buffer), 0, &sender);
+		if(sender)
+			usock_free_socket(sender);
+		if(n != (usock_ssize_t)len)
+		{
+			printf("Received %lld bytes, expected %llu\n", (long long)n, (unsigned long long)len);
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	usock_handle_t server, client;
+	usock_create_socket("Server socket", &server);
+	usock_configure(server, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_REUSE_ADDRESS);
+	usock_create_socket("Client socket", &client);
+	usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_FAST, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind_address(server, "127.0.0.1", PORT) != USOCK_OK || usock_connect(client, "127.0.0.1", PORT) != USOCK_OK)
+	{
+		printf("Failed to set up the sockets\n");
+		return 1;
+	}
+
+	if(!TestBurst(client))
+		return 2;
+	// The burst and the three paced messages
+	if(!ReceiveAll(server, BURST / MESSAGE_SIZE + 3, MESSAGE_SIZE))
+		return 3;
+	if(!TestOversized(client))
+		return 4;
+	if(!ReceiveAll(server, 1, OVERSIZED))
+		return 5;
+
+	usock_close_socket(client);
+	usock_free_socket(client);
+	usock_close_socket(server);
+	usock_free_socket(server);
+	return 0;
+}
@@ -0,0 +1,184 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <usock.hpp>
+#include <usock_pool.hpp>
+
+#define PORT 8085
+#define HOST "127.0.0.1"
+#define MAX_PER_HOST 2
+#define MAX_IDLE_MS 100
+
+// The pool's connects finish in the listen backlog, so the server side is
+// accepted afterwards on the same thread.
+static usock_handle_t AcceptOne(usock_handle_t listener)
+{
+	usock_handle_t hsock = nullptr;
+	if(usock_accept(listener, &hsock) != USOCK_OK)
+		return nullptr;
+	return hsock;
+}
+
+static bool Expect(bool condition, const char *what)
+{
+	if(!condition)
+		printf("%s\n", what);
+	return condition;
+}
+
+static bool TestReuseAndLimit(usock_handle_t listener)
+{
+	usock::pool::options opts;
+	opts.maxPerHost = MAX_PER_HOST;
+	usock::pool pool(opts);
+	usock_err_t err;
+
+	usock_handle_t first;
+	{
+		usock::pool::lease conn = pool.acquire(HOST, PORT, &err);
+		if(!Expect(conn && err == USOCK_OK, "Failed to connect"))
+			return false;
+		AcceptOne(listener);
+		first = conn.get();
+	}
+
+	// Given back on destruction, so the next acquire gets the same socket
+	usock::pool::lease a = pool.acquire(HOST, PORT, &err);
+	if(!Expect(a.get() == first && pool.get_stats().reused == 1, "Idle connection not reused"))
+		return false;
+
+	usock::pool::lease b = pool.acquire(HOST, PORT, &err);
+	if(!Expect(b && b.get() != first, "Second connection failed"))
+		return false;
+	AcceptOne(listener);
+
+	usock::pool::lease c = pool.acquire(HOST, PORT, &err);
+	if(!Expect(!c && err == USOCK_ERROR_LIMIT_REACHED, "Limit per host not enforced"))
+		return false;
+	if(!Expect(pool.open_count(HOST, PORT) == MAX_PER_HOST, "Wrong open count at the limit"))
+		return false;
+
+	// Releasing takes the socket out of the pool and frees up its slot
+	usock::unique_sock owned(b.release());
+	c = pool.acquire(HOST, PORT, &err);
+	if(!Expect(c && err == USOCK_OK, "Released connection still counted"))
+		return false;
+	AcceptOne(listener);
+
+	usock::pool::stats stats = pool.get_stats();
+	return Expect(stats.connected == 3 && stats.reused == 1, "Wrong connect or reuse counts");
+}
+
+static bool TestBroken(usock_handle_t listener)
+{
+	usock::pool pool;
+	usock_err_t err;
+
+	usock::pool::lease conn = pool.acquire(HOST, PORT, &err);
+	if(!Expect(conn.get() != nullptr, "Failed to connect"))
+		return false;
+	AcceptOne(listener);
+
+	conn.mark_broken();
+	conn.reset();
+	if(!Expect(pool.open_count(HOST, PORT) == 0 && pool.get_stats().broken == 1, "Broken connection kept"))
+		return false;
+
+	conn = pool.acquire(HOST, PORT, &err);
+	AcceptOne(listener);
+	return Expect(conn && pool.get_stats().connected == 2 && pool.get_stats().reused == 0, "Broken connection reused");
+}
+
+static bool TestIdleExpiry(usock_handle_t listener)
+{
+	usock::pool::options opts;
+	opts.maxIdleMs = MAX_IDLE_MS;
+	usock::pool pool(opts);
+	usock_err_t err;
+
+	pool.acquire(HOST, PORT, &err).reset();
+	AcceptOne(listener);
+	if(!Expect(pool.evict_idle() == 0 && pool.open_count(HOST, PORT) == 1, "Fresh connection evicted"))
+		return false;
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(2 * MAX_IDLE_MS));
+	if(!Expect(pool.evict_idle() == 1 && pool.open_count(HOST, PORT) == 0, "Idle connection not evicted"))
+		return false;
+
+	// acquire() ages out what it finds too, and connects afresh
+	pool.acquire(HOST, PORT, &err).reset();
+	AcceptOne(listener);
+	std::this_thread::sleep_for(std::chrono::milliseconds(2 * MAX_IDLE_MS));
+	usock::pool::lease conn = pool.acquire(HOST, PORT, &err);
+	AcceptOne(listener);
+
+	usock::pool::stats stats = pool.get_stats();
+	return Expect(conn && stats.expired == 2 && stats.reused == 0 && stats.connected == 3, "Stale connection reused");
+}
+
+static bool TestHangup(usock_handle_t listener)
+{
+	usock::pool pool;
+	usock_err_t err;
+
+	pool.acquire(HOST, PORT, &err).reset();
+	usock_handle_t server = AcceptOne(listener);
+	if(!Expect(server != nullptr, "Failed to connect"))
+		return false;
+
+	// The peer goes away while the connection sits idle
+	usock_close_socket(server);
+	usock_free_socket(server);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	usock::pool::lease conn = pool.acquire(HOST, PORT, &err);
+	AcceptOne(listener);
+	usock::pool::stats stats = pool.get_stats();
+	return Expect(conn && stats.broken == 1 && stats.reused == 0 && stats.connected == 2, "Hung up connection handed out");
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	usock_handle_t listener;
+	usock_create_socket("Listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(listener, PORT) != USOCK_OK || usock_listen(listener, 16) != USOCK_OK)
+	{
+		printf("Failed to listen\n");
+		return 1;
+	}
+
+	if(!TestReuseAndLimit(listener))
+		return 2;
+	if(!TestBroken(listener))
+		return 3;
+	if(!TestIdleExpiry(listener))
+		return 4;
+	if(!TestHangup(listener))
+		return 5;
+	return 0;
+}
@@ -0,0 +1,271 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <usock.hpp>
+
+#define DEFAULT_BUFLEN 2048
+#define PORT 8082
+#define TCP_PORT 8083
+#define LOSS_RATE 0.1
+
+#define ORDERED_CHANNELS 4
+#define ORDERED_MESSAGES 250
+#define UNORDERED_CHANNEL 4
+#define UNORDERED_MESSAGES 200
+
+#define PING_COUNT 1000
+#define PING_SIZE 64
+#define STREAM_COUNT 20000
+#define STREAM_SIZE 1024
+
+using Clock = std::chrono::steady_clock;
+
+struct Result
+{
+	double avgUs;
+	double p99Us;
+	double mbPerSec;
+};
+
+static double ElapsedUs(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+static void Summarize(std::vector<double> &samples, Result &result)
+{
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for(double s : samples)
+		sum += s;
+	result.avgUs = sum / samples.size();
+	result.p99Us = samples[samples.size() * 99 / 100];
+}
+
+// Send messages on several channels over a lossy link and check that every
+// echo comes back, in order within each ordered channel.
+static bool RunLossyTest(usock_handle_t sock)
+{
+	char buffer[DEFAULT_BUFLEN];
+	unsigned expected[ORDERED_CHANNELS] = {};
+	unsigned unordered = 0;
+	unsigned received = 0;
+	const unsigned total = ORDERED_CHANNELS * ORDERED_MESSAGES + UNORDERED_MESSAGES;
+
+	for(unsigned i = 0; i < ORDERED_MESSAGES; ++i)
+	{
+		for(unsigned ch = 0; ch < ORDERED_CHANNELS; ++ch)
+		{
+			int len = snprintf(buffer, sizeof(buffer), "%u:%u", ch, i);
+			if(usock_rudp_send(sock, ch, buffer, len, USOCK_RUDP_DEFAULT) != len)
+				return false;
+		}
+		if(i < UNORDERED_MESSAGES)
+		{
+			int len = snprintf(buffer, sizeof(buffer), "u:%u", i);
+			if(usock_rudp_send(sock, UNORDERED_CHANNEL, buffer, len, USOCK_RUDP_UNORDERED) != len)
+				return false;
+		}
+	}
+
+	while(received < total)
+	{
+		unsigned channel;
+		usock_ssize_t n = usock_rudp_recv(sock, buffer, sizeof(buffer) - 1, &channel);
+		if(n <= 0)
+			return false;
+		buffer[n] = '\0';
+		++received;
+
+		if(channel == UNORDERED_CHANNEL)
+		{
+			++unordered;
+			continue;
+		}
+
+		unsigned ch, seq;
+		if(channel >= ORDERED_CHANNELS || sscanf(buffer, "%u:%u", &ch, &seq) != 2 || ch != channel)
+		{
+			printf("Unexpected message '%s' on channel %u\n", buffer, channel);
+			return false;
+		}
+		if(seq != expected[ch]++)
+		{
+			printf("Channel %u out of order: got %u, expected %u\n", ch, seq, expected[ch] - 1);
+			return false;
+		}
+	}
+
+	usock_rudp_stats_t stats;
+	usock_rudp_get_stats(sock, &stats);
+	printf("Lossy run: %u messages, %llu retransmits (%llu fast), %llu timeouts\n",
+		received,
+		(unsigned long long)stats.retransmits,
+		(unsigned long long)stats.fastRetransmits,
+		(unsigned long long)stats.timeouts);
+
+	return unordered == UNORDERED_MESSAGES;
+}
+
+static bool MeasureRUDP(usock_handle_t sock, Result &result)
+{
+	char buffer[DEFAULT_BUFLEN] = {};
+	std::vector<double> samples;
+
+	for(int i = 0; i < PING_COUNT; ++i)
+	{
+		auto start = Clock::now();
+		if(usock_rudp_send(sock, 0, buffer, PING_SIZE, 0) != PING_SIZE)
+			return false;
+		if(usock_rudp_recv(sock, buffer, sizeof(buffer), nullptr) != PING_SIZE)
+			return false;
+		samples.push_back(ElapsedUs(start));
+	}
+	Summarize(samples, result);
+
+	auto start = Clock::now();
+	for(int i = 0; i < STREAM_COUNT; ++i)
+	{
+		if(usock_rudp_send(sock, 0, buffer, STREAM_SIZE, 0) != STREAM_SIZE)
+			return false;
+	}
+	for(int i = 0; i < STREAM_COUNT; ++i)
+	{
+		if(usock_rudp_recv(sock, buffer, sizeof(buffer), nullptr) != STREAM_SIZE)
+			return false;
+	}
+	result.mbPerSec = (double)STREAM_COUNT * STREAM_SIZE / ElapsedUs(start);
+	return true;
+}
+
+static bool RecvAll(usock_handle_t sock, char *buffer, usock_size_t len)
+{
+	usock_size_t got = 0;
+	while(got < len)
+	{
+		usock_ssize_t n = usock_recv(sock, buffer + got, len - got);
+		if(n <= 0)
+			return false;
+		got += n;
+	}
+	return true;
+}
+
+static bool MeasureTCP(const char *ip_address, Result &result)
+{
+	usock_handle_t sock;
+	usock_create_socket("TCP socket", &sock);
+	usock_configure(sock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_connect(sock, ip_address, TCP_PORT) != USOCK_OK)
+		return false;
+
+	char buffer[DEFAULT_BUFLEN] = {};
+	std::vector<double> samples;
+	for(int i = 0; i < PING_COUNT; ++i)
+	{
+		auto start = Clock::now();
+		if(usock_send(sock, buffer, PING_SIZE) != PING_SIZE)
+			return false;
+		if(!RecvAll(sock, buffer, PING_SIZE))
+			return false;
+		samples.push_back(ElapsedUs(start));
+	}
+	Summarize(samples, result);
+
+	// Read the echoes on another thread so neither side stalls on a full buffer.
+	bool readOk = true;
+	auto start = Clock::now();
+	std::thread reader([&]() {
+		std::vector<char> in(STREAM_SIZE);
+		for(int i = 0; i < STREAM_COUNT && readOk; ++i)
+			readOk = RecvAll(sock, in.data(), STREAM_SIZE);
+	});
+	for(int i = 0; i < STREAM_COUNT; ++i)
+	{
+		if(usock_send(sock, buffer, STREAM_SIZE) != STREAM_SIZE)
+			break;
+	}
+	reader.join();
+	result.mbPerSec = (double)STREAM_COUNT * STREAM_SIZE / ElapsedUs(start);
+
+	usock_close_socket(sock);
+	usock_free_socket(sock);
+	return readOk;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	const char *ip_address = "127.0.0.1";
+	if(argc > 1)
+		ip_address = argv[1];
+
+	usock_handle_t sock;
+	usock_create_socket("RUDP socket", &sock);
+	usock_configure(sock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE_DATAGRAM, USOCK_OPTIONS_DEFAULT);
+	if(usock_connect(sock, ip_address, PORT) != USOCK_OK)
+	{
+		printf("Connect failed\n");
+		return 1;
+	}
+	usock_rudp_set_loss(sock, LOSS_RATE);
+
+	if(!RunLossyTest(sock))
+	{
+		printf("Lossy transfer failed\n");
+		return 2;
+	}
+
+	// Switch both ends to a clean link for the comparison
+	char buffer[DEFAULT_BUFLEN];
+	usock_rudp_set_loss(sock, 0.0);
+	usock_rudp_send(sock, 0, "lossless", 8, 0);
+	if(usock_rudp_recv(sock, buffer, sizeof(buffer), nullptr) != 8)
+		return 2;
+
+	Result rudp = {}, tcp = {};
+	if(!MeasureRUDP(sock, rudp))
+	{
+		printf("RUDP measurement failed\n");
+		return 3;
+	}
+	if(!MeasureTCP(ip_address, tcp))
+	{
+		printf("TCP measurement failed\n");
+		return 3;
+	}
+
+	printf("%-6s | %12s | %12s | %10s\n", "", "avg RTT (us)", "p99 RTT (us)", "echo MB/s");
+	printf("%-6s | %12.1f | %12.1f | %10.1f\n", "RUDP", rudp.avgUs, rudp.p99Us, rudp.mbPerSec);
+	printf("%-6s | %12.1f | %12.1f | %10.1f\n", "TCP", tcp.avgUs, tcp.p99Us, tcp.mbPerSec);
+
+	usock_rudp_send(sock, 0, "quit", 4, 0);
+	usock_rudp_recv(sock, buffer, sizeof(buffer), nullptr);
+	return 0;
+}
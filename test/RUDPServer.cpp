@@ -0,0 +1,101 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <usock.hpp>
+
+#define DEFAULT_BUFLEN 2048
+#define PORT 8082
+#define TCP_PORT 8083
+#define LOSS_RATE 0.1
+
+// Echo everything back over TCP, for the comparison run.
+void TCPEcho()
+{
+	usock_handle_t listenSock;
+	usock_create_socket("TCP listen socket", &listenSock);
+	usock_configure(listenSock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(listenSock, TCP_PORT) != USOCK_OK || usock_listen(listenSock, 1) != USOCK_OK)
+	{
+		printf("TCP bind failed\n");
+		return;
+	}
+
+	usock_handle_t client;
+	if(usock_accept(listenSock, &client) != USOCK_OK)
+		return;
+
+	char buffer[DEFAULT_BUFLEN];
+	usock_ssize_t n;
+	while((n = usock_recv(client, buffer, sizeof(buffer))) > 0)
+	{
+		if(usock_send(client, buffer, n) != n)
+			break;
+	}
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	std::thread tcpThread(TCPEcho);
+
+	usock_handle_t sock;
+	usock_create_socket("RUDP socket", &sock);
+	usock_configure(sock, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE_DATAGRAM, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(sock, PORT) != USOCK_OK)
+	{
+		printf("Bind failed\n");
+		return 1;
+	}
+	usock_rudp_set_loss(sock, LOSS_RATE);
+
+	// Echo every message back on the channel it arrived on, until told to quit.
+	char buffer[DEFAULT_BUFLEN];
+	for(;;)
+	{
+		unsigned channel;
+		usock_ssize_t n = usock_rudp_recv(sock, buffer, sizeof(buffer), &channel);
+		if(n < 0)
+		{
+			printf("Receive failed\n");
+			return 1;
+		}
+
+		if(n == 8 && memcmp(buffer, "lossless", 8) == 0)
+			usock_rudp_set_loss(sock, 0.0);
+
+		if(usock_rudp_send(sock, channel, buffer, n, 0) != n)
+		{
+			printf("Send failed\n");
+			return 1;
+		}
+
+		if(n == 4 && memcmp(buffer, "quit", 4) == 0)
+			break;
+	}
+
+	tcpThread.join();
+	return 0;
+}
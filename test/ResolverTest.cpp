@@ -0,0 +1,185 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <usock.hpp>
+
+#define TTL_MS 300
+#define NEGATIVE_TTL_MS 100
+#define LOOKUP_MS 100
+#define WAITERS 10
+
+/*
+* Stand in for the system resolver, so the test needs no DNS and can
+* count queries. Each query is slow, to keep it in flight while more
+* lookups arrive, and answers 10.0.0.N for the Nth query, so an answer
+* that was looked up again is told apart from a cached one.
+*/
+static std::atomic<int> g_queries(0);
+
+struct FakeAnswer
+{
+	struct addrinfo info;
+	struct sockaddr_in addr;
+};
+
+extern "C" int getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res)
+{
+	int query = ++g_queries;
+	std::this_thread::sleep_for(std::chrono::milliseconds(LOOKUP_MS));
+	if(strcmp(node, "missing.test") == 0)
+		return EAI_NONAME;
+
+	FakeAnswer *answer = (FakeAnswer *)calloc(1, sizeof(FakeAnswer));
+	answer->addr.sin_family = AF_INET;
+	answer->addr.sin_addr.s_addr = htonl(0x0A000000u + query);
+	answer->info.ai_family = AF_INET;
+	answer->info.ai_socktype = SOCK_STREAM;
+	answer->info.ai_addr = (struct sockaddr *)&answer->addr;
+	answer->info.ai_addrlen = sizeof(answer->addr);
+	*res = &answer->info;
+	return 0;
+}
+
+extern "C" void freeaddrinfo(struct addrinfo *res) noexcept
+{
+	free(res);
+}
+
+struct Lookup
+{
+	std::atomic<bool> done{false};
+	usock_err_t result = USOCK_ERROR_INTERNAL;
+	std::string address;
+};
+
+static void OnResolved(void *pUserData, usock_err_t result, const char *const *ppAddresses, usock_size_t count)
+{
+	Lookup *lookup = (Lookup *)pUserData;
+	lookup->result = result;
+	if(result == USOCK_OK && count > 0)
+		lookup->address = ppAddresses[0];
+	lookup->done = true;
+}
+
+static void Wait(Lookup &lookup)
+{
+	while(!lookup.done)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+static bool TestCoalescing()
+{
+	// Every lookup arrives while the first is still being resolved
+	Lookup lookups[WAITERS];
+	for(Lookup &lookup : lookups)
+		usock_resolve_async("coalesce.test", USOCK_DOMAIN_IPV4, OnResolved, &lookup);
+	for(Lookup &lookup : lookups)
+	{
+		Wait(lookup);
+		if(lookup.result != USOCK_OK || lookup.address != "10.0.0.1")
+		{
+			printf("Lookup got %d, \"%s\"\n", (int)lookup.result, lookup.address.c_str());
+			return false;
+		}
+	}
+	if(g_queries != 1)
+	{
+		printf("%d lookups of one name made %d queries\n", WAITERS, g_queries.load());
+		return false;
+	}
+	return true;
+}
+
+static bool TestExpiry()
+{
+	// Cached, so answered before usock_resolve_async returns
+	Lookup cached;
+	usock_resolve_async("coalesce.test", USOCK_DOMAIN_IPV4, OnResolved, &cached);
+	if(!cached.done || cached.address != "10.0.0.1" || g_queries != 1)
+	{
+		printf("Cached answer not used\n");
+		return false;
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(TTL_MS));
+	char address[USOCK_ADDRESS_STRLEN];
+	if(usock_resolve("coalesce.test", USOCK_DOMAIN_IPV4, address, sizeof(address)) != USOCK_OK || strcmp(address, "10.0.0.2") != 0 || g_queries != 2)
+	{
+		printf("Expired answer not looked up again\n");
+		return false;
+	}
+
+	// Failures are cached too, for their own time
+	if(usock_resolve("missing.test", USOCK_DOMAIN_IPV4, address, sizeof(address)) != USOCK_ERROR_INTERNAL || g_queries != 3)
+	{
+		printf("Missing name resolved\n");
+		return false;
+	}
+	Lookup failed;
+	usock_resolve_async("missing.test", USOCK_DOMAIN_IPV4, OnResolved, &failed);
+	if(!failed.done || failed.result != USOCK_ERROR_INTERNAL || g_queries != 3)
+	{
+		printf("Failed lookup not cached\n");
+		return false;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(NEGATIVE_TTL_MS));
+	usock_resolve("missing.test", USOCK_DOMAIN_IPV4, address, sizeof(address));
+	if(g_queries != 4)
+	{
+		printf("Failed lookup cached past its time\n");
+		return false;
+	}
+
+	// Numeric addresses never reach the resolver
+	if(usock_resolve("127.0.0.1", USOCK_DOMAIN_IPV4, address, sizeof(address)) != USOCK_OK || g_queries != 4)
+	{
+		printf("Numeric address looked up\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	if(usock_resolver_start(TTL_MS, NEGATIVE_TTL_MS) != USOCK_OK)
+	{
+		printf("Failed to start the resolver\n");
+		return 1;
+	}
+	if(!TestCoalescing())
+		return 2;
+	if(!TestExpiry())
+		return 3;
+	usock_resolver_stop();
+	return 0;
+}
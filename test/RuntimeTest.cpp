@@ -0,0 +1,263 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <usock.hpp>
+#include <usock_runtime.hpp>
+
+#define PORT 8094
+#define TAKEN_PORT 8095
+#define CORES 2
+#define CLIENTS 8
+// Each one a post to a core that's most likely asleep
+#define ROUND_TRIPS 20000
+#define WAIT_MS 10000
+
+enum MessageKind
+{
+	KIND_HANDOFF = 1, // A connection, and the core that accepted it
+	KIND_PING,
+};
+
+struct State
+{
+	std::atomic<unsigned> started{0};
+	std::atomic<unsigned> stopped{0};
+	std::atomic<unsigned> handoffs{0};
+	std::atomic<bool> pingsDone{false};
+	std::atomic<bool> failed{false};
+	// Indexed by core, each only touched on its own core's thread
+	std::unordered_map<usock_handle_t, unsigned> acceptedBy[CORES];
+};
+
+static State g_state;
+
+static usock::runtime::handlers MakeHandlers()
+{
+	usock::runtime::handlers h;
+	h.onStart = [](usock::runtime::core &c) {
+		++g_state.started;
+		// Core 0 starts the ping pong
+		usock::runtime::message msg;
+		msg.kind = KIND_PING;
+		if(c.index() == 0 && !c.post(1, msg))
+			g_state.failed = true;
+	};
+
+	// Every connection moves to the other core
+	h.onConnection = [](usock::runtime::core &c, usock_handle_t hsock) {
+		usock::runtime::message msg;
+		msg.kind = KIND_HANDOFF;
+		msg.hsock = hsock;
+		msg.value = c.index();
+		if(!c.post((c.index() + 1) % CORES, msg))
+			g_state.failed = true;
+	};
+
+	h.onMessage = [](usock::runtime::core &c, const usock::runtime::message &msg) {
+		if(msg.kind == KIND_HANDOFF)
+		{
+			g_state.acceptedBy[c.index()][msg.hsock] = (unsigned)msg.value;
+			++g_state.handoffs;
+		}
+		else if(msg.kind == KIND_PING)
+		{
+			if(msg.value + 1 >= ROUND_TRIPS)
+			{
+				g_state.pingsDone = true;
+				return;
+			}
+			usock::runtime::message reply;
+			reply.kind = KIND_PING;
+			reply.value = msg.value + 1;
+			if(!c.post(msg.from, reply))
+				g_state.failed = true;
+		}
+	};
+
+	// Reply with the core that accepted the connection and the one serving it
+	h.onReadable = [](usock::runtime::core &c, usock_handle_t hsock) {
+		char byte;
+		usock_ssize_t n = usock_recv(hsock, &byte, 1);
+		if(n == 0)
+		{
+			g_state.acceptedBy[c.index()].erase(hsock);
+			c.close(hsock);
+			return;
+		}
+		if(n < 0)
+			return;
+		auto it = g_state.acceptedBy[c.index()].find(hsock);
+		char reply[2] = { (char)(it == g_state.acceptedBy[c.index()].end() ? 0xFF : it->second), (char)c.index() };
+		usock_send(hsock, reply, sizeof(reply));
+	};
+
+	h.onStop = [](usock::runtime::core &c) { ++g_state.stopped; };
+	return h;
+}
+
+template <typename Predicate>
+static bool WaitFor(Predicate done)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(WAIT_MS);
+	while(!done())
+	{
+		if(std::chrono::steady_clock::now() > deadline)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return true;
+}
+
+static bool RecvAll(usock_handle_t hsock, char *buffer, usock_size_t len)
+{
+	usock_size_t got = 0;
+	while(got < len)
+	{
+		usock_ssize_t n = usock_recv(hsock, buffer + got, len - got);
+		if(n <= 0)
+			return false;
+		got += (usock_size_t)n;
+	}
+	return true;
+}
+
+static bool TestRuntime()
+{
+	usock::runtime::options opts;
+	opts.cores = CORES;
+	opts.pin = false;
+	opts.address = "127.0.0.1";
+	opts.port = PORT;
+	usock::runtime rt(opts, MakeHandlers());
+	if(rt.start() != USOCK_OK || rt.core_count() != CORES)
+	{
+		printf("Failed to start the runtime\n");
+		return false;
+	}
+
+	if(!WaitFor([]() { return g_state.pingsDone.load() || g_state.failed.load(); }) || g_state.failed)
+	{
+		printf("Ping pong between cores stalled, a wakeup was lost\n");
+		return false;
+	}
+
+	usock_handle_t clients[CLIENTS];
+	for(usock_handle_t &client : clients)
+	{
+		usock_create_socket("Client socket", &client);
+		usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_NO_DELAY);
+		if(usock_connect(client, "127.0.0.1", PORT) != USOCK_OK)
+		{
+			printf("Failed to connect\n");
+			return false;
+		}
+	}
+	if(!WaitFor([]() { return g_state.handoffs.load() == CLIENTS; }))
+	{
+		printf("%u of %d connections handed over\n", g_state.handoffs.load(), CLIENTS);
+		return false;
+	}
+
+	// The core that took each connection over serves it
+	for(usock_handle_t client : clients)
+	{
+		char reply[2];
+		if(usock_send(client, "x", 1) != 1 || !RecvAll(client, reply, sizeof(reply)))
+		{
+			printf("No reply from the runtime\n");
+			return false;
+		}
+		if((unsigned char)reply[0] >= CORES || reply[1] != ((unsigned char)reply[0] + 1) % CORES)
+		{
+			printf("Accepted on core %d, served by core %d\n", reply[0], reply[1]);
+			return false;
+		}
+	}
+
+	// Stopping closes the connections each core still watches
+	rt.stop();
+	rt.join();
+	if(g_state.started != CORES || g_state.stopped != CORES)
+	{
+		printf("%u cores started and %u stopped\n", g_state.started.load(), g_state.stopped.load());
+		return false;
+	}
+	for(usock_handle_t client : clients)
+	{
+		char byte;
+		if(usock_recv(client, &byte, 1) != 0)
+		{
+			printf("Connection left open after the runtime stopped\n");
+			return false;
+		}
+		usock_close_socket(client);
+		usock_free_socket(client);
+	}
+	return true;
+}
+
+static bool TestStartFailure()
+{
+	// Held without SO_REUSEPORT, so no core can listen there
+	usock_handle_t taken;
+	usock_create_socket("Listen socket", &taken);
+	usock_configure(taken, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind(taken, TAKEN_PORT) != USOCK_OK || usock_listen(taken, 1) != USOCK_OK)
+	{
+		printf("Failed to listen\n");
+		return false;
+	}
+
+	std::atomic<unsigned> started(0);
+	usock::runtime::handlers h;
+	h.onStart = [&started](usock::runtime::core &) { ++started; };
+	usock::runtime::options opts;
+	opts.cores = CORES;
+	opts.pin = false;
+	opts.port = TAKEN_PORT;
+	usock::runtime rt(opts, h);
+	if(rt.start() == USOCK_OK || started != 0 || rt.core_count() != 0)
+	{
+		printf("Runtime started on a port that's taken\n");
+		return false;
+	}
+
+	usock_close_socket(taken);
+	usock_free_socket(taken);
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	if(!TestRuntime())
+		return 1;
+	if(!TestStartFailure())
+		return 2;
+	return 0;
+}
@@ -0,0 +1,214 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <usock.hpp>
+
+#define ADDRESS "@usock-shm-test"
+#define MESSAGES 5000
+#define WAKE_ROUNDS 5
+#define WAKE_DELAY_MS 150
+// The wait on a full ring times out every 100ms to check on the peer, so
+// a writer only back this quickly was woken
+#define WAKE_LATENCY_NS 30000000ULL
+
+// The handshake runs while the client connects, so accept on another thread
+static bool Connect(usock_handle_t listener, usock_handle_t &client, usock_handle_t &server)
+{
+	usock_err_t acceptErr = USOCK_ERROR_INTERNAL;
+	server = nullptr;
+	std::thread acceptor([&]() { acceptErr = usock_accept(listener, &server); });
+
+	usock_create_socket("Client socket", &client);
+	usock_configure(client, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_SHARED_MEMORY, USOCK_OPTIONS_DEFAULT);
+	usock_err_t err = usock_connect(client, ADDRESS, 0);
+	acceptor.join();
+	if(err != USOCK_OK || acceptErr != USOCK_OK)
+	{
+		printf("Failed to connect\n");
+		return false;
+	}
+	return true;
+}
+
+static void FreeSocket(usock_handle_t hsock)
+{
+	usock_close_socket(hsock);
+	usock_free_socket(hsock);
+}
+
+// Sizes that leave records at every alignment, and one as big as the ring allows
+static size_t MessageSize(int index)
+{
+	return index == MESSAGES / 2 ? USOCK_SHM_MAX_MESSAGE_SIZE : (size_t)(index * 7919) % 4000 + 1;
+}
+
+static void FillMessage(std::vector<unsigned char> &buffer, int index)
+{
+	buffer.resize(MessageSize(index));
+	for(size_t i = 0; i < buffer.size(); ++i)
+		buffer[i] = (unsigned char)(index + i);
+}
+
+static bool TestWraparound(usock_handle_t client, usock_handle_t server)
+{
+	// Several times the ring's size goes through it
+	std::thread writer([client]() {
+		std::vector<unsigned char> message;
+		for(int i = 0; i < MESSAGES; ++i)
+		{
+			FillMessage(message, i);
+			if(usock_send(client, message.data(), message.size()) != (usock_ssize_t)message.size())
+				return;
+		}
+	});
+
+	std::vector<unsigned char> expected, received(USOCK_SHM_MAX_MESSAGE_SIZE);
+	bool ok = true;
+	for(int i = 0; i < MESSAGES && ok; ++i)
+	{
+		FillMessage(expected, i);
+
+		// Take the first byte on its own, the rest stays for the next call
+		usock_ssize_t first = usock_recv(server, received.data(), 1);
+		usock_ssize_t rest = expected.size() > 1 ? usock_recv(server, received.data() + 1, received.size() - 1) : 0;
+		if(first != 1 || (size_t)(first + rest) != expected.size() || memcmp(received.data(), expected.data(), expected.size()) != 0)
+		{
+			printf("Message %d of %zu bytes came back as %lld bytes, or corrupt\n", i, expected.size(), (long long)(first + rest));
+			ok = false;
+		}
+	}
+
+	if(!ok)
+		FreeSocket(server);
+	writer.join();
+	return ok;
+}
+
+static bool TestFullRing(usock_handle_t client, usock_handle_t server)
+{
+	std::vector<unsigned char> buffer(USOCK_SHM_MAX_MESSAGE_SIZE);
+	for(int round = 0; round < WAKE_ROUNDS; ++round)
+	{
+		// One message fills the ring, so the next has to wait for it to be read
+		if(usock_send(client, buffer.data(), buffer.size()) != (usock_ssize_t)buffer.size())
+		{
+			printf("Failed to fill the ring\n");
+			return false;
+		}
+
+		std::atomic<usock_size_t> drainedNs(0);
+		std::thread reader([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(WAKE_DELAY_MS));
+			usock_recv(server, buffer.data(), buffer.size());
+			drainedNs = usock_get_time_ns();
+		});
+
+		usock_size_t start = usock_get_time_ns();
+		usock_ssize_t ret = usock_send(client, "x", 1);
+		usock_size_t end = usock_get_time_ns();
+		reader.join();
+
+		if(ret != 1 || end - start < WAKE_DELAY_MS * 1000000ULL)
+		{
+			printf("Send on a full ring didn't wait\n");
+			return false;
+		}
+		if(end > drainedNs + WAKE_LATENCY_NS)
+		{
+			printf("Writer woke %llu ns after the ring drained\n", (unsigned long long)(end - drainedNs));
+			return false;
+		}
+
+		char byte;
+		if(usock_recv(server, &byte, 1) != 1 || byte != 'x')
+		{
+			printf("Message sent on a full ring lost\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool TestPeerClose(usock_handle_t client, usock_handle_t server)
+{
+	// What was sent before the close is still delivered
+	usock_send(client, "last", 4);
+
+	std::atomic<usock_ssize_t> ends(-1);
+	std::thread reader([&]() {
+		char buffer[16];
+		if(usock_recv(server, buffer, sizeof(buffer)) != 4)
+			return;
+		// Blocks until the close
+		ends = usock_recv(server, buffer, sizeof(buffer));
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	FreeSocket(client);
+	reader.join();
+	if(ends != 0)
+	{
+		printf("Peer close not seen as the end of the stream\n");
+		return false;
+	}
+
+	if(usock_send(server, "x", 1) != -1)
+	{
+		printf("Sent to a closed peer\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	usock_handle_t listener;
+	usock_create_socket("Listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_LOCAL, USOCK_SOCKTYPE_SHARED_MEMORY, USOCK_OPTIONS_DEFAULT);
+	if(usock_bind_address(listener, ADDRESS, 0) != USOCK_OK || usock_listen(listener, 1) != USOCK_OK)
+	{
+		printf("Failed to listen\n");
+		return 1;
+	}
+
+	usock_handle_t client, server;
+	if(!Connect(listener, client, server))
+		return 2;
+	if(!TestWraparound(client, server))
+		return 3;
+	if(!TestFullRing(client, server))
+		return 4;
+	if(!TestPeerClose(client, server))
+		return 5;
+
+	FreeSocket(server);
+	FreeSocket(listener);
+	return 0;
+}
@@ -0,0 +1,357 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <usock.hpp>
+
+#define PORT 8100
+#define MESSAGES 10
+#define MESSAGE_SIZE 100
+#define CLIENT_NAME "Stats client"
+
+struct TraceCounts
+{
+	usock_handle_t client;
+	std::atomic<unsigned> clientSends{0};
+	std::atomic<unsigned> connects{0};
+	std::atomic<unsigned> accepts{0};
+};
+
+static void OnTrace(const usock_trace_record_t *pRecords, usock_size_t count, void *pUserData)
+{
+	TraceCounts *counts = (TraceCounts *)pUserData;
+	for(usock_size_t i = 0; i < count; ++i)
+	{
+		const usock_trace_record_t &record = pRecords[i];
+		if(record.event == USOCK_TRACE_SEND && record.hsock == counts->client && record.result == MESSAGE_SIZE)
+			++counts->clientSends;
+		else if(record.event == USOCK_TRACE_CONNECT && record.hsock == counts->client && record.result == USOCK_OK)
+			++counts->connects;
+		else if(record.event == USOCK_TRACE_ACCEPT && record.result == USOCK_OK)
+			++counts->accepts;
+	}
+}
+
+struct Sample
+{
+	std::string name;
+	std::map<std::string, std::string> labels;
+	double value;
+};
+
+// A line of the Prometheus text format: name{label="value",...} value
+static bool ParseSample(const std::string &line, Sample *pOut)
+{
+	size_t pos = 0;
+	while(pos < line.size() && (isalnum((unsigned char)line[pos]) || line[pos] == '_' || line[pos] == ':'))
+		++pos;
+	if(pos == 0 || isdigit((unsigned char)line[0]))
+		return false;
+	pOut->name = line.substr(0, pos);
+	pOut->labels.clear();
+
+	if(pos < line.size() && line[pos] == '{')
+	{
+		++pos;
+		while(pos < line.size() && line[pos] != '}')
+		{
+			size_t eq = line.find("=\"", pos);
+			if(eq == std::string::npos)
+				return false;
+			std::string key = line.substr(pos, eq - pos), value;
+			for(pos = eq + 2; pos < line.size() && line[pos] != '"'; ++pos)
+			{
+				if(line[pos] == '\\' && ++pos < line.size())
+					value += line[pos] == 'n' ? '\n' : line[pos];
+				else
+					value += line[pos];
+			}
+			if(pos++ >= line.size() || key.empty())
+				return false;
+			pOut->labels[key] = value;
+			if(pos < line.size() && line[pos] == ',')
+				++pos;
+		}
+		if(pos++ >= line.size())
+			return false;
+	}
+
+	if(pos >= line.size() || line[pos] != ' ')
+		return false;
+	const char *start = line.c_str() + pos + 1;
+	char *end;
+	pOut->value = strtod(start, &end);
+	return end != start && *end == '\0';
+}
+
+static bool ParseMetrics(const std::string &text, std::vector<Sample> *pOut)
+{
+	std::map<std::string, std::string> types;
+	size_t start = 0, end;
+	while((end = text.find('\n', start)) != std::string::npos)
+	{
+		std::string line = text.substr(start, end - start);
+		start = end + 1;
+		if(line.empty() || line.compare(0, 7, "# HELP ") == 0)
+			continue;
+		if(line.compare(0, 7, "# TYPE ") == 0)
+		{
+			size_t space = line.find(' ', 7);
+			if(space == std::string::npos)
+				return false;
+			types[line.substr(7, space - 7)] = line.substr(space + 1);
+			continue;
+		}
+
+		Sample sample;
+		if(!ParseSample(line, &sample))
+		{
+			printf("Malformed metrics line: %s\n", line.c_str());
+			return false;
+		}
+		// Every sample belongs to a family declared before it
+		std::string family = sample.name;
+		for(const char *suffix : { "_bucket", "_sum", "_count" })
+		{
+			size_t len = strlen(suffix);
+			if(!types.count(family) && family.size() > len && family.compare(family.size() - len, len, suffix) == 0 &&
+			   types[family.substr(0, family.size() - len)] == "histogram")
+				family = family.substr(0, family.size() - len);
+		}
+		if(!types.count(family) || types[family].empty())
+		{
+			printf("Metric %s has no type\n", sample.name.c_str());
+			return false;
+		}
+		pOut->push_back(sample);
+	}
+	// The text ends with a newline
+	return start == text.size();
+}
+
+static const Sample *FindSample(const std::vector<Sample> &samples, const char *name, const char *label, const char *value)
+{
+	for(const Sample &sample : samples)
+	{
+		auto it = sample.labels.find(label);
+		if(sample.name == name && it != sample.labels.end() && it->second == value)
+			return &sample;
+	}
+	return nullptr;
+}
+
+static bool TestMetrics(const usock_stats_t &clientStats)
+{
+	usock_size_t len = usock_metrics_format(nullptr, 0);
+	std::string text(len + 1, '\0');
+	if(usock_metrics_format(&text[0], text.size()) != len)
+	{
+		printf("Metrics changed length between calls\n");
+		return false;
+	}
+	text.resize(len);
+
+	std::vector<Sample> samples;
+	if(!ParseMetrics(text, &samples))
+		return false;
+
+	const Sample *sent = FindSample(samples, "usock_socket_bytes_sent_total", "socket", CLIENT_NAME);
+	if(!sent || sent->value != (double)clientStats.bytesSent)
+	{
+		printf("Client bytes sent missing from the metrics\n");
+		return false;
+	}
+
+	// Send buckets are cumulative and end at the sample count
+	double previous = 0, count = -1;
+	for(const Sample &sample : samples)
+	{
+		auto op = sample.labels.find("op");
+		if(op == sample.labels.end() || op->second != "send")
+			continue;
+		if(sample.name == "usock_call_duration_seconds_bucket")
+		{
+			if(sample.value < previous)
+			{
+				printf("Send latency buckets aren't cumulative\n");
+				return false;
+			}
+			previous = sample.value;
+		}
+		else if(sample.name == "usock_call_duration_seconds_count")
+			count = sample.value;
+	}
+	if(count < MESSAGES || previous != count)
+	{
+		printf("Send latency histogram has %g samples, its buckets %g\n", count, previous);
+		return false;
+	}
+	return true;
+}
+
+static bool TestLatency()
+{
+	usock_latency_histogram_t hist;
+	if(usock_latency_get_histogram(USOCK_LATENCY_SEND, &hist) != USOCK_OK || hist.count < MESSAGES)
+	{
+		printf("Expected at least %d send samples\n", MESSAGES);
+		return false;
+	}
+	usock_size_t total = 0;
+	for(usock_size_t bucket : hist.buckets)
+		total += bucket;
+	if(total != hist.count || hist.minNs > hist.maxNs || hist.sumNs < hist.count * hist.minNs ||
+	   usock_latency_percentile(&hist, 50) < hist.minNs)
+	{
+		printf("Inconsistent send histogram\n");
+		return false;
+	}
+	if(usock_latency_get_histogram(USOCK_LATENCY_RECV, &hist) != USOCK_OK || hist.count == 0 ||
+	   usock_latency_get_histogram(USOCK_LATENCY_CONNECT, &hist) != USOCK_OK || hist.count != 1)
+	{
+		printf("Missing receive or connect samples\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	// Only counted sockets keep stats
+	usock_handle_t plain;
+	usock_stats_t stats;
+	usock_create_socket("Plain socket", &plain);
+	usock_configure(plain, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_get_stats(plain, &stats) != USOCK_ERROR_NOT_INITIALIZED)
+	{
+		printf("Stats kept for a socket without USOCK_OPTIONS_STATS\n");
+		return 1;
+	}
+	usock_free_socket(plain);
+
+	TraceCounts traceCounts;
+	usock_handle_t listener, client, server;
+	usock_create_socket("Stats listener", &listener);
+	usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS | USOCK_OPTIONS_STATS);
+	usock_create_socket(CLIENT_NAME, &client);
+	usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_NO_DELAY | USOCK_OPTIONS_STATS);
+	traceCounts.client = client;
+
+	usock_latency_reset();
+	usock_latency_set_sample_rate(1);
+	if(usock_trace_start(OnTrace, &traceCounts) != USOCK_OK)
+	{
+		printf("Failed to start tracing\n");
+		return 2;
+	}
+	if(usock_bind(listener, PORT) != USOCK_OK || usock_listen(listener, 1) != USOCK_OK ||
+	   usock_connect(client, "127.0.0.1", PORT) != USOCK_OK || usock_accept(listener, &server) != USOCK_OK)
+	{
+		printf("Failed to connect\n");
+		return 3;
+	}
+
+	// Only the traffic below is counted
+	usock_reset_stats(client);
+	usock_reset_stats(server);
+	char buffer[MESSAGES * MESSAGE_SIZE] = {};
+	for(int i = 0; i < MESSAGES; ++i)
+	{
+		if(usock_send(client, buffer, MESSAGE_SIZE) != MESSAGE_SIZE)
+		{
+			printf("Failed to send\n");
+			return 4;
+		}
+	}
+	usock_size_t received = 0, recvCalls = 0;
+	while(received < sizeof(buffer))
+	{
+		usock_ssize_t n = usock_recv(server, buffer + received, sizeof(buffer) - received);
+		if(n <= 0)
+		{
+			printf("Failed to receive\n");
+			return 5;
+		}
+		received += (usock_size_t)n;
+		++recvCalls;
+	}
+	usock_trace_stop();
+	usock_latency_set_sample_rate(0);
+
+	usock_stats_t clientStats, serverStats;
+	if(usock_get_stats(client, &clientStats) != USOCK_OK || usock_get_stats(server, &serverStats) != USOCK_OK)
+	{
+		printf("Failed to read the stats\n");
+		return 6;
+	}
+	if(clientStats.bytesSent != sizeof(buffer) || clientStats.sendCalls != MESSAGES ||
+	   clientStats.messagesSent != MESSAGES || clientStats.sendErrors != 0 || clientStats.shortWrites != 0 ||
+	   clientStats.bytesReceived != 0 || clientStats.recvCalls != 0)
+	{
+		printf("Client sent %llu bytes in %llu calls\n",
+		       (unsigned long long)clientStats.bytesSent, (unsigned long long)clientStats.sendCalls);
+		return 7;
+	}
+	if(serverStats.bytesReceived != sizeof(buffer) || serverStats.recvCalls != recvCalls ||
+	   serverStats.messagesReceived != recvCalls || serverStats.recvErrors != 0 || serverStats.bytesSent != 0)
+	{
+		printf("Server received %llu bytes in %llu calls\n",
+		       (unsigned long long)serverStats.bytesReceived, (unsigned long long)serverStats.recvCalls);
+		return 8;
+	}
+
+	if(traceCounts.clientSends != MESSAGES || traceCounts.connects != 1 || traceCounts.accepts != 1)
+	{
+		printf("Traced %u sends, %u connects and %u accepts\n",
+		       traceCounts.clientSends.load(), traceCounts.connects.load(), traceCounts.accepts.load());
+		return 9;
+	}
+
+	if(!TestLatency())
+		return 10;
+	if(!TestMetrics(clientStats))
+		return 11;
+
+	usock_reset_stats(client);
+	if(usock_get_stats(client, &clientStats) != USOCK_OK || clientStats.bytesSent != 0 || clientStats.sendCalls != 0)
+	{
+		printf("Stats not cleared by a reset\n");
+		return 12;
+	}
+
+	usock_close_socket(client);
+	usock_free_socket(client);
+	usock_close_socket(server);
+	usock_free_socket(server);
+	usock_close_socket(listener);
+	usock_free_socket(listener);
+	return 0;
+}
@@ -0,0 +1,215 @@
+/******************************************************************************
+Copyright (c) 2019 Sagnik Chowdhury
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <usock.hpp>
+#include <usock_timer.h>
+
+#define PORT 8084
+#define TICK_MS 1
+#define DEADLINE_MS 100
+#define SEND_SIZE (64 * 1024 * 1024)
+
+struct Fired
+{
+	usock_timer_wheel_t *wheel;
+	usock_size_t tick; // The wheel's tick when it fired, 0 if it hasn't
+};
+
+static void OnFire(usock_timer_t *pTimer, void *pUserData)
+{
+	Fired *fired = (Fired *)pUserData;
+	fired->tick = fired->wheel->current;
+}
+
+static usock_size_t TickNs(const usock_timer_wheel_t &wheel, usock_size_t tick)
+{
+	return wheel.startNs + tick * wheel.tickNs;
+}
+
+// Arm one timer per level, plus one past the top level's reach, then walk
+// the wheel with made up times: nothing may fire a tick early, and each
+// timer has to fire on exactly the tick it was filed for.
+static bool TestLevels()
+{
+	const usock_size_t delays[] = {
+		5,                 // Level 0
+		300,               // Level 1, from 256 ticks
+		70000,             // Level 2, from 65536 ticks
+		17000000,          // Level 3, from 16777216 ticks
+	};
+	const size_t count = sizeof(delays) / sizeof(delays[0]);
+
+	usock_timer_wheel_t wheel;
+	usock_timer_wheel_init(&wheel, TICK_MS);
+
+	std::vector<usock_timer_t> timers(count);
+	std::vector<Fired> fired(count, Fired{ &wheel, 0 });
+	for(size_t i = 0; i < count; ++i)
+	{
+		usock_timer_init(&timers[i], OnFire, &fired[i]);
+		usock_timer_arm(&wheel, &timers[i], delays[i]);
+		if(timers[i].slot / USOCK_TIMER_SLOTS != i)
+		{
+			printf("Timer %zu filed on level %u\n", i, timers[i].slot / USOCK_TIMER_SLOTS);
+			return false;
+		}
+	}
+
+	for(size_t i = 0; i < count; ++i)
+	{
+		usock_size_t expires = timers[i].expires;
+		if(expires < delays[i])
+		{
+			printf("Timer %zu expires on tick %llu, before its delay\n", i, (unsigned long long)expires);
+			return false;
+		}
+
+		usock_timer_wheel_advance(&wheel, TickNs(wheel, expires - 1));
+		if(fired[i].tick || !usock_timer_armed(&timers[i]))
+		{
+			printf("Timer %zu fired before tick %llu\n", i, (unsigned long long)expires);
+			return false;
+		}
+		if(usock_timer_wheel_advance(&wheel, TickNs(wheel, expires)) != 1 || fired[i].tick != expires)
+		{
+			printf("Timer %zu due on tick %llu fired on %llu\n", i, (unsigned long long)expires, (unsigned long long)fired[i].tick);
+			return false;
+		}
+	}
+
+	if(wheel.count != 0 || usock_timer_wheel_timeout_ms(&wheel, TickNs(wheel, wheel.current)) != -1)
+	{
+		printf("Wheel not empty after every timer fired\n");
+		return false;
+	}
+	return true;
+}
+
+// A cancelled timer never fires, and a re-armed one only on its new tick.
+static bool TestCancel()
+{
+	usock_timer_wheel_t wheel;
+	usock_timer_wheel_init(&wheel, TICK_MS);
+
+	usock_timer_t cancelled, moved;
+	Fired cancelledFired = { &wheel, 0 }, movedFired = { &wheel, 0 };
+	usock_timer_init(&cancelled, OnFire, &cancelledFired);
+	usock_timer_init(&moved, OnFire, &movedFired);
+	usock_timer_arm(&wheel, &cancelled, 70000);
+	usock_timer_arm(&wheel, &moved, 300);
+	usock_size_t firstExpiry = moved.expires;
+
+	usock_timer_cancel(&wheel, &cancelled);
+	usock_timer_arm(&wheel, &moved, 1000);
+	usock_timer_wheel_advance(&wheel, TickNs(wheel, firstExpiry));
+	if(movedFired.tick)
+	{
+		printf("Moved timer fired on its old tick\n");
+		return false;
+	}
+
+	usock_timer_wheel_advance(&wheel, TickNs(wheel, 100000));
+	if(cancelledFired.tick || movedFired.tick != moved.expires)
+	{
+		printf("Cancel or re-arm failed\n");
+		return false;
+	}
+	return true;
+}
+
+static bool Connect(usock_handle_t &listener, usock_handle_t &client, usock_handle_t &server)
+{
+	usock_create_socket("Listen socket", &listener);
+	usock_configure(listener, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_REUSE_ADDRESS);
+	if(usock_bind(listener, PORT) != USOCK_OK || usock_listen(listener, 1) != USOCK_OK)
+		return false;
+
+	usock_create_socket("Client socket", &client);
+	usock_configure(client, USOCK_DOMAIN_IPV4, USOCK_SOCKTYPE_RELIABLE, USOCK_OPTIONS_DEFAULT);
+	if(usock_connect(client, "127.0.0.1", PORT) != USOCK_OK)
+		return false;
+	return usock_accept(listener, &server) == USOCK_OK;
+}
+
+// Deadline receives and sends give up in time when the peer is silent.
+static bool TestDeadlines()
+{
+	usock_handle_t listener, client, server;
+	if(!Connect(listener, client, server))
+	{
+		printf("Failed to connect\n");
+		return false;
+	}
+
+	char buffer[16];
+	usock_size_t received = 0;
+	usock_size_t start = usock_get_time_ns();
+	usock_err_t err = usock_recv_deadline(server, buffer, sizeof(buffer), start + DEADLINE_MS * 1000000ull, &received);
+	usock_size_t elapsedMs = (usock_get_time_ns() - start) / 1000000;
+	if(err != USOCK_ERROR_TIMEOUT || received != 0 || elapsedMs < DEADLINE_MS - 1 || elapsedMs > 10 * DEADLINE_MS)
+	{
+		printf("Receive deadline: error %d after %llums\n", err, (unsigned long long)elapsedMs);
+		return false;
+	}
+
+	// A passed deadline still takes what's already there
+	usock_send(client, "ping", 4);
+	err = usock_recv_deadline(server, buffer, sizeof(buffer), usock_get_time_ns() + 1000000000ull, &received);
+	if(err != USOCK_OK || received != 4)
+	{
+		printf("Receive with data waiting failed\n");
+		return false;
+	}
+
+	// Nobody reads, so the socket buffers fill up long before this is sent
+	std::vector<char> big(SEND_SIZE);
+	usock_size_t sent = 0;
+	start = usock_get_time_ns();
+	err = usock_send_deadline(client, big.data(), big.size(), start + DEADLINE_MS * 1000000ull, &sent);
+	elapsedMs = (usock_get_time_ns() - start) / 1000000;
+	if(err != USOCK_ERROR_TIMEOUT || sent == 0 || sent >= big.size() || elapsedMs < DEADLINE_MS - 1 || elapsedMs > 10 * DEADLINE_MS)
+	{
+		printf("Send deadline: error %d, %llu bytes after %llums\n", err, (unsigned long long)sent, (unsigned long long)elapsedMs);
+		return false;
+	}
+
+	usock_close_socket(server);
+	usock_close_socket(client);
+	usock_close_socket(listener);
+	return true;
+}
+
+int main(int argc, const char *argv[])
+{
+	usock::instance usockInst;
+
+	if(!TestLevels())
+		return 1;
+	if(!TestCancel())
+		return 2;
+	if(!TestDeadlines())
+		return 3;
+	return 0;
+}
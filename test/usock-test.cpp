@@ -32,12 +32,44 @@ SOFTWARE.
 //Test names
 #define TCP_SERVER_CLIENT "tcp-server-client"
 #define UDP_SERVER_CLIENT "udp-server-client"
+#define RUDP_SERVER_CLIENT "rudp-server-client"
+#define TIMER_WHEEL "timer-wheel"
+#define CONNECTION_POOL "connection-pool"
+#define FRAMING "framing"
+#define MEMORY_TRANSPORT "memory-transport"
+#define LINE_READER "line-reader"
+#define SHARED_MEMORY "shared-memory"
+#define RESOLVER "resolver"
+#define FANOUT "fanout"
+#define CONNECT_BATCH "connect-batch"
+#define RUNTIME "runtime"
+#define LOCAL "local"
+#define PACER "pacer"
+#define MULTICAST "multicast"
+#define STATS "stats"
 
 //Target names
 #define TCPCLIENT "TCPClient"
 #define TCPSERVER "TCPServer"
 #define UDPCLIENT "UDPClient"
 #define UDPSERVER "UDPServer"
+#define RUDPCLIENT "RUDPClient"
+#define RUDPSERVER "RUDPServer"
+#define TIMERTEST "TimerTest"
+#define POOLTEST "PoolTest"
+#define FRAMETEST "FrameTest"
+#define MEMORYTEST "MemoryTest"
+#define LINESERVER "LineServer"
+#define LINECLIENT "LineClient"
+#define SHMTEST "ShmTest"
+#define RESOLVERTEST "ResolverTest"
+#define FANOUTTEST "FanoutTest"
+#define CONNECTBATCHTEST "ConnectBatchTest"
+#define RUNTIMETEST "RuntimeTest"
+#define LOCALTEST "LocalTest"
+#define PACERTEST "PacerTest"
+#define MULTICASTTEST "MulticastTest"
+#define STATSTEST "StatsTest"
 
 struct Test
 {
@@ -69,6 +101,66 @@ int main(int argc, const char *argv[])
 		{ UDP_SERVER_CLIENT, Test({
 			{ BUILDDIR "/" UDPSERVER, BUILDDIR "/" UDPCLIENT },
 			"Run the UDP server/client test."}) 
+		},
+		{ RUDP_SERVER_CLIENT, Test({
+			{ BUILDDIR "/" RUDPSERVER, BUILDDIR "/" RUDPCLIENT },
+			"Run the reliable datagram test over a lossy link."})
+		},
+		{ TIMER_WHEEL, Test({
+			{ BUILDDIR "/" TIMERTEST },
+			"Run the timer wheel and deadline I/O test."})
+		},
+		{ CONNECTION_POOL, Test({
+			{ BUILDDIR "/" POOLTEST },
+			"Run the connection pool test."})
+		},
+		{ FRAMING, Test({
+			{ BUILDDIR "/" FRAMETEST },
+			"Run the CRC32C and framing test."})
+		},
+		{ MEMORY_TRANSPORT, Test({
+			{ BUILDDIR "/" MEMORYTEST },
+			"Run the in-process memory transport test."})
+		},
+		{ LINE_READER, Test({
+			{ BUILDDIR "/" LINESERVER, BUILDDIR "/" LINECLIENT },
+			"Run the line reader server/client test."})
+		},
+		{ SHARED_MEMORY, Test({
+			{ BUILDDIR "/" SHMTEST },
+			"Run the shared memory ring test."})
+		},
+		{ RESOLVER, Test({
+			{ BUILDDIR "/" RESOLVERTEST },
+			"Run the name resolver cache test."})
+		},
+		{ FANOUT, Test({
+			{ BUILDDIR "/" FANOUTTEST },
+			"Run the topic fan-out test."})
+		},
+		{ CONNECT_BATCH, Test({
+			{ BUILDDIR "/" CONNECTBATCHTEST },
+			"Run the batch connect test."})
+		},
+		{ RUNTIME, Test({
+			{ BUILDDIR "/" RUNTIMETEST },
+			"Run the thread-per-core runtime test."})
+		},
+		{ LOCAL, Test({
+			{ BUILDDIR "/" LOCALTEST },
+			"Run the local socket and socket passing test."})
+		},
+		{ PACER, Test({
+			{ BUILDDIR "/" PACERTEST },
+			"Run the send pacer test."})
+		},
+		{ MULTICAST, Test({
+			{ BUILDDIR "/" MULTICASTTEST },
+			"Run the multicast loopback test."})
+		},
+		{ STATS, Test({
+			{ BUILDDIR "/" STATSTEST },
+			"Run the stats, tracing, latency and metrics test."})
 		}
 	};
 